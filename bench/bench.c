@@ -0,0 +1,210 @@
+#include "bench.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "capture.h"
+#include "monotonic.h"
+#include "replay.h"
+#include "sim.h"
+
+// Every allocation made by the code under test goes through these: the
+// benchmarks are linked with --wrap for each allocator entry point. The C
+// library's own internal allocations are not counted.
+static atomic_uint_least64_t allocations;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+void *__real_aligned_alloc(size_t alignment, size_t size);
+int __real_posix_memalign(void **pointer, size_t alignment, size_t size);
+
+void *__wrap_malloc(size_t size) {
+  atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+  atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+  return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *pointer, size_t size) {
+  atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+  return __real_realloc(pointer, size);
+}
+
+void *__wrap_aligned_alloc(size_t alignment, size_t size) {
+  atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+  return __real_aligned_alloc(alignment, size);
+}
+
+int __wrap_posix_memalign(void **pointer, size_t alignment, size_t size) {
+  atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+  return __real_posix_memalign(pointer, alignment, size);
+}
+
+static volatile uint64_t sink;
+
+void bench_consume(uint64_t value) { sink += value; }
+
+static int bench_add_report(struct bench_input *input, size_t *capacity,
+                            uint64_t timestamp_ns, uint16_t product_id,
+                            uint8_t endpoint, const uint8_t *data,
+                            size_t length) {
+  if (input->count == *capacity) {
+    *capacity = *capacity == 0 ? 4096 : *capacity * 2;
+    struct report *reports =
+        realloc(input->reports, *capacity * sizeof(*reports));
+    if (reports == NULL) {
+      return -1;
+    }
+    input->reports = reports;
+  }
+  struct report *report = &input->reports[input->count++];
+  memset(report, 0, sizeof(*report));
+  report->timestamp_ns = timestamp_ns;
+  report->product_id = product_id;
+  report->endpoint = endpoint;
+  report->length = length > REPORT_MAX_SIZE ? REPORT_MAX_SIZE : length;
+  memcpy(report->data, data, report->length);
+  return 0;
+}
+
+static int bench_load_capture(const char *path, struct bench_input *input) {
+  struct capture_reader reader;
+  if (capture_reader_open(&reader, path) != 0) {
+    return -1;
+  }
+  size_t capacity = 0;
+  const struct capture_record_header *header;
+  const uint8_t *payload;
+  while ((header = capture_reader_next(&reader, &payload)) != NULL) {
+    if (header->endpoint == CAPTURE_ENDPOINT_DESCRIPTOR) {
+      if (input->descriptor_length == 0 &&
+          header->length <= HID_MAX_DESCRIPTOR_SIZE) {
+        memcpy(input->descriptor, payload, header->length);
+        input->descriptor_length = header->length;
+      }
+      continue;
+    }
+    if (bench_add_report(input, &capacity, header->timestamp_ns,
+                         header->product_id, header->endpoint, payload,
+                         header->length) != 0) {
+      capture_reader_close(&reader);
+      return -1;
+    }
+  }
+  capture_reader_close(&reader);
+  if (input->count == 0) {
+    fprintf(stderr, "%s:%d: no report in %s\n", __FILE__, __LINE__, path);
+    return -1;
+  }
+  return 0;
+}
+
+static int bench_generate(struct bench_input *input) {
+  struct sim sim;
+  // Only the generators are used, the sim thread is never started.
+  if (sim_open(&sim, SIM_DEFAULT_RATE_HZ, 0.0) != 0) {
+    return -1;
+  }
+  const float dt = 1.0f / SIM_DEFAULT_RATE_HZ;
+  size_t capacity = 0;
+  int result = 0;
+  for (size_t i = 0; i < BENCH_SYNTHETIC_REPORTS && result == 0; ++i) {
+    struct sim_source *source = &sim.sources[i % sim.num_sources];
+    const uint32_t device_time_us = (uint32_t)(source->reports * 1000);
+    sim_generate_report(source, dt, device_time_us);
+    result = bench_add_report(input, &capacity, i * 500000ull,
+                              source->device->device.idProduct,
+                              source->endpoint, source->report,
+                              SIM_REPORT_SIZE);
+  }
+  sim_close(&sim);
+  memcpy(input->descriptor, sim_report_descriptor, SIM_REPORT_DESCRIPTOR_SIZE);
+  input->descriptor_length = SIM_REPORT_DESCRIPTOR_SIZE;
+  return result;
+}
+
+int bench_load(int argc, char *argv[], struct bench_input *input) {
+  memset(input, 0, sizeof(*input));
+  if (argc > 1) {
+    input->source = argv[1];
+    return bench_load_capture(argv[1], input);
+  }
+  input->source = "synthetic";
+  return bench_generate(input);
+}
+
+void bench_free(struct bench_input *input) {
+  free(input->reports);
+  input->reports = NULL;
+  input->count = 0;
+}
+
+int bench_write_capture(const struct bench_input *input, const char *path) {
+  struct capture_writer writer;
+  if (capture_writer_open(&writer, path) != 0) {
+    return -1;
+  }
+  int result = 0;
+  // One descriptor record per device found in the reports.
+  uint16_t written[REPLAY_MAX_SOURCES];
+  int num_written = 0;
+  for (size_t i = 0; i < input->count && input->descriptor_length > 0; ++i) {
+    int known = 0;
+    for (int j = 0; j < num_written; ++j) {
+      known |= written[j] == input->reports[i].product_id;
+    }
+    if (!known && num_written < REPLAY_MAX_SOURCES) {
+      written[num_written++] = input->reports[i].product_id;
+      result |= capture_write_descriptor(&writer, input->reports[i].product_id,
+                                         input->descriptor,
+                                         input->descriptor_length);
+    }
+  }
+  for (size_t i = 0; i < input->count && result == 0; ++i) {
+    result = capture_write(&writer, &input->reports[i]);
+  }
+  capture_writer_close(&writer);
+  return result;
+}
+
+static int bench_compare(const void *a, const void *b) {
+  const uint64_t x = *(const uint64_t *)a;
+  const uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+void bench_run(const char *name, const char *op,
+               const struct bench_input *input, size_t ops, bench_function run,
+               void *context) {
+  uint64_t durations[BENCH_REPETITIONS];
+  run(context);
+  const uint64_t allocations_before =
+      atomic_load_explicit(&allocations, memory_order_relaxed);
+  for (int i = 0; i < BENCH_REPETITIONS; ++i) {
+    const uint64_t start = monotonic_ns();
+    run(context);
+    durations[i] = monotonic_ns() - start;
+  }
+  const uint64_t allocations_made =
+      atomic_load_explicit(&allocations, memory_order_relaxed) -
+      allocations_before;
+  qsort(durations, BENCH_REPETITIONS, sizeof(durations[0]), bench_compare);
+
+  const double median_ns =
+      (double)durations[BENCH_REPETITIONS / 2] / (double)ops;
+  const double best_ns = (double)durations[0] / (double)ops;
+  printf("{\"benchmark\": \"%s\", \"source\": \"%s\", \"compiler\": \"%s\", "
+         "\"op\": \"%s\", \"ops\": %zu, \"repetitions\": %d, "
+         "\"ns_per_op\": %.2f, \"best_ns_per_op\": %.2f, "
+         "\"ops_per_s\": %.0f, \"allocations_per_run\": %.1f}\n",
+         name, input->source, __VERSION__, op, ops, BENCH_REPETITIONS,
+         median_ns, best_ns, 1e9 / median_ns,
+         (double)allocations_made / BENCH_REPETITIONS);
+  fflush(stdout);
+}
@@ -0,0 +1,49 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hid.h"
+#include "ring.h"
+
+// Shared harness of the benchmarks run by `make bench`. Each benchmark is its
+// own program taking an optional capture file; without one it runs on
+// reports generated by the simulated controllers, always the same ones.
+// Results are printed one JSON object per line on stdout.
+
+#define BENCH_REPETITIONS 5
+#define BENCH_SYNTHETIC_REPORTS 100000
+
+struct bench_input {
+  // The capture path, or "synthetic".
+  const char *source;
+  struct report *reports;
+  size_t count;
+  // The first report descriptor found, 0 long if there was none.
+  uint8_t descriptor[HID_MAX_DESCRIPTOR_SIZE];
+  int descriptor_length;
+};
+
+// Loads argv[1] if given, otherwise generates the synthetic reports.
+// Returns 0 or -1 (with a message on stderr).
+int bench_load(int argc, char *argv[], struct bench_input *input);
+void bench_free(struct bench_input *input);
+
+// Writes the input back out as a capture, descriptors first, for the
+// benchmarks that need a file. Returns 0 or -1.
+int bench_write_capture(const struct bench_input *input, const char *path);
+
+typedef void (*bench_function)(void *context);
+
+// Calls `run` once to warm up, then BENCH_REPETITIONS times, and prints the
+// median and best time per operation. Each call of `run` does `ops`
+// operations of the kind named by `op` ("report", "descriptor"...).
+void bench_run(const char *name, const char *op,
+               const struct bench_input *input, size_t ops, bench_function run,
+               void *context);
+
+// Keeps the compiler from optimising a result away.
+void bench_consume(uint64_t value);
+
+#endif // BENCH_H
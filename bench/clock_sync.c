@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "clock_sync.h"
+
+// Mapping device ticks to host time, on a counter narrow enough to wrap
+// often: 16 bits at 1 kHz, one report per tick, a device clock 50 ppm fast
+// and arrivals late by up to half a polling interval. The stream wraps
+// CLOCK_BENCH_WRAPS times, then the device goes quiet for longer than a
+// whole wrap before carrying on. The mapped times must keep increasing and
+// stay on the sample times across the missed wrap, or the program fails.
+// Always runs on this generated stream, a capture has no such gap.
+
+#define CLOCK_BENCH_BITS 16
+#define CLOCK_BENCH_TICK_NS 1000000ull
+#define CLOCK_BENCH_DRIFT 50e-6
+#define CLOCK_BENCH_LATENCY_NS 250000ull
+#define CLOCK_BENCH_JITTER_NS 500000ull
+#define CLOCK_BENCH_WRAPS 4
+// A wrap and a quarter of silence.
+#define CLOCK_BENCH_GAP_TICKS (5ull << CLOCK_BENCH_BITS) / 4
+// Mapped time against the sample time, once the fit has settled.
+#define CLOCK_BENCH_MAX_ERROR_NS 1000000ll
+
+struct clock_context {
+  // Unwrapped device ticks, and the host time the device sampled and the
+  // report arrived at.
+  uint64_t *ticks;
+  uint64_t *sample_ns;
+  uint64_t *arrival_ns;
+  size_t count;
+  // Index of the first report after the gap.
+  size_t resume;
+  uint64_t *mapped_ns;
+  struct clock_sync sync;
+};
+
+static void map_reports(void *data) {
+  struct clock_context *context = data;
+  const struct clock_field field = {.report_id = -1,
+                                    .bit_size = CLOCK_BENCH_BITS};
+  clock_sync_init(&context->sync, &field);
+  const uint64_t mask = (1ull << CLOCK_BENCH_BITS) - 1;
+  for (size_t i = 0; i < context->count; ++i) {
+    context->mapped_ns[i] = clock_sync_update(
+        &context->sync, context->ticks[i] & mask, context->arrival_ns[i]);
+  }
+  bench_consume(context->mapped_ns[context->count - 1]);
+}
+
+// Returns 0, or -1 with a message on stderr.
+static int check_mapping(const struct clock_context *context) {
+  int64_t worst_ns = 0;
+  for (size_t i = 1; i < context->count; ++i) {
+    if (context->mapped_ns[i] <= context->mapped_ns[i - 1]) {
+      fprintf(stderr, "clock_sync: report %zu mapped %lu ns, not after %lu\n",
+              i, (unsigned long)context->mapped_ns[i],
+              (unsigned long)context->mapped_ns[i - 1]);
+      return -1;
+    }
+    if (i < CLOCK_SYNC_WINDOW) {
+      continue;
+    }
+    int64_t error_ns =
+        (int64_t)(context->mapped_ns[i] - context->sample_ns[i]) -
+        (int64_t)(CLOCK_BENCH_LATENCY_NS + CLOCK_BENCH_JITTER_NS / 2);
+    error_ns = error_ns < 0 ? -error_ns : error_ns;
+    if (error_ns > worst_ns) {
+      worst_ns = error_ns;
+    }
+    if (error_ns > CLOCK_BENCH_MAX_ERROR_NS) {
+      fprintf(stderr,
+              "clock_sync: report %zu%s mapped %ld ns away from its sample\n",
+              i, i >= context->resume ? ", after the gap," : "",
+              (long)error_ns);
+      return -1;
+    }
+  }
+  if (context->sync.resets > 0) {
+    fprintf(stderr, "clock_sync: the estimate restarted %lu times\n",
+            (unsigned long)context->sync.resets);
+    return -1;
+  }
+  fprintf(stderr,
+          "clock_sync: %d wraps and a missed one, increasing and within "
+          "%ld ns of the samples\n",
+          CLOCK_BENCH_WRAPS, (long)worst_ns);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  static struct bench_input input;
+  static struct clock_context context;
+  if (bench_load(argc, argv, &input) != 0) {
+    return 1;
+  }
+  const size_t before = (size_t)CLOCK_BENCH_WRAPS << CLOCK_BENCH_BITS;
+  const size_t after = (size_t)1 << CLOCK_BENCH_BITS;
+  context.count = before + after;
+  context.resume = before;
+  context.ticks = malloc(context.count * sizeof(uint64_t));
+  context.sample_ns = malloc(context.count * sizeof(uint64_t));
+  context.arrival_ns = malloc(context.count * sizeof(uint64_t));
+  context.mapped_ns = malloc(context.count * sizeof(uint64_t));
+  if (context.ticks == NULL || context.sample_ns == NULL ||
+      context.arrival_ns == NULL || context.mapped_ns == NULL) {
+    fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+    return 1;
+  }
+  uint32_t random = 12345;
+  for (size_t i = 0; i < context.count; ++i) {
+    context.ticks[i] = i < before ? i : i + CLOCK_BENCH_GAP_TICKS;
+    context.sample_ns[i] =
+        1000000000ull + (uint64_t)((double)context.ticks[i] *
+                                   CLOCK_BENCH_TICK_NS /
+                                   (1.0 + CLOCK_BENCH_DRIFT));
+    random = random * 1664525u + 1013904223u;
+    context.arrival_ns[i] = context.sample_ns[i] + CLOCK_BENCH_LATENCY_NS +
+                            (random >> 8) % CLOCK_BENCH_JITTER_NS;
+  }
+
+  bench_run("clock_sync", "report", &input, context.count, map_reports,
+            &context);
+  const int result = check_mapping(&context);
+  free(context.ticks);
+  free(context.sample_ns);
+  free(context.arrival_ns);
+  free(context.mapped_ns);
+  bench_free(&input);
+  return result == 0 ? 0 : 1;
+}
@@ -0,0 +1,43 @@
+#include <stdio.h>
+
+#include "bench.h"
+#include "hid.h"
+
+// Decoding a report through the compiled descriptor into a hid_state.
+
+struct decode_context {
+  const struct bench_input *input;
+  struct hid_decoder decoder;
+  struct hid_state state;
+};
+
+static void decode_reports(void *data) {
+  struct decode_context *context = data;
+  uint64_t checksum = 0;
+  for (size_t i = 0; i < context->input->count; ++i) {
+    const struct report *report = &context->input->reports[i];
+    checksum += hid_decode(&context->decoder, report->data, report->length,
+                           &context->state);
+    checksum += context->state.buttons;
+  }
+  bench_consume(checksum);
+}
+
+int main(int argc, char *argv[]) {
+  static struct bench_input input;
+  static struct decode_context context;
+  if (bench_load(argc, argv, &input) != 0) {
+    return 1;
+  }
+  if (input.descriptor_length == 0 ||
+      hid_compile(input.descriptor, input.descriptor_length,
+                  &context.decoder) != 0) {
+    fprintf(stderr, "%s: no usable report descriptor\n", input.source);
+    bench_free(&input);
+    return 1;
+  }
+  context.input = &input;
+  bench_run("decode", "report", &input, input.count, decode_reports, &context);
+  bench_free(&input);
+  return 0;
+}
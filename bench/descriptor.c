@@ -0,0 +1,44 @@
+#include <stdio.h>
+
+#include "bench.h"
+#include "hid.h"
+
+// Parsing a report descriptor into decode tables, as done once per device.
+
+#define DESCRIPTOR_COMPILES 10000
+
+struct descriptor_context {
+  const struct bench_input *input;
+  struct hid_decoder decoder;
+};
+
+static void compile_descriptors(void *data) {
+  struct descriptor_context *context = data;
+  uint64_t checksum = 0;
+  for (int i = 0; i < DESCRIPTOR_COMPILES; ++i) {
+    hid_compile(context->input->descriptor, context->input->descriptor_length,
+                &context->decoder);
+    checksum += context->decoder.num_fields;
+  }
+  bench_consume(checksum);
+}
+
+int main(int argc, char *argv[]) {
+  static struct bench_input input;
+  static struct descriptor_context context;
+  if (bench_load(argc, argv, &input) != 0) {
+    return 1;
+  }
+  if (input.descriptor_length == 0 ||
+      hid_compile(input.descriptor, input.descriptor_length,
+                  &context.decoder) != 0) {
+    fprintf(stderr, "%s: no usable report descriptor\n", input.source);
+    bench_free(&input);
+    return 1;
+  }
+  context.input = &input;
+  bench_run("descriptor", "descriptor", &input, DESCRIPTOR_COMPILES,
+            compile_descriptors, &context);
+  bench_free(&input);
+  return 0;
+}
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "downsample.h"
+#include "hid.h"
+#include "imu.h"
+
+// Reducing decoded reports to min/max points for the panel: the six IMU
+// channels of every report, in the rows that shared_state_decode_history
+// fills, added in batches of a panel update.
+
+#define DOWNSAMPLE_BENCH_BATCH 64
+#define DOWNSAMPLE_BENCH_BUCKET_NS 10000000ull
+
+struct downsample_context {
+  size_t count;
+  uint64_t *timestamps;
+  float *values;
+  int columns[6];
+  struct downsample downsample;
+};
+
+static void downsample_reports(void *data) {
+  struct downsample_context *context = data;
+  downsample_init(&context->downsample, 6, DOWNSAMPLE_BENCH_BUCKET_NS);
+  for (size_t i = 0; i < context->count; i += DOWNSAMPLE_BENCH_BATCH) {
+    const size_t left = context->count - i;
+    downsample_add(&context->downsample, context->timestamps + i,
+                   context->values + i * HID_MAX_VALUES, HID_MAX_VALUES,
+                   context->columns,
+                   left < DOWNSAMPLE_BENCH_BATCH ? (int)left
+                                                 : DOWNSAMPLE_BENCH_BATCH);
+  }
+  bench_consume(context->downsample.levels[0].count);
+}
+
+int main(int argc, char *argv[]) {
+  static struct bench_input input;
+  static struct hid_decoder decoder;
+  static struct downsample_context context;
+  if (bench_load(argc, argv, &input) != 0) {
+    return 1;
+  }
+  struct imu_channels channels;
+  if (input.descriptor_length == 0 ||
+      hid_compile(input.descriptor, input.descriptor_length, &decoder) != 0 ||
+      imu_find_channels(&decoder, &channels) != 0) {
+    fprintf(stderr, "%s: no report descriptor with IMU fields\n",
+            input.source);
+    bench_free(&input);
+    return 1;
+  }
+  for (int axis = 0; axis < 3; ++axis) {
+    context.columns[axis] = channels.gyro[axis];
+    context.columns[3 + axis] = channels.accel[axis];
+  }
+  context.timestamps = malloc(input.count * sizeof(*context.timestamps));
+  context.values = malloc(input.count * HID_MAX_VALUES * sizeof(float));
+  if (context.timestamps == NULL || context.values == NULL) {
+    free(context.timestamps);
+    free(context.values);
+    bench_free(&input);
+    return 1;
+  }
+  // Reports the decoder does not know are left out, as the panel gets them.
+  struct hid_state state;
+  for (size_t i = 0; i < input.count; ++i) {
+    const struct report *report = &input.reports[i];
+    if (hid_decode(&decoder, report->data, report->length, &state) < 0) {
+      continue;
+    }
+    context.timestamps[context.count] = report->timestamp_ns;
+    memcpy(context.values + context.count * HID_MAX_VALUES, state.values,
+           sizeof(state.values));
+    ++context.count;
+  }
+
+  bench_run("downsample", "report", &input, context.count,
+            downsample_reports, &context);
+  uint64_t next = 0;
+  static uint64_t timestamps[2 * DOWNSAMPLE_BUCKETS];
+  static float values[2 * DOWNSAMPLE_BUCKETS * 6];
+  fprintf(stderr, "downsample: %lu reports to %d points\n",
+          (unsigned long)context.count,
+          downsample_read(&context.downsample, 0, &next, timestamps, values,
+                          2 * DOWNSAMPLE_BUCKETS));
+  free(context.timestamps);
+  free(context.values);
+  bench_free(&input);
+  return 0;
+}
@@ -0,0 +1,120 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "hid.h"
+#include "imu.h"
+
+// IMU fusion of both controllers, the vector path in batches as main queues
+// them, and the scalar reference one sample at a time on the same samples.
+// Both must end with the same orientation on every lane: the program fails
+// if they drift apart by more than FUSION_BENCH_TOLERANCE.
+
+#define FUSION_BENCH_TOLERANCE 1e-4f
+
+struct fusion_sample {
+  int controller;
+  float gyro[3];
+  float accel[3];
+};
+
+struct fusion_context {
+  struct fusion_sample *samples;
+  size_t count;
+  struct imu_batch batch;
+  struct imu_fusion vector;
+  struct imu_fusion scalar;
+};
+
+static void fuse_vector(void *data) {
+  struct fusion_context *context = data;
+  imu_fusion_init(&context->vector);
+  imu_batch_clear(&context->batch);
+  for (size_t i = 0; i < context->count; ++i) {
+    const struct fusion_sample *sample = &context->samples[i];
+    if (imu_batch_add(&context->batch, sample->controller, sample->gyro,
+                      sample->accel, 0.001f) != 0) {
+      imu_fusion_update(&context->vector, &context->batch);
+      imu_batch_clear(&context->batch);
+      imu_batch_add(&context->batch, sample->controller, sample->gyro,
+                    sample->accel, 0.001f);
+    }
+  }
+  imu_fusion_update(&context->vector, &context->batch);
+  bench_consume((uint64_t)(context->vector.q[0][IMU_LEFT] * 1e6f));
+}
+
+static void fuse_scalar(void *data) {
+  struct fusion_context *context = data;
+  imu_fusion_init(&context->scalar);
+  for (size_t i = 0; i < context->count; ++i) {
+    const struct fusion_sample *sample = &context->samples[i];
+    imu_fusion_update_scalar(&context->scalar, sample->controller,
+                             sample->gyro, sample->accel, 0.001f);
+  }
+  bench_consume((uint64_t)(context->scalar.q[0][IMU_LEFT] * 1e6f));
+}
+
+int main(int argc, char *argv[]) {
+  static struct bench_input input;
+  static struct hid_decoder decoder;
+  static struct fusion_context context;
+  struct imu_channels channels;
+  if (bench_load(argc, argv, &input) != 0) {
+    return 1;
+  }
+  if (input.descriptor_length == 0 ||
+      hid_compile(input.descriptor, input.descriptor_length, &decoder) != 0 ||
+      imu_find_channels(&decoder, &channels) != 0) {
+    fprintf(stderr, "%s: no report descriptor with IMU fields\n",
+            input.source);
+    bench_free(&input);
+    return 1;
+  }
+  context.samples = malloc(input.count * sizeof(*context.samples));
+  if (context.samples == NULL) {
+    bench_free(&input);
+    return 1;
+  }
+  // One controller per device, as main assigns them.
+  const uint16_t first_product = input.reports[0].product_id;
+  struct hid_state state;
+  for (size_t i = 0; i < input.count; ++i) {
+    const struct report *report = &input.reports[i];
+    if (hid_decode(&decoder, report->data, report->length, &state) < 0) {
+      continue;
+    }
+    struct fusion_sample *sample = &context.samples[context.count++];
+    sample->controller =
+        report->product_id == first_product ? IMU_LEFT : IMU_RIGHT;
+    for (int axis = 0; axis < 3; ++axis) {
+      sample->gyro[axis] =
+          state.values[channels.gyro[axis]] * channels.gyro_scale;
+      sample->accel[axis] =
+          state.values[channels.accel[axis]] * channels.accel_scale;
+    }
+  }
+
+  bench_run("fusion", "sample", &input, context.count, fuse_vector, &context);
+  bench_run("fusion_scalar", "sample", &input, context.count, fuse_scalar,
+            &context);
+  float difference = 0.0f;
+  for (int controller = 0; controller < IMU_NUM_CONTROLLERS; ++controller) {
+    for (int i = 0; i < 4; ++i) {
+      difference = fmaxf(difference, fabsf(context.vector.q[i][controller] -
+                                           context.scalar.q[i][controller]));
+    }
+  }
+  free(context.samples);
+  bench_free(&input);
+  if (!(difference <= FUSION_BENCH_TOLERANCE)) {
+    fprintf(stderr, "fusion: the vector path is %g away from the scalar "
+                    "reference\n",
+            difference);
+    return 1;
+  }
+  fprintf(stderr, "fusion: vector and scalar orientations within %g\n",
+          difference);
+  return 0;
+}
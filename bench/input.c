@@ -0,0 +1,54 @@
+#include <stdio.h>
+
+#include "bench.h"
+#include "hid.h"
+#include "input.h"
+
+// Turning reports into input events: the byte compare against the previous
+// report, and decoding plus event extraction for the reports that changed.
+// Each controller has its own diff, as each stream does in main.
+
+struct input_context {
+  const struct bench_input *input;
+  struct hid_decoder decoder;
+  struct input_diff diffs[2];
+};
+
+static void diff_reports(void *data) {
+  struct input_context *context = data;
+  struct input_event events[INPUT_MAX_EVENTS];
+  input_diff_init(&context->diffs[0], &context->decoder);
+  input_diff_init(&context->diffs[1], &context->decoder);
+  const uint16_t first_product = context->input->reports[0].product_id;
+  uint64_t checksum = 0;
+  for (size_t i = 0; i < context->input->count; ++i) {
+    const struct report *report = &context->input->reports[i];
+    struct input_diff *diff =
+        &context->diffs[report->product_id == first_product ? 0 : 1];
+    checksum += input_diff_report(diff, report, events);
+  }
+  bench_consume(checksum);
+}
+
+int main(int argc, char *argv[]) {
+  static struct bench_input input;
+  static struct input_context context;
+  if (bench_load(argc, argv, &input) != 0) {
+    return 1;
+  }
+  if (input.descriptor_length == 0 ||
+      hid_compile(input.descriptor, input.descriptor_length,
+                  &context.decoder) != 0) {
+    fprintf(stderr, "%s: no usable report descriptor\n", input.source);
+    bench_free(&input);
+    return 1;
+  }
+  context.input = &input;
+  bench_run("input", "report", &input, input.count, diff_reports, &context);
+  fprintf(stderr, "input: %lu of %lu reports without input change\n",
+          (unsigned long)(context.diffs[0].unchanged +
+                          context.diffs[1].unchanged),
+          (unsigned long)(context.diffs[0].reports + context.diffs[1].reports));
+  bench_free(&input);
+  return 0;
+}
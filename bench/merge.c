@@ -0,0 +1,203 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "hid.h"
+#include "merge.h"
+
+// Joining both controllers into frames at 250 Hz as `main --merge 250` does:
+// every decoded report added to its hand, and the frames that came due given
+// out. Then the merge is checked on a few hand-made samples: interpolation,
+// the nearest mode, a hand going stale and frames skipped after a long pause.
+// The program fails if any of them is off.
+
+#define MERGE_BENCH_PERIOD_NS 4000000ull
+#define MERGE_BENCH_STALE_NS 10000000ull
+#define MERGE_BENCH_TOLERANCE 1e-4f
+
+struct merge_sample {
+  int side;
+  struct hid_state state;
+};
+
+struct merge_context {
+  struct merge_sample *samples;
+  size_t count;
+  struct merge merge;
+};
+
+static void merge_samples(void *data) {
+  struct merge_context *context = data;
+  struct merge_frame frame;
+  uint64_t checksum = 0;
+  merge_init(&context->merge, MERGE_BENCH_PERIOD_NS, MERGE_BENCH_STALE_NS,
+             MERGE_INTERPOLATE);
+  for (size_t i = 0; i < context->count; ++i) {
+    const struct merge_sample *sample = &context->samples[i];
+    merge_add(&context->merge, sample->side, &sample->state);
+    while (merge_next(&context->merge, sample->state.timestamp_ns, &frame)) {
+      checksum += frame.sides[MERGE_LEFT].buttons + frame.stale;
+    }
+  }
+  bench_consume(checksum);
+}
+
+static void add_sample(struct merge *merge, int side, uint64_t timestamp_ns,
+                       uint32_t buttons, float value) {
+  struct hid_state state;
+  memset(&state, 0, sizeof(state));
+  state.timestamp_ns = timestamp_ns;
+  state.buttons = buttons;
+  state.values[0] = value;
+  merge_add(merge, side, &state);
+}
+
+// Both hands at 0.4 ms and 1.4 ms, the first frame at 1 ms, 60% of the way.
+// Returns 0, or -1 with a message on stderr.
+static int check_between(enum merge_mode mode) {
+  const char *name = mode == MERGE_NEAREST ? "nearest" : "interpolation";
+  struct merge merge;
+  struct merge_frame frame;
+  merge_init(&merge, 1000000, MERGE_BENCH_STALE_NS, mode);
+  for (int side = 0; side < MERGE_SIDES; ++side) {
+    add_sample(&merge, side, 400000, 1, 0.0f);
+    add_sample(&merge, side, 1400000, 2, 10.0f);
+  }
+  if (!merge_next(&merge, 1400000, &frame) || frame.timestamp_ns != 1000000 ||
+      frame.stale != 0) {
+    fprintf(stderr, "merge: %s, no frame at 1 ms\n", name);
+    return -1;
+  }
+  const uint64_t expected_ns = mode == MERGE_NEAREST ? 1400000 : 1000000;
+  const float expected = mode == MERGE_NEAREST ? 10.0f : 6.0f;
+  for (int side = 0; side < MERGE_SIDES; ++side) {
+    const struct hid_state *state = &frame.sides[side];
+    if (state->timestamp_ns != expected_ns || state->buttons != 2 ||
+        !(fabsf(state->values[0] - expected) <= MERGE_BENCH_TOLERANCE)) {
+      fprintf(stderr,
+              "merge: %s, hand %d at %lu ns with buttons %u and value %g, "
+              "expected %lu ns, 2 and %g\n",
+              name, side, (unsigned long)state->timestamp_ns, state->buttons,
+              state->values[0], (unsigned long)expected_ns, expected);
+      return -1;
+    }
+  }
+  if (merge_next(&merge, 1400000, &frame)) {
+    fprintf(stderr, "merge: %s, a frame past the samples\n", name);
+    return -1;
+  }
+  return 0;
+}
+
+// The right hand stops after its first sample: its frame is held back until
+// the stale limit, then given out with the hand flagged and held.
+static int check_stale(void) {
+  struct merge merge;
+  struct merge_frame frame;
+  merge_init(&merge, 1000000, MERGE_BENCH_STALE_NS, MERGE_INTERPOLATE);
+  add_sample(&merge, MERGE_LEFT, 400000, 1, 0.0f);
+  add_sample(&merge, MERGE_RIGHT, 400000, 4, 3.0f);
+  add_sample(&merge, MERGE_LEFT, 1400000, 2, 10.0f);
+  if (merge_next(&merge, 1400000 + MERGE_BENCH_STALE_NS / 2, &frame)) {
+    fprintf(stderr, "merge: a frame before the stale limit\n");
+    return -1;
+  }
+  if (!merge_next(&merge, 1000000 + MERGE_BENCH_STALE_NS, &frame) ||
+      frame.timestamp_ns != 1000000 || frame.stale != 1u << MERGE_RIGHT ||
+      frame.sides[MERGE_RIGHT].timestamp_ns != 400000 ||
+      frame.sides[MERGE_RIGHT].buttons != 4 ||
+      frame.sides[MERGE_RIGHT].values[0] != 3.0f ||
+      !(fabsf(frame.sides[MERGE_LEFT].values[0] - 6.0f) <=
+        MERGE_BENCH_TOLERANCE) ||
+      merge.sides[MERGE_RIGHT].stale_frames != 1 ||
+      merge.sides[MERGE_LEFT].stale_frames != 0) {
+    fprintf(stderr, "merge: the late right hand was not held and flagged\n");
+    return -1;
+  }
+  return 0;
+}
+
+// Samples every millisecond up to 99.5 ms but merge_next first called at
+// 100 ms: the frames older than twice the stale limit are skipped, the rest
+// given out in order.
+static int check_skip_ahead(void) {
+  struct merge merge;
+  struct merge_frame frame;
+  merge_init(&merge, 1000000, MERGE_BENCH_STALE_NS, MERGE_INTERPOLATE);
+  for (uint64_t t = 500000; t < 100000000; t += 1000000) {
+    for (int side = 0; side < MERGE_SIDES; ++side) {
+      add_sample(&merge, side, t, 1, (float)t);
+    }
+  }
+  const uint64_t now = 100000000;
+  const uint64_t first = now - 2 * MERGE_BENCH_STALE_NS + 1000000;
+  uint64_t expected = first;
+  while (merge_next(&merge, now, &frame)) {
+    if (frame.timestamp_ns != expected || frame.stale != 0) {
+      fprintf(stderr, "merge: after skipping, frame at %lu ns, expected %lu\n",
+              (unsigned long)frame.timestamp_ns, (unsigned long)expected);
+      return -1;
+    }
+    expected += 1000000;
+  }
+  if (expected != now || merge.skipped != first / 1000000 - 1) {
+    fprintf(stderr,
+            "merge: after skipping, frames up to %lu ns and %lu skipped, "
+            "expected up to %lu and %lu\n",
+            (unsigned long)expected, (unsigned long)merge.skipped,
+            (unsigned long)now, (unsigned long)(first / 1000000 - 1));
+    return -1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  static struct bench_input input;
+  static struct hid_decoder decoder;
+  static struct merge_context context;
+  if (bench_load(argc, argv, &input) != 0) {
+    return 1;
+  }
+  if (input.descriptor_length == 0 ||
+      hid_compile(input.descriptor, input.descriptor_length, &decoder) != 0) {
+    fprintf(stderr, "%s: no usable report descriptor\n", input.source);
+    bench_free(&input);
+    return 1;
+  }
+  context.samples = malloc(input.count * sizeof(*context.samples));
+  if (context.samples == NULL) {
+    bench_free(&input);
+    return 1;
+  }
+  // One hand per device, as main assigns them.
+  const uint16_t first_product = input.reports[0].product_id;
+  for (size_t i = 0; i < input.count; ++i) {
+    const struct report *report = &input.reports[i];
+    struct merge_sample *sample = &context.samples[context.count];
+    if (hid_decode(&decoder, report->data, report->length, &sample->state) <
+        0) {
+      continue;
+    }
+    sample->state.timestamp_ns = report->timestamp_ns;
+    sample->side =
+        report->product_id == first_product ? MERGE_LEFT : MERGE_RIGHT;
+    ++context.count;
+  }
+
+  bench_run("merge", "report", &input, context.count, merge_samples, &context);
+  fprintf(stderr, "merge: %lu frames, %lu skipped\n",
+          (unsigned long)context.merge.frames,
+          (unsigned long)context.merge.skipped);
+  free(context.samples);
+  bench_free(&input);
+  if (check_between(MERGE_INTERPOLATE) != 0 ||
+      check_between(MERGE_NEAREST) != 0 || check_stale() != 0 ||
+      check_skip_ahead() != 0) {
+    return 1;
+  }
+  fprintf(stderr, "merge: interpolation, nearest, stale and skip-ahead "
+                  "frames as expected\n");
+  return 0;
+}
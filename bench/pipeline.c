@@ -0,0 +1,132 @@
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "hid.h"
+#include "imu.h"
+#include "replay.h"
+
+// End to end: the capture is replayed as fast as possible on the replay
+// thread, and every report is drained, decoded and fed to the IMU filter on
+// this one, as `main --replay --fast` does.
+
+struct pipeline_context {
+  const struct bench_input *input;
+  const char *path;
+  struct hid_decoder decoder;
+  struct imu_channels channels;
+  int has_imu;
+  struct imu_fusion fusion;
+  struct imu_batch batch;
+};
+
+static int drain(struct pipeline_context *context, struct report_ring *ring,
+                 int controller, uint64_t *checksum) {
+  const struct report *report;
+  struct hid_state state;
+  int drained = 0;
+  while ((report = report_ring_peek(ring)) != NULL) {
+    if (hid_decode(&context->decoder, report->data, report->length, &state) >=
+        0) {
+      *checksum += state.buttons;
+      if (context->has_imu && controller >= 0) {
+        float gyro[3];
+        float accel[3];
+        for (int axis = 0; axis < 3; ++axis) {
+          gyro[axis] = state.values[context->channels.gyro[axis]] *
+                       context->channels.gyro_scale;
+          accel[axis] = state.values[context->channels.accel[axis]] *
+                        context->channels.accel_scale;
+        }
+        if (imu_batch_add(&context->batch, controller, gyro, accel, 0.001f) !=
+            0) {
+          imu_fusion_update(&context->fusion, &context->batch);
+          imu_batch_clear(&context->batch);
+          imu_batch_add(&context->batch, controller, gyro, accel, 0.001f);
+        }
+      }
+    }
+    report_ring_release(ring);
+    ++drained;
+  }
+  return drained;
+}
+
+static void run_pipeline(void *data) {
+  struct pipeline_context *context = data;
+  struct replay replay;
+  if (replay_open(&replay, context->path, 0) != 0 ||
+      replay_start(&replay) != 0) {
+    fprintf(stderr, "%s:%d: unable to replay %s\n", __FILE__, __LINE__,
+            context->path);
+    exit(1);
+  }
+  imu_fusion_init(&context->fusion);
+  imu_batch_clear(&context->batch);
+  uint64_t checksum = 0;
+  int producing = 1;
+  while (producing) {
+    producing = atomic_load(&replay.running);
+    int drained = 0;
+    for (int i = 0; i < replay.num_sources; ++i) {
+      drained += drain(context, replay.sources[i].ring,
+                       i < IMU_LANES ? i : -1, &checksum);
+    }
+    if (drained == 0) {
+      sched_yield();
+    }
+    if (context->batch.steps > 0) {
+      imu_fusion_update(&context->fusion, &context->batch);
+      imu_batch_clear(&context->batch);
+    }
+  }
+  replay_stop(&replay);
+  replay_close(&replay);
+  bench_consume(checksum);
+}
+
+int main(int argc, char *argv[]) {
+  static struct bench_input input;
+  static struct pipeline_context context;
+  if (bench_load(argc, argv, &input) != 0) {
+    return 1;
+  }
+  if (input.descriptor_length == 0 ||
+      hid_compile(input.descriptor, input.descriptor_length,
+                  &context.decoder) != 0) {
+    fprintf(stderr, "%s: no usable report descriptor\n", input.source);
+    bench_free(&input);
+    return 1;
+  }
+  context.input = &input;
+  context.has_imu = imu_find_channels(&context.decoder, &context.channels) == 0;
+
+  // The replay needs a file, synthetic reports are written to a temporary
+  // one first.
+  char path[] = "/tmp/psvr2-bench-XXXXXX";
+  int fd = -1;
+  if (argc > 1) {
+    context.path = argv[1];
+  } else {
+    fd = mkstemp(path);
+    // capture_writer_open writes the header into empty files only.
+    if (fd < 0 || bench_write_capture(&input, path) != 0) {
+      fprintf(stderr, "%s:%d: unable to write %s\n", __FILE__, __LINE__, path);
+      bench_free(&input);
+      return 1;
+    }
+    context.path = path;
+  }
+
+  bench_run("pipeline", "report", &input, input.count, run_pipeline,
+            &context);
+
+  if (fd >= 0) {
+    close(fd);
+    unlink(path);
+  }
+  bench_free(&input);
+  return 0;
+}
@@ -0,0 +1,123 @@
+#include <math.h>
+#include <stdio.h>
+
+#include "bench.h"
+#include "hid.h"
+#include "imu.h"
+#include "pose.h"
+
+// One pose prediction, as every render thread asks for each frame: a seqlock
+// read of the published sample and its extrapolation to a scan-out 16 ms
+// after each report. Then the fit is checked across a restart of the device
+// clock mapping, and the program fails if it is off.
+
+#define PREDICT_BENCH_TOLERANCE 1e-4f
+
+struct predict_context {
+  const struct bench_input *input;
+  struct pose_predictor predictor;
+};
+
+static void predict_poses(void *data) {
+  struct predict_context *context = data;
+  uint64_t checksum = 0;
+  for (size_t i = 0; i < context->input->count; ++i) {
+    struct pose pose;
+    const uint64_t target =
+        context->input->reports[i].timestamp_ns + 16000000ull;
+    if (pose_predict(&context->predictor, (int)(i % IMU_NUM_CONTROLLERS),
+                     target, &pose) == 0) {
+      checksum += (uint64_t)(pose.q[0] * 1e6f);
+    }
+  }
+  bench_consume(checksum);
+}
+
+// Half the history 1 ms apart, then the other half 50 ms earlier, as after
+// clock_sync restarted, turning at 10 rad/s². The samples from before the
+// restart are newer than the latest one and left out of the fit.
+static int check_clock_restart(void) {
+  static struct imu_fusion fusion;
+  static struct pose_predictor predictor;
+  imu_fusion_init(&fusion);
+  pose_predictor_init(&predictor);
+  for (int i = 0; i < POSE_HISTORY / 2; ++i) {
+    const float gyro[3] = {5.0f, 0.0f, 0.0f};
+    pose_predictor_add_sample(&predictor, 0, 100000000ull + i * 1000000ull,
+                              gyro);
+  }
+  for (int i = 0; i < POSE_HISTORY / 2; ++i) {
+    const float gyro[3] = {1.0f + 0.01f * i, 0.0f, 0.0f};
+    pose_predictor_add_sample(&predictor, 0, 50000000ull + i * 1000000ull,
+                              gyro);
+  }
+  pose_predictor_publish(&predictor, 0, &fusion);
+  const struct pose_sample *sample = &predictor.slots[0].sample;
+  const float expected = 1.0f + 0.01f * (POSE_HISTORY / 2 - 1);
+  if (!(fabsf(sample->angular_velocity[0] + fusion.bias[0][0] - expected) <=
+        PREDICT_BENCH_TOLERANCE) ||
+      !(fabsf(sample->angular_acceleration[0] - 10.0f) <= 0.01f)) {
+    fprintf(stderr,
+            "predict: after a clock restart, %g rad/s and %g rad/s², "
+            "expected %g and 10\n",
+            sample->angular_velocity[0] + fusion.bias[0][0],
+            sample->angular_acceleration[0], expected);
+    return -1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  static struct bench_input input;
+  static struct predict_context context;
+  static struct hid_decoder decoder;
+  static struct imu_fusion fusion;
+  static struct imu_batch batch;
+  struct imu_channels channels;
+  if (bench_load(argc, argv, &input) != 0) {
+    return 1;
+  }
+  if (input.descriptor_length == 0 ||
+      hid_compile(input.descriptor, input.descriptor_length, &decoder) != 0 ||
+      imu_find_channels(&decoder, &channels) != 0) {
+    fprintf(stderr, "%s: no report descriptor with IMU fields\n",
+            input.source);
+    bench_free(&input);
+    return 1;
+  }
+  context.input = &input;
+
+  // Publish a realistic state for both controllers from the first reports.
+  imu_fusion_init(&fusion);
+  imu_batch_clear(&batch);
+  pose_predictor_init(&context.predictor);
+  struct hid_state state;
+  for (size_t i = 0; i < input.count && i < IMU_MAX_BATCH; ++i) {
+    const struct report *report = &input.reports[i];
+    if (hid_decode(&decoder, report->data, report->length, &state) < 0) {
+      continue;
+    }
+    const int controller = (int)(i % IMU_NUM_CONTROLLERS);
+    float gyro[3];
+    float accel[3];
+    for (int axis = 0; axis < 3; ++axis) {
+      gyro[axis] = state.values[channels.gyro[axis]] * channels.gyro_scale;
+      accel[axis] = state.values[channels.accel[axis]] * channels.accel_scale;
+    }
+    imu_batch_add(&batch, controller, gyro, accel, 0.001f);
+    pose_predictor_add_sample(&context.predictor, controller,
+                              report->timestamp_ns, gyro);
+  }
+  imu_fusion_update(&fusion, &batch);
+  for (int controller = 0; controller < IMU_NUM_CONTROLLERS; ++controller) {
+    pose_predictor_publish(&context.predictor, controller, &fusion);
+  }
+
+  bench_run("predict", "pose", &input, input.count, predict_poses, &context);
+  bench_free(&input);
+  if (check_clock_restart() != 0) {
+    return 1;
+  }
+  fprintf(stderr, "predict: fit across a clock restart as expected\n");
+  return 0;
+}
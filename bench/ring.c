@@ -0,0 +1,72 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+
+#include "bench.h"
+#include "ring.h"
+
+// Handing reports from a producer thread to the consumer through a
+// report_ring, the path between the USB thread and the main loop.
+
+#define RING_REPORTS 1000000
+
+struct ring_context {
+  const struct bench_input *input;
+  struct report_ring *ring;
+};
+
+static void *produce(void *data) {
+  struct ring_context *context = data;
+  const struct bench_input *input = context->input;
+  for (size_t i = 0; i < RING_REPORTS; ++i) {
+    const struct report *report = &input->reports[i % input->count];
+    // Wait for room, yielding so this also measures something sensible
+    // when both threads share a core.
+    while (report_ring_count(context->ring) == REPORT_RING_SIZE) {
+      sched_yield();
+    }
+    report_ring_push(context->ring, report->timestamp_ns, report->product_id,
+                     report->endpoint, report->data, report->length);
+  }
+  return NULL;
+}
+
+static void hand_off_reports(void *data) {
+  struct ring_context *context = data;
+  pthread_t producer;
+  if (pthread_create(&producer, NULL, produce, context) != 0) {
+    fprintf(stderr, "%s:%d: unable to start the producer\n", __FILE__,
+            __LINE__);
+    return;
+  }
+  uint64_t checksum = 0;
+  for (size_t consumed = 0; consumed < RING_REPORTS;) {
+    const struct report *report = report_ring_peek(context->ring);
+    if (report == NULL) {
+      sched_yield();
+      continue;
+    }
+    checksum += report->data[0];
+    report_ring_release(context->ring);
+    ++consumed;
+  }
+  pthread_join(producer, NULL);
+  bench_consume(checksum);
+}
+
+int main(int argc, char *argv[]) {
+  static struct bench_input input;
+  if (bench_load(argc, argv, &input) != 0) {
+    return 1;
+  }
+  struct ring_context context = {.input = &input, .ring = report_ring_create()};
+  if (context.ring == NULL) {
+    bench_free(&input);
+    return 1;
+  }
+  bench_run("ring", "report", &input, RING_REPORTS, hand_off_reports,
+            &context);
+  report_ring_destroy(context.ring);
+  bench_free(&input);
+  return 0;
+}
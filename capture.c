@@ -0,0 +1,176 @@
+#include "capture.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "monotonic.h"
+
+static size_t capture_padding(size_t length) {
+  return (CAPTURE_RECORD_ALIGNMENT - length % CAPTURE_RECORD_ALIGNMENT) %
+         CAPTURE_RECORD_ALIGNMENT;
+}
+
+static int capture_header_valid(const struct capture_file_header *header) {
+  return memcmp(header->magic, CAPTURE_MAGIC, sizeof(header->magic)) == 0 &&
+         header->version == CAPTURE_VERSION &&
+         header->header_size == sizeof(struct capture_file_header);
+}
+
+int capture_writer_open(struct capture_writer *writer, const char *path) {
+  writer->records = 0;
+  writer->file = fopen(path, "a+b");
+  if (writer->file == NULL) {
+    fprintf(stderr, "%s:%d: unable to open %s\n", __FILE__, __LINE__, path);
+    return -1;
+  }
+
+  fseek(writer->file, 0, SEEK_END);
+  if (ftell(writer->file) == 0) {
+    struct capture_file_header header = {
+        .version = CAPTURE_VERSION,
+        .header_size = sizeof(struct capture_file_header),
+    };
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    if (fwrite(&header, sizeof(header), 1, writer->file) != 1) {
+      fprintf(stderr, "%s:%d: unable to write to %s\n", __FILE__, __LINE__,
+              path);
+      capture_writer_close(writer);
+      return -1;
+    }
+    return 0;
+  }
+
+  // Appending to an existing capture, make sure it is one.
+  struct capture_file_header header;
+  rewind(writer->file);
+  if (fread(&header, sizeof(header), 1, writer->file) != 1 ||
+      !capture_header_valid(&header)) {
+    fprintf(stderr, "%s:%d: %s is not a capture file\n", __FILE__, __LINE__,
+            path);
+    capture_writer_close(writer);
+    return -1;
+  }
+  // In append mode every write goes to the end of the file regardless.
+  fseek(writer->file, 0, SEEK_END);
+  return 0;
+}
+
+static int capture_write_record(struct capture_writer *writer,
+                                const struct capture_record_header *header,
+                                const uint8_t *payload) {
+  static const uint8_t padding[CAPTURE_RECORD_ALIGNMENT] = {0};
+  size_t padding_length = capture_padding(header->length);
+  if (fwrite(header, sizeof(*header), 1, writer->file) != 1 ||
+      fwrite(payload, 1, header->length, writer->file) != header->length ||
+      fwrite(padding, 1, padding_length, writer->file) != padding_length) {
+    return -1;
+  }
+  return 0;
+}
+
+int capture_write(struct capture_writer *writer, const struct report *report) {
+  struct capture_record_header header = {
+      .timestamp_ns = report->timestamp_ns,
+      .product_id = report->product_id,
+      .endpoint = report->endpoint,
+      .length = report->length,
+  };
+  if (capture_write_record(writer, &header, report->data) != 0) {
+    return -1;
+  }
+  ++writer->records;
+  return 0;
+}
+
+int capture_write_descriptor(struct capture_writer *writer,
+                             uint16_t product_id, const uint8_t *descriptor,
+                             uint16_t length) {
+  struct capture_record_header header = {
+      .timestamp_ns = monotonic_ns(),
+      .product_id = product_id,
+      .endpoint = CAPTURE_ENDPOINT_DESCRIPTOR,
+      .length = length,
+  };
+  return capture_write_record(writer, &header, descriptor);
+}
+
+void capture_writer_close(struct capture_writer *writer) {
+  if (writer->file != NULL) {
+    fclose(writer->file);
+    writer->file = NULL;
+  }
+}
+
+int capture_reader_open(struct capture_reader *reader, const char *path) {
+  memset(reader, 0, sizeof(*reader));
+  reader->fd = open(path, O_RDONLY);
+  if (reader->fd < 0) {
+    fprintf(stderr, "%s:%d: unable to open %s\n", __FILE__, __LINE__, path);
+    return -1;
+  }
+  struct stat st;
+  if (fstat(reader->fd, &st) != 0 ||
+      (size_t)st.st_size < sizeof(struct capture_file_header)) {
+    fprintf(stderr, "%s:%d: %s is not a capture file\n", __FILE__, __LINE__,
+            path);
+    close(reader->fd);
+    return -1;
+  }
+  reader->size = st.st_size;
+  void *data = mmap(NULL, reader->size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "%s:%d: unable to map %s\n", __FILE__, __LINE__, path);
+    close(reader->fd);
+    return -1;
+  }
+  reader->data = data;
+  // Records are read front to back.
+  madvise(data, reader->size, MADV_SEQUENTIAL);
+
+  if (!capture_header_valid((const struct capture_file_header *)data)) {
+    fprintf(stderr, "%s:%d: %s is not a capture file\n", __FILE__, __LINE__,
+            path);
+    capture_reader_close(reader);
+    return -1;
+  }
+  reader->offset = sizeof(struct capture_file_header);
+  return 0;
+}
+
+void capture_reader_close(struct capture_reader *reader) {
+  if (reader->data != NULL) {
+    munmap((void *)reader->data, reader->size);
+    reader->data = NULL;
+  }
+  if (reader->fd >= 0) {
+    close(reader->fd);
+    reader->fd = -1;
+  }
+}
+
+const struct capture_record_header *
+capture_reader_next(struct capture_reader *reader, const uint8_t **payload) {
+  if (reader->size - reader->offset < sizeof(struct capture_record_header)) {
+    return NULL;
+  }
+  const struct capture_record_header *header =
+      (const struct capture_record_header *)(reader->data + reader->offset);
+  size_t record_size = sizeof(*header) + header->length;
+  if (reader->size - reader->offset < record_size) {
+    return NULL;
+  }
+  *payload = reader->data + reader->offset + sizeof(*header);
+  reader->offset += record_size + capture_padding(header->length);
+  if (reader->offset > reader->size) {
+    // Only the padding of the last record is missing.
+    reader->offset = reader->size;
+  }
+  return header;
+}
+
+void capture_reader_rewind(struct capture_reader *reader) {
+  reader->offset = sizeof(struct capture_file_header);
+}
@@ -0,0 +1,74 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "ring.h"
+
+// Capture files are a file header followed by records appended one after the
+// other. Every record starts on an 8 byte boundary so a mmapped capture can
+// be walked in place.
+#define CAPTURE_MAGIC "PSVR2CAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_RECORD_ALIGNMENT 8
+// Records on this endpoint hold the HID report descriptor of the device
+// rather than a report, so a capture can be decoded on its own.
+#define CAPTURE_ENDPOINT_DESCRIPTOR 0x00
+
+struct capture_file_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+};
+
+struct capture_record_header {
+  // Host CLOCK_MONOTONIC time at which the report was received.
+  uint64_t timestamp_ns;
+  uint16_t product_id;
+  uint8_t endpoint;
+  uint8_t reserved;
+  // Payload bytes following this header, padding excluded.
+  uint16_t length;
+  uint16_t reserved2;
+};
+
+_Static_assert(sizeof(struct capture_file_header) == 16,
+               "capture file header layout changed");
+_Static_assert(sizeof(struct capture_record_header) == 16,
+               "capture record header layout changed");
+
+struct capture_writer {
+  FILE *file;
+  uint64_t records;
+};
+
+// Opens `path` for appending, writing the file header if the file is new.
+// Returns 0 or -1 (with a message on stderr).
+int capture_writer_open(struct capture_writer *writer, const char *path);
+int capture_write(struct capture_writer *writer, const struct report *report);
+int capture_write_descriptor(struct capture_writer *writer,
+                             uint16_t product_id, const uint8_t *descriptor,
+                             uint16_t length);
+void capture_writer_close(struct capture_writer *writer);
+
+struct capture_reader {
+  int fd;
+  const uint8_t *data;
+  size_t size;
+  size_t offset;
+};
+
+// Maps the whole capture read-only. Returns 0 or -1.
+int capture_reader_open(struct capture_reader *reader, const char *path);
+void capture_reader_close(struct capture_reader *reader);
+
+// Returns the next record and points `payload` into the mapping, or NULL at
+// the end of the capture. A truncated last record (capture interrupted while
+// writing) ends the capture.
+const struct capture_record_header *
+capture_reader_next(struct capture_reader *reader, const uint8_t **payload);
+void capture_reader_rewind(struct capture_reader *reader);
+
+#endif // CAPTURE_H
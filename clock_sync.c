@@ -0,0 +1,188 @@
+#include "clock_sync.h"
+
+#include <math.h>
+#include <string.h>
+
+void clock_sync_init(struct clock_sync *sync, const struct clock_field *field) {
+  memset(sync, 0, sizeof(*sync));
+  sync->field = *field;
+  sync->tick_mask =
+      field->bit_size >= 64 ? ~0ull : (1ull << field->bit_size) - 1;
+}
+
+int clock_field_read(const struct clock_field *field, const uint8_t *data,
+                     int length, uint64_t *ticks) {
+  if (field->report_id >= 0 && (length < 1 || data[0] != field->report_id)) {
+    return -1;
+  }
+  const int shift = field->bit_offset % 8;
+  const int first = field->bit_offset / 8;
+  const int last = (field->bit_offset + field->bit_size - 1) / 8;
+  if (field->bit_size == 0 || shift + field->bit_size > 64 || last >= length) {
+    return -1;
+  }
+  uint64_t value = 0;
+  for (int byte = last; byte >= first; --byte) {
+    value = value << 8 | data[byte];
+  }
+  value >>= shift;
+  *ticks = field->bit_size >= 64 ? value
+                                 : value & ((1ull << field->bit_size) - 1);
+  return 0;
+}
+
+static double clock_sync_predict(const struct clock_sync *sync,
+                                 int64_t ticks) {
+  return sync->offset_ns +
+         sync->slope_ns * (double)(ticks - sync->reference_ticks);
+}
+
+// Extends the ticks to 64 bits. Between close pairs this only has to count
+// the wraps; after a gap longer than the counter's range the fit says how
+// many were missed.
+static int64_t clock_sync_unwrap(const struct clock_sync *sync,
+                                 uint64_t raw_ticks, uint64_t host_ns) {
+  if (!sync->has_last) {
+    return (int64_t)raw_ticks;
+  }
+  int64_t ticks =
+      sync->last_ticks +
+      (int64_t)((raw_ticks - (uint64_t)sync->last_ticks) & sync->tick_mask);
+  if (sync->valid && sync->tick_mask != ~0ull) {
+    const double range = (double)sync->tick_mask + 1.0;
+    const double elapsed_ns =
+        (double)(int64_t)(host_ns - sync->reference_ns) - sync->offset_ns;
+    const double expected =
+        (double)sync->reference_ticks + elapsed_ns / sync->slope_ns;
+    const double wraps = floor((expected - (double)ticks) / range + 0.5);
+    if (wraps > 0.0) {
+      ticks += (int64_t)wraps * (int64_t)(sync->tick_mask + 1);
+    }
+  }
+  return ticks;
+}
+
+// Least squares line through the window, relative to its newest pair, then
+// refitted twice without the pairs more than three residuals away: a report
+// that waited for an event loop iteration is not a sample of the line.
+static void clock_sync_fit(struct clock_sync *sync) {
+  const int n = sync->count < CLOCK_SYNC_WINDOW ? (int)sync->count
+                                                : CLOCK_SYNC_WINDOW;
+  const struct clock_sync_pair *newest =
+      &sync->pairs[(sync->count - 1) & (CLOCK_SYNC_WINDOW - 1)];
+  double slope = 0.0;
+  double offset = 0.0;
+  double residual = INFINITY;
+  int fitted = 0;
+  for (int pass = 0; pass < 3; ++pass) {
+    // Never tighter than a microsecond, a perfect clock would reject all.
+    const double limit = 3.0 * residual + 1000.0;
+    double sum_x = 0.0;
+    double sum_y = 0.0;
+    double sum_xx = 0.0;
+    double sum_xy = 0.0;
+    int kept = 0;
+    for (int i = 0; i < n; ++i) {
+      const double x = (double)(sync->pairs[i].ticks - newest->ticks);
+      const double y = (double)(int64_t)(sync->pairs[i].host_ns -
+                                         newest->host_ns);
+      if (fabs(y - offset - slope * x) > limit) {
+        continue;
+      }
+      sum_x += x;
+      sum_y += y;
+      sum_xx += x * x;
+      sum_xy += x * y;
+      ++kept;
+    }
+    if (kept < CLOCK_SYNC_MIN_SAMPLES / 2) {
+      break;
+    }
+    const double mean_x = sum_x / kept;
+    const double mean_y = sum_y / kept;
+    const double variance = sum_xx - sum_x * mean_x;
+    if (variance <= 0.0) {
+      break;
+    }
+    const double new_slope = (sum_xy - sum_x * mean_y) / variance;
+    const double new_offset = mean_y - new_slope * mean_x;
+    if (new_slope <= 0.0) {
+      break;
+    }
+
+    double squares = 0.0;
+    for (int i = 0; i < n; ++i) {
+      const double x = (double)(sync->pairs[i].ticks - newest->ticks);
+      const double y = (double)(int64_t)(sync->pairs[i].host_ns -
+                                         newest->host_ns);
+      if (fabs(y - offset - slope * x) > limit) {
+        continue;
+      }
+      const double r = y - new_offset - new_slope * x;
+      squares += r * r;
+    }
+    slope = new_slope;
+    offset = new_offset;
+    residual = sqrt(squares / kept);
+    fitted = 1;
+  }
+  if (!fitted) {
+    return;
+  }
+  sync->reference_ticks = newest->ticks;
+  sync->reference_ns = newest->host_ns;
+  sync->offset_ns = offset;
+  sync->slope_ns = slope;
+  sync->residual_ns = residual;
+  sync->valid = 1;
+}
+
+static void clock_sync_reset(struct clock_sync *sync) {
+  sync->count = 0;
+  sync->valid = 0;
+  sync->has_last = 0;
+  sync->far_off = 0;
+  ++sync->resets;
+}
+
+uint64_t clock_sync_update(struct clock_sync *sync, uint64_t raw_ticks,
+                           uint64_t host_ns) {
+  int64_t ticks = clock_sync_unwrap(sync, raw_ticks, host_ns);
+  if (sync->valid) {
+    const double error = (double)(int64_t)(host_ns - sync->reference_ns) -
+                         clock_sync_predict(sync, ticks);
+    if (fabs(error) > (double)CLOCK_SYNC_MAX_ERROR_NS) {
+      ++sync->rejected;
+      if (++sync->far_off < CLOCK_SYNC_RESET_COUNT) {
+        // Most likely a report that waited, the fit still knows when it
+        // was sampled.
+        sync->last_ticks = ticks;
+        return sync->reference_ns +
+               (int64_t)llround(clock_sync_predict(sync, ticks));
+      }
+      clock_sync_reset(sync);
+      ticks = (int64_t)raw_ticks;
+    } else {
+      sync->far_off = 0;
+    }
+  }
+
+  sync->pairs[sync->count & (CLOCK_SYNC_WINDOW - 1)] =
+      (struct clock_sync_pair){.ticks = ticks, .host_ns = host_ns};
+  ++sync->count;
+  sync->last_ticks = ticks;
+  sync->has_last = 1;
+  if (sync->count >= CLOCK_SYNC_MIN_SAMPLES &&
+      (!sync->valid || sync->count % CLOCK_SYNC_REFIT_INTERVAL == 0)) {
+    clock_sync_fit(sync);
+  }
+  if (!sync->valid) {
+    return host_ns;
+  }
+  return sync->reference_ns +
+         (int64_t)llround(clock_sync_predict(sync, ticks));
+}
+
+double clock_sync_rate(const struct clock_sync *sync) {
+  return sync->valid ? 1e9 / sync->slope_ns : 0.0;
+}
@@ -0,0 +1,81 @@
+#ifndef CLOCK_SYNC_H
+#define CLOCK_SYNC_H
+
+#include <stdint.h>
+
+// Maps the ticks of a device clock carried in the reports to host
+// CLOCK_MONOTONIC time. The arrival time of a report is late by a varying
+// amount (the polling interval, event batching, scheduling) while the device
+// samples on its own steady clock: a line fitted through (ticks, arrival)
+// pairs gives sample times with the jitter averaged out, at the mean
+// latency.
+
+// Pairs kept for the fit, about a second at 1 kHz. Must be a power of two.
+#define CLOCK_SYNC_WINDOW 1024
+// Pairs needed before the fit is used.
+#define CLOCK_SYNC_MIN_SAMPLES 64
+// The fit is redone every this many pairs, and kept in between.
+#define CLOCK_SYNC_REFIT_INTERVAL 32
+// Arrival further than this from the fit: late by far more than any
+// jitter, or the device clock jumped.
+#define CLOCK_SYNC_MAX_ERROR_NS 20000000ll
+// Consecutive pairs that far off before the device clock is considered
+// restarted and the estimate starts over.
+#define CLOCK_SYNC_RESET_COUNT 16
+
+// Where the ticks are in the reports.
+struct clock_field {
+  // -1 for any report.
+  int report_id;
+  // From the start of the report, report ID included.
+  uint16_t bit_offset;
+  // At most 64, and within 8 bytes of the report.
+  uint8_t bit_size;
+};
+
+struct clock_sync_pair {
+  // Unwrapped device ticks.
+  int64_t ticks;
+  uint64_t host_ns;
+};
+
+struct clock_sync {
+  struct clock_field field;
+  uint64_t tick_mask;
+  // Unwrapping: the ticks of the last pair, extended to 64 bits.
+  int64_t last_ticks;
+  int has_last;
+  struct clock_sync_pair pairs[CLOCK_SYNC_WINDOW];
+  uint64_t count;
+  // host_ns = reference_ns + offset_ns + slope_ns * (ticks - reference_ticks)
+  int valid;
+  int64_t reference_ticks;
+  uint64_t reference_ns;
+  double offset_ns;
+  double slope_ns;
+  // Of the pairs kept by the last fit.
+  double residual_ns;
+  int far_off;
+  // Since the start.
+  uint64_t rejected;
+  uint64_t resets;
+};
+
+// Ticks `field->bit_size` wide wrap around.
+void clock_sync_init(struct clock_sync *sync, const struct clock_field *field);
+
+// Reads the ticks of `field` in a report. Returns 0, or -1 if the report
+// does not carry them.
+int clock_field_read(const struct clock_field *field, const uint8_t *data,
+                     int length, uint64_t *ticks);
+
+// Adds the raw ticks of a report that arrived at `host_ns` and returns the
+// host time of its sample: from the fit once there is one, `host_ns` until
+// then.
+uint64_t clock_sync_update(struct clock_sync *sync, uint64_t raw_ticks,
+                           uint64_t host_ns);
+
+// Device ticks per second according to the fit, 0 without one.
+double clock_sync_rate(const struct clock_sync *sync);
+
+#endif // CLOCK_SYNC_H
@@ -0,0 +1,184 @@
+#include "discovery.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sony.h"
+
+static const uint16_t discovery_products[DISCOVERY_MAX_PRODUCTS] = {
+    LEFT_SENSE_CONTROLLER_DEVICE_ID,
+    RIGHT_SENSE_CONTROLLER_DEVICE_ID,
+    PSVR2_DEVICE_ID,
+};
+
+void discovery_port_path(libusb_device *device, char *port_path) {
+  uint8_t ports[7];
+  int num_ports = libusb_get_port_numbers(device, ports, sizeof(ports));
+  int length = snprintf(port_path, DISCOVERY_PORT_PATH_SIZE, "%d",
+                        libusb_get_bus_number(device));
+  for (int i = 0; i < num_ports && length < DISCOVERY_PORT_PATH_SIZE; ++i) {
+    length += snprintf(port_path + length, DISCOVERY_PORT_PATH_SIZE - length,
+                       "%c%d", i == 0 ? '-' : '.', ports[i]);
+  }
+}
+
+static void discovery_queue(struct discovery *discovery,
+                            libusb_device *device, libusb_hotplug_event event,
+                            uint16_t product_id) {
+  pthread_mutex_lock(&discovery->lock);
+  if (discovery->num_events == DISCOVERY_MAX_EVENTS) {
+    ++discovery->lost_events;
+    pthread_mutex_unlock(&discovery->lock);
+    return;
+  }
+  struct discovery_event *queued = &discovery->events[discovery->num_events++];
+  queued->event = event;
+  queued->product_id = product_id;
+  discovery_port_path(device, queued->port_path);
+  queued->device = event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED
+                       ? libusb_ref_device(device)
+                       : NULL;
+  pthread_mutex_unlock(&discovery->lock);
+}
+
+// Runs on the event thread, or on the registering thread for the devices
+// already present. Opening the device and synchronous transfers are not
+// allowed from here, so the event is only queued.
+static int discovery_hotplug_callback(libusb_context *ctx,
+                                      libusb_device *device,
+                                      libusb_hotplug_event event,
+                                      void *user_data) {
+  struct libusb_device_descriptor dev_desc;
+  if (libusb_get_device_descriptor(device, &dev_desc) == LIBUSB_SUCCESS) {
+    discovery_queue(user_data, device, event, dev_desc.idProduct);
+  }
+  // Stay registered.
+  return 0;
+}
+
+int discovery_matches_ids(uint16_t vendor_id, uint16_t product_id) {
+  if (vendor_id != SONY_VENDOR_ID) {
+    return 0;
+  }
+  for (int i = 0; i < DISCOVERY_MAX_PRODUCTS; ++i) {
+    if (product_id == discovery_products[i]) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int discovery_matches(const struct libusb_device_descriptor *dev_desc) {
+  return discovery_matches_ids(dev_desc->idVendor, dev_desc->idProduct);
+}
+
+static int discovery_scan(struct discovery *discovery) {
+  libusb_device **dev_list;
+  ssize_t count = libusb_get_device_list(discovery->ctx, &dev_list);
+  if (count < 0) {
+    return (int)count;
+  }
+  for (ssize_t i = 0; i < count; ++i) {
+    struct libusb_device_descriptor dev_desc;
+    if (libusb_get_device_descriptor(dev_list[i], &dev_desc) ==
+            LIBUSB_SUCCESS &&
+        discovery_matches(&dev_desc)) {
+      discovery_queue(discovery, dev_list[i],
+                      LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, dev_desc.idProduct);
+    }
+  }
+  libusb_free_device_list(dev_list, 1);
+  return 0;
+}
+
+int discovery_start(struct discovery *discovery, libusb_context *ctx) {
+  memset(discovery, 0, sizeof(*discovery));
+  discovery->ctx = ctx;
+  pthread_mutex_init(&discovery->lock, NULL);
+
+  if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+    printf("No hotplug support, looking for devices once.\n");
+    return discovery_scan(discovery);
+  }
+  for (int i = 0; i < DISCOVERY_MAX_PRODUCTS; ++i) {
+    int result = libusb_hotplug_register_callback(
+        ctx,
+        LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+        LIBUSB_HOTPLUG_ENUMERATE, SONY_VENDOR_ID, discovery_products[i],
+        LIBUSB_HOTPLUG_MATCH_ANY, discovery_hotplug_callback, discovery,
+        &discovery->handles[discovery->num_handles]);
+    if (result != LIBUSB_SUCCESS) {
+      fprintf(stderr, "%s:%d: unable to register a hotplug callback: %s\n",
+              __FILE__, __LINE__, libusb_error_name(result));
+      discovery_stop(discovery);
+      return result;
+    }
+    ++discovery->num_handles;
+  }
+  return 0;
+}
+
+int discovery_take_events(struct discovery *discovery,
+                          struct discovery_event *events, int max_events) {
+  pthread_mutex_lock(&discovery->lock);
+  int taken = discovery->num_events < max_events ? discovery->num_events
+                                                 : max_events;
+  memcpy(events, discovery->events, taken * sizeof(*events));
+  memmove(discovery->events, discovery->events + taken,
+          (discovery->num_events - taken) * sizeof(*events));
+  discovery->num_events -= taken;
+  pthread_mutex_unlock(&discovery->lock);
+  return taken;
+}
+
+void discovery_release_event(struct discovery_event *event) {
+  if (event->device != NULL) {
+    libusb_unref_device(event->device);
+    event->device = NULL;
+  }
+}
+
+struct discovery_device *discovery_lookup(struct discovery *discovery,
+                                          const char *port_path,
+                                          uint16_t product_id) {
+  for (int i = 0; i < discovery->num_devices; ++i) {
+    struct discovery_device *device = &discovery->devices[i];
+    if (device->product_id == product_id &&
+        strcmp(device->port_path, port_path) == 0) {
+      return device;
+    }
+  }
+  return NULL;
+}
+
+struct discovery_device *
+discovery_remember(struct discovery *discovery,
+                   const struct discovery_event *event,
+                   struct libusb_config_descriptor *config) {
+  if (discovery->num_devices == DISCOVERY_MAX_DEVICES) {
+    return NULL;
+  }
+  struct discovery_device *device =
+      &discovery->devices[discovery->num_devices++];
+  memcpy(device->port_path, event->port_path, sizeof(device->port_path));
+  device->product_id = event->product_id;
+  device->config = config;
+  device->dev_handle = NULL;
+  return device;
+}
+
+void discovery_stop(struct discovery *discovery) {
+  for (int i = 0; i < discovery->num_handles; ++i) {
+    libusb_hotplug_deregister_callback(discovery->ctx, discovery->handles[i]);
+  }
+  discovery->num_handles = 0;
+  for (int i = 0; i < discovery->num_events; ++i) {
+    discovery_release_event(&discovery->events[i]);
+  }
+  discovery->num_events = 0;
+  for (int i = 0; i < discovery->num_devices; ++i) {
+    libusb_free_config_descriptor(discovery->devices[i].config);
+  }
+  discovery->num_devices = 0;
+  pthread_mutex_destroy(&discovery->lock);
+}
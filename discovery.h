@@ -0,0 +1,87 @@
+#ifndef DISCOVERY_H
+#define DISCOVERY_H
+
+#include <libusb-1.0/libusb.h>
+#include <pthread.h>
+#include <stdint.h>
+
+// Finds the PSVR2 devices through libusb hotplug events filtered on their
+// vendor and product ids, so no other device on the bus is ever opened.
+// Events are delivered on the thread running the libusb event loop and
+// queued until the thread owning the streams takes them.
+
+#define DISCOVERY_MAX_EVENTS 32
+#define DISCOVERY_MAX_DEVICES 8
+#define DISCOVERY_MAX_PRODUCTS 3
+// "bus-port.port...", USB allows at most 7 ports in a chain.
+#define DISCOVERY_PORT_PATH_SIZE 32
+
+struct discovery_event {
+  libusb_hotplug_event event;
+  // Holds a reference on arrivals, released by discovery_release_event.
+  // NULL on departures, the device is gone by the time they are handled.
+  libusb_device *device;
+  uint16_t product_id;
+  char port_path[DISCOVERY_PORT_PATH_SIZE];
+};
+
+// What was learnt about a device the first time it showed up on a port. A
+// controller plugged back in the same port reuses it rather than being
+// enumerated and described again.
+struct discovery_device {
+  char port_path[DISCOVERY_PORT_PATH_SIZE];
+  uint16_t product_id;
+  struct libusb_config_descriptor *config;
+  // Owned by whoever streams from the device, NULL while it is away.
+  libusb_device_handle *dev_handle;
+};
+
+struct discovery {
+  libusb_context *ctx;
+  libusb_hotplug_callback_handle handles[DISCOVERY_MAX_PRODUCTS];
+  int num_handles;
+  pthread_mutex_t lock;
+  struct discovery_event events[DISCOVERY_MAX_EVENTS];
+  int num_events;
+  // Events lost because the queue was full.
+  uint64_t lost_events;
+  struct discovery_device devices[DISCOVERY_MAX_DEVICES];
+  int num_devices;
+};
+
+// Registers the hotplug callbacks. The devices already plugged in are
+// reported as arrivals. Without hotplug support on the platform the device
+// list is scanned once instead, only comparing device descriptors. Returns 0
+// or a libusb error code.
+int discovery_start(struct discovery *discovery, libusb_context *ctx);
+
+// Moves up to `max_events` queued events to `events`, oldest first, and
+// returns how many were moved.
+int discovery_take_events(struct discovery *discovery,
+                          struct discovery_event *events, int max_events);
+void discovery_release_event(struct discovery_event *event);
+
+// NULL if nothing is cached for this device on this port.
+struct discovery_device *discovery_lookup(struct discovery *discovery,
+                                          const char *port_path,
+                                          uint16_t product_id);
+// Caches the config descriptor of a newly seen device, which then belongs to
+// the cache. Returns NULL if the cache is full.
+struct discovery_device *
+discovery_remember(struct discovery *discovery,
+                   const struct discovery_event *event,
+                   struct libusb_config_descriptor *config);
+
+// Whether a device is one of the PSVR2 devices.
+int discovery_matches(const struct libusb_device_descriptor *dev_desc);
+int discovery_matches_ids(uint16_t vendor_id, uint16_t product_id);
+
+// Writes the "bus-port.port" path of a device into `port_path`, which holds
+// DISCOVERY_PORT_PATH_SIZE bytes. Only reads what libusb already knows about
+// the device, no I/O.
+void discovery_port_path(libusb_device *device, char *port_path);
+
+// Deregisters the callbacks, drops the pending events and frees the cache.
+void discovery_stop(struct discovery *discovery);
+
+#endif // DISCOVERY_H
@@ -0,0 +1,139 @@
+#include "downsample.h"
+
+#include <stdio.h>
+#include <string.h>
+
+int downsample_init(struct downsample *downsample, int num_channels,
+                    uint64_t bucket_ns) {
+  if (num_channels <= 0 || num_channels > DOWNSAMPLE_MAX_CHANNELS ||
+      bucket_ns == 0) {
+    fprintf(stderr, "%s:%d: %d channels of %lu ns buckets\n", __FILE__,
+            __LINE__, num_channels, (unsigned long)bucket_ns);
+    return -1;
+  }
+  memset(downsample, 0, sizeof(*downsample));
+  downsample->num_channels = num_channels;
+  for (int i = 0; i < DOWNSAMPLE_LEVELS; ++i) {
+    downsample->levels[i].bucket_ns = bucket_ns;
+    bucket_ns *= DOWNSAMPLE_FACTOR;
+  }
+  return 0;
+}
+
+// Folds `from`, which comes after everything already in `into`.
+static void downsample_merge(struct downsample_bucket *into,
+                             const struct downsample_bucket *from,
+                             int num_channels) {
+  if (into->samples == 0) {
+    memcpy(into->min, from->min, sizeof(into->min));
+    memcpy(into->max, from->max, sizeof(into->max));
+    into->min_first = from->min_first;
+    into->samples = from->samples;
+    return;
+  }
+  for (int c = 0; c < num_channels; ++c) {
+    const uint8_t bit = (uint8_t)(1u << c);
+    const int lower = from->min[c] < into->min[c];
+    const int higher = from->max[c] > into->max[c];
+    // Whichever extreme was just replaced is now the later one.
+    if (lower && higher) {
+      into->min_first = (into->min_first & ~bit) | (from->min_first & bit);
+    } else if (lower) {
+      into->min_first &= ~bit;
+    } else if (higher) {
+      into->min_first |= bit;
+    }
+    if (lower) {
+      into->min[c] = from->min[c];
+    }
+    if (higher) {
+      into->max[c] = from->max[c];
+    }
+  }
+  into->samples += from->samples;
+}
+
+// Adds a sample or a completed bucket of the level below to `level`,
+// completing its current bucket first if this one starts past it.
+static void downsample_push(struct downsample *downsample, int level,
+                            const struct downsample_bucket *bucket) {
+  struct downsample_level *current_level = &downsample->levels[level];
+  struct downsample_bucket *current = &current_level->current;
+  const uint64_t start_ns =
+      bucket->start_ns - bucket->start_ns % current_level->bucket_ns;
+  if (current->samples > 0 && start_ns != current->start_ns) {
+    if (start_ns < current->start_ns) {
+      return;
+    }
+    current_level->buckets[current_level->count & DOWNSAMPLE_BUCKETS_MASK] =
+        *current;
+    ++current_level->count;
+    if (level + 1 < DOWNSAMPLE_LEVELS) {
+      downsample_push(downsample, level + 1, current);
+    }
+    current->samples = 0;
+  }
+  if (current->samples == 0) {
+    current->start_ns = start_ns;
+  }
+  downsample_merge(current, bucket, downsample->num_channels);
+}
+
+void downsample_add(struct downsample *downsample, const uint64_t *timestamps,
+                    const float *values, int stride, const int *columns,
+                    int count) {
+  struct downsample_bucket sample;
+  memset(&sample, 0, sizeof(sample));
+  sample.samples = 1;
+  for (int i = 0; i < count; ++i) {
+    sample.start_ns = timestamps[i];
+    for (int c = 0; c < downsample->num_channels; ++c) {
+      sample.min[c] = values[(size_t)i * stride + columns[c]];
+      sample.max[c] = sample.min[c];
+    }
+    downsample_push(downsample, 0, &sample);
+  }
+}
+
+int downsample_read(const struct downsample *downsample, int level,
+                    uint64_t *next, uint64_t *timestamps, float *values,
+                    int max_points) {
+  if (level < 0 || level >= DOWNSAMPLE_LEVELS) {
+    return 0;
+  }
+  const struct downsample_level *read_level = &downsample->levels[level];
+  const int num_channels = downsample->num_channels;
+  if (read_level->count > DOWNSAMPLE_BUCKETS &&
+      *next < read_level->count - DOWNSAMPLE_BUCKETS) {
+    *next = read_level->count - DOWNSAMPLE_BUCKETS;
+  }
+  int points = 0;
+  for (; *next < read_level->count && points + 2 <= max_points; ++*next) {
+    const struct downsample_bucket *bucket =
+        &read_level->buckets[*next & DOWNSAMPLE_BUCKETS_MASK];
+    // Halfway through for the second point, wherever the extremes were.
+    timestamps[points] = bucket->start_ns;
+    timestamps[points + 1] = bucket->start_ns + read_level->bucket_ns / 2;
+    float *first = values + (size_t)points * num_channels;
+    float *second = first + num_channels;
+    for (int c = 0; c < num_channels; ++c) {
+      const int min_first = (bucket->min_first >> c) & 1;
+      first[c] = min_first ? bucket->min[c] : bucket->max[c];
+      second[c] = min_first ? bucket->max[c] : bucket->min[c];
+    }
+    points += 2;
+  }
+  return points;
+}
+
+int downsample_level_for(const struct downsample *downsample,
+                         uint64_t window_ns) {
+  for (int i = 0; i < DOWNSAMPLE_LEVELS - 1; ++i) {
+    if (downsample->levels[i].bucket_ns * DOWNSAMPLE_BUCKETS >= window_ns) {
+      return i;
+    }
+  }
+  return DOWNSAMPLE_LEVELS - 1;
+}
+
+size_t downsample_size(void) { return sizeof(struct downsample); }
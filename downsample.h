@@ -0,0 +1,80 @@
+#ifndef DOWNSAMPLE_H
+#define DOWNSAMPLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Reduces samples to a fixed number of points for plotting, keeping the
+// peaks: time is cut into buckets and each bucket becomes two points, the
+// smallest and the largest value of every channel in the order they came.
+// A spike one sample wide still shows, at any zoom.
+//
+// Buckets are kept at several levels, each DOWNSAMPLE_FACTOR times coarser
+// than the one below and built from it as its buckets complete, so the last
+// seconds and the whole of an hours-long session are both at hand, in the
+// same fixed amount of memory. Every sample costs the same bounded work,
+// nothing is ever recomputed.
+
+#define DOWNSAMPLE_MAX_CHANNELS 8
+// Completed buckets kept per level. Must be a power of two.
+#define DOWNSAMPLE_BUCKETS 1024
+#define DOWNSAMPLE_BUCKETS_MASK (DOWNSAMPLE_BUCKETS - 1)
+#define DOWNSAMPLE_LEVELS 4
+// Buckets of a level making up one of the next.
+#define DOWNSAMPLE_FACTOR 16
+
+struct downsample_bucket {
+  // Aligned on the bucket size of the level.
+  uint64_t start_ns;
+  float min[DOWNSAMPLE_MAX_CHANNELS];
+  float max[DOWNSAMPLE_MAX_CHANNELS];
+  // Bit per channel: its minimum came before its maximum.
+  uint8_t min_first;
+  // 0 for a bucket that has not started yet.
+  uint32_t samples;
+};
+
+struct downsample_level {
+  uint64_t bucket_ns;
+  struct downsample_bucket buckets[DOWNSAMPLE_BUCKETS];
+  // Completed buckets since the start, the last DOWNSAMPLE_BUCKETS are kept.
+  uint64_t count;
+  // Being filled.
+  struct downsample_bucket current;
+};
+
+struct downsample {
+  int num_channels;
+  struct downsample_level levels[DOWNSAMPLE_LEVELS];
+};
+
+// Buckets of `bucket_ns` at the finest level. Returns 0, or -1 if there are
+// more than DOWNSAMPLE_MAX_CHANNELS channels.
+int downsample_init(struct downsample *downsample, int num_channels,
+                    uint64_t bucket_ns);
+
+// Adds `count` samples in time order. The value of channel `c` of sample `i`
+// is `values[i * stride + columns[c]]`, so that the rows of decoded reports
+// are taken as they are. Samples older than the bucket being filled are
+// ignored.
+void downsample_add(struct downsample *downsample, const uint64_t *timestamps,
+                    const float *values, int stride, const int *columns,
+                    int count);
+
+// Writes the points of the buckets of `level` completed since `*next`, oldest
+// first, and moves `*next` past them: up to `max_points` times, two points per
+// bucket, in `timestamps` and `values[point * num_channels + channel]`. Starts
+// with the oldest kept bucket if `*next` is older, 0 reads every one. Returns
+// the number of points.
+int downsample_read(const struct downsample *downsample, int level,
+                    uint64_t *next, uint64_t *timestamps, float *values,
+                    int max_points);
+
+// The finest level whose kept buckets span `window_ns`, or the coarsest.
+int downsample_level_for(const struct downsample *downsample,
+                         uint64_t window_ns);
+
+// For the Python bindings, which allocate the structure themselves.
+size_t downsample_size(void);
+
+#endif // DOWNSAMPLE_H
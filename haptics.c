@@ -0,0 +1,273 @@
+#include "haptics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HAPTICS_FIFO_MASK (HAPTICS_FIFO_SIZE - 1)
+
+_Static_assert((HAPTICS_FIFO_SIZE & HAPTICS_FIFO_MASK) == 0,
+               "HAPTICS_FIFO_SIZE must be a power of two");
+
+static void counter_increment(atomic_uint_least64_t *counter) {
+  // Only the USB thread writes the counters.
+  atomic_store_explicit(
+      counter, atomic_load_explicit(counter, memory_order_relaxed) + 1,
+      memory_order_relaxed);
+}
+
+// Moves the queued samples into the packets of `transfer`. Runs on the USB
+// thread, or before the stream starts.
+static void haptics_fill(struct haptics *haptics,
+                         struct libusb_transfer *transfer) {
+  size_t tail = atomic_load_explicit(&haptics->tail, memory_order_relaxed);
+  const size_t head =
+      atomic_load_explicit(&haptics->head, memory_order_acquire);
+  unsigned char *out = transfer->buffer;
+  int length = 0;
+
+  for (int i = 0; i < transfer->num_iso_packets; ++i) {
+    haptics->sample_remainder += HAPTICS_SAMPLE_RATE;
+    int samples = haptics->sample_remainder / haptics->packets_per_second;
+    haptics->sample_remainder %= haptics->packets_per_second;
+    if (samples > haptics->max_packet_samples) {
+      samples = haptics->max_packet_samples;
+    }
+
+    const size_t available = head - tail;
+    const int queued = available < (size_t)samples ? (int)available : samples;
+    for (int j = 0; j < queued; ++j) {
+      const uint16_t sample =
+          (uint16_t)haptics->fifo[tail++ & HAPTICS_FIFO_MASK];
+      out[2 * j] = sample & 0xff;
+      out[2 * j + 1] = sample >> 8;
+    }
+    memset(out + queued * HAPTICS_SAMPLE_SIZE, 0,
+           (samples - queued) * HAPTICS_SAMPLE_SIZE);
+    if (queued == 0) {
+      counter_increment(&haptics->idle_packets);
+    } else if (queued < samples) {
+      counter_increment(&haptics->underruns);
+    }
+    counter_increment(&haptics->packets);
+
+    transfer->iso_packet_desc[i].length = samples * HAPTICS_SAMPLE_SIZE;
+    out += samples * HAPTICS_SAMPLE_SIZE;
+    length += samples * HAPTICS_SAMPLE_SIZE;
+  }
+  transfer->length = length;
+  atomic_store_explicit(&haptics->tail, tail, memory_order_release);
+}
+
+static void haptics_transfer_callback(struct libusb_transfer *transfer) {
+  struct haptics *haptics = transfer->user_data;
+
+  switch (transfer->status) {
+  case LIBUSB_TRANSFER_COMPLETED:
+    break;
+  case LIBUSB_TRANSFER_CANCELLED:
+  case LIBUSB_TRANSFER_NO_DEVICE:
+    atomic_fetch_sub(&haptics->in_flight, 1);
+    return;
+  default:
+    // Those samples are lost, keep the stream going.
+    counter_increment(&haptics->errors);
+    break;
+  }
+
+  if (!atomic_load_explicit(&haptics->running, memory_order_acquire)) {
+    atomic_fetch_sub(&haptics->in_flight, 1);
+    return;
+  }
+
+  haptics_fill(haptics, transfer);
+  if (libusb_submit_transfer(transfer) != LIBUSB_SUCCESS) {
+    counter_increment(&haptics->errors);
+    atomic_fetch_sub(&haptics->in_flight, 1);
+  }
+}
+
+int haptics_endpoint_supported(
+    const struct libusb_endpoint_descriptor *endpoint) {
+  return (endpoint->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) ==
+             LIBUSB_TRANSFER_TYPE_ISOCHRONOUS &&
+         (endpoint->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) ==
+             LIBUSB_ENDPOINT_OUT;
+}
+
+struct haptics *
+haptics_open(libusb_device_handle *dev_handle, struct transfer_pool *pool,
+             const struct libusb_interface_descriptor *altsetting,
+             const struct libusb_endpoint_descriptor *endpoint,
+             int num_transfers, int packets_per_transfer) {
+  if (!haptics_endpoint_supported(endpoint)) {
+    fprintf(stderr,
+            "%s:%d: endpoint 0x%02x is not an isochronous OUT endpoint\n",
+            __FILE__, __LINE__, endpoint->bEndpointAddress);
+    return NULL;
+  }
+  if (num_transfers <= 0 || num_transfers > HAPTICS_MAX_TRANSFERS) {
+    num_transfers = HAPTICS_DEFAULT_TRANSFERS;
+  }
+  if (packets_per_transfer <= 0 ||
+      packets_per_transfer > HAPTICS_MAX_PACKETS) {
+    packets_per_transfer = HAPTICS_DEFAULT_PACKETS;
+  }
+
+  // One packet every 2^(bInterval - 1) frames at full speed, microframes
+  // above.
+  const int interval = 1 << (endpoint->bInterval > 0 ? endpoint->bInterval - 1
+                                                     : 0);
+  const int speed = libusb_get_device_speed(libusb_get_device(dev_handle));
+  const int packets_per_second =
+      (speed >= LIBUSB_SPEED_HIGH ? 8000 : 1000) / interval;
+  // wMaxPacketSize is already in host byte order in libusb's descriptors.
+  const int max_packet_samples =
+      (endpoint->wMaxPacketSize & 0x7ff) / HAPTICS_SAMPLE_SIZE;
+  if (max_packet_samples * packets_per_second < HAPTICS_SAMPLE_RATE) {
+    fprintf(stderr, "%s:%d: endpoint 0x%02x is too small for %d Hz\n",
+            __FILE__, __LINE__, endpoint->bEndpointAddress,
+            HAPTICS_SAMPLE_RATE);
+    return NULL;
+  }
+
+  int result = libusb_set_interface_alt_setting(
+      dev_handle, altsetting->bInterfaceNumber, altsetting->bAlternateSetting);
+  if (result != LIBUSB_SUCCESS) {
+    fprintf(stderr, "%s:%d: unable to select alt setting %d: %s\n", __FILE__,
+            __LINE__, altsetting->bAlternateSetting,
+            libusb_error_name(result));
+    return NULL;
+  }
+
+  // The FIFO is a few kilobytes, like the report rings it is not kept on the
+  // stack.
+  struct haptics *haptics = aligned_alloc(RING_CACHE_LINE, sizeof(*haptics));
+  if (haptics == NULL) {
+    libusb_set_interface_alt_setting(dev_handle, altsetting->bInterfaceNumber,
+                                     0);
+    return NULL;
+  }
+  memset(haptics, 0, sizeof(*haptics));
+  atomic_init(&haptics->head, 0);
+  atomic_init(&haptics->tail, 0);
+  atomic_init(&haptics->packets, 0);
+  atomic_init(&haptics->underruns, 0);
+  atomic_init(&haptics->idle_packets, 0);
+  atomic_init(&haptics->errors, 0);
+  atomic_init(&haptics->running, 0);
+  atomic_init(&haptics->in_flight, 0);
+  haptics->dev_handle = dev_handle;
+  haptics->pool = pool;
+  haptics->interface_number = altsetting->bInterfaceNumber;
+  haptics->alt_setting = altsetting->bAlternateSetting;
+  haptics->endpoint_address = endpoint->bEndpointAddress;
+  haptics->max_packet_samples = max_packet_samples;
+  haptics->packets_per_second = packets_per_second;
+  haptics->packets_per_transfer = packets_per_transfer;
+  haptics->num_transfers = num_transfers;
+
+  const int buffer_size =
+      packets_per_transfer * max_packet_samples * HAPTICS_SAMPLE_SIZE;
+  for (int i = 0; i < num_transfers; ++i) {
+    struct libusb_transfer *transfer =
+        transfer_pool_acquire(pool, packets_per_transfer, buffer_size);
+    if (transfer == NULL) {
+      haptics_close(haptics);
+      return NULL;
+    }
+    libusb_fill_iso_transfer(transfer, dev_handle, haptics->endpoint_address,
+                             transfer->buffer, buffer_size,
+                             packets_per_transfer, haptics_transfer_callback,
+                             haptics, 0);
+    haptics->transfers[i] = transfer;
+  }
+  return haptics;
+}
+
+int haptics_start(struct haptics *haptics) {
+  atomic_store(&haptics->running, 1);
+  for (int i = 0; i < haptics->num_transfers; ++i) {
+    haptics_fill(haptics, haptics->transfers[i]);
+    // Counted before submitting, the event thread may complete it first.
+    atomic_fetch_add(&haptics->in_flight, 1);
+    int result = libusb_submit_transfer(haptics->transfers[i]);
+    if (result != LIBUSB_SUCCESS) {
+      fprintf(stderr, "%s:%d: unable to submit transfer %d: %s\n", __FILE__,
+              __LINE__, i, libusb_error_name(result));
+      atomic_fetch_sub(&haptics->in_flight, 1);
+      haptics_stop(haptics);
+      return result;
+    }
+  }
+  return LIBUSB_SUCCESS;
+}
+
+size_t haptics_write(struct haptics *haptics, const int16_t *samples,
+                     size_t count) {
+  const size_t head =
+      atomic_load_explicit(&haptics->head, memory_order_relaxed);
+  if (head - haptics->cached_tail + count > HAPTICS_FIFO_SIZE) {
+    haptics->cached_tail =
+        atomic_load_explicit(&haptics->tail, memory_order_acquire);
+  }
+  const size_t room = HAPTICS_FIFO_SIZE - (head - haptics->cached_tail);
+  if (count > room) {
+    count = room;
+  }
+  // At most two copies, around the end of the FIFO.
+  const size_t start = head & HAPTICS_FIFO_MASK;
+  const size_t first = count < HAPTICS_FIFO_SIZE - start
+                           ? count
+                           : HAPTICS_FIFO_SIZE - start;
+  memcpy(haptics->fifo + start, samples, first * sizeof(*samples));
+  memcpy(haptics->fifo, samples + first, (count - first) * sizeof(*samples));
+  atomic_store_explicit(&haptics->head, head + count, memory_order_release);
+  return count;
+}
+
+size_t haptics_queued(struct haptics *haptics) {
+  const size_t head =
+      atomic_load_explicit(&haptics->head, memory_order_acquire);
+  const size_t tail =
+      atomic_load_explicit(&haptics->tail, memory_order_acquire);
+  return head - tail;
+}
+
+void haptics_get_stats(struct haptics *haptics, struct haptics_stats *stats) {
+  stats->packets =
+      atomic_load_explicit(&haptics->packets, memory_order_relaxed);
+  stats->underruns =
+      atomic_load_explicit(&haptics->underruns, memory_order_relaxed);
+  stats->idle_packets =
+      atomic_load_explicit(&haptics->idle_packets, memory_order_relaxed);
+  stats->errors = atomic_load_explicit(&haptics->errors, memory_order_relaxed);
+}
+
+void haptics_stop(struct haptics *haptics) {
+  atomic_store(&haptics->running, 0);
+  for (int i = 0; i < haptics->num_transfers; ++i) {
+    // Transfers that are not in flight return LIBUSB_ERROR_NOT_FOUND.
+    libusb_cancel_transfer(haptics->transfers[i]);
+  }
+}
+
+int haptics_in_flight(struct haptics *haptics) {
+  return atomic_load(&haptics->in_flight);
+}
+
+void haptics_close(struct haptics *haptics) {
+  if (haptics == NULL) {
+    return;
+  }
+  for (int i = 0; i < haptics->num_transfers; ++i) {
+    if (haptics->transfers[i] != NULL) {
+      transfer_pool_release(haptics->pool, haptics->transfers[i]);
+    }
+  }
+  // Gives the isochronous bandwidth back. Fails harmlessly if the device is
+  // gone.
+  libusb_set_interface_alt_setting(haptics->dev_handle,
+                                   haptics->interface_number, 0);
+  free(haptics);
+}
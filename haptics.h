@@ -0,0 +1,109 @@
+#ifndef HAPTICS_H
+#define HAPTICS_H
+
+#include <libusb-1.0/libusb.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ring.h"
+#include "transfer_pool.h"
+
+// Isochronous output to the audio streaming interface of the Sense
+// Controllers, which drives their haptic actuators: 48 kHz, one channel of
+// 16-bit little endian samples (see the class specific descriptors).
+//
+// Samples are written into a lock-free FIFO by any one thread and moved into
+// the isochronous packets by the USB thread as transfers complete. When the
+// FIFO runs dry the rest of the packet is silence.
+
+#define HAPTICS_SAMPLE_RATE 48000
+#define HAPTICS_SAMPLE_SIZE 2
+// Samples, must be a power of two. About 85 ms, far more than the latency
+// anyone wants queued, so writers are never the ones limited by it.
+#define HAPTICS_FIFO_SIZE 4096
+
+// 3 transfers of 2 packets: at 1 ms per packet 4 to 6 ms are queued in the
+// host controller, which leaves the USB thread 4 ms to refill a transfer
+// before the device plays silence.
+#define HAPTICS_DEFAULT_TRANSFERS 3
+#define HAPTICS_DEFAULT_PACKETS 2
+#define HAPTICS_MAX_TRANSFERS 8
+#define HAPTICS_MAX_PACKETS 16
+
+struct haptics_stats {
+  uint64_t packets;
+  // Packets the FIFO could only partly fill: the writer fell behind in the
+  // middle of a waveform.
+  uint64_t underruns;
+  // Packets sent as silence because nothing was queued.
+  uint64_t idle_packets;
+  uint64_t errors;
+};
+
+struct haptics {
+  // Writer side.
+  _Alignas(RING_CACHE_LINE) atomic_size_t head;
+  size_t cached_tail;
+
+  // USB thread side.
+  _Alignas(RING_CACHE_LINE) atomic_size_t tail;
+  // Carries the fraction of a sample per packet so the rate is exact.
+  int sample_remainder;
+  atomic_uint_least64_t packets;
+  atomic_uint_least64_t underruns;
+  atomic_uint_least64_t idle_packets;
+  atomic_uint_least64_t errors;
+
+  _Alignas(RING_CACHE_LINE) int16_t fifo[HAPTICS_FIFO_SIZE];
+
+  libusb_device_handle *dev_handle;
+  int interface_number;
+  int alt_setting;
+  unsigned char endpoint_address;
+  // Largest packet the endpoint takes, in samples.
+  int max_packet_samples;
+  int packets_per_second;
+  int packets_per_transfer;
+  int num_transfers;
+  // From `pool`, each with its own buffer.
+  struct transfer_pool *pool;
+  struct libusb_transfer *transfers[HAPTICS_MAX_TRANSFERS];
+
+  atomic_int running;
+  atomic_int in_flight;
+};
+
+// Whether `haptics_open` can drive this endpoint: isochronous OUT only.
+int haptics_endpoint_supported(
+    const struct libusb_endpoint_descriptor *endpoint);
+
+// Selects `altsetting`, whose interface must already be claimed, and takes
+// the transfers from the pool of the device. Returns NULL on failure.
+struct haptics *
+haptics_open(libusb_device_handle *dev_handle, struct transfer_pool *pool,
+             const struct libusb_interface_descriptor *altsetting,
+             const struct libusb_endpoint_descriptor *endpoint,
+             int num_transfers, int packets_per_transfer);
+
+// Submits every transfer, filled from the FIFO. Returns LIBUSB_SUCCESS or a
+// libusb error code.
+int haptics_start(struct haptics *haptics);
+
+// Writer: queues up to `count` samples and returns how many fit.
+size_t haptics_write(struct haptics *haptics, const int16_t *samples,
+                     size_t count);
+// Samples waiting in the FIFO.
+size_t haptics_queued(struct haptics *haptics);
+
+void haptics_get_stats(struct haptics *haptics, struct haptics_stats *stats);
+
+// Cancels the in flight transfers. Events must still be handled until
+// `haptics_in_flight` returns 0 before closing.
+void haptics_stop(struct haptics *haptics);
+int haptics_in_flight(struct haptics *haptics);
+
+// Frees the transfers and goes back to the zero bandwidth alt setting.
+void haptics_close(struct haptics *haptics);
+
+#endif // HAPTICS_H
@@ -0,0 +1,474 @@
+#include "hid.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+// Item types and tags from the HID 1.11 specification, section 6.2.2.
+#define HID_ITEM_TYPE_MAIN 0
+#define HID_ITEM_TYPE_GLOBAL 1
+#define HID_ITEM_TYPE_LOCAL 2
+#define HID_ITEM_LONG 0xfe
+
+#define HID_MAIN_INPUT 0x8
+#define HID_MAIN_OUTPUT 0x9
+#define HID_MAIN_COLLECTION 0xa
+#define HID_MAIN_FEATURE 0xb
+#define HID_MAIN_END_COLLECTION 0xc
+
+#define HID_GLOBAL_USAGE_PAGE 0x0
+#define HID_GLOBAL_LOGICAL_MINIMUM 0x1
+#define HID_GLOBAL_LOGICAL_MAXIMUM 0x2
+#define HID_GLOBAL_PHYSICAL_MINIMUM 0x3
+#define HID_GLOBAL_PHYSICAL_MAXIMUM 0x4
+#define HID_GLOBAL_UNIT_EXPONENT 0x5
+#define HID_GLOBAL_REPORT_SIZE 0x7
+#define HID_GLOBAL_REPORT_ID 0x8
+#define HID_GLOBAL_REPORT_COUNT 0x9
+#define HID_GLOBAL_PUSH 0xa
+#define HID_GLOBAL_POP 0xb
+
+#define HID_LOCAL_USAGE 0x0
+#define HID_LOCAL_USAGE_MINIMUM 0x1
+#define HID_LOCAL_USAGE_MAXIMUM 0x2
+
+#define HID_INPUT_CONSTANT 0x01
+#define HID_INPUT_VARIABLE 0x02
+
+#define HID_MAX_USAGES 64
+#define HID_MAX_PUSH 4
+#define HID_MAX_RAW_FIELDS 256
+
+struct hid_globals {
+  uint16_t usage_page;
+  int32_t logical_minimum;
+  int32_t logical_maximum;
+  int32_t physical_minimum;
+  int32_t physical_maximum;
+  int unit_exponent;
+  uint32_t report_size;
+  uint8_t report_id;
+  uint32_t report_count;
+};
+
+// A field as found in the descriptor, before it is laid out in the tables.
+struct hid_raw_field {
+  uint8_t report_id;
+  uint16_t bit_offset;
+  uint8_t bit_size;
+  uint8_t count; // > 1 only for button runs
+  uint16_t usage_page;
+  uint16_t usage;
+  struct hid_globals globals;
+};
+
+int hid_report_descriptor_length(
+    const struct libusb_interface_descriptor *altsetting) {
+  const unsigned char *extra = altsetting->extra;
+  int offset = 0;
+  while (offset + 2 <= altsetting->extra_length) {
+    const int length = extra[offset];
+    if (length < 2 || offset + length > altsetting->extra_length) {
+      break;
+    }
+    // bLength, bDescriptorType, bcdHID, bCountryCode, bNumDescriptors, then
+    // (bDescriptorType, wDescriptorLength) for each class descriptor.
+    if (extra[offset + 1] == HID_DT_HID && length >= 9) {
+      const int num_descriptors = extra[offset + 5];
+      for (int i = 0; i < num_descriptors && 6 + 3 * i + 2 < length; ++i) {
+        const unsigned char *descriptor = extra + offset + 6 + 3 * i;
+        if (descriptor[0] == HID_DT_REPORT) {
+          return descriptor[1] | descriptor[2] << 8;
+        }
+      }
+    }
+    offset += length;
+  }
+  return 0;
+}
+
+int hid_fetch_report_descriptor(libusb_device_handle *dev_handle,
+                                int interface_number, uint8_t *descriptor,
+                                int length) {
+  return libusb_control_transfer(
+      dev_handle,
+      LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_STANDARD |
+          LIBUSB_RECIPIENT_INTERFACE,
+      LIBUSB_REQUEST_GET_DESCRIPTOR, HID_DT_REPORT << 8, interface_number,
+      descriptor, length, 1000);
+}
+
+static uint32_t item_unsigned(const uint8_t *data, int size) {
+  uint32_t value = 0;
+  for (int i = 0; i < size; ++i) {
+    value |= (uint32_t)data[i] << (8 * i);
+  }
+  return value;
+}
+
+static int32_t item_signed(const uint8_t *data, int size) {
+  switch (size) {
+  case 1:
+    return (int8_t)data[0];
+  case 2:
+    return (int16_t)item_unsigned(data, 2);
+  case 4:
+    return (int32_t)item_unsigned(data, 4);
+  }
+  return 0;
+}
+
+static void compute_scale(const struct hid_globals *globals, int is_signed,
+                          float *scale, float *offset) {
+  const double exponent = pow(10.0, globals->unit_exponent);
+  const double logical_minimum = globals->logical_minimum;
+  const double logical_maximum = is_signed
+                                     ? (double)globals->logical_maximum
+                                     : (double)(uint32_t)globals->logical_maximum;
+  if ((globals->physical_minimum == 0 && globals->physical_maximum == 0) ||
+      logical_maximum == logical_minimum) {
+    // No physical range: the physical value is the logical value.
+    *scale = (float)exponent;
+    *offset = 0.0f;
+    return;
+  }
+  const double resolution =
+      (double)(globals->physical_maximum - globals->physical_minimum) /
+      (logical_maximum - logical_minimum);
+  *scale = (float)(resolution * exponent);
+  *offset =
+      (float)((globals->physical_minimum - logical_minimum * resolution) *
+              exponent);
+}
+
+// Precomputes where to read a field from. Reports of at least 8 bytes never
+// read past their end, shorter ones are padded by hid_decode.
+static void compute_window(uint16_t bit_offset, uint8_t bit_size,
+                           uint16_t report_size, uint16_t *byte_offset,
+                           uint8_t *left_shift, uint8_t *right_shift) {
+  int byte = bit_offset / 8;
+  if (report_size >= 8 && byte + 8 > report_size) {
+    byte = report_size - 8;
+  } else if (report_size < 8) {
+    byte = 0;
+  }
+  const int shift = bit_offset - 8 * byte;
+  *byte_offset = byte;
+  *left_shift = 64 - (shift + bit_size);
+  *right_shift = 64 - bit_size;
+}
+
+int hid_compile(const uint8_t *descriptor, int length,
+                struct hid_decoder *decoder) {
+  memset(decoder, 0, sizeof(*decoder));
+  memset(decoder->report_index, 0xff, sizeof(decoder->report_index));
+
+  struct hid_raw_field raw_fields[HID_MAX_RAW_FIELDS];
+  int num_raw_fields = 0;
+  uint32_t input_bits[256] = {0};
+
+  struct hid_globals globals = {0};
+  struct hid_globals stack[HID_MAX_PUSH];
+  int stack_depth = 0;
+  uint32_t usages[HID_MAX_USAGES];
+  int num_usages = 0;
+  uint32_t usage_minimum = 0;
+  uint32_t usage_maximum = 0;
+  int has_usage_range = 0;
+
+  int offset = 0;
+  while (offset < length) {
+    const uint8_t prefix = descriptor[offset];
+    if (prefix == HID_ITEM_LONG) {
+      if (offset + 2 >= length) {
+        break;
+      }
+      offset += 3 + descriptor[offset + 1];
+      continue;
+    }
+    const int size = (prefix & 0x03) == 3 ? 4 : (prefix & 0x03);
+    const int type = (prefix >> 2) & 0x03;
+    const int tag = prefix >> 4;
+    if (offset + 1 + size > length) {
+      fprintf(stderr, "%s:%d: truncated item at offset %d\n", __FILE__,
+              __LINE__, offset);
+      return -1;
+    }
+    const uint8_t *data = descriptor + offset + 1;
+    const uint32_t value = item_unsigned(data, size);
+    offset += 1 + size;
+
+    if (type == HID_ITEM_TYPE_GLOBAL) {
+      switch (tag) {
+      case HID_GLOBAL_USAGE_PAGE:
+        globals.usage_page = value;
+        break;
+      case HID_GLOBAL_LOGICAL_MINIMUM:
+        globals.logical_minimum = item_signed(data, size);
+        break;
+      case HID_GLOBAL_LOGICAL_MAXIMUM:
+        globals.logical_maximum = item_signed(data, size);
+        break;
+      case HID_GLOBAL_PHYSICAL_MINIMUM:
+        globals.physical_minimum = item_signed(data, size);
+        break;
+      case HID_GLOBAL_PHYSICAL_MAXIMUM:
+        globals.physical_maximum = item_signed(data, size);
+        break;
+      case HID_GLOBAL_UNIT_EXPONENT:
+        // Usually a 4 bit two's complement nibble.
+        globals.unit_exponent =
+            size == 1 && value < 16 ? (value > 7 ? (int)value - 16 : (int)value)
+                                    : item_signed(data, size);
+        break;
+      case HID_GLOBAL_REPORT_SIZE:
+        globals.report_size = value;
+        break;
+      case HID_GLOBAL_REPORT_ID:
+        globals.report_id = value;
+        decoder->uses_report_ids = 1;
+        break;
+      case HID_GLOBAL_REPORT_COUNT:
+        globals.report_count = value;
+        break;
+      case HID_GLOBAL_PUSH:
+        if (stack_depth < HID_MAX_PUSH) {
+          stack[stack_depth++] = globals;
+        }
+        break;
+      case HID_GLOBAL_POP:
+        if (stack_depth > 0) {
+          globals = stack[--stack_depth];
+        }
+        break;
+      }
+      continue;
+    }
+
+    if (type == HID_ITEM_TYPE_LOCAL) {
+      // 4 byte usages carry their own usage page in the upper 16 bits.
+      const uint32_t usage =
+          size == 4 ? value : ((uint32_t)globals.usage_page << 16) | value;
+      switch (tag) {
+      case HID_LOCAL_USAGE:
+        if (num_usages < HID_MAX_USAGES) {
+          usages[num_usages++] = usage;
+        }
+        break;
+      case HID_LOCAL_USAGE_MINIMUM:
+        usage_minimum = usage;
+        has_usage_range = 1;
+        break;
+      case HID_LOCAL_USAGE_MAXIMUM:
+        usage_maximum = usage;
+        has_usage_range = 1;
+        break;
+      }
+      continue;
+    }
+
+    if (type != HID_ITEM_TYPE_MAIN) {
+      continue;
+    }
+    if (tag == HID_MAIN_INPUT) {
+      const uint32_t bit_size = globals.report_size;
+      const uint32_t count = globals.report_count;
+      uint32_t *bits = &input_bits[globals.report_id];
+      const int is_data = !(value & HID_INPUT_CONSTANT);
+      const int is_button = globals.usage_page == HID_USAGE_PAGE_BUTTON &&
+                            bit_size == 1 && (value & HID_INPUT_VARIABLE);
+
+      for (uint32_t i = 0; is_data && i < count; ++i) {
+        uint32_t usage;
+        if (has_usage_range) {
+          usage = usage_minimum + i <= usage_maximum ? usage_minimum + i
+                                                     : usage_maximum;
+        } else if (num_usages > 0) {
+          usage = usages[i < (uint32_t)num_usages ? i : num_usages - 1];
+        } else {
+          usage = (uint32_t)globals.usage_page << 16;
+        }
+
+        if (num_raw_fields == HID_MAX_RAW_FIELDS) {
+          fprintf(stderr, "%s:%d: too many fields, ignoring the rest\n",
+                  __FILE__, __LINE__);
+          break;
+        }
+        if (bit_size == 0 || bit_size > 32) {
+          fprintf(stderr, "%s:%d: skipping %u bit field\n", __FILE__,
+                  __LINE__, bit_size);
+          continue;
+        }
+
+        struct hid_raw_field *raw_field = &raw_fields[num_raw_fields];
+        raw_field->report_id = globals.report_id;
+        raw_field->bit_offset = *bits + i * bit_size;
+        raw_field->bit_size = bit_size;
+        raw_field->count = 1;
+        raw_field->usage_page = usage >> 16;
+        raw_field->usage = usage & 0xffff;
+        raw_field->globals = globals;
+
+        // Extend the previous button run if this button follows it.
+        struct hid_raw_field *previous =
+            num_raw_fields > 0 ? &raw_fields[num_raw_fields - 1] : NULL;
+        if (is_button && previous != NULL &&
+            previous->usage_page == HID_USAGE_PAGE_BUTTON &&
+            previous->bit_size == 1 &&
+            previous->report_id == raw_field->report_id &&
+            previous->bit_offset + previous->count == raw_field->bit_offset &&
+            previous->usage + previous->count == raw_field->usage &&
+            previous->count < 32) {
+          ++previous->count;
+          continue;
+        }
+        ++num_raw_fields;
+      }
+      *bits += bit_size * count;
+    }
+    // Output and feature reports are not decoded, and their bits do not
+    // move the input report offsets.
+    // Local items only apply to the main item that follows them.
+    num_usages = 0;
+    has_usage_range = 0;
+    usage_minimum = usage_maximum = 0;
+  }
+
+  // Lay the fields out, grouped by report.
+  for (int id = 0; id < 256; ++id) {
+    if (input_bits[id] == 0) {
+      continue;
+    }
+    if (decoder->num_reports == HID_MAX_REPORTS) {
+      fprintf(stderr, "%s:%d: too many reports, ignoring report %d\n",
+              __FILE__, __LINE__, id);
+      continue;
+    }
+    struct hid_report_layout *report = &decoder->reports[decoder->num_reports];
+    report->report_id = id;
+    report->size = (input_bits[id] + 7) / 8 + (decoder->uses_report_ids ? 1 : 0);
+    report->first_field = decoder->num_fields;
+    report->first_button_run = decoder->num_button_runs;
+    decoder->report_index[id] = decoder->num_reports++;
+
+    const int prefix_bits = decoder->uses_report_ids ? 8 : 0;
+    for (int i = 0; i < num_raw_fields; ++i) {
+      const struct hid_raw_field *raw_field = &raw_fields[i];
+      if (raw_field->report_id != id) {
+        continue;
+      }
+      const uint16_t bit_offset = raw_field->bit_offset + prefix_bits;
+
+      if (raw_field->usage_page == HID_USAGE_PAGE_BUTTON &&
+          raw_field->bit_size == 1 && raw_field->usage >= 1 &&
+          raw_field->usage - 1 + raw_field->count <= HID_MAX_BUTTONS &&
+          decoder->num_button_runs < HID_MAX_BUTTON_RUNS) {
+        struct hid_button_run *run =
+            &decoder->button_runs[decoder->num_button_runs++];
+        compute_window(bit_offset, raw_field->count, report->size,
+                       &run->byte_offset, &run->left_shift, &run->right_shift);
+        run->first_button = raw_field->usage - 1;
+        run->mask = (raw_field->count == 32 ? 0xffffffffu
+                                            : (1u << raw_field->count) - 1)
+                    << run->first_button;
+        report->button_mask |= run->mask;
+        ++report->num_button_runs;
+        continue;
+      }
+
+      if (decoder->num_fields == HID_MAX_FIELDS ||
+          decoder->num_values == HID_MAX_VALUES) {
+        fprintf(stderr, "%s:%d: too many values, ignoring usage 0x%04x:0x%04x\n",
+                __FILE__, __LINE__, raw_field->usage_page, raw_field->usage);
+        continue;
+      }
+      const struct hid_globals *field_globals = &raw_field->globals;
+      const int is_signed = field_globals->logical_minimum < 0;
+      struct hid_field *field = &decoder->fields[decoder->num_fields++];
+      compute_window(bit_offset, raw_field->bit_size, report->size,
+                     &field->byte_offset, &field->left_shift,
+                     &field->right_shift);
+      field->sign_mask = is_signed ? -1 : 0;
+      compute_scale(field_globals, is_signed, &field->scale, &field->offset);
+      field->value_index = decoder->num_values;
+      ++report->num_fields;
+
+      struct hid_value_info *info = &decoder->values[decoder->num_values++];
+      info->usage_page = raw_field->usage_page;
+      info->usage = raw_field->usage;
+      info->report_id = id;
+      info->bit_offset = bit_offset;
+      info->bit_size = raw_field->bit_size;
+      info->logical_minimum = field_globals->logical_minimum;
+      info->logical_maximum = field_globals->logical_maximum;
+    }
+  }
+  return 0;
+}
+
+static inline uint64_t load_le64(const uint8_t *data) {
+  uint64_t value;
+  memcpy(&value, data, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  value = __builtin_bswap64(value);
+#endif
+  return value;
+}
+
+int hid_decode(const struct hid_decoder *decoder, const uint8_t *data,
+               int length, struct hid_state *state) {
+  if (length < 1) {
+    return -1;
+  }
+  const uint8_t report_id = decoder->uses_report_ids ? data[0] : 0;
+  const uint8_t index = decoder->report_index[report_id];
+  if (index == 0xff) {
+    return -1;
+  }
+  const struct hid_report_layout *report = &decoder->reports[index];
+  if (length < report->size) {
+    return -1;
+  }
+  uint8_t padded[8];
+  if (report->size < 8) {
+    memset(padded, 0, sizeof(padded));
+    memcpy(padded, data, report->size);
+    data = padded;
+  }
+
+  const struct hid_field *field = &decoder->fields[report->first_field];
+  for (int i = 0; i < report->num_fields; ++i, ++field) {
+    const uint64_t window = load_le64(data + field->byte_offset)
+                            << field->left_shift;
+    // Both extensions are computed, the mask picks one without a branch.
+    const int64_t as_unsigned = (int64_t)(window >> field->right_shift);
+    const int64_t as_signed = (int64_t)window >> field->right_shift;
+    const int64_t raw = (as_signed & field->sign_mask) |
+                        (as_unsigned & ~field->sign_mask);
+    state->values[field->value_index] =
+        (float)raw * field->scale + field->offset;
+  }
+
+  uint32_t buttons = state->buttons & ~report->button_mask;
+  const struct hid_button_run *run =
+      &decoder->button_runs[report->first_button_run];
+  for (int i = 0; i < report->num_button_runs; ++i, ++run) {
+    const uint64_t window = load_le64(data + run->byte_offset)
+                            << run->left_shift;
+    buttons |= (uint32_t)(window >> run->right_shift) << run->first_button;
+  }
+  state->buttons = buttons;
+  state->report_id = report_id;
+  return report_id;
+}
+
+int hid_find_value(const struct hid_decoder *decoder, uint16_t usage_page,
+                   uint16_t usage) {
+  for (int i = 0; i < decoder->num_values; ++i) {
+    if (decoder->values[i].usage_page == usage_page &&
+        decoder->values[i].usage == usage) {
+      return i;
+    }
+  }
+  return -1;
+}
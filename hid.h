@@ -0,0 +1,136 @@
+#ifndef HID_H
+#define HID_H
+
+#include <libusb-1.0/libusb.h>
+#include <stdint.h>
+
+// HID report descriptors are compiled once into flat decode tables. Decoding
+// a report is then a walk over an array of precomputed shifts and scales
+// into a fixed size state, with no per-field parsing or allocation.
+
+#define HID_DT_HID 0x21
+#define HID_DT_REPORT 0x22
+#define HID_MAX_DESCRIPTOR_SIZE 4096
+
+#define HID_MAX_REPORTS 16
+#define HID_MAX_FIELDS 128
+#define HID_MAX_BUTTON_RUNS 16
+#define HID_MAX_VALUES 64
+#define HID_MAX_BUTTONS 32
+
+#define HID_USAGE_PAGE_GENERIC_DESKTOP 0x01
+#define HID_USAGE_PAGE_BUTTON 0x09
+#define HID_USAGE_PAGE_SENSORS 0x20
+#define HID_USAGE_PAGE_VENDOR 0xff00
+
+#define HID_USAGE_X 0x30
+#define HID_USAGE_Y 0x31
+#define HID_USAGE_Z 0x32
+#define HID_USAGE_RZ 0x35
+#define HID_USAGE_ACCELERATION_X 0x0453
+#define HID_USAGE_ACCELERATION_Y 0x0454
+#define HID_USAGE_ACCELERATION_Z 0x0455
+#define HID_USAGE_ANGULAR_VELOCITY_X 0x0457
+#define HID_USAGE_ANGULAR_VELOCITY_Y 0x0458
+#define HID_USAGE_ANGULAR_VELOCITY_Z 0x0459
+// Vendor page: the device clock of the simulated controllers, in us.
+#define HID_USAGE_VENDOR_TIMESTAMP 0x21
+
+// One decoded value: read 64 bits little endian at `byte_offset`, keep
+// `bit_size` bits starting at `shift`, sign extend if needed, then scale.
+struct hid_field {
+  uint16_t byte_offset;
+  // Left shift that puts the field's top bit at bit 63.
+  uint8_t left_shift;
+  // Right shift that brings it back down, 64 - bit_size.
+  uint8_t right_shift;
+  // All ones for signed fields, zero otherwise.
+  int64_t sign_mask;
+  float scale;
+  float offset;
+  uint16_t value_index;
+};
+
+// Consecutive 1 bit button usages, decoded with a single extraction.
+struct hid_button_run {
+  uint16_t byte_offset;
+  uint8_t left_shift;
+  uint8_t right_shift;
+  uint8_t first_button;
+  uint32_t mask;
+};
+
+struct hid_report_layout {
+  uint8_t report_id;
+  // Input report size including the report ID byte, if any.
+  uint16_t size;
+  uint16_t first_field;
+  uint16_t num_fields;
+  uint16_t first_button_run;
+  uint16_t num_button_runs;
+  // Buttons owned by this report, cleared before decoding it.
+  uint32_t button_mask;
+};
+
+// What a value index means, for looking fields up by usage. Not used while
+// decoding.
+struct hid_value_info {
+  uint16_t usage_page;
+  uint16_t usage;
+  uint8_t report_id;
+  uint16_t bit_offset;
+  uint8_t bit_size;
+  int32_t logical_minimum;
+  int32_t logical_maximum;
+};
+
+struct hid_decoder {
+  int uses_report_ids;
+  int num_reports;
+  // Index into `reports` for every report ID, or 0xff.
+  uint8_t report_index[256];
+  struct hid_report_layout reports[HID_MAX_REPORTS];
+  struct hid_field fields[HID_MAX_FIELDS];
+  int num_fields;
+  struct hid_button_run button_runs[HID_MAX_BUTTON_RUNS];
+  int num_button_runs;
+  struct hid_value_info values[HID_MAX_VALUES];
+  int num_values;
+};
+
+// Latest decoded input of one device. Values keep their last decoded content
+// when a report that does not carry them comes in.
+struct hid_state {
+  uint64_t timestamp_ns;
+  uint8_t report_id;
+  uint32_t buttons;
+  float values[HID_MAX_VALUES];
+};
+
+// Returns the length of the report descriptor announced by the HID class
+// descriptor in `altsetting->extra`, or 0 if there is none.
+int hid_report_descriptor_length(
+    const struct libusb_interface_descriptor *altsetting);
+
+// Reads the report descriptor of `interface_number` with a GET_DESCRIPTOR
+// control request. Returns the number of bytes read or a libusb error code.
+int hid_fetch_report_descriptor(libusb_device_handle *dev_handle,
+                                int interface_number, uint8_t *descriptor,
+                                int length);
+
+// Compiles the input reports of a report descriptor. Returns 0, or -1 if the
+// descriptor is malformed (with a message on stderr). Fields that do not fit
+// in the tables are skipped with a warning.
+int hid_compile(const uint8_t *descriptor, int length,
+                struct hid_decoder *decoder);
+
+// Decodes one input report into `state`. Returns the report ID, or -1 if the
+// report is unknown or too short.
+int hid_decode(const struct hid_decoder *decoder, const uint8_t *data,
+               int length, struct hid_state *state);
+
+// Returns the value index of the first field with this usage, or -1.
+int hid_find_value(const struct hid_decoder *decoder, uint16_t usage_page,
+                   uint16_t usage);
+
+#endif // HID_H
@@ -0,0 +1,305 @@
+#include "hidraw.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "monotonic.h"
+
+// Reads a whole sysfs file into `buffer`. Returns the number of bytes read or
+// -1.
+static int hidraw_read_file(const char *path, void *buffer, size_t size) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  size_t length = 0;
+  while (length < size) {
+    ssize_t result = read(fd, (uint8_t *)buffer + length, size - length);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      break;
+    }
+    length += (size_t)result;
+  }
+  close(fd);
+  return (int)length;
+}
+
+// The interrupt IN endpoint of a USB interface directory, from its "ep_XX"
+// entries.
+static uint8_t hidraw_find_endpoint(const char *interface_path) {
+  DIR *dir = opendir(interface_path);
+  if (dir == NULL) {
+    return HIDRAW_UNKNOWN_ENDPOINT;
+  }
+  uint8_t endpoint = HIDRAW_UNKNOWN_ENDPOINT;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    unsigned address;
+    if (sscanf(entry->d_name, "ep_%2x", &address) != 1 ||
+        (address & 0x80) == 0 || (address & 0x7f) == 0) {
+      continue;
+    }
+    char path[PATH_MAX];
+    char type[32] = {0};
+    if (snprintf(path, sizeof(path), "%s/%s/type", interface_path,
+                 entry->d_name) >= (int)sizeof(path)) {
+      continue;
+    }
+    if (hidraw_read_file(path, type, sizeof(type) - 1) > 0 &&
+        strncmp(type, "Interrupt", 9) == 0) {
+      endpoint = (uint8_t)address;
+      break;
+    }
+  }
+  closedir(dir);
+  return endpoint;
+}
+
+// Fills in a source from sysfs if `name` is the hidraw node of a PSVR2
+// device. Returns 0, or -1 to skip it.
+static int hidraw_describe(const char *name, struct hidraw_source *source) {
+  char path[PATH_MAX];
+  char uevent[1024] = {0};
+  snprintf(path, sizeof(path), "%s/%s/device/uevent", HIDRAW_SYSFS_PATH, name);
+  if (hidraw_read_file(path, uevent, sizeof(uevent) - 1) <= 0) {
+    return -1;
+  }
+  const char *id = strstr(uevent, "HID_ID=");
+  unsigned bus;
+  unsigned vendor_id;
+  unsigned product_id;
+  if (id == NULL ||
+      sscanf(id, "HID_ID=%x:%x:%x", &bus, &vendor_id, &product_id) != 3 ||
+      !discovery_matches_ids((uint16_t)vendor_id, (uint16_t)product_id)) {
+    return -1;
+  }
+
+  memset(source, 0, sizeof(*source));
+  snprintf(source->node, sizeof(source->node), "/dev/%s", name);
+  source->product_id = (uint16_t)product_id;
+  source->endpoint = HIDRAW_UNKNOWN_ENDPOINT;
+  source->interface_number = -1;
+  source->fd = -1;
+
+  // On USB the HID device sits in its interface directory,
+  // ".../1-2/1-2:1.3/0003:054C:0E45.0001": port path and interface number
+  // are in the name of the parent.
+  snprintf(path, sizeof(path), "%s/%s/device", HIDRAW_SYSFS_PATH, name);
+  char device_path[PATH_MAX];
+  if (realpath(path, device_path) != NULL) {
+    char *slash = strrchr(device_path, '/');
+    if (slash != NULL) {
+      *slash = '\0';
+      const char *interface_name = strrchr(device_path, '/');
+      char port_path[DISCOVERY_PORT_PATH_SIZE];
+      int configuration;
+      int interface_number;
+      if (interface_name != NULL &&
+          sscanf(interface_name + 1, "%31[0-9.-]:%d.%d", port_path,
+                 &configuration, &interface_number) == 3) {
+        memcpy(source->port_path, port_path, sizeof(source->port_path));
+        source->interface_number = interface_number;
+        source->endpoint = hidraw_find_endpoint(device_path);
+      }
+    }
+  }
+
+  snprintf(path, sizeof(path), "%s/%s/device/report_descriptor",
+           HIDRAW_SYSFS_PATH, name);
+  int length = hidraw_read_file(path, source->report_descriptor,
+                                sizeof(source->report_descriptor));
+  source->report_descriptor_length = length > 0 ? length : 0;
+  return 0;
+}
+
+int hidraw_open(struct hidraw *hidraw) {
+  hidraw->num_sources = 0;
+  hidraw->epoll_fd = -1;
+  hidraw->wake_fd = -1;
+  atomic_init(&hidraw->running, 0);
+  atomic_init(&hidraw->wakeups, 0);
+
+  DIR *dir = opendir(HIDRAW_SYSFS_PATH);
+  if (dir == NULL) {
+    fprintf(stderr, "%s:%d: unable to list %s\n", __FILE__, __LINE__,
+            HIDRAW_SYSFS_PATH);
+    return -1;
+  }
+  hidraw->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  hidraw->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  struct epoll_event wake = {.events = EPOLLIN,
+                             .data.u32 = HIDRAW_MAX_SOURCES};
+  if (hidraw->epoll_fd < 0 || hidraw->wake_fd < 0 ||
+      epoll_ctl(hidraw->epoll_fd, EPOLL_CTL_ADD, hidraw->wake_fd, &wake) !=
+          0) {
+    fprintf(stderr, "%s:%d: unable to set up epoll: %s\n", __FILE__,
+            __LINE__, strerror(errno));
+    closedir(dir);
+    hidraw_close(hidraw);
+    return -1;
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL &&
+         hidraw->num_sources < HIDRAW_MAX_SOURCES) {
+    if (strncmp(entry->d_name, "hidraw", 6) != 0) {
+      continue;
+    }
+    struct hidraw_source *source = &hidraw->sources[hidraw->num_sources];
+    if (hidraw_describe(entry->d_name, source) != 0) {
+      continue;
+    }
+    source->fd = open(source->node, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (source->fd < 0) {
+      // Usually permissions, see README.md for a udev rule.
+      fprintf(stderr, "%s:%d: unable to open %s: %s\n", __FILE__, __LINE__,
+              source->node, strerror(errno));
+      continue;
+    }
+    source->ring = report_ring_create();
+    struct epoll_event event = {.events = EPOLLIN,
+                                .data.u32 = (uint32_t)hidraw->num_sources};
+    if (source->ring == NULL ||
+        epoll_ctl(hidraw->epoll_fd, EPOLL_CTL_ADD, source->fd, &event) != 0) {
+      fprintf(stderr, "%s:%d: unable to watch %s\n", __FILE__, __LINE__,
+              source->node);
+      report_ring_destroy(source->ring);
+      close(source->fd);
+      continue;
+    }
+    atomic_init(&source->connected, 1);
+    atomic_init(&source->reports, 0);
+    atomic_init(&source->errors, 0);
+    ++hidraw->num_sources;
+  }
+  closedir(dir);
+  return hidraw->num_sources;
+}
+
+static void hidraw_disconnect(struct hidraw *hidraw,
+                              struct hidraw_source *source) {
+  epoll_ctl(hidraw->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+  atomic_store(&source->connected, 0);
+}
+
+// A single read per wakeup: epoll is level triggered, so a second waiting
+// report makes the next epoll_wait return at once. Reading until EAGAIN
+// would cost an extra read for every wakeup with a single report, which at
+// 1 kHz is nearly all of them.
+static void hidraw_read_report(struct hidraw *hidraw,
+                               struct hidraw_source *source) {
+  // Straight into the ring. A full ring still has the report read, into
+  // `discard`, so the node does not stay readable.
+  struct report *report = report_ring_reserve(source->ring);
+  uint8_t discard[REPORT_MAX_SIZE];
+  ssize_t length = read(source->fd, report != NULL ? report->data : discard,
+                        REPORT_MAX_SIZE);
+  if (length < 0) {
+    if (errno == ENODEV) {
+      hidraw_disconnect(hidraw, source);
+    } else if (errno != EAGAIN && errno != EINTR) {
+      atomic_fetch_add_explicit(&source->errors, 1, memory_order_relaxed);
+    }
+    return;
+  }
+  if (report == NULL) {
+    return;
+  }
+  report->timestamp_ns = monotonic_ns();
+  report->product_id = source->product_id;
+  report->endpoint = source->endpoint;
+  report->length = (uint16_t)length;
+  report_ring_commit(source->ring);
+  atomic_fetch_add_explicit(&source->reports, 1, memory_order_relaxed);
+}
+
+static void *hidraw_main(void *arg) {
+  struct hidraw *hidraw = arg;
+  struct epoll_event events[HIDRAW_MAX_SOURCES + 1];
+  while (atomic_load_explicit(&hidraw->running, memory_order_acquire)) {
+    int count = epoll_wait(hidraw->epoll_fd, events,
+                           HIDRAW_MAX_SOURCES + 1, -1);
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "%s:%d: epoll_wait failed: %s\n", __FILE__, __LINE__,
+              strerror(errno));
+      atomic_store(&hidraw->running, 0);
+      break;
+    }
+    atomic_fetch_add_explicit(&hidraw->wakeups, 1, memory_order_relaxed);
+    for (int i = 0; i < count; ++i) {
+      if (events[i].data.u32 >= (uint32_t)hidraw->num_sources) {
+        // The wake up eventfd, `running` says what to do.
+        continue;
+      }
+      struct hidraw_source *source = &hidraw->sources[events[i].data.u32];
+      if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+        hidraw_disconnect(hidraw, source);
+      } else {
+        hidraw_read_report(hidraw, source);
+      }
+    }
+  }
+  return NULL;
+}
+
+int hidraw_start(struct hidraw *hidraw) {
+  atomic_store(&hidraw->running, 1);
+  int result = pthread_create(&hidraw->thread, NULL, hidraw_main, hidraw);
+  if (result != 0) {
+    atomic_store(&hidraw->running, 0);
+  }
+  return result;
+}
+
+void hidraw_stop(struct hidraw *hidraw) {
+  atomic_store_explicit(&hidraw->running, 0, memory_order_release);
+  const uint64_t one = 1;
+  if (write(hidraw->wake_fd, &one, sizeof(one)) != sizeof(one)) {
+    fprintf(stderr, "%s:%d: unable to wake the hidraw thread\n", __FILE__,
+            __LINE__);
+  }
+  pthread_join(hidraw->thread, NULL);
+}
+
+void hidraw_close(struct hidraw *hidraw) {
+  for (int i = 0; i < hidraw->num_sources; ++i) {
+    close(hidraw->sources[i].fd);
+    report_ring_destroy(hidraw->sources[i].ring);
+  }
+  hidraw->num_sources = 0;
+  if (hidraw->wake_fd >= 0) {
+    close(hidraw->wake_fd);
+  }
+  if (hidraw->epoll_fd >= 0) {
+    close(hidraw->epoll_fd);
+  }
+}
+
+int hidraw_write(struct hidraw_source *source, const uint8_t *report,
+                 int length) {
+  if (!atomic_load(&source->connected)) {
+    return -1;
+  }
+  ssize_t written = write(source->fd, report, (size_t)length);
+  if (written != length) {
+    if (written >= 0 || errno != EAGAIN) {
+      atomic_fetch_add_explicit(&source->errors, 1, memory_order_relaxed);
+    }
+    return -1;
+  }
+  return 0;
+}
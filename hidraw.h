@@ -0,0 +1,70 @@
+#ifndef HIDRAW_H
+#define HIDRAW_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "discovery.h"
+#include "hid.h"
+#include "ring.h"
+
+// Reads the controllers through the kernel's hidraw nodes instead of libusb:
+// the HID driver stays attached, nothing is claimed, and other programs keep
+// seeing the controllers. The nodes are found in sysfs and read by one
+// thread waiting on all of them with epoll, feeding the same report rings as
+// the libusb streams. Output reports are written to the same nodes.
+
+#define HIDRAW_MAX_SOURCES 8
+#define HIDRAW_SYSFS_PATH "/sys/class/hidraw"
+// "/dev/hidrawNNN".
+#define HIDRAW_NODE_SIZE 32
+// hidraw does not say which endpoint a report came in on. Stands for the
+// interrupt IN endpoint when sysfs does not have it either, as for uhid
+// devices: endpoint 0 with the IN bit, which no interrupt endpoint can be.
+#define HIDRAW_UNKNOWN_ENDPOINT 0x80
+
+struct hidraw_source {
+  char node[HIDRAW_NODE_SIZE];
+  uint16_t product_id;
+  uint8_t endpoint;
+  // Empty for devices not on USB, like uhid ones.
+  char port_path[DISCOVERY_PORT_PATH_SIZE];
+  int interface_number;
+  uint8_t report_descriptor[HID_MAX_DESCRIPTOR_SIZE];
+  int report_descriptor_length;
+  int fd;
+  struct report_ring *ring;
+  // Cleared by the reader thread when the node goes away.
+  atomic_int connected;
+  atomic_uint_least64_t reports;
+  atomic_uint_least64_t errors;
+};
+
+struct hidraw {
+  struct hidraw_source sources[HIDRAW_MAX_SOURCES];
+  int num_sources;
+  int epoll_fd;
+  // Wakes the reader thread up when stopping.
+  int wake_fd;
+  pthread_t thread;
+  atomic_int running;
+  // Returns of epoll_wait, against the reports read: how well reads are
+  // batched.
+  atomic_uint_least64_t wakeups;
+};
+
+// Finds the hidraw nodes of the PSVR2 devices, opens them non-blocking and
+// creates a ring for each. Returns the number of sources, which can be 0,
+// or -1 (with a message on stderr).
+int hidraw_open(struct hidraw *hidraw);
+int hidraw_start(struct hidraw *hidraw);
+void hidraw_stop(struct hidraw *hidraw);
+void hidraw_close(struct hidraw *hidraw);
+
+// Writes an output report, report ID first, without blocking. Returns 0, or
+// -1 if the report could not be written right now.
+int hidraw_write(struct hidraw_source *source, const uint8_t *report,
+                 int length);
+
+#endif // HIDRAW_H
@@ -0,0 +1,92 @@
+#include "histogram.h"
+
+void histogram_reset(struct histogram *histogram) {
+  for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+    atomic_init(&histogram->counts[i], 0);
+  }
+  atomic_init(&histogram->max, 0);
+}
+
+uint64_t histogram_bucket_limit(int bucket) {
+  if (bucket < HISTOGRAM_SUB_BUCKETS) {
+    return (uint64_t)bucket;
+  }
+  const int shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+  const uint64_t mantissa =
+      (uint64_t)((bucket & (HISTOGRAM_SUB_BUCKETS - 1)) | HISTOGRAM_SUB_BUCKETS);
+  return (mantissa << shift) + ((1ull << shift) - 1);
+}
+
+// Counts are read one by one while other threads may still record, so the
+// snapshot is only approximately consistent, which is fine for percentiles.
+static uint64_t histogram_snapshot(const struct histogram *histogram,
+                                   uint64_t counts[HISTOGRAM_BUCKETS]) {
+  uint64_t total = 0;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+    counts[i] = atomic_load_explicit(&histogram->counts[i],
+                                     memory_order_relaxed);
+    total += counts[i];
+  }
+  return total;
+}
+
+// Bucket holding the `rank`th value, counting from 1.
+static uint64_t histogram_rank(const uint64_t counts[HISTOGRAM_BUCKETS],
+                               uint64_t rank, int *bucket, uint64_t *seen) {
+  while (*bucket < HISTOGRAM_BUCKETS && *seen + counts[*bucket] < rank) {
+    *seen += counts[(*bucket)++];
+  }
+  return histogram_bucket_limit(*bucket < HISTOGRAM_BUCKETS
+                                    ? *bucket
+                                    : HISTOGRAM_BUCKETS - 1);
+}
+
+static uint64_t histogram_percentile_rank(uint64_t total, double p) {
+  uint64_t rank = (uint64_t)(p * total + 0.5);
+  return rank == 0 ? 1 : rank;
+}
+
+uint64_t histogram_percentile(const struct histogram *histogram, double p) {
+  uint64_t counts[HISTOGRAM_BUCKETS];
+  const uint64_t total = histogram_snapshot(histogram, counts);
+  if (total == 0) {
+    return 0;
+  }
+  int bucket = 0;
+  uint64_t seen = 0;
+  const uint64_t value = histogram_rank(
+      counts, histogram_percentile_rank(total, p), &bucket, &seen);
+  const uint64_t max =
+      atomic_load_explicit(&histogram->max, memory_order_relaxed);
+  return value < max ? value : max;
+}
+
+void histogram_summarize(const struct histogram *histogram,
+                         struct histogram_summary *summary) {
+  uint64_t counts[HISTOGRAM_BUCKETS];
+  summary->count = histogram_snapshot(histogram, counts);
+  summary->max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+  if (summary->count == 0) {
+    summary->p50 = summary->p99 = summary->p999 = 0;
+    return;
+  }
+  // The percentiles are increasing, one walk over the buckets finds them all.
+  int bucket = 0;
+  uint64_t seen = 0;
+  summary->p50 = histogram_rank(
+      counts, histogram_percentile_rank(summary->count, 0.5), &bucket, &seen);
+  summary->p99 = histogram_rank(
+      counts, histogram_percentile_rank(summary->count, 0.99), &bucket, &seen);
+  summary->p999 = histogram_rank(
+      counts, histogram_percentile_rank(summary->count, 0.999), &bucket, &seen);
+  // The bucket limit may overshoot the largest value actually recorded.
+  if (summary->p50 > summary->max) {
+    summary->p50 = summary->max;
+  }
+  if (summary->p99 > summary->max) {
+    summary->p99 = summary->max;
+  }
+  if (summary->p999 > summary->max) {
+    summary->p999 = summary->max;
+  }
+}
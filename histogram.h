@@ -0,0 +1,65 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// Fixed bucket histogram of durations in ns. Buckets are log-linear: every
+// power of two is split in 2^HISTOGRAM_SUB_BITS equal buckets, so a value is
+// known within 12.5% from 8 ns up to the full 64-bit range, in 4 KiB.
+// Recording is one relaxed atomic increment, any thread can record while
+// another one reads.
+
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+struct histogram {
+  atomic_uint_least64_t counts[HISTOGRAM_BUCKETS];
+  atomic_uint_least64_t max;
+};
+
+struct histogram_summary {
+  uint64_t count;
+  // Upper bounds of the buckets holding the percentiles, in ns.
+  uint64_t p50;
+  uint64_t p99;
+  uint64_t p999;
+  uint64_t max;
+};
+
+// Must not race with histogram_record.
+void histogram_reset(struct histogram *histogram);
+
+static inline int histogram_bucket(uint64_t value) {
+  if (value < HISTOGRAM_SUB_BUCKETS) {
+    return (int)value;
+  }
+  const int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+  return ((shift + 1) << HISTOGRAM_SUB_BITS) +
+         (int)((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+static inline void histogram_record(struct histogram *histogram,
+                                    uint64_t value) {
+  atomic_fetch_add_explicit(&histogram->counts[histogram_bucket(value)], 1,
+                            memory_order_relaxed);
+  uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+  while (value > max &&
+         !atomic_compare_exchange_weak_explicit(&histogram->max, &max, value,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+  }
+}
+
+// Largest value that falls in `bucket`.
+uint64_t histogram_bucket_limit(int bucket);
+
+// Percentile `p` (0 to 1) of what was recorded so far, 0 if nothing was.
+uint64_t histogram_percentile(const struct histogram *histogram, double p);
+
+// Count, p50, p99, p99.9 and max from a single pass over the buckets.
+void histogram_summarize(const struct histogram *histogram,
+                         struct histogram_summary *summary);
+
+#endif // HISTOGRAM_H
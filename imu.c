@@ -0,0 +1,298 @@
+#include "imu.h"
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+// GCC vector extensions: lowered to SSE on x86 and NEON on ARM. With two
+// controllers a 4 wide vector already covers every lane.
+typedef float v4f __attribute__((vector_size(16)));
+typedef int32_t v4i __attribute__((vector_size(16)));
+
+// Below these, a sample counts as stationary for the bias low pass filter.
+#define IMU_STATIONARY_GYRO 0.05f  // rad/s
+#define IMU_STATIONARY_ACCEL 0.05f // g away from 1 g
+// Keeps the gradient normalisation finite when it is exactly zero.
+#define IMU_EPSILON 1e-30f
+
+static inline v4f v4_splat(float value) {
+  return (v4f){value, value, value, value};
+}
+
+static inline v4f v4_load(const float *data) {
+  v4f value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+static inline void v4_store(float *data, v4f value) {
+  memcpy(data, &value, sizeof(value));
+}
+
+static inline v4f v4_rsqrt(v4f value) {
+#if defined(__SSE__)
+  // A real square root rather than rsqrtps, so the vector path matches the
+  // scalar reference.
+  return v4_splat(1.0f) / (v4f)_mm_sqrt_ps((__m128)value);
+#else
+  v4f result;
+  for (int i = 0; i < IMU_LANES; ++i) {
+    result[i] = 1.0f / sqrtf(value[i]);
+  }
+  return result;
+#endif
+}
+
+static inline v4f v4_select(v4i mask, v4f a, v4f b) {
+  return (v4f)(((v4i)a & mask) | ((v4i)b & ~mask));
+}
+
+static inline v4f v4_abs(v4f value) {
+  const v4i magnitude = {0x7fffffff, 0x7fffffff, 0x7fffffff, 0x7fffffff};
+  return (v4f)((v4i)value & magnitude);
+}
+
+void imu_fusion_init(struct imu_fusion *fusion) {
+  memset(fusion, 0, sizeof(*fusion));
+  for (int lane = 0; lane < IMU_LANES; ++lane) {
+    fusion->q[0][lane] = 1.0f;
+  }
+  fusion->beta = IMU_DEFAULT_BETA;
+  fusion->zeta = IMU_DEFAULT_ZETA;
+  fusion->stationary_rate = 0.001f;
+}
+
+void imu_batch_clear(struct imu_batch *batch) {
+  memset(batch, 0, sizeof(*batch));
+}
+
+int imu_batch_add(struct imu_batch *batch, int controller, const float gyro[3],
+                  const float accel[3], float dt) {
+  const int step = batch->count[controller];
+  if (step == IMU_MAX_BATCH) {
+    return -1;
+  }
+  for (int axis = 0; axis < 3; ++axis) {
+    batch->gyro[axis][step][controller] = gyro[axis];
+    batch->accel[axis][step][controller] = accel[axis];
+  }
+  batch->dt[step][controller] = dt;
+  batch->count[controller] = step + 1;
+  if (step + 1 > batch->steps) {
+    batch->steps = step + 1;
+  }
+  return 0;
+}
+
+void imu_fusion_update(struct imu_fusion *fusion,
+                       const struct imu_batch *batch) {
+  v4f q0 = v4_load(fusion->q[0]);
+  v4f q1 = v4_load(fusion->q[1]);
+  v4f q2 = v4_load(fusion->q[2]);
+  v4f q3 = v4_load(fusion->q[3]);
+  v4f bx = v4_load(fusion->bias[0]);
+  v4f by = v4_load(fusion->bias[1]);
+  v4f bz = v4_load(fusion->bias[2]);
+  const v4f zero = v4_splat(0.0f);
+  const v4f one = v4_splat(1.0f);
+  const v4f two = v4_splat(2.0f);
+  const v4f four = v4_splat(4.0f);
+  const v4f half = v4_splat(0.5f);
+  const v4f beta = v4_splat(fusion->beta);
+  const v4f zeta = v4_splat(fusion->zeta);
+  const v4f stationary_rate = v4_splat(fusion->stationary_rate);
+
+  for (int step = 0; step < batch->steps; ++step) {
+    v4f gx = v4_load(batch->gyro[0][step]);
+    v4f gy = v4_load(batch->gyro[1][step]);
+    v4f gz = v4_load(batch->gyro[2][step]);
+    v4f ax = v4_load(batch->accel[0][step]);
+    v4f ay = v4_load(batch->accel[1][step]);
+    v4f az = v4_load(batch->accel[2][step]);
+    const v4f dt = v4_load(batch->dt[step]);
+
+    // Normalise the accelerometer, lanes without a reading are left out of
+    // the correction.
+    const v4f accel_norm2 = ax * ax + ay * ay + az * az;
+    const v4i has_accel = accel_norm2 > zero;
+    const v4f accel_rnorm = v4_rsqrt(v4_select(has_accel, accel_norm2, one));
+    ax *= accel_rnorm;
+    ay *= accel_rnorm;
+    az *= accel_rnorm;
+
+    // When the controller is at rest the gyro only reads its bias.
+    const v4f cx = gx - bx;
+    const v4f cy = gy - by;
+    const v4f cz = gz - bz;
+    const v4i stationary =
+        (cx * cx + cy * cy + cz * cz <
+         v4_splat(IMU_STATIONARY_GYRO * IMU_STATIONARY_GYRO)) &
+        (v4_abs(accel_norm2 * accel_rnorm - one) <
+         v4_splat(IMU_STATIONARY_ACCEL)) &
+        has_accel & (dt > zero);
+    bx += v4_select(stationary, stationary_rate * (gx - bx), zero);
+    by += v4_select(stationary, stationary_rate * (gy - by), zero);
+    bz += v4_select(stationary, stationary_rate * (gz - bz), zero);
+
+    // Gradient descent step towards the measured gravity.
+    const v4f _2q0 = two * q0, _2q1 = two * q1, _2q2 = two * q2,
+              _2q3 = two * q3;
+    const v4f _4q0 = four * q0, _4q1 = four * q1, _4q2 = four * q2;
+    const v4f _8q1 = two * _4q1, _8q2 = two * _4q2;
+    const v4f q0q0 = q0 * q0, q1q1 = q1 * q1, q2q2 = q2 * q2, q3q3 = q3 * q3;
+    v4f s0 = _4q0 * q2q2 + _2q2 * ax + _4q0 * q1q1 - _2q1 * ay;
+    v4f s1 = _4q1 * q3q3 - _2q3 * ax + four * q0q0 * q1 - _2q0 * ay - _4q1 +
+             _8q1 * q1q1 + _8q1 * q2q2 + _4q1 * az;
+    v4f s2 = four * q0q0 * q2 + _2q0 * ax + _4q2 * q3q3 - _2q3 * ay - _4q2 +
+             _8q2 * q1q1 + _8q2 * q2q2 + _4q2 * az;
+    v4f s3 = four * q1q1 * q3 - _2q1 * ax + four * q2q2 * q3 - _2q2 * ay;
+    const v4f s_rnorm =
+        v4_rsqrt(s0 * s0 + s1 * s1 + s2 * s2 + s3 * s3 + IMU_EPSILON);
+    s0 = v4_select(has_accel, s0 * s_rnorm, zero);
+    s1 = v4_select(has_accel, s1 * s_rnorm, zero);
+    s2 = v4_select(has_accel, s2 * s_rnorm, zero);
+    s3 = v4_select(has_accel, s3 * s_rnorm, zero);
+
+    // Gyro bias drift: the part of the correction that a constant angular
+    // rate would explain, 2 q* x s.
+    bx += zeta * dt * two * (q0 * s1 - q1 * s0 - q2 * s3 + q3 * s2);
+    by += zeta * dt * two * (q0 * s2 + q1 * s3 - q2 * s0 - q3 * s1);
+    bz += zeta * dt * two * (q0 * s3 - q1 * s2 + q2 * s1 - q3 * s0);
+    gx -= bx;
+    gy -= by;
+    gz -= bz;
+
+    const v4f qdot0 = half * (-q1 * gx - q2 * gy - q3 * gz) - beta * s0;
+    const v4f qdot1 = half * (q0 * gx + q2 * gz - q3 * gy) - beta * s1;
+    const v4f qdot2 = half * (q0 * gy - q1 * gz + q3 * gx) - beta * s2;
+    const v4f qdot3 = half * (q0 * gz + q1 * gy - q2 * gx) - beta * s3;
+    q0 += qdot0 * dt;
+    q1 += qdot1 * dt;
+    q2 += qdot2 * dt;
+    q3 += qdot3 * dt;
+    const v4f q_rnorm = v4_rsqrt(q0 * q0 + q1 * q1 + q2 * q2 + q3 * q3);
+    q0 *= q_rnorm;
+    q1 *= q_rnorm;
+    q2 *= q_rnorm;
+    q3 *= q_rnorm;
+  }
+
+  v4_store(fusion->q[0], q0);
+  v4_store(fusion->q[1], q1);
+  v4_store(fusion->q[2], q2);
+  v4_store(fusion->q[3], q3);
+  v4_store(fusion->bias[0], bx);
+  v4_store(fusion->bias[1], by);
+  v4_store(fusion->bias[2], bz);
+  for (int lane = 0; lane < IMU_LANES; ++lane) {
+    fusion->updates[lane] += batch->count[lane];
+  }
+}
+
+void imu_fusion_update_scalar(struct imu_fusion *fusion, int controller,
+                              const float gyro[3], const float accel[3],
+                              float dt) {
+  float q0 = fusion->q[0][controller], q1 = fusion->q[1][controller],
+        q2 = fusion->q[2][controller], q3 = fusion->q[3][controller];
+  float bx = fusion->bias[0][controller], by = fusion->bias[1][controller],
+        bz = fusion->bias[2][controller];
+  float gx = gyro[0], gy = gyro[1], gz = gyro[2];
+  float ax = accel[0], ay = accel[1], az = accel[2];
+
+  const float accel_norm2 = ax * ax + ay * ay + az * az;
+  const int has_accel = accel_norm2 > 0.0f;
+  const float accel_rnorm = 1.0f / sqrtf(has_accel ? accel_norm2 : 1.0f);
+  ax *= accel_rnorm;
+  ay *= accel_rnorm;
+  az *= accel_rnorm;
+
+  const float cx = gx - bx, cy = gy - by, cz = gz - bz;
+  if (cx * cx + cy * cy + cz * cz <
+          IMU_STATIONARY_GYRO * IMU_STATIONARY_GYRO &&
+      fabsf(accel_norm2 * accel_rnorm - 1.0f) < IMU_STATIONARY_ACCEL &&
+      has_accel && dt > 0.0f) {
+    bx += fusion->stationary_rate * (gx - bx);
+    by += fusion->stationary_rate * (gy - by);
+    bz += fusion->stationary_rate * (gz - bz);
+  }
+
+  float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+  if (has_accel) {
+    const float _2q0 = 2.0f * q0, _2q1 = 2.0f * q1, _2q2 = 2.0f * q2,
+                _2q3 = 2.0f * q3;
+    const float _4q0 = 4.0f * q0, _4q1 = 4.0f * q1, _4q2 = 4.0f * q2;
+    const float _8q1 = 2.0f * _4q1, _8q2 = 2.0f * _4q2;
+    const float q0q0 = q0 * q0, q1q1 = q1 * q1, q2q2 = q2 * q2,
+                q3q3 = q3 * q3;
+    s0 = _4q0 * q2q2 + _2q2 * ax + _4q0 * q1q1 - _2q1 * ay;
+    s1 = _4q1 * q3q3 - _2q3 * ax + 4.0f * q0q0 * q1 - _2q0 * ay - _4q1 +
+         _8q1 * q1q1 + _8q1 * q2q2 + _4q1 * az;
+    s2 = 4.0f * q0q0 * q2 + _2q0 * ax + _4q2 * q3q3 - _2q3 * ay - _4q2 +
+         _8q2 * q1q1 + _8q2 * q2q2 + _4q2 * az;
+    s3 = 4.0f * q1q1 * q3 - _2q1 * ax + 4.0f * q2q2 * q3 - _2q2 * ay;
+    const float s_rnorm =
+        1.0f / sqrtf(s0 * s0 + s1 * s1 + s2 * s2 + s3 * s3 + IMU_EPSILON);
+    s0 *= s_rnorm;
+    s1 *= s_rnorm;
+    s2 *= s_rnorm;
+    s3 *= s_rnorm;
+  }
+
+  bx += fusion->zeta * dt * 2.0f * (q0 * s1 - q1 * s0 - q2 * s3 + q3 * s2);
+  by += fusion->zeta * dt * 2.0f * (q0 * s2 + q1 * s3 - q2 * s0 - q3 * s1);
+  bz += fusion->zeta * dt * 2.0f * (q0 * s3 - q1 * s2 + q2 * s1 - q3 * s0);
+  gx -= bx;
+  gy -= by;
+  gz -= bz;
+
+  const float qdot0 = 0.5f * (-q1 * gx - q2 * gy - q3 * gz) - fusion->beta * s0;
+  const float qdot1 = 0.5f * (q0 * gx + q2 * gz - q3 * gy) - fusion->beta * s1;
+  const float qdot2 = 0.5f * (q0 * gy - q1 * gz + q3 * gx) - fusion->beta * s2;
+  const float qdot3 = 0.5f * (q0 * gz + q1 * gy - q2 * gx) - fusion->beta * s3;
+  q0 += qdot0 * dt;
+  q1 += qdot1 * dt;
+  q2 += qdot2 * dt;
+  q3 += qdot3 * dt;
+  const float q_rnorm = 1.0f / sqrtf(q0 * q0 + q1 * q1 + q2 * q2 + q3 * q3);
+
+  fusion->q[0][controller] = q0 * q_rnorm;
+  fusion->q[1][controller] = q1 * q_rnorm;
+  fusion->q[2][controller] = q2 * q_rnorm;
+  fusion->q[3][controller] = q3 * q_rnorm;
+  fusion->bias[0][controller] = bx;
+  fusion->bias[1][controller] = by;
+  fusion->bias[2][controller] = bz;
+  ++fusion->updates[controller];
+}
+
+void imu_fusion_get_orientation(const struct imu_fusion *fusion,
+                                int controller, float q[4]) {
+  for (int i = 0; i < 4; ++i) {
+    q[i] = fusion->q[i][controller];
+  }
+}
+
+int imu_find_channels(const struct hid_decoder *decoder,
+                      struct imu_channels *channels) {
+  static const uint16_t gyro_usages[3] = {HID_USAGE_ANGULAR_VELOCITY_X,
+                                          HID_USAGE_ANGULAR_VELOCITY_Y,
+                                          HID_USAGE_ANGULAR_VELOCITY_Z};
+  static const uint16_t accel_usages[3] = {HID_USAGE_ACCELERATION_X,
+                                           HID_USAGE_ACCELERATION_Y,
+                                           HID_USAGE_ACCELERATION_Z};
+  for (int axis = 0; axis < 3; ++axis) {
+    channels->gyro[axis] =
+        hid_find_value(decoder, HID_USAGE_PAGE_SENSORS, gyro_usages[axis]);
+    channels->accel[axis] =
+        hid_find_value(decoder, HID_USAGE_PAGE_SENSORS, accel_usages[axis]);
+    if (channels->gyro[axis] < 0 || channels->accel[axis] < 0) {
+      return -1;
+    }
+  }
+  channels->gyro_scale = (float)M_PI / 180.0f;
+  channels->accel_scale = 1.0f;
+  return 0;
+}
@@ -0,0 +1,86 @@
+#ifndef IMU_H
+#define IMU_H
+
+#include <stdint.h>
+
+#include "hid.h"
+
+// Madgwick style orientation filter running both controllers together. All
+// state is stored structure-of-arrays, one lane per controller, so every
+// step of the filter is a handful of 4 wide vector operations.
+
+#define IMU_NUM_CONTROLLERS 2
+#define IMU_LANES 4
+#define IMU_MAX_BATCH 64
+
+#define IMU_LEFT 0
+#define IMU_RIGHT 1
+
+// Default filter gains: beta weighs the accelerometer correction, zeta the
+// gyro bias drift correction (both in rad/s).
+#define IMU_DEFAULT_BETA 0.05f
+#define IMU_DEFAULT_ZETA 0.01f
+
+struct imu_fusion {
+  // Orientation quaternions (w, x, y, z) rotating the controller frame into
+  // the world frame, whose Z axis points up.
+  _Alignas(16) float q[4][IMU_LANES];
+  // Estimated gyro bias in rad/s.
+  _Alignas(16) float bias[3][IMU_LANES];
+  float beta;
+  float zeta;
+  // Weight of a stationary sample in the bias low pass filter.
+  float stationary_rate;
+  uint64_t updates[IMU_LANES];
+};
+
+// A burst of queued samples. Step k of every lane is processed together;
+// lanes with fewer samples are padded with dt = 0, which leaves them
+// untouched.
+struct imu_batch {
+  int count[IMU_LANES];
+  int steps;
+  // rad/s
+  _Alignas(16) float gyro[3][IMU_MAX_BATCH][IMU_LANES];
+  // Any unit, only the direction is used. 1 g for the stationary detection.
+  _Alignas(16) float accel[3][IMU_MAX_BATCH][IMU_LANES];
+  // Seconds since the previous sample of the same lane.
+  _Alignas(16) float dt[IMU_MAX_BATCH][IMU_LANES];
+};
+
+// Value indices of the IMU fields in a decoded hid_state.
+struct imu_channels {
+  int gyro[3];
+  int accel[3];
+  // Multiply decoded values by these to get rad/s and g.
+  float gyro_scale;
+  float accel_scale;
+};
+
+void imu_fusion_init(struct imu_fusion *fusion);
+
+void imu_batch_clear(struct imu_batch *batch);
+// Returns 0, or -1 if the lane is full (update and clear the batch first).
+int imu_batch_add(struct imu_batch *batch, int controller, const float gyro[3],
+                  const float accel[3], float dt);
+
+// Runs every step of the batch on all lanes.
+void imu_fusion_update(struct imu_fusion *fusion,
+                       const struct imu_batch *batch);
+
+// Reference implementation, one sample of one controller, same math as the
+// vector path. Meant for checking it.
+void imu_fusion_update_scalar(struct imu_fusion *fusion, int controller,
+                              const float gyro[3], const float accel[3],
+                              float dt);
+
+void imu_fusion_get_orientation(const struct imu_fusion *fusion,
+                                int controller, float q[4]);
+
+// Looks the angular velocity and acceleration usages of the Sensors page up
+// in a decoder. Returns 0 if all six are present, -1 otherwise. Values are
+// expected in deg/s and g, as the HID Sensors usages define them.
+int imu_find_channels(const struct hid_decoder *decoder,
+                      struct imu_channels *channels);
+
+#endif // IMU_H
@@ -0,0 +1,194 @@
+#include "input.h"
+
+#include <math.h>
+#include <string.h>
+
+// GCC vector extensions, as in imu.c.
+typedef uint8_t v16u8 __attribute__((vector_size(16)));
+typedef uint64_t v2u64 __attribute__((vector_size(16)));
+typedef float v4f __attribute__((vector_size(16)));
+typedef int32_t v4i __attribute__((vector_size(16)));
+
+_Static_assert(REPORT_MAX_SIZE % 16 == 0, "reports are compared 16 bytes at "
+                                          "a time");
+
+static inline v16u8 v16_load(const uint8_t *data) {
+  v16u8 value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+static inline v4f v4_load(const float *data) {
+  v4f value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+static inline v4f v4_abs(v4f value) {
+  const v4i magnitude = {0x7fffffff, 0x7fffffff, 0x7fffffff, 0x7fffffff};
+  return (v4f)((v4i)value & magnitude);
+}
+
+// Marks the bytes covered by `bit_size` bits read at `byte_offset` the way
+// hid_decode does: a 64 bit little endian load shifted left then right.
+static void input_mark(uint8_t *watched, int byte_offset, int left_shift,
+                       int right_shift) {
+  const int bit_size = 64 - right_shift;
+  const int first_bit = byte_offset * 8 + 64 - left_shift - bit_size;
+  const int last_bit = first_bit + bit_size - 1;
+  for (int byte = first_bit / 8; byte <= last_bit / 8; ++byte) {
+    if (byte < REPORT_MAX_SIZE) {
+      watched[byte] = 0xff;
+    }
+  }
+}
+
+static void input_update_watched(struct input_diff *diff) {
+  const struct hid_decoder *decoder = diff->decoder;
+  memset(diff->watched, 0, sizeof(diff->watched));
+  for (int r = 0; r < decoder->num_reports; ++r) {
+    const struct hid_report_layout *layout = &decoder->reports[r];
+    for (int i = 0; i < layout->num_button_runs; ++i) {
+      const struct hid_button_run *run =
+          &decoder->button_runs[layout->first_button_run + i];
+      input_mark(diff->watched[r], run->byte_offset, run->left_shift,
+                 run->right_shift);
+    }
+    for (int i = 0; i < layout->num_fields; ++i) {
+      const struct hid_field *field = &decoder->fields[layout->first_field + i];
+      if (isfinite(diff->deadband[field->value_index])) {
+        input_mark(diff->watched[r], field->byte_offset, field->left_shift,
+                   field->right_shift);
+      }
+    }
+  }
+  // The bytes that changed while unwatched are not in `previous` anymore.
+  memset(diff->has_previous, 0, sizeof(diff->has_previous));
+}
+
+void input_diff_init(struct input_diff *diff,
+                     const struct hid_decoder *decoder) {
+  memset(diff, 0, sizeof(*diff));
+  diff->decoder = decoder;
+  for (int i = 0; i < HID_MAX_VALUES; ++i) {
+    diff->deadband[i] = INFINITY;
+  }
+  for (int i = 0; i < decoder->num_fields; ++i) {
+    const struct hid_field *field = &decoder->fields[i];
+    const struct hid_value_info *info = &decoder->values[field->value_index];
+    if (info->usage_page == HID_USAGE_PAGE_SENSORS || info->bit_size >= 32) {
+      continue;
+    }
+    const float range =
+        fabsf(field->scale) *
+        (float)((int64_t)info->logical_maximum - info->logical_minimum);
+    diff->deadband[field->value_index] = INPUT_DEFAULT_DEADBAND * range;
+  }
+  input_update_watched(diff);
+}
+
+void input_diff_set_deadband(struct input_diff *diff, int value_index,
+                             float deadband) {
+  if (value_index < 0 || value_index >= HID_MAX_VALUES) {
+    return;
+  }
+  diff->deadband[value_index] = deadband < 0.0f ? INFINITY : deadband;
+  diff->emitted[value_index] = diff->state.values[value_index];
+  input_update_watched(diff);
+}
+
+// Whether any watched byte differs from the previous report.
+static int input_changed(const uint8_t *report, const uint8_t *previous,
+                         const uint8_t *watched, int length) {
+  v16u8 changed = {0};
+  for (int i = 0; i < length; i += 16) {
+    changed |= (v16_load(report + i) ^ v16_load(previous + i)) &
+               v16_load(watched + i);
+  }
+  const v2u64 folded = (v2u64)changed;
+  return (folded[0] | folded[1]) != 0;
+}
+
+int input_diff_report(struct input_diff *diff, const struct report *report,
+                      struct input_event *events) {
+  const struct hid_decoder *decoder = diff->decoder;
+  ++diff->reports;
+  if (report->length == 0) {
+    return 0;
+  }
+  const uint8_t report_id = decoder->uses_report_ids ? report->data[0] : 0;
+  const int index = decoder->report_index[report_id];
+  if (index == 0xff) {
+    return 0;
+  }
+  // Bytes past the report are zero in both, whatever the slot held before.
+  _Alignas(16) uint8_t data[REPORT_MAX_SIZE] = {0};
+  const int length = report->length;
+  memcpy(data, report->data, length);
+  const int rounded = (length + 15) & ~15;
+  if (diff->has_previous[index] &&
+      !input_changed(data, diff->previous[index], diff->watched[index],
+                     rounded)) {
+    ++diff->unchanged;
+    return 0;
+  }
+  memcpy(diff->previous[index], data, sizeof(data));
+  if (hid_decode(decoder, report->data, length, &diff->state) < 0) {
+    return 0;
+  }
+  if (!diff->has_previous[index]) {
+    // Baseline only.
+    diff->has_previous[index] = 1;
+    diff->buttons = (diff->buttons & ~decoder->reports[index].button_mask) |
+                    (diff->state.buttons & decoder->reports[index].button_mask);
+    for (int i = 0; i < decoder->reports[index].num_fields; ++i) {
+      const int value_index =
+          decoder->fields[decoder->reports[index].first_field + i].value_index;
+      diff->emitted[value_index] = diff->state.values[value_index];
+    }
+    return 0;
+  }
+
+  int count = 0;
+  uint32_t changed = diff->buttons ^ diff->state.buttons;
+  while (changed != 0) {
+    const int button = __builtin_ctz(changed);
+    changed &= changed - 1;
+    const int pressed = (diff->state.buttons >> button) & 1;
+    events[count++] = (struct input_event){
+        .timestamp_ns = report->timestamp_ns,
+        .type = pressed ? INPUT_PRESS : INPUT_RELEASE,
+        .report_id = report_id,
+        .index = (uint16_t)button,
+        .value = (float)pressed,
+    };
+  }
+  diff->buttons = diff->state.buttons;
+
+  // Four values per compare. Unwatched values have an infinite deadband and
+  // never pass, nor do values of other reports, which did not move.
+  for (int i = 0; i < decoder->num_values; i += 4) {
+    const v4f delta = v4_abs(v4_load(diff->state.values + i) -
+                             v4_load(diff->emitted + i));
+    const v4i moved = delta > v4_load(diff->deadband + i);
+    if ((moved[0] | moved[1] | moved[2] | moved[3]) == 0) {
+      continue;
+    }
+    for (int lane = 0; lane < 4 && i + lane < decoder->num_values; ++lane) {
+      if (moved[lane] == 0) {
+        continue;
+      }
+      const float value = diff->state.values[i + lane];
+      diff->emitted[i + lane] = value;
+      events[count++] = (struct input_event){
+          .timestamp_ns = report->timestamp_ns,
+          .type = INPUT_AXIS,
+          .report_id = report_id,
+          .index = (uint16_t)(i + lane),
+          .value = value,
+      };
+    }
+  }
+  diff->events += count;
+  return count;
+}
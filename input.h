@@ -0,0 +1,74 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stdint.h>
+
+#include "hid.h"
+#include "ring.h"
+
+// Turns a stream of reports into sparse input events: button presses and
+// releases, and analog values moving by more than their deadband. Most
+// reports carry no input change (only the IMU moves at 1 kHz), so each one is
+// first compared with the previous report of the same ID, 16 bytes at a time
+// and only on the bytes holding watched fields. Reports that differ nowhere
+// there cost a handful of vector operations and are never decoded.
+
+#define INPUT_MAX_EVENTS (HID_MAX_BUTTONS + HID_MAX_VALUES)
+// Per value default deadband, as a fraction of its physical range.
+#define INPUT_DEFAULT_DEADBAND 0.01f
+
+enum input_event_type {
+  INPUT_PRESS,
+  INPUT_RELEASE,
+  INPUT_AXIS,
+};
+
+struct input_event {
+  // Of the report the change came with.
+  uint64_t timestamp_ns;
+  uint8_t type;
+  uint8_t report_id;
+  // Button number for presses and releases, value index for axes.
+  uint16_t index;
+  // New value of an axis, 1 or 0 for buttons.
+  float value;
+};
+
+struct input_diff {
+  const struct hid_decoder *decoder;
+  // Bytes of every report, by report index, holding a button or a watched
+  // value.
+  _Alignas(16) uint8_t watched[HID_MAX_REPORTS][REPORT_MAX_SIZE];
+  _Alignas(16) uint8_t previous[HID_MAX_REPORTS][REPORT_MAX_SIZE];
+  uint8_t has_previous[HID_MAX_REPORTS];
+  // Change needed for an axis event, infinite for values that are not
+  // watched.
+  _Alignas(16) float deadband[HID_MAX_VALUES];
+  // Value each axis had when its last event was sent.
+  _Alignas(16) float emitted[HID_MAX_VALUES];
+  uint32_t buttons;
+  struct hid_state state;
+  // Reports seen, reports skipped by the byte compare, events produced.
+  uint64_t reports;
+  uint64_t unchanged;
+  uint64_t events;
+};
+
+// Watches the buttons and every value but the Sensors page (the IMU) and
+// fields of 32 bits or more (timestamps and counters), with a deadband of
+// INPUT_DEFAULT_DEADBAND of their range. The decoder must outlive the diff.
+void input_diff_init(struct input_diff *diff,
+                     const struct hid_decoder *decoder);
+
+// Sets the deadband of a value, in decoded units. A negative deadband stops
+// watching it.
+void input_diff_set_deadband(struct input_diff *diff, int value_index,
+                             float deadband);
+
+// Compares a report with the previous one of the same ID and writes the
+// events it brings to `events`, which holds INPUT_MAX_EVENTS. The first
+// report of each ID only sets the baseline. Returns the number of events.
+int input_diff_report(struct input_diff *diff, const struct report *report,
+                      struct input_event *events);
+
+#endif // INPUT_H
@@ -0,0 +1,299 @@
+#include "logger.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "monotonic.h"
+#include "ring.h"
+
+struct logger_format_info {
+  int error;
+  // printf style, without length modifiers: integer arguments are always 64
+  // bits and floating point ones doubles.
+  const char *text;
+};
+
+static const struct logger_format_info logger_formats[LOGGER_NUM_FORMATS] = {
+    [LOGGER_INPUT_PRESS] = {0, "0x%04x press %d"},
+    [LOGGER_INPUT_RELEASE] = {0, "0x%04x release %d"},
+    [LOGGER_INPUT_AXIS] = {0, "0x%04x axis %d %.4g"},
+    [LOGGER_TRANSFER_ERROR] = {1, "0x%04x 0x%02x: transfer failed with "
+                                  "status %d"},
+    [LOGGER_RESUBMIT_ERROR] = {1, "0x%04x 0x%02x: unable to resubmit a "
+                                  "transfer: error %d"},
+};
+
+// Single-producer/single-consumer, like the report rings: the producer is
+// the thread the buffer was handed to, the consumer the background thread.
+struct logger_buffer {
+  _Alignas(RING_CACHE_LINE) atomic_size_t head;
+  _Alignas(RING_CACHE_LINE) atomic_size_t tail;
+  _Alignas(RING_CACHE_LINE) struct logger_record records[LOGGER_BUFFER_SIZE];
+};
+
+static struct {
+  _Atomic(struct logger_buffer *) buffers;
+  // Buffers handed out so far. Never reset, a thread keeps its buffer index
+  // for its whole life.
+  atomic_int num_buffers;
+  atomic_uint_least64_t dropped;
+  atomic_int running;
+  // Raw records go there, NULL to format them.
+  FILE *file;
+  pthread_t thread;
+} logger;
+
+static _Thread_local int logger_thread = -1;
+
+atomic_int logger_enabled = 0;
+
+void logger_write(enum logger_format format, const union logger_arg *args,
+                  int num_args) {
+  struct logger_buffer *buffers =
+      atomic_load_explicit(&logger.buffers, memory_order_acquire);
+  if (buffers == NULL) {
+    return;
+  }
+  if (logger_thread < 0) {
+    logger_thread = atomic_fetch_add(&logger.num_buffers, 1);
+  }
+  if (logger_thread >= LOGGER_MAX_THREADS) {
+    atomic_fetch_add_explicit(&logger.dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  struct logger_buffer *buffer = &buffers[logger_thread];
+  const size_t head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&buffer->tail, memory_order_acquire) ==
+      LOGGER_BUFFER_SIZE) {
+    atomic_fetch_add_explicit(&logger.dropped, 1, memory_order_relaxed);
+    return;
+  }
+  struct logger_record *record =
+      &buffer->records[head & (LOGGER_BUFFER_SIZE - 1)];
+  record->timestamp_ns = monotonic_ns();
+  record->format = (uint16_t)format;
+  record->thread = (uint16_t)logger_thread;
+  record->reserved = 0;
+  for (int i = 0; i < LOGGER_MAX_ARGS; ++i) {
+    record->args[i] = i < num_args ? args[i] : (union logger_arg){0};
+  }
+  atomic_store_explicit(&buffer->head, head + 1, memory_order_release);
+}
+
+static void logger_print(const struct logger_record *record) {
+  char text[256];
+  if (logger_format_record(record, text, sizeof(text)) >= 0) {
+    fprintf(logger_is_error(record) ? stderr : stdout, "%s\n", text);
+  }
+}
+
+// Empties every buffer, returns the number of records written out.
+static size_t logger_drain(struct logger_buffer *buffers) {
+  int num_buffers = atomic_load(&logger.num_buffers);
+  if (num_buffers > LOGGER_MAX_THREADS) {
+    num_buffers = LOGGER_MAX_THREADS;
+  }
+  size_t drained = 0;
+  for (int i = 0; i < num_buffers; ++i) {
+    struct logger_buffer *buffer = &buffers[i];
+    const size_t head =
+        atomic_load_explicit(&buffer->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&buffer->tail, memory_order_relaxed);
+    while (tail != head) {
+      const size_t index = tail & (LOGGER_BUFFER_SIZE - 1);
+      // Up to the end of the buffer in one go.
+      size_t count = LOGGER_BUFFER_SIZE - index;
+      if (count > head - tail) {
+        count = head - tail;
+      }
+      if (logger.file != NULL) {
+        fwrite(&buffer->records[index], sizeof(struct logger_record), count,
+               logger.file);
+      } else {
+        for (size_t j = 0; j < count; ++j) {
+          logger_print(&buffer->records[index + j]);
+        }
+      }
+      tail += count;
+      drained += count;
+    }
+    atomic_store_explicit(&buffer->tail, tail, memory_order_release);
+  }
+  if (drained > 0) {
+    fflush(logger.file != NULL ? logger.file : stdout);
+  }
+  return drained;
+}
+
+static void *logger_main(void *arg) {
+  struct logger_buffer *buffers = arg;
+  while (atomic_load_explicit(&logger.running, memory_order_acquire)) {
+    if (logger_drain(buffers) == 0) {
+      const struct timespec pause = {.tv_sec = 0, .tv_nsec = 2000000};
+      nanosleep(&pause, NULL);
+    }
+  }
+  // What was logged while stopping.
+  logger_drain(buffers);
+  return NULL;
+}
+
+int logger_start(const char *path) {
+  logger.file = NULL;
+  if (path != NULL) {
+    logger.file = fopen(path, "wb");
+    if (logger.file == NULL) {
+      fprintf(stderr, "%s:%d: unable to open %s\n", __FILE__, __LINE__, path);
+      return -1;
+    }
+    struct logger_file_header header = {
+        .version = LOGGER_VERSION,
+        .record_size = sizeof(struct logger_record),
+    };
+    memcpy(header.magic, LOGGER_MAGIC, sizeof(header.magic));
+    if (fwrite(&header, sizeof(header), 1, logger.file) != 1) {
+      fprintf(stderr, "%s:%d: unable to write to %s\n", __FILE__, __LINE__,
+              path);
+      fclose(logger.file);
+      logger.file = NULL;
+      return -1;
+    }
+  }
+
+  struct logger_buffer *buffers = aligned_alloc(
+      RING_CACHE_LINE, LOGGER_MAX_THREADS * sizeof(struct logger_buffer));
+  if (buffers == NULL) {
+    fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+    if (logger.file != NULL) {
+      fclose(logger.file);
+      logger.file = NULL;
+    }
+    return -1;
+  }
+  for (int i = 0; i < LOGGER_MAX_THREADS; ++i) {
+    atomic_init(&buffers[i].head, 0);
+    atomic_init(&buffers[i].tail, 0);
+  }
+  atomic_store(&logger.dropped, 0);
+  atomic_store(&logger.running, 1);
+  if (pthread_create(&logger.thread, NULL, logger_main, buffers) != 0) {
+    fprintf(stderr, "%s:%d: unable to start the logger thread\n", __FILE__,
+            __LINE__);
+    atomic_store(&logger.running, 0);
+    free(buffers);
+    if (logger.file != NULL) {
+      fclose(logger.file);
+      logger.file = NULL;
+    }
+    return -1;
+  }
+  atomic_store_explicit(&logger.buffers, buffers, memory_order_release);
+  atomic_store(&logger_enabled, 1);
+  return 0;
+}
+
+uint64_t logger_stop(void) {
+  struct logger_buffer *buffers = atomic_load(&logger.buffers);
+  if (buffers == NULL) {
+    return 0;
+  }
+  // The threads that log are expected to be done by now, later records are
+  // ignored.
+  atomic_store(&logger_enabled, 0);
+  atomic_store(&logger.buffers, NULL);
+  atomic_store_explicit(&logger.running, 0, memory_order_release);
+  pthread_join(logger.thread, NULL);
+  free(buffers);
+  if (logger.file != NULL) {
+    fclose(logger.file);
+    logger.file = NULL;
+  }
+  return atomic_load(&logger.dropped);
+}
+
+int logger_format_record(const struct logger_record *record, char *out,
+                         size_t size) {
+  if (record->format >= LOGGER_NUM_FORMATS) {
+    return -1;
+  }
+  const char *text = logger_formats[record->format].text;
+  size_t length = 0;
+  int arg = 0;
+  while (*text != '\0') {
+    if (text[0] != '%' || text[1] == '%') {
+      if (length + 1 < size) {
+        out[length] = text[0];
+      }
+      ++length;
+      text += text[0] == '%' ? 2 : 1;
+      continue;
+    }
+    // Flags, width and precision are kept, the length is made to fit the
+    // argument.
+    char spec[16];
+    size_t spec_length = 0;
+    spec[spec_length++] = *text++;
+    while (*text != '\0' && strchr("-+ #.0123456789", *text) != NULL &&
+           spec_length < sizeof(spec) - 4) {
+      spec[spec_length++] = *text++;
+    }
+    const char conversion = *text;
+    if (conversion == '\0') {
+      break;
+    }
+    ++text;
+    const union logger_arg value =
+        arg < LOGGER_MAX_ARGS ? record->args[arg] : (union logger_arg){0};
+    ++arg;
+
+    char *cursor = length < size ? out + length : NULL;
+    const size_t available = length < size ? size - length : 0;
+    int written;
+    switch (conversion) {
+    case 'd':
+    case 'i':
+    case 'u':
+    case 'o':
+    case 'x':
+    case 'X':
+      spec[spec_length++] = 'l';
+      spec[spec_length++] = 'l';
+      spec[spec_length++] = conversion;
+      spec[spec_length] = '\0';
+      written = conversion == 'd' || conversion == 'i'
+                    ? snprintf(cursor, available, spec, (long long)value.i)
+                    : snprintf(cursor, available, spec,
+                               (unsigned long long)value.u);
+      break;
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'F':
+    case 'g':
+    case 'G':
+      spec[spec_length++] = conversion;
+      spec[spec_length] = '\0';
+      written = snprintf(cursor, available, spec, value.f);
+      break;
+    default:
+      return -1;
+    }
+    if (written < 0) {
+      return -1;
+    }
+    length += (size_t)written;
+  }
+  if (size > 0) {
+    out[length < size ? length : size - 1] = '\0';
+  }
+  return (int)length;
+}
+
+int logger_is_error(const struct logger_record *record) {
+  return record->format < LOGGER_NUM_FORMATS &&
+         logger_formats[record->format].error;
+}
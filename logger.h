@@ -0,0 +1,96 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Logging from threads that must not block. A call only copies a fixed size
+// record (format, timestamp, arguments) into a buffer owned by the calling
+// thread; a background thread formats the records, or writes them as they
+// are to a file that tools/logdump reads back. When a buffer is full the
+// record is dropped and counted, the caller never waits.
+#define LOGGER_MAGIC "PSVR2LOG"
+#define LOGGER_VERSION 1
+#define LOGGER_MAX_ARGS 4
+// Threads that can log, each gets a buffer on its first record.
+#define LOGGER_MAX_THREADS 8
+// Records per thread, must be a power of two.
+#define LOGGER_BUFFER_SIZE 4096
+
+// Message formats, referred to by their index in the records. Only ever add
+// to the end so older log files still decode.
+enum logger_format {
+  LOGGER_INPUT_PRESS,
+  LOGGER_INPUT_RELEASE,
+  LOGGER_INPUT_AXIS,
+  LOGGER_TRANSFER_ERROR,
+  LOGGER_RESUBMIT_ERROR,
+  LOGGER_NUM_FORMATS,
+};
+
+union logger_arg {
+  int64_t i;
+  uint64_t u;
+  double f;
+};
+
+struct logger_record {
+  // Host CLOCK_MONOTONIC time of the call.
+  uint64_t timestamp_ns;
+  uint16_t format;
+  // Buffer the record went through, so one per thread.
+  uint16_t thread;
+  uint32_t reserved;
+  union logger_arg args[LOGGER_MAX_ARGS];
+};
+
+struct logger_file_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+};
+
+_Static_assert(sizeof(struct logger_record) == 48,
+               "logger record layout changed");
+_Static_assert(sizeof(struct logger_file_header) == 16,
+               "logger file header layout changed");
+
+// Starts the background thread. With a NULL `path` records are formatted to
+// stdout (stderr for errors), otherwise they are appended raw to `path`.
+// Returns 0 or -1 (with a message on stderr).
+int logger_start(const char *path);
+// Writes out whatever is left and stops the thread. Returns the number of
+// records dropped because a buffer was full.
+uint64_t logger_stop(void);
+
+// Set while the logger is started. LOGGER() checks it before anything else,
+// so logging costs a relaxed load when nothing asked for it.
+extern atomic_int logger_enabled;
+
+// Any thread: never blocks nor allocates. Does nothing unless started.
+void logger_write(enum logger_format format, const union logger_arg *args,
+                  int num_args);
+
+// Formats the message of a record without the trailing newline. Returns the
+// length snprintf would, or -1 for an unknown format.
+int logger_format_record(const struct logger_record *record, char *out,
+                         size_t size);
+// Whether the record is an error rather than plain output.
+int logger_is_error(const struct logger_record *record);
+
+#define LOGGER_INT(x) ((union logger_arg){.i = (int64_t)(x)})
+#define LOGGER_UINT(x) ((union logger_arg){.u = (uint64_t)(x)})
+#define LOGGER_FLOAT(x) ((union logger_arg){.f = (double)(x)})
+
+// LOGGER(LOGGER_INPUT_AXIS, LOGGER_UINT(id), LOGGER_INT(i), LOGGER_FLOAT(v))
+#define LOGGER(format, ...)                                                    \
+  do {                                                                         \
+    if (atomic_load_explicit(&logger_enabled, memory_order_relaxed)) {         \
+      logger_write(format, (const union logger_arg[]){__VA_ARGS__},           \
+                   sizeof((union logger_arg[]){__VA_ARGS__}) /                 \
+                       sizeof(union logger_arg));                              \
+    }                                                                          \
+  } while (0)
+
+#endif // LOGGER_H
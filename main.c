@@ -1,12 +1,40 @@
+#include <errno.h>
+#include <getopt.h>
 #include <libusb-1.0/libusb.h>
+#include <math.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
 
-// SONY DEVICE STUFF
-#define SONY_VENDOR_ID 0x054c
-#define RIGHT_SENSE_CONTROLLER_DEVICE_ID 0x0e46
-#define LEFT_SENSE_CONTROLLER_DEVICE_ID 0x0e45
-#define PSVR2_DEVICE_ID 0x0cde
+#include "capture.h"
+#include "clock_sync.h"
+#include "discovery.h"
+#include "haptics.h"
+#include "hid.h"
+#include "hidraw.h"
+#include "histogram.h"
+#include "imu.h"
+#include "input.h"
+#include "logger.h"
+#include "merge.h"
+#include "monotonic.h"
+#include "output.h"
+#include "pose.h"
+#include "probe.h"
+#include "replay.h"
+#include "ring.h"
+#include "shared_state.h"
+#include "sim.h"
+#include "sony.h"
+#include "stream.h"
+#include "transfer_pool.h"
+#include "usb_loop.h"
+#include "usb_thread.h"
 
 // ENDPOINT STUFF
 #define ENDPOINT_TYPE_CONTROL 0
@@ -93,358 +121,2147 @@ void display_endpoint_attributes(const unsigned char attribute) {
   }
 }
 
-void print_strinf_from_index(libusb_device_handle *dev_handle,
-                             unsigned char index) {
-  char buf[256];
-  int r = libusb_get_string_descriptor_ascii(dev_handle, index,
-                                             (unsigned char *)buf, sizeof(buf));
-  if (r > 0) {
-    printf(" %s", buf);
+void print_device_descriptor(const struct libusb_device_descriptor *dev_desc) {
+  printf(" Device Descriptor: (Length: %d)\n", dev_desc->bLength);
+  printf("  Vendor ID: 0x%04x\n", dev_desc->idVendor);
+  printf("  Product ID: 0x%04x\n", dev_desc->idProduct);
+  printf("  USB Class: 0x%02x\n", dev_desc->bDeviceClass);
+  printf("  USB Subclass: 0x%02x\n", dev_desc->bDeviceSubClass);
+  printf("  USB Protocol: 0x%02x\n", dev_desc->bDeviceProtocol);
+  printf("  Max Packet Size 0: 0x%02x\n", dev_desc->bMaxPacketSize0);
+  printf("  Number of possible configurations: %d\n",
+         dev_desc->bNumConfigurations);
+  printf("  Manufacturer string index: %d\n", dev_desc->iManufacturer);
+  printf("  Product string index: %d\n", dev_desc->iProduct);
+  printf("  Serial Number string index: %d\n", dev_desc->iSerialNumber);
+  printf("  bcdUSB: 0x%04x\n", dev_desc->bcdUSB);
+  printf("  bcdDevice: 0x%04x\n", dev_desc->bcdDevice);
+}
+
+// Prints the name of the known Sony devices. Returns 0 if the device is one
+// of them and should be investigated further, 1 otherwise.
+char identify_device(const struct libusb_device_descriptor *dev_desc) {
+  char investigate = 1;
+  if (dev_desc->idVendor == SONY_VENDOR_ID) {
+    switch (dev_desc->idProduct) {
+    case RIGHT_SENSE_CONTROLLER_DEVICE_ID:
+      printf("  Sony Corp. PlayStation VR2 Sense Controller (R)\n");
+      investigate = 0;
+      break;
+    case LEFT_SENSE_CONTROLLER_DEVICE_ID:
+      printf("  Sony Corp. PlayStation VR2 Sense Controller (L)\n");
+      investigate = 0;
+      break;
+    case PSVR2_DEVICE_ID:
+      printf("  Sony Corp. BillBoard Device\n");
+      investigate = 0;
+      break;
+    }
   }
+  return investigate;
 }
 
-void transfer_callback(struct libusb_transfer *transfer) {
-  if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
-    // Process received data from transfer->buffer
-    printf("Received data: %s\n", (char *)transfer->buffer);
-  } else {
-    // Handle transfer error or failure
-    printf("Transfer failed with status: %d\n", transfer->status);
+// `configuration_name` may be NULL.
+void print_config_descriptor(const struct libusb_config_descriptor *config,
+                             const char *configuration_name) {
+  int num_endpoints = 0;
+  printf(" Config Descriptor:\n");
+  printf("   Number of interfaces: %d", config->bNumInterfaces);
+  if (configuration_name != NULL) {
+    printf(" %s", configuration_name);
+  }
+  printf("\n");
+  if (config->extra_length > 0) {
+    printf(" Extra Length: %d\n", config->extra_length);
+    for (int k = 0; k < config->extra_length; ++k) {
+      printf("   %d", config->extra[k]);
+    }
+  }
+
+  printf("    Attribute: %d (Self-Powered %d, Remote Wakeup %d) \n",
+         config->bmAttributes, (config->bmAttributes & 0x20),
+         (config->bmAttributes & 0x10));
+  printf("    Max Power: %dmA (SuperSpeed mode: %dmA)\n", config->MaxPower * 2,
+         config->MaxPower * 8);
+  for (int i = 0; i < config->bNumInterfaces; ++i) {
+    const struct libusb_interface *interface = &config->interface[i];
+    for (int j = 0; j < interface->num_altsetting; ++j) {
+      const struct libusb_interface_descriptor *altsetting =
+          &interface->altsetting[j];
+      printf("\n    Interface #%d: Length:%d Type:%d Alternate "
+             "Setting: %d "
+             "Class: %d SubClass: %d Protocol: %d SDesc.: %d",
+             altsetting->bInterfaceNumber, altsetting->bLength,
+             altsetting->bDescriptorType, altsetting->bAlternateSetting,
+             altsetting->bInterfaceClass, altsetting->bInterfaceSubClass,
+             altsetting->bInterfaceProtocol, altsetting->iInterface);
+      if (altsetting->extra_length > 0) {
+        printf(" Extra Length: %d\n", altsetting->extra_length);
+        for (int k = 0; k < altsetting->extra_length; ++k) {
+          printf("   %d", altsetting->extra[k]);
+        }
+        printf("\n");
+      }
+      for (int k = 0; k < altsetting->bNumEndpoints; ++k) {
+        const struct libusb_endpoint_descriptor *endpoint =
+            &altsetting->endpoint[k];
+
+        printf("     Endpoint %d: ", num_endpoints++);
+
+        display_endpoint_address(endpoint->bEndpointAddress);
+        display_endpoint_attributes(endpoint->bmAttributes);
+
+        printf(", Maximum Packet Size=%d, Extra Length=%d (i:%d, j:%d, "
+               "k:%d)\n",
+               // endpoint->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK,
+               convert_word(endpoint->wMaxPacketSize), endpoint->extra_length,
+               i, j, k);
+      }
+    }
+  }
+}
+
+// Prints everything known about a device the first time it is seen: its
+// descriptors, strings and BOS capabilities.
+void describe_device(libusb_device *dev, libusb_device_handle *dev_handle,
+                     const struct libusb_config_descriptor *config,
+                     const char *port_path) {
+  struct libusb_device_descriptor dev_desc;
+  int r;
+
+  printf("Opened device on port %s\n", port_path);
+  r = libusb_get_device_descriptor(dev, &dev_desc);
+  if (r == LIBUSB_SUCCESS) {
+    print_device_descriptor(&dev_desc);
+
+    char buf[256];
+    r = libusb_get_string_descriptor_ascii(dev_handle, dev_desc.iManufacturer,
+                                           (unsigned char *)buf, sizeof(buf));
+    if (r >= 0) {
+      printf("  Manufacturer: %s\n", buf);
+    }
+
+    r = libusb_get_string_descriptor_ascii(dev_handle, dev_desc.iProduct,
+                                           (unsigned char *)buf, sizeof(buf));
+    if (r >= 0) {
+      printf("  Product: %s\n", buf);
+    }
+
+    r = libusb_get_string_descriptor_ascii(dev_handle, dev_desc.iSerialNumber,
+                                           (unsigned char *)buf, sizeof(buf));
+    if (r >= 0) {
+      printf("  Serial Number: %s\n", buf);
+    }
+
+    identify_device(&dev_desc);
+    // // list all string available on the device.
+    // for (uint8_t i = 0; i < 255; ++i) {
+    //   r = libusb_get_string_descriptor_ascii(
+    //       dev_handle, i, (unsigned char *)buf, sizeof(buf));
+    //   if (r >= 0) {
+    //     printf("%i : %s\n", i, buf);
+    //   }
+    // }
+    switch (dev_desc.bDeviceClass) {
+    case LIBUSB_CLASS_HUB:
+      printf("HUB!!!\n");
+      break;
+    case LIBUSB_CLASS_VENDOR_SPEC:
+      printf("Vendor Specific!!!\n");
+      break;
+    }
   }
 
-  // Free the transfer structure
-  libusb_free_transfer(transfer);
+  // List the device's config descriptor
+  char name[256];
+  r = libusb_get_string_descriptor_ascii(dev_handle, config->iConfiguration,
+                                         (unsigned char *)name, sizeof(name));
+  print_config_descriptor(config, r > 0 ? name : NULL);
+
+  // List the device's bos configuration
+  struct libusb_bos_descriptor *bos;
+  r = libusb_get_bos_descriptor(dev_handle, &bos);
+  if (r == LIBUSB_SUCCESS) {
+    printf(" BOS Descriptor:\n");
+    printf("  Device on port %s has BOS descriptor:\n", port_path);
+    printf("  Length: %d\n", bos->bLength);
+    printf("  Descriptor Type: %d\n", bos->bDescriptorType);
+    printf("  Total Length: %d\n", convert_word(bos->wTotalLength));
+    printf("  Number of device capabilities: %d\n", bos->bNumDeviceCaps);
+    for (int k = 0; k < bos->bNumDeviceCaps; ++k) {
+      struct libusb_bos_dev_capability_descriptor *dev_capability =
+          bos->dev_capability[k];
+      printf("   BOS Capability %d: Length: %d Descriptor Type %d Dev "
+             "Capability Type: %d\n",
+             k, dev_capability->bLength, dev_capability->bDescriptorType,
+             dev_capability->bDevCapabilityType);
+      if (dev_capability->bLength > 3) {
+        printf("    Data:");
+        for (int l = 0; l < dev_capability->bLength - 3; ++l) {
+          printf("  %d", dev_capability->dev_capability_data[l]);
+        }
+        printf("\n");
+      }
+      printf("\n");
+    }
+    // Explore the device capabilities here
+    libusb_free_bos_descriptor(bos);
+  }
 }
 
-void reactivate_kernel_driver(libusb_device_handle *dev_handle) {
+// Every IN endpoint being streamed, with what is needed to tear it down.
+// Replayed endpoints only have a ring, their stream and device handle are
+// NULL.
+struct endpoint_stream {
+  uint16_t product_id;
+  uint8_t endpoint;
+  // Empty for replayed and simulated endpoints.
+  char port_path[DISCOVERY_PORT_PATH_SIZE];
+  // A stream outlives its device: when the controller comes back on the same
+  // port it continues with the same ring and decoder.
+  int connected;
+  libusb_device_handle *dev_handle;
+  int interface_number;
+  struct stream *stream;
+  struct report_ring *ring;
+  // NULL when the report descriptor of the device is not known.
+  uint8_t *report_descriptor;
+  int report_descriptor_length;
+  struct hid_decoder *decoder;
+  // Button and axis changes, NULL without a decoder.
+  struct input_diff *input;
+  // IMU_LEFT or IMU_RIGHT for Sense controllers with IMU fields, -1 otherwise.
+  int controller;
+  struct imu_channels imu_channels;
+  uint64_t last_imu_ns;
+  // Maps the device clock of the reports to host time, NULL when they carry
+  // none. Decoded samples are timed with it rather than by their arrival.
+  struct clock_sync *clock;
+  uint64_t last_sample_ns;
+  // Consumer side bookkeeping. `reports` restarts with every summary.
+  uint64_t reports;
+  uint64_t total_reports;
+  struct report last_report;
+  struct hid_state state;
+  // Timing of the report path since the start, shown with --stats. Recorded
+  // by the USB thread for the submit latency, by the consumer for the rest.
+  struct histogram submit_latency;
+  // Between the callbacks of consecutive reports.
+  struct histogram interval;
+  // From the callback to the consumer picking the report up.
+  struct histogram handoff;
+  // Between the device sample times of consecutive reports.
+  struct histogram sample_interval;
+};
+
+#define MAX_ENDPOINT_STREAMS 8
+struct endpoint_stream endpoint_streams[MAX_ENDPOINT_STREAMS];
+int num_endpoint_streams = 0;
+
+// Samples longer apart than this restart the integration instead.
+#define IMU_MAX_DT 0.1f
+struct imu_fusion imu_fusion;
+struct imu_batch imu_batch;
+// Orientation of the controllers for any thread, ahead of the latest sample.
+struct pose_predictor pose_predictor;
+
+// Print the timing histograms with the summaries.
+int show_stats = 0;
+// Print every input event as it comes.
+int show_events = 0;
+// Where the device clock is in the reports, given with --device-clock. Found
+// by its usage in the report descriptor otherwise.
+struct clock_field device_clock = {.bit_size = 0};
+
+// Both controllers joined into frames with --merge, frame rate 0 otherwise.
+double merge_rate_hz = 0.0;
+enum merge_mode merge_mode = MERGE_INTERPOLATE;
+// A hand this late is held in the frames rather than waited for: ten
+// reports of a controller, and the most a frame can be delayed by.
+#define MERGE_STALE_NS 10000000ull
+struct merge merge;
+struct merge_frame last_merge_frame;
+// From the time of a frame to it being given out, shown with --stats.
+struct histogram merge_latency;
+
+// Latest state and recent reports of every stream for other processes, with
+// --publish. Not mapped otherwise, which makes publishing a no-op.
+struct shared_state shared_state;
+int num_published_streams = 0;
+
+// The isochronous audio output of a controller, which drives its haptics.
+struct haptic_output {
+  uint16_t product_id;
+  char port_path[DISCOVERY_PORT_PATH_SIZE];
+  libusb_device_handle *dev_handle;
+  int interface_number;
+  struct haptics *haptics;
+  uint64_t next_pulse_ns;
+};
+
+#define MAX_HAPTIC_OUTPUTS 4
+struct haptic_output haptic_outputs[MAX_HAPTIC_OUTPUTS];
+int num_haptic_outputs = 0;
+// Opening the audio interface takes it away from the kernel's sound driver,
+// so only done when asked.
+int enable_haptics = 0;
+
+// The interrupt OUT endpoint of a controller, for its lights and rumble.
+struct feedback_output {
+  uint16_t product_id;
+  libusb_device_handle *dev_handle;
+  int interface_number;
+  struct output *output;
+};
+
+#define MAX_FEEDBACK_OUTPUTS 4
+struct feedback_output feedback_outputs[MAX_FEEDBACK_OUTPUTS];
+int num_feedback_outputs = 0;
+// Cycle the lights of the controllers, to check the output path.
+int enable_feedback = 0;
+
+// The interfaces claimed on the open device handles. Streams and outputs
+// sharing an interface each hold a claim on it: the kernel driver is detached
+// for the first and reattached when the last one releases the interface.
+struct claimed_interface {
+  libusb_device_handle *dev_handle;
+  int interface_number;
+  int claims;
+  int driver_detached;
+};
+
+#define MAX_CLAIMED_INTERFACES                                                 \
+  (MAX_ENDPOINT_STREAMS + MAX_HAPTIC_OUTPUTS + MAX_FEEDBACK_OUTPUTS)
+struct claimed_interface claimed_interfaces[MAX_CLAIMED_INTERFACES];
+int num_claimed_interfaces = 0;
+
+// The transfers of every device seen, by port as discovery remembers them.
+// They are recycled by its streams and outputs, and again when the device
+// comes back: only its device memory goes with the handle.
+struct device_pool {
+  uint16_t product_id;
+  char port_path[DISCOVERY_PORT_PATH_SIZE];
+  // NULL while the device is away.
+  libusb_device_handle *dev_handle;
+  struct transfer_pool *pool;
+};
+
+struct device_pool device_pools[DISCOVERY_MAX_DEVICES];
+int num_device_pools = 0;
+
+// The hidraw nodes being read with --hidraw, NULL otherwise. Its sources are
+// the endpoint streams, in the same order.
+struct hidraw *hidraw_backend = NULL;
+// Writes to a hidraw node are not paced by an OUT transfer like output.c
+// sends are, so the lights are refreshed at most this often.
+#define HIDRAW_OUTPUT_INTERVAL_NS 8000000ull
+uint64_t next_hidraw_output_ns = 0;
+
+// With --event-loop, libusb's events are handled by the consumer thread from
+// its own epoll set, `reactor_fd`, rather than on a USB thread. NULL
+// otherwise.
+struct usb_loop *event_loop = NULL;
+int reactor_fd = -1;
+// How long the consumer waits on the reactor before feeding the outputs and
+// printing the summary anyway.
+#define REACTOR_TIMEOUT_MS 1
+
+volatile sig_atomic_t interrupted = 0;
+
+void handle_interrupt(int signum) { interrupted = 1; }
+
+void reset_endpoint_stats(struct endpoint_stream *endpoint_stream) {
+  histogram_reset(&endpoint_stream->submit_latency);
+  histogram_reset(&endpoint_stream->interval);
+  histogram_reset(&endpoint_stream->handoff);
+  histogram_reset(&endpoint_stream->sample_interval);
+}
+
+// Keeps a copy of the report descriptor and compiles it for decoding.
+void attach_report_descriptor(struct endpoint_stream *endpoint_stream,
+                              const uint8_t *descriptor, int length) {
+  endpoint_stream->report_descriptor = malloc(length);
+  endpoint_stream->decoder = malloc(sizeof(struct hid_decoder));
+  if (endpoint_stream->report_descriptor == NULL ||
+      endpoint_stream->decoder == NULL ||
+      hid_compile(descriptor, length, endpoint_stream->decoder) != 0) {
+    printf("Failed to compile the report descriptor\n");
+    free(endpoint_stream->report_descriptor);
+    free(endpoint_stream->decoder);
+    endpoint_stream->report_descriptor = NULL;
+    endpoint_stream->decoder = NULL;
+    return;
+  }
+  memcpy(endpoint_stream->report_descriptor, descriptor, length);
+  endpoint_stream->report_descriptor_length = length;
+  printf("Report descriptor: %d bytes, %d input reports, %d values\n", length,
+         endpoint_stream->decoder->num_reports,
+         endpoint_stream->decoder->num_values);
+
+  endpoint_stream->input = malloc(sizeof(struct input_diff));
+  if (endpoint_stream->input != NULL) {
+    input_diff_init(endpoint_stream->input, endpoint_stream->decoder);
+  }
+
+  struct clock_field field = device_clock;
+  if (field.bit_size == 0) {
+    const int index = hid_find_value(endpoint_stream->decoder,
+                                     HID_USAGE_PAGE_VENDOR,
+                                     HID_USAGE_VENDOR_TIMESTAMP);
+    if (index >= 0) {
+      const struct hid_value_info *info =
+          &endpoint_stream->decoder->values[index];
+      field.report_id =
+          endpoint_stream->decoder->uses_report_ids ? info->report_id : -1;
+      field.bit_offset = info->bit_offset;
+      field.bit_size = info->bit_size;
+    }
+  }
+  if (field.bit_size != 0) {
+    endpoint_stream->clock = malloc(sizeof(struct clock_sync));
+    if (endpoint_stream->clock != NULL) {
+      clock_sync_init(endpoint_stream->clock, &field);
+      printf("Device clock: %d bits at bit %d\n", field.bit_size,
+             field.bit_offset);
+    }
+  }
+
+  endpoint_stream->controller = -1;
+  if (imu_find_channels(endpoint_stream->decoder,
+                        &endpoint_stream->imu_channels) == 0) {
+    if (endpoint_stream->product_id == LEFT_SENSE_CONTROLLER_DEVICE_ID) {
+      endpoint_stream->controller = IMU_LEFT;
+    } else if (endpoint_stream->product_id ==
+               RIGHT_SENSE_CONTROLLER_DEVICE_ID) {
+      endpoint_stream->controller = IMU_RIGHT;
+    }
+  }
+}
+
+void reactivate_kernel_driver(libusb_device_handle *dev_handle,
+                              int interface_number) {
   printf("Reactivating kernel driver.\n");
-  if (libusb_attach_kernel_driver(dev_handle, 0) != LIBUSB_SUCCESS) {
+  if (libusb_attach_kernel_driver(dev_handle, interface_number) !=
+      LIBUSB_SUCCESS) {
     printf("Failed to reactivate kernel driver.\n");
     return;
   }
   printf("Driver reactivated.\n");
 }
 
-void probe_endpoint(const struct libusb_endpoint_descriptor *endpoint,
-                    libusb_device_handle *dev_handle,
-                    const struct libusb_interface_descriptor *altsetting,
-                    libusb_context *ctx) {
-  printf("Probing endpoint: ");
-  char reactivate_kernel = 1;
-  if (libusb_kernel_driver_active(dev_handle, 0) != 0) {
+// Takes a claim on an interface, detaching the kernel driver and claiming it
+// from libusb if nothing holds it yet. Returns 0 or -1.
+int claim_interface(libusb_device_handle *dev_handle, int interface_number) {
+  for (int i = 0; i < num_claimed_interfaces; ++i) {
+    if (claimed_interfaces[i].dev_handle == dev_handle &&
+        claimed_interfaces[i].interface_number == interface_number) {
+      ++claimed_interfaces[i].claims;
+      return 0;
+    }
+  }
+  if (num_claimed_interfaces == MAX_CLAIMED_INTERFACES) {
+    printf("Too many claimed interfaces already.\n");
+    return -1;
+  }
+  int driver_detached = 0;
+  if (libusb_kernel_driver_active(dev_handle, interface_number) != 0) {
     printf("Kernel driver is active!\n");
     printf("Detaching the kernel driver...\n");
-    if (libusb_detach_kernel_driver(dev_handle, 0) != 0) {
+    if (libusb_detach_kernel_driver(dev_handle, interface_number) != 0) {
       fprintf(stderr,
               "%s:%d: unable to detach the kernel driver from the interface "
               "of the USB device\n ",
               __FILE__, __LINE__);
-      return;
+      return -1;
     }
     printf("Done!\n");
-    reactivate_kernel = 0;
+    driver_detached = 1;
   }
-  if (get_endpoint_type(endpoint->bmAttributes) == ENDPOINT_TYPE_INTERRUPT) {
 
-    // Claim the interface associated with the endpoint
-    int result =
-        libusb_claim_interface(dev_handle, altsetting->bInterfaceNumber);
-    if (result < 0) {
-      printf("Failed to claim interface\n");
-      if (reactivate_kernel == 0) {
-        reactivate_kernel_driver(dev_handle);
-      }
+  // Claim the interface associated with the endpoint
+  int result = libusb_claim_interface(dev_handle, interface_number);
+  if (result < 0) {
+    printf("Failed to claim interface\n");
+    if (driver_detached) {
+      reactivate_kernel_driver(dev_handle, interface_number);
+    }
+    return -1;
+  }
+  printf("Interface claimed!\n");
+  struct claimed_interface *claimed =
+      &claimed_interfaces[num_claimed_interfaces++];
+  claimed->dev_handle = dev_handle;
+  claimed->interface_number = interface_number;
+  claimed->claims = 1;
+  claimed->driver_detached = driver_detached;
+  return 0;
+}
+
+// Gives a claim taken with claim_interface back. The last one releases the
+// interface and reattaches the kernel driver if it was detached, unless the
+// device is gone already.
+void release_interface(libusb_device_handle *dev_handle, int interface_number,
+                       int device_present) {
+  for (int i = 0; i < num_claimed_interfaces; ++i) {
+    struct claimed_interface *claimed = &claimed_interfaces[i];
+    if (claimed->dev_handle != dev_handle ||
+        claimed->interface_number != interface_number) {
+      continue;
+    }
+    if (--claimed->claims > 0) {
       return;
     }
-    printf("Interface claimed!\n");
-    printf("Trying to transfer some data\n");
-
-    uint8_t buffer[8]; // TODO: Remove magic value.
-    int transferred;
-
-    result = libusb_interrupt_transfer(dev_handle, endpoint->bEndpointAddress,
-                                       buffer, sizeof(buffer), &transferred,
-                                       TRANSFER_TIMEOUT_MS);
-    if (result == LIBUSB_SUCCESS) {
-      printf("Probing endpoint was a success! %d bytes were "
-             "transfered\n",
-             transferred);
-      for (int i = 0; i < transferred; ++i) {
-        printf("%0x ", buffer[i]);
+    if (device_present) {
+      libusb_release_interface(dev_handle, interface_number);
+      if (claimed->driver_detached) {
+        reactivate_kernel_driver(dev_handle, interface_number);
       }
-      printf("\n");
+    }
+    *claimed = claimed_interfaces[--num_claimed_interfaces];
+    return;
+  }
+}
+
+struct transfer_pool *device_transfer_pool(libusb_device_handle *dev_handle) {
+  for (int i = 0; i < num_device_pools; ++i) {
+    if (device_pools[i].dev_handle == dev_handle) {
+      return device_pools[i].pool;
+    }
+  }
+  return NULL;
+}
+
+// Opens a device handle along with the transfer pool of the device, the one
+// it had before if it was on this port already. Returns 0, or a libusb error
+// code.
+int open_device_handle(const struct discovery_event *event,
+                       libusb_device_handle **dev_handle) {
+  struct device_pool *device_pool = NULL;
+  for (int i = 0; i < num_device_pools; ++i) {
+    if (device_pools[i].product_id == event->product_id &&
+        strcmp(device_pools[i].port_path, event->port_path) == 0) {
+      device_pool = &device_pools[i];
+      break;
+    }
+  }
+  if (device_pool == NULL && num_device_pools == DISCOVERY_MAX_DEVICES) {
+    return LIBUSB_ERROR_NO_MEM;
+  }
+  int result = libusb_open(event->device, dev_handle);
+  if (result != LIBUSB_SUCCESS) {
+    return result;
+  }
+  if (device_pool != NULL) {
+    transfer_pool_attach(device_pool->pool, *dev_handle);
+    device_pool->dev_handle = *dev_handle;
+    return LIBUSB_SUCCESS;
+  }
+  struct transfer_pool *pool = transfer_pool_create(*dev_handle);
+  if (pool == NULL) {
+    libusb_close(*dev_handle);
+    return LIBUSB_ERROR_NO_MEM;
+  }
+  device_pool = &device_pools[num_device_pools++];
+  device_pool->product_id = event->product_id;
+  memcpy(device_pool->port_path, event->port_path,
+         sizeof(device_pool->port_path));
+  device_pool->dev_handle = *dev_handle;
+  device_pool->pool = pool;
+  return LIBUSB_SUCCESS;
+}
+
+// Every transfer of the handle must have been given back to its pool.
+void close_device_handle(libusb_device_handle *dev_handle) {
+  for (int i = 0; i < num_device_pools; ++i) {
+    if (device_pools[i].dev_handle == dev_handle) {
+      transfer_pool_detach(device_pools[i].pool);
+      device_pools[i].dev_handle = NULL;
+      break;
+    }
+  }
+  libusb_close(dev_handle);
+}
+
+// Once every device handle is closed.
+void destroy_device_pools(void) {
+  for (int i = 0; i < num_device_pools; ++i) {
+    transfer_pool_destroy(device_pools[i].pool);
+  }
+  num_device_pools = 0;
+}
+
+// Opens the haptics output of a device. Returns 1 if it was, in which case the
+// device handle must stay open until it is closed.
+int probe_haptics(const struct libusb_endpoint_descriptor *endpoint,
+                  libusb_device_handle *dev_handle,
+                  const struct libusb_interface_descriptor *altsetting,
+                  const struct discovery_device *device) {
+  if (!enable_haptics) {
+    printf("Skipping, pass --haptics to drive the haptics output.\n");
+    return 0;
+  }
+  if (num_haptic_outputs == MAX_HAPTIC_OUTPUTS) {
+    printf("Too many haptic outputs already.\n");
+    return 0;
+  }
+  const int interface_number = altsetting->bInterfaceNumber;
+  if (claim_interface(dev_handle, interface_number) != 0) {
+    return 0;
+  }
+  struct haptics *haptics = haptics_open(
+      dev_handle, device_transfer_pool(dev_handle), altsetting, endpoint,
+      HAPTICS_DEFAULT_TRANSFERS, HAPTICS_DEFAULT_PACKETS);
+  if (haptics == NULL) {
+    printf("Failed to open the haptics output\n");
+    release_interface(dev_handle, interface_number, 1);
+    return 0;
+  }
+  printf("Haptics output with %d transfers of %d packets, up to %d samples "
+         "each\n",
+         haptics->num_transfers, haptics->packets_per_transfer,
+         haptics->max_packet_samples);
+
+  struct haptic_output *output = &haptic_outputs[num_haptic_outputs++];
+  memset(output, 0, sizeof(*output));
+  output->product_id = device->product_id;
+  memcpy(output->port_path, device->port_path, sizeof(output->port_path));
+  output->dev_handle = dev_handle;
+  output->interface_number = interface_number;
+  output->haptics = haptics;
+  return 1;
+}
+
+// Opens the output report endpoint of a device. Returns 1 if it was, in which
+// case the device handle must stay open until it is closed.
+int probe_output(const struct libusb_endpoint_descriptor *endpoint,
+                 libusb_device_handle *dev_handle,
+                 const struct libusb_interface_descriptor *altsetting,
+                 const struct discovery_device *device) {
+  if (!enable_feedback) {
+    printf("Skipping, pass --feedback to drive the lights.\n");
+    return 0;
+  }
+  if (num_feedback_outputs == MAX_FEEDBACK_OUTPUTS) {
+    printf("Too many feedback outputs already.\n");
+    return 0;
+  }
+  const int interface_number = altsetting->bInterfaceNumber;
+  if (claim_interface(dev_handle, interface_number) != 0) {
+    return 0;
+  }
+  struct output *output =
+      output_open(dev_handle, device_transfer_pool(dev_handle), endpoint);
+  if (output == NULL) {
+    printf("Failed to open the output report endpoint\n");
+    release_interface(dev_handle, interface_number, 1);
+    return 0;
+  }
+  printf("Output reports every %d frame(s)\n", endpoint->bInterval);
+
+  struct feedback_output *feedback = &feedback_outputs[num_feedback_outputs++];
+  memset(feedback, 0, sizeof(*feedback));
+  feedback->product_id = device->product_id;
+  feedback->dev_handle = dev_handle;
+  feedback->interface_number = interface_number;
+  feedback->output = output;
+  return 1;
+}
+
+// Returns 1 if a stream was opened on the endpoint, in which case the device
+// handle must stay open until the streams are torn down.
+int probe_endpoint(const struct libusb_endpoint_descriptor *endpoint,
+                   libusb_device_handle *dev_handle,
+                   const struct libusb_interface_descriptor *altsetting,
+                   const struct discovery_device *device, int num_transfers) {
+  printf("Probing endpoint 0x%02x: ", endpoint->bEndpointAddress);
+  if (haptics_endpoint_supported(endpoint)) {
+    return probe_haptics(endpoint, dev_handle, altsetting, device);
+  }
+  if (output_endpoint_supported(endpoint)) {
+    return probe_output(endpoint, dev_handle, altsetting, device);
+  }
+  if (!stream_endpoint_supported(endpoint)) {
+    printf("Skipping, only interrupt IN endpoints are streamed.\n");
+    return 0;
+  }
+  // The stream this endpoint had before the device was unplugged, if any.
+  struct endpoint_stream *endpoint_stream = NULL;
+  for (int i = 0; i < num_endpoint_streams; ++i) {
+    if (!endpoint_streams[i].connected &&
+        endpoint_streams[i].product_id == device->product_id &&
+        endpoint_streams[i].endpoint == endpoint->bEndpointAddress &&
+        strcmp(endpoint_streams[i].port_path, device->port_path) == 0) {
+      endpoint_stream = &endpoint_streams[i];
+      break;
+    }
+  }
+  if (endpoint_stream == NULL && num_endpoint_streams == MAX_ENDPOINT_STREAMS) {
+    printf("Too many streams already.\n");
+    return 0;
+  }
+
+  const int interface_number = altsetting->bInterfaceNumber;
+  if (claim_interface(dev_handle, interface_number) != 0) {
+    return 0;
+  }
+
+  struct report_ring *ring = endpoint_stream != NULL ? endpoint_stream->ring
+                                                     : report_ring_create();
+  struct stream *stream = NULL;
+  if (ring != NULL) {
+    stream = stream_open(dev_handle, device_transfer_pool(dev_handle),
+                         endpoint->bEndpointAddress, num_transfers,
+                         stream_push_to_ring, ring);
+  }
+  if (stream == NULL) {
+    printf("Failed to open stream\n");
+    if (endpoint_stream == NULL) {
+      report_ring_destroy(ring);
+    }
+    release_interface(dev_handle, interface_number, 1);
+    return 0;
+  }
+  printf("Streaming with %d transfers of %d bytes%s\n", stream->num_transfers,
+         stream->buffer_size,
+         transfer_pool_is_device_memory(stream->pool, stream->transfers[0])
+             ? " in device memory"
+             : "");
+
+  if (endpoint_stream == NULL) {
+    endpoint_stream = &endpoint_streams[num_endpoint_streams++];
+    memset(endpoint_stream, 0, sizeof(*endpoint_stream));
+    reset_endpoint_stats(endpoint_stream);
+    endpoint_stream->controller = -1;
+    endpoint_stream->product_id = stream->product_id;
+    endpoint_stream->endpoint = stream->endpoint_address;
+    memcpy(endpoint_stream->port_path, device->port_path,
+           sizeof(endpoint_stream->port_path));
+    endpoint_stream->ring = ring;
+  }
+  endpoint_stream->connected = 1;
+  endpoint_stream->dev_handle = dev_handle;
+  endpoint_stream->interface_number = interface_number;
+  endpoint_stream->stream = stream;
+  stream->submit_latency = &endpoint_stream->submit_latency;
+  // Neither the filter nor the report interval should span the time the
+  // device was away.
+  endpoint_stream->last_imu_ns = 0;
+  endpoint_stream->last_report.timestamp_ns = 0;
+
+  // Kept from the previous connection otherwise.
+  int descriptor_length = hid_report_descriptor_length(altsetting);
+  if (endpoint_stream->decoder == NULL && descriptor_length > 0) {
+    uint8_t descriptor[HID_MAX_DESCRIPTOR_SIZE];
+    if (descriptor_length > HID_MAX_DESCRIPTOR_SIZE) {
+      descriptor_length = HID_MAX_DESCRIPTOR_SIZE;
+    }
+    int result = hid_fetch_report_descriptor(dev_handle, interface_number,
+                                             descriptor, descriptor_length);
+    if (result > 0) {
+      attach_report_descriptor(endpoint_stream, descriptor, result);
     } else {
-      printf("Failed to open endpoint\n");
-      printf("Transfer failed: %s\n", libusb_error_name(result));
-    }
-  } else if (get_endpoint_type(endpoint->bEndpointAddress) ==
-             ENDPOINT_TYPE_ISOCHRONOUS) {
-    // Claim the interface associated with the endpoint
-    int result =
-        libusb_claim_interface(dev_handle, altsetting->bInterfaceNumber);
-    if (result < 0) {
-      printf("Failed to claim interface\n");
-      if (reactivate_kernel == 0) {
-        reactivate_kernel_driver(dev_handle);
-      }
-      return;
+      printf("Failed to fetch the report descriptor: %s\n",
+             libusb_error_name(result));
     }
-    // Prepare the transfer buffer
-    const int buffer_size = 1024;
-    unsigned char buffer[buffer_size];
-
-    // Create a transfer structure
-    struct libusb_transfer *transfer = libusb_alloc_transfer(0);
-    if (transfer == NULL) {
-      printf("Failed to allocate transfer\n");
-      libusb_release_interface(dev_handle, altsetting->bInterfaceNumber);
-      if (reactivate_kernel == 0) {
-        reactivate_kernel_driver(dev_handle);
+  }
+  return 1;
+}
+
+int probe_endpoints(const struct discovery_device *device,
+                    libusb_device_handle *dev_handle, int num_transfers) {
+  const struct libusb_config_descriptor *config = device->config;
+  int keep_open = 0;
+  for (int i = 0; i < config->bNumInterfaces; ++i) {
+    const struct libusb_interface *interface = &config->interface[i];
+    for (int j = 0; j < interface->num_altsetting; ++j) {
+      const struct libusb_interface_descriptor *altsetting =
+          &interface->altsetting[j];
+      for (int k = 0; k < altsetting->bNumEndpoints; ++k) {
+        keep_open |= probe_endpoint(&altsetting->endpoint[k], dev_handle,
+                                    altsetting, device, num_transfers);
       }
-      return;
     }
-    // Initialize the transfer fields
-    libusb_fill_interrupt_transfer(transfer, dev_handle,
-                                   endpoint->bEndpointAddress, buffer,
-                                   buffer_size, transfer_callback, NULL, 0);
-
-    // Submit the transfer
-    result = libusb_submit_transfer(transfer);
-    if (result < 0) {
-      printf("Failed to submit transfer\n");
-      libusb_free_transfer(transfer);
-      libusb_release_interface(dev_handle, altsetting->bInterfaceNumber);
-      if (reactivate_kernel == 0) {
-        reactivate_kernel_driver(dev_handle);
-      }
+  }
+  return keep_open;
+}
 
-      return;
+// Transfers still owned by libusb, for the streams of `dev_handle` or for
+// every stream if it is NULL.
+int streams_in_flight(libusb_device_handle *dev_handle) {
+  int in_flight = 0;
+  for (int i = 0; i < num_endpoint_streams; ++i) {
+    if (endpoint_streams[i].connected &&
+        (dev_handle == NULL || endpoint_streams[i].dev_handle == dev_handle)) {
+      in_flight += stream_in_flight(endpoint_streams[i].stream);
+    }
+  }
+  for (int i = 0; i < num_haptic_outputs; ++i) {
+    if (dev_handle == NULL || haptic_outputs[i].dev_handle == dev_handle) {
+      in_flight += haptics_in_flight(haptic_outputs[i].haptics);
+    }
+  }
+  for (int i = 0; i < num_feedback_outputs; ++i) {
+    if (dev_handle == NULL || feedback_outputs[i].dev_handle == dev_handle) {
+      in_flight += output_in_flight(feedback_outputs[i].output);
+    }
+  }
+  return in_flight;
+}
+
+// Waits on the reactor up to `timeout_ms` and handles the libusb events that
+// are ready, on this thread. Returns LIBUSB_SUCCESS or a libusb error code.
+int handle_usb_events(int timeout_ms) {
+  struct epoll_event event;
+  int count = epoll_wait(reactor_fd, &event, 1, timeout_ms);
+  if (count < 0 && errno != EINTR) {
+    return LIBUSB_ERROR_IO;
+  }
+  // The only descriptor in the reactor: anything else would be checked here.
+  if (count > 0 && event.data.fd == usb_loop_fd(event_loop)) {
+    return usb_loop_process_ready(event_loop);
+  }
+  return LIBUSB_SUCCESS;
+}
+
+// Gives the USB thread a millisecond to deliver cancellations.
+void pause_for_cancellations(void) {
+  // Nobody else completes the cancellations with --event-loop.
+  if (event_loop != NULL) {
+    handle_usb_events(1);
+    return;
+  }
+  const struct timespec pause = {.tv_sec = 0, .tv_nsec = 1000000};
+  nanosleep(&pause, NULL);
+}
+
+// Lets the USB thread deliver the cancellations of stopped streams.
+void wait_for_streams(libusb_device_handle *dev_handle) {
+  for (int tries = 0; tries < 1000 && streams_in_flight(dev_handle) > 0;
+       ++tries) {
+    pause_for_cancellations();
+  }
+}
+
+// Closes a stopped haptic output with nothing in flight and releases its
+// interface.
+void drop_haptic_output(struct haptic_output *output, int device_present) {
+  haptics_close(output->haptics);
+  release_interface(output->dev_handle, output->interface_number,
+                    device_present);
+  // Nothing to keep for a reconnect, the last one takes its place.
+  *output = haptic_outputs[--num_haptic_outputs];
+}
+
+// Closes a stopped stream with nothing in flight and releases its interface.
+// Its ring stays, for the device to come back.
+void drop_endpoint_stream(struct endpoint_stream *endpoint_stream,
+                          int device_present) {
+  stream_close(endpoint_stream->stream);
+  release_interface(endpoint_stream->dev_handle,
+                    endpoint_stream->interface_number, device_present);
+  endpoint_stream->stream = NULL;
+  endpoint_stream->dev_handle = NULL;
+  endpoint_stream->connected = 0;
+}
+
+// Stops the streams and outputs of `dev_handle`, of every device if NULL.
+// Their transfers are cancelled, see wait_for_streams.
+void stop_device_transfers(libusb_device_handle *dev_handle) {
+  for (int i = 0; i < num_endpoint_streams; ++i) {
+    if (endpoint_streams[i].connected &&
+        (dev_handle == NULL || endpoint_streams[i].dev_handle == dev_handle)) {
+      stream_stop(endpoint_streams[i].stream);
     }
+  }
+  for (int i = 0; i < num_haptic_outputs; ++i) {
+    if (dev_handle == NULL || haptic_outputs[i].dev_handle == dev_handle) {
+      haptics_stop(haptic_outputs[i].haptics);
+    }
+  }
+  for (int i = 0; i < num_feedback_outputs; ++i) {
+    if (dev_handle == NULL || feedback_outputs[i].dev_handle == dev_handle) {
+      output_stop(feedback_outputs[i].output);
+    }
+  }
+}
+
+// Forgets the streams, outputs, claims and transfer pool of `dev_handle`
+// without closing any of them nor the handle: libusb may still complete
+// their transfers. The rings stay, a reconnect gets new streams and a new
+// pool.
+void abandon_device_handle(libusb_device_handle *dev_handle) {
+  for (int i = 0; i < num_endpoint_streams; ++i) {
+    struct endpoint_stream *endpoint_stream = &endpoint_streams[i];
+    if (endpoint_stream->connected &&
+        endpoint_stream->dev_handle == dev_handle) {
+      endpoint_stream->stream = NULL;
+      endpoint_stream->dev_handle = NULL;
+      endpoint_stream->connected = 0;
+    }
+  }
+  for (int i = 0; i < num_haptic_outputs;) {
+    if (haptic_outputs[i].dev_handle == dev_handle) {
+      haptic_outputs[i] = haptic_outputs[--num_haptic_outputs];
+    } else {
+      ++i;
+    }
+  }
+  for (int i = 0; i < num_feedback_outputs;) {
+    if (feedback_outputs[i].dev_handle == dev_handle) {
+      feedback_outputs[i] = feedback_outputs[--num_feedback_outputs];
+    } else {
+      ++i;
+    }
+  }
+  for (int i = 0; i < num_claimed_interfaces;) {
+    if (claimed_interfaces[i].dev_handle == dev_handle) {
+      claimed_interfaces[i] = claimed_interfaces[--num_claimed_interfaces];
+    } else {
+      ++i;
+    }
+  }
+  for (int i = 0; i < num_device_pools; ++i) {
+    if (device_pools[i].dev_handle == dev_handle) {
+      device_pools[i] = device_pools[--num_device_pools];
+      break;
+    }
+  }
+}
+
+// Stops and closes the streams and outputs of `dev_handle` and the
+// handle itself. The rings stay, ready for the device to come back. If some
+// transfers never complete their cancellation, everything of the handle is
+// left open rather than freed under them.
+void disconnect_endpoint_streams(libusb_device_handle *dev_handle,
+                                 int device_present) {
+  stop_device_transfers(dev_handle);
+  wait_for_streams(dev_handle);
+  const int in_flight = streams_in_flight(dev_handle);
+  if (in_flight > 0) {
+    fprintf(stderr,
+            "%s:%d: %d transfers did not complete their cancellation, "
+            "leaving their device open\n",
+            __FILE__, __LINE__, in_flight);
+    abandon_device_handle(dev_handle);
+    return;
+  }
+  for (int i = 0; i < num_feedback_outputs;) {
+    struct feedback_output *feedback = &feedback_outputs[i];
+    if (feedback->dev_handle != dev_handle) {
+      ++i;
+      continue;
+    }
+    output_close(feedback->output);
+    release_interface(dev_handle, feedback->interface_number, device_present);
+    *feedback = feedback_outputs[--num_feedback_outputs];
+  }
+  for (int i = 0; i < num_endpoint_streams; ++i) {
+    if (endpoint_streams[i].connected &&
+        endpoint_streams[i].dev_handle == dev_handle) {
+      drop_endpoint_stream(&endpoint_streams[i], device_present);
+    }
+  }
+  for (int i = 0; i < num_haptic_outputs;) {
+    if (haptic_outputs[i].dev_handle != dev_handle) {
+      ++i;
+      continue;
+    }
+    drop_haptic_output(&haptic_outputs[i], device_present);
+  }
+  close_device_handle(dev_handle);
+}
+
+void clear_endpoint_streams(void) {
+  for (int i = 0; i < num_endpoint_streams; ++i) {
+    free(endpoint_streams[i].report_descriptor);
+    free(endpoint_streams[i].decoder);
+    free(endpoint_streams[i].input);
+    free(endpoint_streams[i].clock);
+  }
+  num_endpoint_streams = 0;
+}
+
+// Disconnects every device still there, streams or outputs, then destroys
+// the rings.
+void close_endpoint_streams(struct discovery *discovery) {
+  for (int i = 0; i < discovery->num_devices; ++i) {
+    struct discovery_device *device = &discovery->devices[i];
+    if (device->dev_handle != NULL) {
+      disconnect_endpoint_streams(device->dev_handle, 1);
+      device->dev_handle = NULL;
+    }
+  }
+  for (int i = 0; i < num_endpoint_streams; ++i) {
+    report_ring_destroy(endpoint_streams[i].ring);
+  }
+  clear_endpoint_streams();
+}
+
+void print_report(const struct report *report) {
+  printf("  0x%04x 0x%02x:", report->product_id, report->endpoint);
+  for (int i = 0; i < report->length; ++i) {
+    printf(" %02x", report->data[i]);
+  }
+  printf("\n");
+}
+
+void print_state(const struct hid_decoder *decoder,
+                 const struct hid_state *state) {
+  printf("  report %d, buttons 0x%08x:", state->report_id, state->buttons);
+  for (int i = 0; i < decoder->num_values; ++i) {
+    printf(" %.4g", state->values[i]);
+  }
+  printf("\n");
+}
+
+// Goes through the logger: formatting and terminal output happen on its
+// thread, not in the middle of draining the rings.
+void log_event(const struct endpoint_stream *endpoint_stream,
+               const struct input_event *event) {
+  static const enum logger_format formats[] = {
+      [INPUT_PRESS] = LOGGER_INPUT_PRESS,
+      [INPUT_RELEASE] = LOGGER_INPUT_RELEASE,
+      [INPUT_AXIS] = LOGGER_INPUT_AXIS,
+  };
+  LOGGER(formats[event->type], LOGGER_UINT(endpoint_stream->product_id),
+         LOGGER_INT(event->index), LOGGER_FLOAT(event->value));
+}
+
+// Host time at which the device sampled a report: from its clock when the
+// reports carry one, the arrival time otherwise.
+uint64_t sample_time(struct endpoint_stream *endpoint_stream,
+                     const struct report *report) {
+  struct clock_sync *clock = endpoint_stream->clock;
+  uint64_t ticks;
+  if (clock == NULL ||
+      clock_field_read(&clock->field, report->data, report->length, &ticks) !=
+          0) {
+    return report->timestamp_ns;
+  }
+  const uint64_t sample_ns =
+      clock_sync_update(clock, ticks, report->timestamp_ns);
+  if (clock->valid) {
+    if (sample_ns > endpoint_stream->last_sample_ns &&
+        endpoint_stream->last_sample_ns != 0) {
+      histogram_record(&endpoint_stream->sample_interval,
+                       sample_ns - endpoint_stream->last_sample_ns);
+    }
+    endpoint_stream->last_sample_ns = sample_ns;
+  }
+  return sample_ns;
+}
+
+// Runs the queued samples through the filter and publishes the orientation of
+// the controllers that had some.
+void update_imu_fusion(void) {
+  imu_fusion_update(&imu_fusion, &imu_batch);
+  for (int controller = 0; controller < IMU_NUM_CONTROLLERS; ++controller) {
+    if (imu_batch.count[controller] > 0) {
+      pose_predictor_publish(&pose_predictor, controller, &imu_fusion);
+    }
+  }
+  imu_batch_clear(&imu_batch);
+}
+
+// Queues the IMU sample of a freshly decoded report for the next fusion
+// update.
+void queue_imu_sample(struct endpoint_stream *endpoint_stream) {
+  const struct imu_channels *channels = &endpoint_stream->imu_channels;
+  const struct hid_state *state = &endpoint_stream->state;
+  float gyro[3];
+  float accel[3];
+  for (int axis = 0; axis < 3; ++axis) {
+    gyro[axis] = state->values[channels->gyro[axis]] * channels->gyro_scale;
+    accel[axis] = state->values[channels->accel[axis]] * channels->accel_scale;
+  }
+  float dt = 0.0f;
+  if (endpoint_stream->last_imu_ns != 0) {
+    dt = (state->timestamp_ns - endpoint_stream->last_imu_ns) * 1e-9f;
+    if (dt > IMU_MAX_DT) {
+      dt = 0.0f;
+    }
+  }
+  endpoint_stream->last_imu_ns = state->timestamp_ns;
 
-    // Run the event loop to process transfers
-    while (1) {
-      result = libusb_handle_events(ctx);
-      if (result < 0) {
-        printf("Event handling error: %d\n", result);
-        if (reactivate_kernel == 0) {
-          reactivate_kernel_driver(dev_handle);
+  if (imu_batch_add(&imu_batch, endpoint_stream->controller, gyro, accel,
+                    dt) != 0) {
+    update_imu_fusion();
+    imu_batch_add(&imu_batch, endpoint_stream->controller, gyro, accel, dt);
+  }
+  pose_predictor_add_sample(&pose_predictor, endpoint_stream->controller,
+                            state->timestamp_ns, gyro);
+}
+
+// Publishes the state of the streams that got reports, after the IMU fusion
+// so that the orientation goes with the report it comes from.
+void publish_streams(uint32_t updated) {
+  for (int i = 0; i < num_endpoint_streams; ++i) {
+    if ((updated & (1u << i)) == 0) {
+      continue;
+    }
+    const struct endpoint_stream *endpoint_stream = &endpoint_streams[i];
+    struct shared_stream_state state = {0};
+    state.timestamp_ns = endpoint_stream->last_report.timestamp_ns;
+    state.reports = endpoint_stream->total_reports;
+    state.product_id = endpoint_stream->product_id;
+    state.endpoint = endpoint_stream->endpoint;
+    // Replayed and simulated streams have no port and never disconnect.
+    state.connected = endpoint_stream->connected ||
+                      endpoint_stream->port_path[0] == '\0';
+    if (endpoint_stream->decoder != NULL) {
+      state.report_id = endpoint_stream->state.report_id;
+      state.buttons = endpoint_stream->state.buttons;
+      state.num_values = (uint16_t)endpoint_stream->decoder->num_values;
+      memcpy(state.values, endpoint_stream->state.values,
+             sizeof(state.values));
+    }
+    if (endpoint_stream->controller >= 0) {
+      state.has_orientation = 1;
+      imu_fusion_get_orientation(&imu_fusion, endpoint_stream->controller,
+                                 state.orientation);
+    }
+    shared_state_publish(&shared_state, i, &state);
+  }
+}
+
+// Gives out the frames of both controllers that are due: published with
+// --publish, for a gesture recognizer in another process, and the last one
+// kept for the summary.
+void drain_merged_frames(void) {
+  struct merge_frame frame;
+  uint64_t now = monotonic_ns();
+  while (merge_next(&merge, now, &frame)) {
+    // A fast replay runs ahead of the clock.
+    if (now > frame.timestamp_ns) {
+      histogram_record(&merge_latency, now - frame.timestamp_ns);
+    }
+    shared_state_append_merged(&shared_state, &frame);
+    last_merge_frame = frame;
+  }
+}
+
+// Adds a freshly decoded state to the merge if it comes from one of the
+// Sense controllers.
+void merge_stream_state(const struct endpoint_stream *endpoint_stream) {
+  if (endpoint_stream->product_id == LEFT_SENSE_CONTROLLER_DEVICE_ID) {
+    merge_add(&merge, MERGE_LEFT, &endpoint_stream->state);
+  } else if (endpoint_stream->product_id == RIGHT_SENSE_CONTROLLER_DEVICE_ID) {
+    merge_add(&merge, MERGE_RIGHT, &endpoint_stream->state);
+  } else {
+    return;
+  }
+  drain_merged_frames();
+}
+
+int drain_reports(struct capture_writer *capture) {
+  int drained = 0;
+  uint32_t updated = 0;
+  for (; shared_state.segment != NULL &&
+         num_published_streams < num_endpoint_streams;
+       ++num_published_streams) {
+    const struct endpoint_stream *endpoint_stream =
+        &endpoint_streams[num_published_streams];
+    shared_state_add_stream(&shared_state, num_published_streams,
+                            endpoint_stream->product_id,
+                            endpoint_stream->endpoint,
+                            endpoint_stream->report_descriptor,
+                            endpoint_stream->report_descriptor_length);
+  }
+  for (int i = 0; i < num_endpoint_streams; ++i) {
+    struct endpoint_stream *endpoint_stream = &endpoint_streams[i];
+    const struct report *report;
+    while ((report = report_ring_peek(endpoint_stream->ring)) != NULL) {
+      histogram_record(&endpoint_stream->handoff,
+                       monotonic_ns() - report->timestamp_ns);
+      if (endpoint_stream->last_report.timestamp_ns != 0) {
+        histogram_record(&endpoint_stream->interval,
+                         report->timestamp_ns -
+                             endpoint_stream->last_report.timestamp_ns);
+      }
+      if (capture != NULL && capture->file != NULL &&
+          capture_write(capture, report) != 0) {
+        fprintf(stderr, "%s:%d: unable to write to the capture\n", __FILE__,
+                __LINE__);
+        capture_writer_close(capture);
+      }
+      if (endpoint_stream->decoder != NULL &&
+          hid_decode(endpoint_stream->decoder, report->data, report->length,
+                     &endpoint_stream->state) >= 0) {
+        endpoint_stream->state.timestamp_ns =
+            sample_time(endpoint_stream, report);
+        if (endpoint_stream->controller >= 0) {
+          queue_imu_sample(endpoint_stream);
+        }
+        if (merge_rate_hz > 0.0) {
+          merge_stream_state(endpoint_stream);
+        }
+      }
+      if (endpoint_stream->input != NULL) {
+        struct input_event events[INPUT_MAX_EVENTS];
+        int num_events =
+            input_diff_report(endpoint_stream->input, report, events);
+        for (int j = 0; show_events && j < num_events; ++j) {
+          log_event(endpoint_stream, &events[j]);
         }
-        break;
       }
+      shared_state_append(&shared_state, i, report);
+      endpoint_stream->last_report = *report;
+      ++endpoint_stream->reports;
+      ++endpoint_stream->total_reports;
+      updated |= 1u << i;
+      report_ring_release(endpoint_stream->ring);
+      ++drained;
     }
   }
-  libusb_release_interface(dev_handle, altsetting->bInterfaceNumber);
-  if (reactivate_kernel == 0) {
-    reactivate_kernel_driver(dev_handle);
+  // Frames waiting on a controller that went quiet.
+  if (merge_rate_hz > 0.0) {
+    drain_merged_frames();
   }
+  // Both controllers in one pass over the filter.
+  if (imu_batch.steps > 0) {
+    update_imu_fusion();
+  }
+  if (shared_state.segment != NULL) {
+    publish_streams(updated);
+  }
+  return drained;
 }
 
-int main(int argc, char *argv[]) {
-  // printf("Hello world\n");
-  // return 0;
-  libusb_device **dev_list;
-  libusb_context *ctx;
-  libusb_device_handle *dev_handle;
-  struct libusb_device_descriptor dev_desc;
+void print_orientation(int controller) {
+  float q[4];
+  imu_fusion_get_orientation(&imu_fusion, controller, q);
+  const float rad_to_deg = 180.0f / (float)M_PI;
+  printf("  orientation %.4f %.4f %.4f %.4f, gyro bias %.3f %.3f %.3f dps\n",
+         q[0], q[1], q[2], q[3],
+         imu_fusion.bias[0][controller] * rad_to_deg,
+         imu_fusion.bias[1][controller] * rad_to_deg,
+         imu_fusion.bias[2][controller] * rad_to_deg);
+  // What a renderer would ask for: the pose at a scan-out 16 ms from now.
+  struct pose pose;
+  if (pose_predict(&pose_predictor, controller, monotonic_ns() + 16000000ull,
+                   &pose) == 0) {
+    printf("  predicted %.4f %.4f %.4f %.4f, %.1f ms ahead of the last "
+           "sample\n",
+           pose.q[0], pose.q[1], pose.q[2], pose.q[3], pose.horizon_s * 1e3f);
+  }
+}
 
-  int r, i;
-  ssize_t cnt;
+// Skipped when nothing was recorded, like the submit latency of replayed
+// reports.
+void print_histogram(const char *name, const struct histogram *histogram) {
+  struct histogram_summary summary;
+  histogram_summarize(histogram, &summary);
+  if (summary.count == 0) {
+    return;
+  }
+  printf("  %-14s p50 %8.1f us, p99 %8.1f us, p99.9 %8.1f us, max %8.1f us "
+         "(%lu samples)\n",
+         name, summary.p50 * 1e-3, summary.p99 * 1e-3, summary.p999 * 1e-3,
+         summary.max * 1e-3, (unsigned long)summary.count);
+}
 
-  // Initialize libusb
-  r = libusb_init(&ctx);
-  if (r < 0) {
-    printf("Error initializing libusb: %s\n", libusb_strerror(r));
-    return 1;
+void print_summary(void) {
+  for (int i = 0; i < num_endpoint_streams; ++i) {
+    struct endpoint_stream *endpoint_stream = &endpoint_streams[i];
+    struct report_ring_stats stats;
+    report_ring_get_stats(endpoint_stream->ring, &stats);
+    printf("0x%04x 0x%02x: %lu reports, %lu dropped, %lu overruns\n",
+           endpoint_stream->product_id, endpoint_stream->endpoint,
+           (unsigned long)endpoint_stream->reports,
+           (unsigned long)stats.dropped, (unsigned long)stats.overruns);
+    if (hidraw_backend != NULL) {
+      const struct hidraw_source *source = &hidraw_backend->sources[i];
+      printf("  %s, %lu errors\n", source->node,
+             (unsigned long)atomic_load(&source->errors));
+    }
+    if (endpoint_stream->port_path[0] != '\0' &&
+        !endpoint_stream->connected) {
+      printf("  disconnected from port %s\n", endpoint_stream->port_path);
+    }
+    if (endpoint_stream->reports > 0) {
+      print_report(&endpoint_stream->last_report);
+      if (endpoint_stream->decoder != NULL) {
+        print_state(endpoint_stream->decoder, &endpoint_stream->state);
+      }
+      if (endpoint_stream->controller >= 0) {
+        print_orientation(endpoint_stream->controller);
+      }
+    }
+    if (endpoint_stream->input != NULL) {
+      printf("  %lu input events, %lu of %lu reports without input change\n",
+             (unsigned long)endpoint_stream->input->events,
+             (unsigned long)endpoint_stream->input->unchanged,
+             (unsigned long)endpoint_stream->input->reports);
+    }
+    const struct clock_sync *clock = endpoint_stream->clock;
+    if (clock != NULL && clock->valid) {
+      printf("  device clock %.6f MHz, %.1f us from the fit, %lu rejected, "
+             "%lu restarts\n",
+             clock_sync_rate(clock) * 1e-6, clock->residual_ns * 1e-3,
+             (unsigned long)clock->rejected, (unsigned long)clock->resets);
+    }
+    if (show_stats) {
+      print_histogram("submit latency", &endpoint_stream->submit_latency);
+      print_histogram("interval", &endpoint_stream->interval);
+      print_histogram("handoff", &endpoint_stream->handoff);
+      if (clock != NULL && clock->valid) {
+        print_histogram("sample interval", &endpoint_stream->sample_interval);
+      }
+    }
+    endpoint_stream->reports = 0;
+  }
+  for (int i = 0; i < num_haptic_outputs; ++i) {
+    struct haptics_stats stats;
+    haptics_get_stats(haptic_outputs[i].haptics, &stats);
+    printf("0x%04x haptics: %lu packets, %lu underruns, %lu idle, %lu errors, "
+           "%lu samples queued\n",
+           haptic_outputs[i].product_id, (unsigned long)stats.packets,
+           (unsigned long)stats.underruns, (unsigned long)stats.idle_packets,
+           (unsigned long)stats.errors,
+           (unsigned long)haptics_queued(haptic_outputs[i].haptics));
+  }
+  if (merge_rate_hz > 0.0) {
+    printf("merged: %lu frames at %.0f Hz, left stale in %lu, right stale in "
+           "%lu, %lu skipped\n",
+           (unsigned long)merge.frames, merge_rate_hz,
+           (unsigned long)merge.sides[MERGE_LEFT].stale_frames,
+           (unsigned long)merge.sides[MERGE_RIGHT].stale_frames,
+           (unsigned long)merge.skipped);
+    if (merge.frames > 0) {
+      const struct merge_frame *frame = &last_merge_frame;
+      printf("  left buttons 0x%08x%s, right buttons 0x%08x%s\n",
+             frame->sides[MERGE_LEFT].buttons,
+             frame->stale & (1u << MERGE_LEFT) ? " (stale)" : "",
+             frame->sides[MERGE_RIGHT].buttons,
+             frame->stale & (1u << MERGE_RIGHT) ? " (stale)" : "");
+    }
+    if (show_stats) {
+      print_histogram("merge latency", &merge_latency);
+    }
+  }
+  if (hidraw_backend != NULL) {
+    uint64_t reports = 0;
+    for (int i = 0; i < hidraw_backend->num_sources; ++i) {
+      reports += atomic_load(&hidraw_backend->sources[i].reports);
+    }
+    printf("hidraw: %lu reports in %lu wakeups\n", (unsigned long)reports,
+           (unsigned long)atomic_load(&hidraw_backend->wakeups));
+  }
+  for (int i = 0; i < num_feedback_outputs; ++i) {
+    struct output_stats stats;
+    output_get_stats(feedback_outputs[i].output, &stats);
+    printf("0x%04x output: %lu updates in %lu reports, %lu errors\n",
+           feedback_outputs[i].product_id, (unsigned long)stats.updates,
+           (unsigned long)stats.reports, (unsigned long)stats.errors);
   }
+  for (int i = 0; i < num_device_pools; ++i) {
+    const struct transfer_pool *pool = device_pools[i].pool;
+    printf("0x%04x transfers: %d allocated, %lu recycled, %zu bytes of device "
+           "memory\n",
+           device_pools[i].product_id, pool->num_transfers,
+           (unsigned long)pool->recycled, pool->device_memory_used);
+  }
+}
 
-  // Get the list of USB devices
-  cnt = libusb_get_device_list(ctx, &dev_list);
-  if (cnt < 0) {
-    printf("Error getting device list: %s\n", libusb_strerror(cnt));
-    libusb_exit(ctx);
-    return 1;
+// Controllers plugged in and out while streaming from the real devices.
+struct live_devices {
+  struct discovery discovery;
+  int num_transfers;
+};
+
+// Writes the report descriptors of the streams from `first` on to the
+// capture, if there is one. Descriptors go before the reports so the capture
+// can be decoded on its own.
+void write_stream_descriptors(struct capture_writer *capture, int first) {
+  for (int i = first; capture != NULL && i < num_endpoint_streams; ++i) {
+    const struct endpoint_stream *endpoint_stream = &endpoint_streams[i];
+    if (endpoint_stream->report_descriptor != NULL) {
+      capture_write_descriptor(capture, endpoint_stream->product_id,
+                               endpoint_stream->report_descriptor,
+                               endpoint_stream->report_descriptor_length);
+    }
+  }
+}
+
+// Starts streaming from a device that just arrived. The first time a port is
+// seen the device is described in full and its config descriptor cached, a
+// reconnect goes straight to claiming the interfaces and resubmitting.
+void open_device(struct live_devices *live,
+                 const struct discovery_event *event,
+                 struct capture_writer *capture) {
+  libusb_device_handle *dev_handle;
+  int r = open_device_handle(event, &dev_handle);
+  if (r != LIBUSB_SUCCESS) {
+    printf("Failed to open 0x%04x on port %s: %s\n", event->product_id,
+           event->port_path, libusb_error_name(r));
+    return;
+  }
+
+  struct discovery_device *device = discovery_lookup(
+      &live->discovery, event->port_path, event->product_id);
+  if (device == NULL) {
+    struct libusb_config_descriptor *config;
+    if (libusb_get_config_descriptor(event->device, 0, &config) !=
+        LIBUSB_SUCCESS) {
+      printf("Failed to read the config descriptor of port %s\n",
+             event->port_path);
+      close_device_handle(dev_handle);
+      return;
+    }
+    describe_device(event->device, dev_handle, config, event->port_path);
+    device = discovery_remember(&live->discovery, event, config);
+    if (device == NULL) {
+      printf("Too many devices already.\n");
+      libusb_free_config_descriptor(config);
+      close_device_handle(dev_handle);
+      return;
+    }
+  } else {
+    printf("0x%04x is back on port %s\n", event->product_id,
+           event->port_path);
   }
 
-  // Loop through the devices and print their descriptors
-  for (i = 0; i < cnt; i++) {
-    libusb_device *dev = dev_list[i];
-    r = libusb_open(dev, &dev_handle);
+  const int first_new = num_endpoint_streams;
+  if (!probe_endpoints(device, dev_handle, live->num_transfers)) {
+    close_device_handle(dev_handle);
+    return;
+  }
+  device->dev_handle = dev_handle;
+  // First, so that nothing else of the device is in flight while waiting for
+  // the transfers of a haptic output that failed to start.
+  for (int i = 0; i < num_haptic_outputs;) {
+    if (haptic_outputs[i].dev_handle != dev_handle) {
+      ++i;
+      continue;
+    }
+    r = haptics_start(haptic_outputs[i].haptics);
     if (r == LIBUSB_SUCCESS) {
-      printf("Openning device %d\n", i);
-      // Display the device descriptor
-      r = libusb_get_device_descriptor(dev, &dev_desc);
-      if (r == LIBUSB_SUCCESS) {
-        printf(" Device Descriptor: (Length: %d)\n", dev_desc.bLength);
-        printf("  Vendor ID: 0x%04x\n", dev_desc.idVendor);
-        printf("  Product ID: 0x%04x\n", dev_desc.idProduct);
-        printf("  USB Class: 0x%02x\n", dev_desc.bDeviceClass);
-        printf("  USB Subclass: 0x%02x\n", dev_desc.bDeviceSubClass);
-        printf("  USB Protocol: 0x%02x\n", dev_desc.bDeviceProtocol);
-        printf("  Max Packet Size 0: 0x%02x\n", dev_desc.bMaxPacketSize0);
-        printf("  Number of possible configurations: %d\n",
-               dev_desc.bNumConfigurations);
-        printf("  Manufacturer string index: %d\n", dev_desc.iManufacturer);
-        printf("  Product string index: %d\n", dev_desc.iProduct);
-        printf("  Serial Number string index: %d\n", dev_desc.iSerialNumber);
-        printf("  bcdUSB: 0x%04x\n", dev_desc.bcdUSB);
-        printf("  bcdDevice: 0x%04x\n", dev_desc.bcdDevice);
-
-        char buf[256];
-        r = libusb_get_string_descriptor_ascii(
-            dev_handle, dev_desc.iManufacturer, (unsigned char *)buf,
-            sizeof(buf));
-        if (r >= 0) {
-          printf("  Manufacturer: %s\n", buf);
-        }
+      ++i;
+      continue;
+    }
+    printf("Failed to start the haptics output: %s\n", libusb_error_name(r));
+    wait_for_streams(dev_handle);
+    if (streams_in_flight(dev_handle) > 0) {
+      // Not safe to close under its transfers: the device is given up on,
+      // and left open.
+      disconnect_endpoint_streams(dev_handle, 1);
+      device->dev_handle = NULL;
+      return;
+    }
+    drop_haptic_output(&haptic_outputs[i], 1);
+  }
+  for (int i = 0; i < num_endpoint_streams; ++i) {
+    struct endpoint_stream *endpoint_stream = &endpoint_streams[i];
+    if (!endpoint_stream->connected ||
+        endpoint_stream->dev_handle != dev_handle) {
+      continue;
+    }
+    r = stream_start(endpoint_stream->stream);
+    if (r == LIBUSB_SUCCESS) {
+      continue;
+    }
+    printf("Failed to start the stream of endpoint 0x%02x: %s\n",
+           endpoint_stream->endpoint, libusb_error_name(r));
+    // Only this stream: the others and the outputs are running already.
+    struct stream *stream = endpoint_stream->stream;
+    for (int tries = 0; tries < 1000 && stream_in_flight(stream) > 0;
+         ++tries) {
+      pause_for_cancellations();
+    }
+    if (stream_in_flight(stream) > 0) {
+      // As for the haptics output above.
+      disconnect_endpoint_streams(dev_handle, 1);
+      device->dev_handle = NULL;
+      write_stream_descriptors(capture, first_new);
+      return;
+    }
+    drop_endpoint_stream(endpoint_stream, 1);
+  }
+  for (int i = 0; i < num_feedback_outputs; ++i) {
+    if (feedback_outputs[i].dev_handle == dev_handle) {
+      output_start(feedback_outputs[i].output);
+    }
+  }
+  write_stream_descriptors(capture, first_new);
+}
 
-        r = libusb_get_string_descriptor_ascii(
-            dev_handle, dev_desc.iProduct, (unsigned char *)buf, sizeof(buf));
-        if (r >= 0) {
-          printf("  Product: %s\n", buf);
-        }
+void close_device(struct live_devices *live,
+                  const struct discovery_event *event) {
+  struct discovery_device *device = discovery_lookup(
+      &live->discovery, event->port_path, event->product_id);
+  if (device == NULL || device->dev_handle == NULL) {
+    return;
+  }
+  printf("0x%04x left port %s\n", event->product_id, event->port_path);
+  // Also when only outputs are left open on it.
+  disconnect_endpoint_streams(device->dev_handle, 0);
+  device->dev_handle = NULL;
+}
 
-        r = libusb_get_string_descriptor_ascii(
-            dev_handle, dev_desc.iSerialNumber, (unsigned char *)buf,
-            sizeof(buf));
-        if (r >= 0) {
-          printf("  Serial Number: %s\n", buf);
-        }
+void handle_device_events(struct live_devices *live,
+                          struct capture_writer *capture) {
+  struct discovery_event events[DISCOVERY_MAX_EVENTS];
+  int num_events =
+      discovery_take_events(&live->discovery, events, DISCOVERY_MAX_EVENTS);
+  for (int i = 0; i < num_events; ++i) {
+    if (events[i].event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+      open_device(live, &events[i], capture);
+    } else {
+      close_device(live, &events[i]);
+    }
+    discovery_release_event(&events[i]);
+  }
+}
 
-        if (dev_desc.idVendor == SONY_VENDOR_ID) {
-          switch (dev_desc.idProduct) {
-          case RIGHT_SENSE_CONTROLLER_DEVICE_ID:
-            printf("  Sony Corp. PlayStation VR2 Sense Controller (R)\n");
-            investigate = 0;
-            break;
-          case LEFT_SENSE_CONTROLLER_DEVICE_ID:
-            printf("  Sony Corp. PlayStation VR2 Sense Controller (L)\n");
-            investigate = 0;
-            break;
-          case PSVR2_DEVICE_ID:
-            printf("  Sony Corp. BillBoard Device\n");
-            investigate = 0;
-            break;
-          }
-        }
-        // // list all string available on the device.
-        // for (uint8_t i = 0; i < 255; ++i) {
-        //   r = libusb_get_string_descriptor_ascii(
-        //       dev_handle, i, (unsigned char *)buf, sizeof(buf));
-        //   if (r >= 0) {
-        //     printf("%i : %s\n", i, buf);
-        //   }
-        // }
-        switch (dev_desc.bDeviceClass) {
-        case LIBUSB_CLASS_HUB:
-          printf("HUB!!!\n");
-          break;
-        case LIBUSB_CLASS_VENDOR_SPEC:
-          printf("Vendor Specific!!!\n");
-          break;
-        }
+// A short 160 Hz buzz on every haptic output once per second, to check the
+// path end to end.
+#define HAPTICS_PULSE_SAMPLES (HAPTICS_SAMPLE_RATE / 25)
+void feed_haptics(uint64_t now) {
+  static int16_t pulse[HAPTICS_PULSE_SAMPLES];
+  if (pulse[1] == 0) {
+    for (int i = 0; i < HAPTICS_PULSE_SAMPLES; ++i) {
+      pulse[i] = (int16_t)(16000.0f * sinf(2.0f * (float)M_PI * 160.0f * i /
+                                           HAPTICS_SAMPLE_RATE));
+    }
+  }
+  for (int i = 0; i < num_haptic_outputs; ++i) {
+    struct haptic_output *output = &haptic_outputs[i];
+    if (now < output->next_pulse_ns) {
+      continue;
+    }
+    haptics_write(output->haptics, pulse, HAPTICS_PULSE_SAMPLES);
+    output->next_pulse_ns = now + 1000000000ull;
+  }
+}
+
+// Slowly cycles the hue of the lights. Called on every pass of the consumer
+// loop, far more often than the endpoint takes reports, so most updates are
+// coalesced.
+void feed_lights(uint64_t now) {
+  const float hue = (float)(now % 6000000000ull) / 1e9f;
+  uint8_t rgb[3];
+  for (int c = 0; c < 3; ++c) {
+    const float k = fmodf(hue + (float)(5 - 2 * c), 6.0f);
+    const float level = fminf(fminf(k, 4.0f - k), 1.0f);
+    rgb[c] = (uint8_t)(255.0f * (1.0f - fmaxf(level, 0.0f)));
+  }
+  for (int i = 0; i < num_feedback_outputs; ++i) {
+    output_set_led(feedback_outputs[i].output, rgb[0], rgb[1], rgb[2]);
+  }
+  if (enable_feedback && hidraw_backend != NULL &&
+      now >= next_hidraw_output_ns) {
+    next_hidraw_output_ns = now + HIDRAW_OUTPUT_INTERVAL_NS;
+    const struct output_state state = {.led = {rgb[0], rgb[1], rgb[2]}};
+    uint8_t report[OUTPUT_REPORT_SIZE];
+    output_encode(&state, OUTPUT_FLAG_LED, report);
+    for (int i = 0; i < hidraw_backend->num_sources; ++i) {
+      struct hidraw_source *source = &hidraw_backend->sources[i];
+      if (source->product_id == LEFT_SENSE_CONTROLLER_DEVICE_ID ||
+          source->product_id == RIGHT_SENSE_CONTROLLER_DEVICE_ID) {
+        hidraw_write(source, report, sizeof(report));
       }
+    }
+  }
+}
 
-      if (investigate == 0) {
-        // List the device's config descriptor
-        struct libusb_config_descriptor *config;
-        r = libusb_get_config_descriptor(dev, 0, &config);
-        int num_endpoints = 0;
-        if (r >= 0) {
-          printf(" Config Descriptor:\n");
-          printf("   Number of interfaces: %d", config->bNumInterfaces);
-          print_strinf_from_index(dev_handle, config->iConfiguration);
-          printf("\n");
-          if (config->extra_length > 0) {
-            printf(" Extra Length: %d\n", config->extra_length);
-            for (int k = 0; k < config->extra_length; ++k) {
-              printf("   %d", config->extra[k]);
-            }
-          }
-        }
+// The hidraw reader thread notices the nodes going away, their streams follow
+// on this thread.
+void follow_hidraw_nodes(void) {
+  for (int i = 0; i < hidraw_backend->num_sources; ++i) {
+    endpoint_streams[i].connected =
+        atomic_load(&hidraw_backend->sources[i].connected);
+  }
+}
 
-        printf("    Attribute: %d (Self-Powered %d, Remote Wakeup %d) \n",
-               config->bmAttributes, (config->bmAttributes & 0x20),
-               (config->bmAttributes & 0x10));
-        printf("    Max Power: %dmA (SuperSpeed mode: %dmA)\n",
-               config->MaxPower * 2, config->MaxPower * 8);
-        for (int i = 0; i < config->bNumInterfaces; ++i) {
-          const struct libusb_interface *interface = &config->interface[i];
-          for (int j = 0; j < interface->num_altsetting; ++j) {
-            const struct libusb_interface_descriptor *altsetting =
-                &interface->altsetting[j];
-            printf("\n    Interface #%d: Length:%d Type:%d Alternate "
-                   "Setting: %d "
-                   "Class: %d SubClass: %d Protocol: %d SDesc.: %d",
-                   altsetting->bInterfaceNumber, altsetting->bLength,
-                   altsetting->bDescriptorType, altsetting->bAlternateSetting,
-                   altsetting->bInterfaceClass, altsetting->bInterfaceSubClass,
-                   altsetting->bInterfaceProtocol, altsetting->iInterface);
-            if (altsetting->extra_length > 0) {
-              printf(" Extra Length: %d\n", altsetting->extra_length);
-              for (int k = 0; k < altsetting->extra_length; ++k) {
-                printf("   %d", altsetting->extra[k]);
-              }
-              printf("\n");
-            }
-            for (int k = 0; k < altsetting->bNumEndpoints; ++k) {
-              const struct libusb_endpoint_descriptor *endpoint =
-                  &altsetting->endpoint[k];
-
-              printf("     Endpoint %d: ", num_endpoints++);
-
-              display_endpoint_address(endpoint->bEndpointAddress);
-              display_endpoint_attributes(endpoint->bmAttributes);
-
-              printf(", Maximum Packet Size=%d, Extra Length=%d (i:%d, j:%d, "
-                     "k:%d)\n",
-                     // endpoint->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK,
-                     convert_word(endpoint->wMaxPacketSize),
-                     endpoint->extra_length, i, j, k);
-
-              // Probe endpoint:
-              probe_endpoint(endpoint, dev_handle, altsetting, ctx);
-            }
-          }
-        }
-        // List the device's bos configuration
-        struct libusb_bos_descriptor *bos;
-        r = libusb_get_bos_descriptor(dev_handle, &bos);
-        if (r == LIBUSB_SUCCESS) {
-          printf(" BOS Descriptor:\n");
-          printf("  Device %d has BOS descriptor:\n", i);
-          printf("  Length: %d\n", bos->bLength);
-          printf("  Descriptor Type: %d\n", bos->bDescriptorType);
-          printf("  Total Length: %d\n", convert_word(bos->wTotalLength));
-          printf("  Number of device capabilities: %d\n", bos->bNumDeviceCaps);
-          for (int k = 0; k < bos->bNumDeviceCaps; ++k) {
-            struct libusb_bos_dev_capability_descriptor *dev_capability =
-                bos->dev_capability[k];
-            printf("   BOS Capability %d: Length: %d Descriptor Type %d Dev "
-                   "Capability Type: %d\n",
-                   k, dev_capability->bLength, dev_capability->bDescriptorType,
-                   dev_capability->bDevCapabilityType);
-            if (dev_capability->bLength > 3) {
-              printf("    Data:");
-              for (int l = 0; l < dev_capability->bLength - 3; ++l) {
-                printf("  %d", dev_capability->dev_capability_data[l]);
-              }
-              printf("\n");
-            }
-            printf("\n");
-          }
-          // Explore the device capabilities here
-          libusb_free_bos_descriptor(bos);
-        }
+// Drains every ring on this thread until interrupted or until the producer
+// stops, printing a summary once per second. Nothing here waits on USB I/O.
+void consume_reports(atomic_int *producer_running,
+                     struct capture_writer *capture,
+                     struct live_devices *live) {
+  imu_fusion_init(&imu_fusion);
+  imu_batch_clear(&imu_batch);
+  pose_predictor_init(&pose_predictor);
+  if (merge_rate_hz > 0.0) {
+    merge_init(&merge, (uint64_t)(1e9 / merge_rate_hz), MERGE_STALE_NS,
+               merge_mode);
+    shared_state_set_merge(&shared_state, merge.period_ns);
+  }
+
+  write_stream_descriptors(capture, 0);
+
+  uint64_t next_summary = monotonic_ns() + 1000000000ull;
+  while (!interrupted && atomic_load(producer_running)) {
+    if (live != NULL) {
+      handle_device_events(live, capture);
+    } else if (hidraw_backend != NULL) {
+      follow_hidraw_nodes();
+    }
+    int drained = drain_reports(capture);
 
-        libusb_free_config_descriptor(config);
-        libusb_close(dev_handle);
+    uint64_t now = monotonic_ns();
+    feed_haptics(now);
+    feed_lights(now);
+    if (now >= next_summary) {
+      next_summary = now + 1000000000ull;
+      print_summary();
+    }
+
+    if (event_loop != NULL) {
+      // Reports completed here are drained on the next turn, without any
+      // other thread involved.
+      int result = handle_usb_events(REACTOR_TIMEOUT_MS);
+      if (result != LIBUSB_SUCCESS) {
+        fprintf(stderr, "%s:%d: event handling error: %s\n", __FILE__,
+                __LINE__, libusb_error_name(result));
+        atomic_store(producer_running, 0);
+      }
+    } else if (drained == 0) {
+      const struct timespec pause = {.tv_sec = 0, .tv_nsec = 500000};
+      nanosleep(&pause, NULL);
+    }
+  }
+  // Whatever the producer pushed before stopping.
+  drain_reports(capture);
+  print_summary();
+}
+
+// Sets up the reactor of --event-loop, with the descriptors of `usb_loop` in
+// it. Returns 0 or -1.
+int open_reactor(struct usb_loop *usb_loop, libusb_context *ctx) {
+  if (usb_loop_open(usb_loop, ctx) != 0) {
+    return -1;
+  }
+  reactor_fd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event event = {.events = EPOLLIN,
+                              .data.fd = usb_loop_fd(usb_loop)};
+  if (reactor_fd < 0 ||
+      epoll_ctl(reactor_fd, EPOLL_CTL_ADD, usb_loop_fd(usb_loop), &event) !=
+          0) {
+    fprintf(stderr, "%s:%d: unable to set up the reactor: %s\n", __FILE__,
+            __LINE__, strerror(errno));
+    if (reactor_fd >= 0) {
+      close(reactor_fd);
+    }
+    usb_loop_close(usb_loop);
+    return -1;
+  }
+  event_loop = usb_loop;
+  return 0;
+}
+
+void close_reactor(void) {
+  printf("Event loop: %lu wakeups, %lu descriptor changes\n",
+         (unsigned long)event_loop->wakeups,
+         (unsigned long)event_loop->fd_changes);
+  usb_loop_close(event_loop);
+  close(reactor_fd);
+  event_loop = NULL;
+  reactor_fd = -1;
+}
+
+void stream_endpoints(libusb_context *ctx, int num_transfers,
+                      int use_event_loop, struct capture_writer *capture) {
+  struct usb_thread usb_thread;
+  struct usb_loop usb_loop;
+  // Stands in for the USB thread with --event-loop, which has none.
+  atomic_int loop_running;
+  atomic_int *running;
+  if (use_event_loop) {
+    if (open_reactor(&usb_loop, ctx) != 0) {
+      printf("Failed to set up the event loop\n");
+      return;
+    }
+    atomic_init(&loop_running, 1);
+    running = &loop_running;
+  } else {
+    if (usb_thread_start(&usb_thread, ctx) != 0) {
+      printf("Failed to start the USB thread\n");
+      return;
+    }
+    running = &usb_thread.running;
+  }
+  struct live_devices live = {.num_transfers = num_transfers};
+  if (discovery_start(&live.discovery, ctx) != 0) {
+    printf("Failed to look for devices\n");
+    if (use_event_loop) {
+      close_reactor();
+    } else {
+      usb_thread_stop(&usb_thread);
+    }
+    return;
+  }
+
+  printf("Waiting for devices, press Ctrl-C to stop.\n");
+  signal(SIGINT, handle_interrupt);
+  consume_reports(running, capture, &live);
+
+  // While the USB events are still handled, to deliver the cancellations.
+  stop_device_transfers(NULL);
+  wait_for_streams(NULL);
+  if (use_event_loop) {
+    close_reactor();
+  } else {
+    usb_thread_stop(&usb_thread);
+  }
+  close_endpoint_streams(&live.discovery);
+  destroy_device_pools();
+  discovery_stop(&live.discovery);
+}
+
+// Returns 0, or -1 if the capture could not be replayed.
+int replay_endpoints(const char *path, int realtime,
+                     struct capture_writer *capture) {
+  struct replay replay;
+  if (replay_open(&replay, path, realtime) != 0) {
+    return -1;
+  }
+  for (int i = 0; i < replay.num_sources; ++i) {
+    struct endpoint_stream *endpoint_stream =
+        &endpoint_streams[num_endpoint_streams++];
+    memset(endpoint_stream, 0, sizeof(*endpoint_stream));
+    reset_endpoint_stats(endpoint_stream);
+    endpoint_stream->controller = -1;
+    endpoint_stream->product_id = replay.sources[i].product_id;
+    endpoint_stream->endpoint = replay.sources[i].endpoint;
+    endpoint_stream->ring = replay.sources[i].ring;
+    if (replay.sources[i].report_descriptor != NULL) {
+      attach_report_descriptor(endpoint_stream,
+                               replay.sources[i].report_descriptor,
+                               replay.sources[i].report_descriptor_length);
+    }
+  }
+  printf("Replaying %d endpoints from %s%s\n", replay.num_sources, path,
+         realtime ? "" : " as fast as possible");
+
+  const uint64_t start_ns = monotonic_ns();
+  const int result = replay_start(&replay);
+  if (result == 0) {
+    signal(SIGINT, handle_interrupt);
+    consume_reports(&replay.running, capture, NULL);
+    replay_stop(&replay);
+  } else {
+    printf("Failed to start the replay\n");
+  }
+  const uint64_t elapsed_ns = monotonic_ns() - start_ns;
+  printf("Replayed %lu reports in %.3f s\n", (unsigned long)replay.records,
+         elapsed_ns / 1e9);
+
+  // The rings belong to the replay.
+  clear_endpoint_streams();
+  replay_close(&replay);
+  return result == 0 ? 0 : -1;
+}
+
+// Reads the controllers through the kernel's hidraw nodes, with the HID
+// driver left attached, into the same consumer path as the live devices.
+// Returns 0, or -1 if there was nothing to read or the reader did not start.
+int hidraw_endpoints(struct capture_writer *capture) {
+  // The sources hold their report descriptors, too big for the stack.
+  static struct hidraw hidraw;
+  const int found = hidraw_open(&hidraw);
+  if (found <= 0) {
+    if (found == 0) {
+      printf("No PSVR2 hidraw node found\n");
+      hidraw_close(&hidraw);
+    }
+    return -1;
+  }
+  for (int i = 0; i < hidraw.num_sources; ++i) {
+    const struct hidraw_source *source = &hidraw.sources[i];
+    printf("0x%04x on %s, port %s, interface %d, endpoint 0x%02x\n",
+           source->product_id, source->node,
+           source->port_path[0] != '\0' ? source->port_path : "none",
+           source->interface_number, source->endpoint);
+    struct endpoint_stream *endpoint_stream =
+        &endpoint_streams[num_endpoint_streams++];
+    memset(endpoint_stream, 0, sizeof(*endpoint_stream));
+    reset_endpoint_stats(endpoint_stream);
+    endpoint_stream->controller = -1;
+    endpoint_stream->product_id = source->product_id;
+    endpoint_stream->endpoint = source->endpoint;
+    memcpy(endpoint_stream->port_path, source->port_path,
+           sizeof(endpoint_stream->port_path));
+    endpoint_stream->connected = 1;
+    endpoint_stream->interface_number = source->interface_number;
+    endpoint_stream->ring = source->ring;
+    if (source->report_descriptor_length > 0) {
+      attach_report_descriptor(endpoint_stream, source->report_descriptor,
+                               source->report_descriptor_length);
+    }
+  }
+  printf("Reading %d hidraw nodes, press Ctrl-C to stop.\n",
+         hidraw.num_sources);
+
+  const int result = hidraw_start(&hidraw);
+  if (result == 0) {
+    hidraw_backend = &hidraw;
+    signal(SIGINT, handle_interrupt);
+    consume_reports(&hidraw.running, capture, NULL);
+    hidraw_stop(&hidraw);
+    hidraw_backend = NULL;
+  } else {
+    printf("Failed to start reading the hidraw nodes\n");
+  }
+
+  // The rings belong to the hidraw sources.
+  clear_endpoint_streams();
+  hidraw_close(&hidraw);
+  return result == 0 ? 0 : -1;
+}
+
+// Same enumeration and consumer path as the live devices, driven by the
+// simulated controllers. Returns 0, or -1 if they could not be started.
+int simulate_endpoints(double rate_hz, double jitter_us,
+                        struct capture_writer *capture) {
+  for (int d = 0; d < SIM_NUM_DEVICES; ++d) {
+    const struct sim_device *device = &sim_devices[d];
+    printf("Simulating device %d\n", d);
+    print_device_descriptor(&device->device);
+    printf("  Manufacturer: %s\n", device->manufacturer);
+    printf("  Product: %s\n", device->product);
+    identify_device(&device->device);
+    print_config_descriptor(device->config, NULL);
+  }
+
+  struct sim sim;
+  if (sim_open(&sim, rate_hz, jitter_us) != 0) {
+    printf("Failed to open the simulated devices\n");
+    return -1;
+  }
+  for (int i = 0; i < sim.num_sources; ++i) {
+    struct endpoint_stream *endpoint_stream =
+        &endpoint_streams[num_endpoint_streams++];
+    memset(endpoint_stream, 0, sizeof(*endpoint_stream));
+    reset_endpoint_stats(endpoint_stream);
+    endpoint_stream->controller = -1;
+    endpoint_stream->product_id = sim.sources[i].device->device.idProduct;
+    endpoint_stream->endpoint = sim.sources[i].endpoint;
+    endpoint_stream->ring = sim.sources[i].ring;
+    attach_report_descriptor(endpoint_stream, sim_report_descriptor,
+                             SIM_REPORT_DESCRIPTOR_SIZE);
+  }
+  printf("Streaming %d simulated endpoints at %.0f Hz, press Ctrl-C to "
+         "stop.\n",
+         sim.num_sources, sim.rate_hz);
+
+  const int result = sim_start(&sim);
+  if (result == 0) {
+    signal(SIGINT, handle_interrupt);
+    consume_reports(&sim.running, capture, NULL);
+    sim_stop(&sim);
+  } else {
+    printf("Failed to start the simulated devices\n");
+  }
+
+  // The rings belong to the simulation.
+  clear_endpoint_streams();
+  sim_close(&sim);
+  return result == 0 ? 0 : -1;
+}
+
+// Prints one JSON object per endpoint on stdout, and how long it took on
+// stderr. Returns the exit status.
+int probe_inventory(libusb_context *ctx, int deadline_ms) {
+  struct probe_result results[PROBE_MAX_ENDPOINTS];
+  const uint64_t start = monotonic_ns();
+  int count = probe_devices(ctx, deadline_ms, results, PROBE_MAX_ENDPOINTS);
+  if (count < 0) {
+    fprintf(stderr, "%s:%d: unable to list the USB devices: %s\n", __FILE__,
+            __LINE__, libusb_strerror(count));
+    return 1;
+  }
+  int answered = 0;
+  for (int i = 0; i < count; ++i) {
+    probe_print_json(&results[i]);
+    answered += results[i].outcome == PROBE_ANSWERED;
+  }
+  fprintf(stderr, "%d of %d endpoints answered in %.1f ms\n", answered, count,
+          (monotonic_ns() - start) * 1e-6);
+  return 0;
+}
+
+// Stops the logger, saying so if it had to drop records.
+void stop_logger(void) {
+  uint64_t dropped = logger_stop();
+  if (dropped > 0) {
+    fprintf(stderr, "The logger dropped %lu records\n",
+            (unsigned long)dropped);
+  }
+}
+
+void print_usage(const char *program) {
+  printf("Usage: %s [options]\n", program);
+  printf("  -t, --transfers N  transfers kept in flight per IN endpoint "
+         "(default %d)\n",
+         STREAM_DEFAULT_TRANSFERS);
+  printf("  -c, --capture FILE append every received report to FILE\n");
+  printf("  -r, --replay FILE  replay a capture instead of using devices\n");
+  printf("  -f, --fast         replay as fast as possible\n");
+  printf("  -s, --sim          use simulated controllers instead of devices\n");
+  printf("      --hidraw       read the kernel's hidraw nodes instead of "
+         "libusb,\n"
+         "                     leaving the HID driver attached\n");
+  printf("      --event-loop   handle USB events on the thread reading the "
+         "reports,\n"
+         "                     from its epoll loop, instead of a USB thread\n");
+  printf("      --rate HZ      simulated report rate (default %.0f)\n",
+         SIM_DEFAULT_RATE_HZ);
+  printf("      --jitter US    simulated completion jitter (default %.0f)\n",
+         SIM_DEFAULT_JITTER_US);
+  printf("      --stats        print latency and jitter percentiles with the "
+         "summaries\n");
+  printf("      --haptics      drive the haptics output of the controllers "
+         "with a test pulse\n");
+  printf("      --events       print button and axis changes as they come\n");
+  printf("      --feedback     cycle the colour of the controllers' lights\n");
+  printf("      --device-clock BYTE[:BITS]\n"
+         "                     time the samples with the little endian "
+         "device clock\n"
+         "                     at BYTE of the reports (default 32 bits)\n");
+  printf("      --merge HZ[:nearest]\n"
+         "                     join both controllers into frames at HZ, "
+         "interpolated\n"
+         "                     or from the nearer sample\n");
+  printf("      --log FILE     write --events and transfer errors to FILE as "
+         "binary\n"
+         "                     records instead, see tools/logdump\n");
+  printf("      --publish[=NAME]\n"
+         "                     publish the state of the streams in shared "
+         "memory\n"
+         "                     (default %s)\n",
+         SHARED_STATE_DEFAULT_NAME);
+  printf("  -p, --probe        read once from every IN endpoint and print one "
+         "JSON\n"
+         "                     line per endpoint instead of streaming\n");
+  printf("      --deadline MS  give up on the endpoints that did not answer "
+         "after MS\n"
+         "                     (default %d)\n",
+         PROBE_DEFAULT_DEADLINE_MS);
+  printf("  -h, --help         show this help\n");
+}
+
+int main(int argc, char *argv[]) {
+  int num_transfers = STREAM_DEFAULT_TRANSFERS;
+  const char *capture_path = NULL;
+  const char *replay_path = NULL;
+  const char *publish_name = NULL;
+  const char *log_path = NULL;
+  int probe = 0;
+  int deadline_ms = PROBE_DEFAULT_DEADLINE_MS;
+  int realtime = 1;
+  int simulate = 0;
+  int use_hidraw = 0;
+  int use_event_loop = 0;
+  double sim_rate_hz = SIM_DEFAULT_RATE_HZ;
+  double sim_jitter_us = SIM_DEFAULT_JITTER_US;
+
+  enum { OPTION_RATE = 256, OPTION_JITTER, OPTION_STATS, OPTION_HAPTICS,
+         OPTION_FEEDBACK, OPTION_PUBLISH, OPTION_DEADLINE, OPTION_EVENTS,
+         OPTION_LOG, OPTION_DEVICE_CLOCK, OPTION_HIDRAW, OPTION_MERGE,
+         OPTION_EVENT_LOOP };
+
+  static const struct option options[] = {
+      {"transfers", required_argument, NULL, 't'},
+      {"capture", required_argument, NULL, 'c'},
+      {"replay", required_argument, NULL, 'r'},
+      {"fast", no_argument, NULL, 'f'},
+      {"sim", no_argument, NULL, 's'},
+      {"hidraw", no_argument, NULL, OPTION_HIDRAW},
+      {"event-loop", no_argument, NULL, OPTION_EVENT_LOOP},
+      {"rate", required_argument, NULL, OPTION_RATE},
+      {"jitter", required_argument, NULL, OPTION_JITTER},
+      {"stats", no_argument, NULL, OPTION_STATS},
+      {"haptics", no_argument, NULL, OPTION_HAPTICS},
+      {"feedback", no_argument, NULL, OPTION_FEEDBACK},
+      {"events", no_argument, NULL, OPTION_EVENTS},
+      {"log", required_argument, NULL, OPTION_LOG},
+      {"device-clock", required_argument, NULL, OPTION_DEVICE_CLOCK},
+      {"merge", required_argument, NULL, OPTION_MERGE},
+      {"publish", optional_argument, NULL, OPTION_PUBLISH},
+      {"probe", no_argument, NULL, 'p'},
+      {"deadline", required_argument, NULL, OPTION_DEADLINE},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0},
+  };
+  int option;
+  while ((option = getopt_long(argc, argv, "t:c:r:fsph", options, NULL)) !=
+         -1) {
+    switch (option) {
+    case 't':
+      num_transfers = atoi(optarg);
+      if (num_transfers <= 0 || num_transfers > STREAM_MAX_TRANSFERS) {
+        fprintf(stderr, "--transfers must be between 1 and %d\n",
+                STREAM_MAX_TRANSFERS);
+        return 1;
       }
+      break;
+    case 'c':
+      capture_path = optarg;
+      break;
+    case 'r':
+      replay_path = optarg;
+      break;
+    case 'f':
+      realtime = 0;
+      break;
+    case 's':
+      simulate = 1;
+      break;
+    case OPTION_HIDRAW:
+      use_hidraw = 1;
+      break;
+    case OPTION_EVENT_LOOP:
+      use_event_loop = 1;
+      break;
+    case OPTION_RATE:
+      sim_rate_hz = atof(optarg);
+      if (sim_rate_hz <= 0.0) {
+        fprintf(stderr, "--rate must be positive\n");
+        return 1;
+      }
+      break;
+    case OPTION_JITTER:
+      sim_jitter_us = atof(optarg);
+      break;
+    case OPTION_STATS:
+      show_stats = 1;
+      break;
+    case OPTION_HAPTICS:
+      enable_haptics = 1;
+      break;
+    case OPTION_FEEDBACK:
+      enable_feedback = 1;
+      break;
+    case OPTION_EVENTS:
+      show_events = 1;
+      break;
+    case OPTION_LOG:
+      log_path = optarg;
+      break;
+    case OPTION_DEVICE_CLOCK: {
+      char *end;
+      long offset = strtol(optarg, &end, 0);
+      long bits = *end == ':' ? strtol(end + 1, &end, 0) : 32;
+      if (*end != '\0' || offset < 0 || offset >= REPORT_MAX_SIZE ||
+          bits <= 0 || bits > 64 || offset * 8 + bits > REPORT_MAX_SIZE * 8) {
+        fprintf(stderr, "--device-clock takes BYTE[:BITS], BITS up to 64\n");
+        return 1;
+      }
+      device_clock.report_id = -1;
+      device_clock.bit_offset = (uint16_t)(offset * 8);
+      device_clock.bit_size = (uint8_t)bits;
+      break;
     }
+    case OPTION_MERGE: {
+      char *end;
+      merge_rate_hz = strtod(optarg, &end);
+      if (strcmp(end, ":nearest") == 0) {
+        merge_mode = MERGE_NEAREST;
+        end += strlen(":nearest");
+      }
+      if (*end != '\0' || merge_rate_hz <= 0.0 || merge_rate_hz > 1e6) {
+        fprintf(stderr, "--merge takes HZ[:nearest]\n");
+        return 1;
+      }
+      break;
+    }
+    case OPTION_PUBLISH:
+      publish_name = optarg != NULL ? optarg : SHARED_STATE_DEFAULT_NAME;
+      break;
+    case 'p':
+      probe = 1;
+      break;
+    case OPTION_DEADLINE:
+      deadline_ms = atoi(optarg);
+      if (deadline_ms <= 0) {
+        fprintf(stderr, "--deadline must be positive\n");
+        return 1;
+      }
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      return 0;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  struct capture_writer capture = {0};
+  if (capture_path != NULL &&
+      capture_writer_open(&capture, capture_path) != 0) {
+    return 1;
+  }
+  if (publish_name != NULL) {
+    if (shared_state_create(&shared_state, publish_name) != 0) {
+      capture_writer_close(&capture);
+      return 1;
+    }
+    printf("Publishing the state of the streams in %s\n", publish_name);
+  }
+  // Nothing to log otherwise: the transfer errors are still counted in the
+  // summaries.
+  if ((show_events || log_path != NULL) && logger_start(log_path) != 0) {
+    capture_writer_close(&capture);
+    shared_state_close(&shared_state);
+    return 1;
   }
 
-  // Free the device list and exit libusb
-  libusb_free_device_list(dev_list, 1);
+  // A replay does not need any device, or libusb at all.
+  if (replay_path != NULL) {
+    int result = replay_endpoints(replay_path, realtime,
+                                  capture.file != NULL ? &capture : NULL);
+    stop_logger();
+    capture_writer_close(&capture);
+    shared_state_close(&shared_state);
+    return result == 0 ? 0 : 1;
+  }
+  if (use_hidraw) {
+    int result = hidraw_endpoints(capture.file != NULL ? &capture : NULL);
+    stop_logger();
+    capture_writer_close(&capture);
+    shared_state_close(&shared_state);
+    return result == 0 ? 0 : 1;
+  }
+  if (simulate) {
+    int result = simulate_endpoints(sim_rate_hz, sim_jitter_us,
+                                    capture.file != NULL ? &capture : NULL);
+    stop_logger();
+    capture_writer_close(&capture);
+    shared_state_close(&shared_state);
+    return result == 0 ? 0 : 1;
+  }
+
+  libusb_context *ctx;
+  // Initialize libusb
+  int r = libusb_init(&ctx);
+  if (r < 0) {
+    printf("Error initializing libusb: %s\n", libusb_strerror(r));
+    stop_logger();
+    capture_writer_close(&capture);
+    shared_state_close(&shared_state);
+    return 1;
+  }
+
+  if (probe) {
+    int result = probe_inventory(ctx, deadline_ms);
+    libusb_exit(ctx);
+    stop_logger();
+    capture_writer_close(&capture);
+    shared_state_close(&shared_state);
+    return result;
+  }
+
+  stream_endpoints(ctx, num_transfers, use_event_loop,
+                   capture.file != NULL ? &capture : NULL);
+  stop_logger();
+  if (capture.file != NULL) {
+    printf("Captured %lu reports to %s\n", (unsigned long)capture.records,
+           capture_path);
+    capture_writer_close(&capture);
+  }
   libusb_exit(ctx);
+  shared_state_close(&shared_state);
 
   return 0;
 }
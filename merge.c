@@ -0,0 +1,132 @@
+#include "merge.h"
+
+#include <string.h>
+
+void merge_init(struct merge *merge, uint64_t period_ns, uint64_t stale_ns,
+                enum merge_mode mode) {
+  memset(merge, 0, sizeof(*merge));
+  merge->period_ns = period_ns;
+  merge->stale_ns = stale_ns;
+  merge->mode = mode;
+}
+
+static const struct hid_state *merge_latest(const struct merge_side *side) {
+  return &side->samples[(side->count - 1) & MERGE_HISTORY_MASK];
+}
+
+void merge_add(struct merge *merge, int side, const struct hid_state *state) {
+  struct merge_side *merge_side = &merge->sides[side];
+  if (merge_side->count > 0 &&
+      state->timestamp_ns <= merge_latest(merge_side)->timestamp_ns) {
+    return;
+  }
+  merge_side->samples[merge_side->count & MERGE_HISTORY_MASK] = *state;
+  ++merge_side->count;
+  if (merge->next_ns == 0) {
+    // Frames fall on multiples of the period, from the first sample on.
+    merge->next_ns = (state->timestamp_ns + merge->period_ns - 1) /
+                     merge->period_ns * merge->period_ns;
+  }
+}
+
+// The state of a hand at `timestamp_ns`, from the kept samples. The newest
+// one is at or past it.
+static void merge_sample_at(const struct merge *merge,
+                            const struct merge_side *side,
+                            uint64_t timestamp_ns, struct hid_state *state) {
+  const uint64_t kept =
+      side->count < MERGE_HISTORY ? side->count : MERGE_HISTORY;
+  // Walking back from the newest: `after` is the oldest sample seen past the
+  // frame time, `before` the first one at or before it.
+  const struct hid_state *after = merge_latest(side);
+  const struct hid_state *before = NULL;
+  for (uint64_t i = 1; i <= kept; ++i) {
+    const struct hid_state *sample =
+        &side->samples[(side->count - i) & MERGE_HISTORY_MASK];
+    if (sample->timestamp_ns <= timestamp_ns) {
+      before = sample;
+      break;
+    }
+    after = sample;
+  }
+  if (before == NULL || before->timestamp_ns == timestamp_ns) {
+    // Older than every kept sample, or right on one.
+    *state = before != NULL ? *before : *after;
+    return;
+  }
+
+  const uint64_t span = after->timestamp_ns - before->timestamp_ns;
+  const uint64_t into = timestamp_ns - before->timestamp_ns;
+  const struct hid_state *nearer = into * 2 < span ? before : after;
+  // Values of different reports are not the same fields.
+  if (merge->mode == MERGE_NEAREST || before->report_id != after->report_id) {
+    *state = *nearer;
+    return;
+  }
+  const float weight = (float)into / (float)span;
+  state->timestamp_ns = timestamp_ns;
+  state->report_id = nearer->report_id;
+  state->buttons = nearer->buttons;
+  for (int i = 0; i < HID_MAX_VALUES; ++i) {
+    state->values[i] = before->values[i] +
+                       (after->values[i] - before->values[i]) * weight;
+  }
+}
+
+int merge_next(struct merge *merge, uint64_t now_ns,
+               struct merge_frame *frame) {
+  if (merge->next_ns == 0) {
+    return 0;
+  }
+  // Not called for a while: carry on from now rather than give out every
+  // frame missed in between.
+  if (now_ns > merge->next_ns + 2 * merge->stale_ns) {
+    const uint64_t behind =
+        (now_ns - 2 * merge->stale_ns - merge->next_ns) / merge->period_ns + 1;
+    merge->next_ns += behind * merge->period_ns;
+    merge->skipped += behind;
+  }
+
+  uint64_t timestamp_ns;
+  unsigned stale;
+  for (;;) {
+    timestamp_ns = merge->next_ns;
+    const int late = now_ns >= timestamp_ns + merge->stale_ns;
+    stale = 0;
+    for (int i = 0; i < MERGE_SIDES; ++i) {
+      const struct merge_side *side = &merge->sides[i];
+      if (side->count == 0 ||
+          merge_latest(side)->timestamp_ns < timestamp_ns) {
+        if (!late) {
+          return 0;
+        }
+        stale |= 1u << i;
+      }
+    }
+    if (stale != (1u << MERGE_SIDES) - 1) {
+      break;
+    }
+    // Neither hand: nothing worth a frame.
+    merge->next_ns += merge->period_ns;
+    ++merge->skipped;
+  }
+
+  frame->timestamp_ns = timestamp_ns;
+  frame->stale = stale;
+  for (int i = 0; i < MERGE_SIDES; ++i) {
+    struct merge_side *side = &merge->sides[i];
+    if (side->count == 0) {
+      memset(&frame->sides[i], 0, sizeof(frame->sides[i]));
+    } else if (stale & (1u << i)) {
+      frame->sides[i] = *merge_latest(side);
+    } else {
+      merge_sample_at(merge, side, timestamp_ns, &frame->sides[i]);
+    }
+    if (stale & (1u << i)) {
+      ++side->stale_frames;
+    }
+  }
+  merge->next_ns += merge->period_ns;
+  ++merge->frames;
+  return 1;
+}
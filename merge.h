@@ -0,0 +1,82 @@
+#ifndef MERGE_H
+#define MERGE_H
+
+#include <stdint.h>
+
+#include "hid.h"
+
+// Joins the decoded samples of the left and right controllers into frames at
+// a fixed rate, both hands at the same instant. The controllers sample on
+// their own, unrelated clocks and their reports arrive interleaved: each
+// frame takes, for either hand, its state at the frame time interpolated
+// between the two samples around it, or the nearer of them. A frame is given
+// out as soon as both hands have a sample at or past its time, or once one of
+// them is late by more than the stale limit, in which case that hand's latest
+// state is held and flagged.
+//
+// Incremental: only the last few samples of each hand are kept, and every
+// sample and frame costs a bounded amount of work.
+
+#define MERGE_SIDES 2
+#define MERGE_LEFT 0
+#define MERGE_RIGHT 1
+// Samples kept per hand. One hand can run this far ahead of the other before
+// frames fall back to its oldest sample: should cover the stale limit at the
+// report rate. Must be a power of two.
+#define MERGE_HISTORY 16
+#define MERGE_HISTORY_MASK (MERGE_HISTORY - 1)
+
+enum merge_mode {
+  // Values linearly interpolated between the samples around the frame time,
+  // buttons from the nearer one.
+  MERGE_INTERPOLATE,
+  // Everything from the sample nearer to the frame time.
+  MERGE_NEAREST,
+};
+
+struct merge_frame {
+  uint64_t timestamp_ns;
+  // `timestamp_ns` of each is the frame time when interpolated, the time of
+  // the sample used otherwise.
+  struct hid_state sides[MERGE_SIDES];
+  // 1 << MERGE_LEFT and 1 << MERGE_RIGHT: the hand had no sample at or past
+  // the frame time within the stale limit. Its latest state is held, zeroed
+  // if it never had any.
+  unsigned stale;
+};
+
+struct merge_side {
+  struct hid_state samples[MERGE_HISTORY];
+  // Samples added since the start.
+  uint64_t count;
+  // Frames this hand was stale in.
+  uint64_t stale_frames;
+};
+
+struct merge {
+  uint64_t period_ns;
+  uint64_t stale_ns;
+  enum merge_mode mode;
+  // Time of the next frame, 0 until the first sample.
+  uint64_t next_ns;
+  struct merge_side sides[MERGE_SIDES];
+  uint64_t frames;
+  // Frames not given out, because neither hand had a sample for them or
+  // merge_next was not called for a while.
+  uint64_t skipped;
+};
+
+// Frames every `period_ns`, on multiples of it. A hand whose sample has not
+// come `stale_ns` after a frame time is held.
+void merge_init(struct merge *merge, uint64_t period_ns, uint64_t stale_ns,
+                enum merge_mode mode);
+
+// Adds the decoded state of a hand, timed by its `timestamp_ns`. Samples not
+// newer than the previous one of the hand are ignored.
+void merge_add(struct merge *merge, int side, const struct hid_state *state);
+
+// Writes the next frame if it is due by `now_ns`. Returns 1 if it did, 0
+// otherwise; call until it returns 0 after adding samples.
+int merge_next(struct merge *merge, uint64_t now_ns, struct merge_frame *frame);
+
+#endif // MERGE_H
@@ -0,0 +1,15 @@
+#ifndef MONOTONIC_H
+#define MONOTONIC_H
+
+#include <stdint.h>
+#include <time.h>
+
+// Host CLOCK_MONOTONIC time in nanoseconds. Every timestamp attached to a
+// report uses this clock.
+static inline uint64_t monotonic_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+#endif // MONOTONIC_H
@@ -0,0 +1,205 @@
+#include "output.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void output_begin_update(struct output *output) {
+  const unsigned sequence =
+      atomic_load_explicit(&output->sequence, memory_order_relaxed);
+  atomic_store_explicit(&output->sequence, sequence + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+}
+
+static void output_end_update(struct output *output, unsigned changed) {
+  const unsigned sequence =
+      atomic_load_explicit(&output->sequence, memory_order_relaxed);
+  atomic_store_explicit(&output->sequence, sequence + 1, memory_order_release);
+  atomic_fetch_or_explicit(&output->changed, changed, memory_order_release);
+  atomic_fetch_add_explicit(&output->updates, 1, memory_order_relaxed);
+}
+
+static void output_read_state(struct output *output,
+                              struct output_state *state) {
+  unsigned before;
+  unsigned after;
+  do {
+    before = atomic_load_explicit(&output->sequence, memory_order_acquire);
+    memcpy(state, &output->state, sizeof(*state));
+    atomic_thread_fence(memory_order_acquire);
+    after = atomic_load_explicit(&output->sequence, memory_order_relaxed);
+  } while ((before & 1) != 0 || before != after);
+}
+
+// Sends what changed since the last report, or gives the transfer back if
+// nothing did. Called by whoever owns the transfer (in_flight is 1).
+static void output_send(struct output *output) {
+  for (;;) {
+    // Changes made before starting are kept for `output_start`.
+    const unsigned changed =
+        atomic_load_explicit(&output->running, memory_order_acquire)
+            ? atomic_exchange_explicit(&output->changed, 0,
+                                       memory_order_acquire)
+            : 0;
+    if (changed != 0) {
+      struct output_state state;
+      output_read_state(output, &state);
+      output_encode(&state, changed, output->buffer);
+      if (libusb_submit_transfer(output->transfer) == LIBUSB_SUCCESS) {
+        return;
+      }
+      atomic_fetch_add_explicit(&output->errors, 1, memory_order_relaxed);
+    }
+    atomic_store_explicit(&output->in_flight, 0, memory_order_release);
+    // A setter may have run between the exchange and the store above and
+    // left it to us, take the transfer back in that case.
+    int idle = 0;
+    if (atomic_load_explicit(&output->changed, memory_order_acquire) == 0 ||
+        !atomic_load_explicit(&output->running, memory_order_acquire) ||
+        !atomic_compare_exchange_strong(&output->in_flight, &idle, 1)) {
+      return;
+    }
+  }
+}
+
+static void output_schedule(struct output *output) {
+  int idle = 0;
+  if (atomic_compare_exchange_strong(&output->in_flight, &idle, 1)) {
+    output_send(output);
+  }
+  // Otherwise the completion of the report in flight sends the new state.
+}
+
+static void output_transfer_callback(struct libusb_transfer *transfer) {
+  struct output *output = transfer->user_data;
+  if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+    atomic_fetch_add_explicit(&output->reports, 1, memory_order_relaxed);
+  } else if (transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+    atomic_fetch_add_explicit(&output->errors, 1, memory_order_relaxed);
+  }
+  // The endpoint only takes one report per polling interval, so completions
+  // pace the reports: whatever changed meanwhile goes out now, coalesced.
+  output_send(output);
+}
+
+int output_endpoint_supported(
+    const struct libusb_endpoint_descriptor *endpoint) {
+  return (endpoint->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) ==
+             LIBUSB_TRANSFER_TYPE_INTERRUPT &&
+         (endpoint->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) ==
+             LIBUSB_ENDPOINT_OUT;
+}
+
+struct output *output_open(libusb_device_handle *dev_handle,
+                           struct transfer_pool *pool,
+                           const struct libusb_endpoint_descriptor *endpoint) {
+  if (!output_endpoint_supported(endpoint)) {
+    fprintf(stderr, "%s:%d: endpoint 0x%02x is not an interrupt OUT endpoint\n",
+            __FILE__, __LINE__, endpoint->bEndpointAddress);
+    return NULL;
+  }
+  // wMaxPacketSize is already in host byte order in libusb's descriptors.
+  if (endpoint->wMaxPacketSize < OUTPUT_REPORT_SIZE) {
+    fprintf(stderr, "%s:%d: endpoint 0x%02x takes %d bytes, less than a "
+            "report\n", __FILE__, __LINE__, endpoint->bEndpointAddress,
+            endpoint->wMaxPacketSize);
+    return NULL;
+  }
+
+  struct output *output = calloc(1, sizeof(*output));
+  if (output == NULL) {
+    return NULL;
+  }
+  output->dev_handle = dev_handle;
+  output->pool = pool;
+  output->endpoint_address = endpoint->bEndpointAddress;
+  atomic_init(&output->sequence, 0);
+  atomic_init(&output->changed, 0);
+  atomic_init(&output->in_flight, 0);
+  atomic_init(&output->running, 0);
+  atomic_init(&output->updates, 0);
+  atomic_init(&output->reports, 0);
+  atomic_init(&output->errors, 0);
+
+  output->transfer = transfer_pool_acquire(pool, 0, OUTPUT_REPORT_SIZE);
+  if (output->transfer == NULL) {
+    output_close(output);
+    return NULL;
+  }
+  output->buffer = output->transfer->buffer;
+  libusb_fill_interrupt_transfer(output->transfer, dev_handle,
+                                 output->endpoint_address, output->buffer,
+                                 OUTPUT_REPORT_SIZE, output_transfer_callback,
+                                 output, 0);
+  return output;
+}
+
+void output_start(struct output *output) {
+  atomic_store(&output->running, 1);
+  output_schedule(output);
+}
+
+void output_set_led(struct output *output, uint8_t red, uint8_t green,
+                    uint8_t blue) {
+  output_begin_update(output);
+  output->state.led[0] = red;
+  output->state.led[1] = green;
+  output->state.led[2] = blue;
+  output_end_update(output, OUTPUT_FLAG_LED);
+  output_schedule(output);
+}
+
+void output_set_rumble(struct output *output, uint8_t strength) {
+  output_begin_update(output);
+  output->state.rumble = strength;
+  output_end_update(output, OUTPUT_FLAG_RUMBLE);
+  output_schedule(output);
+}
+
+void output_set_trigger(struct output *output, uint8_t mode,
+                        const uint8_t params[OUTPUT_TRIGGER_PARAMS]) {
+  output_begin_update(output);
+  output->state.trigger_mode = mode;
+  memcpy(output->state.trigger_params, params, OUTPUT_TRIGGER_PARAMS);
+  output_end_update(output, OUTPUT_FLAG_TRIGGER);
+  output_schedule(output);
+}
+
+void output_encode(const struct output_state *state, unsigned flags,
+                   uint8_t *report) {
+  memset(report, 0, OUTPUT_REPORT_SIZE);
+  report[0] = OUTPUT_REPORT_ID;
+  report[OUTPUT_OFFSET_FLAGS] = (uint8_t)flags;
+  // The whole state is always there, the flags say what to apply.
+  memcpy(report + OUTPUT_OFFSET_LED, state->led, sizeof(state->led));
+  report[OUTPUT_OFFSET_RUMBLE] = state->rumble;
+  report[OUTPUT_OFFSET_TRIGGER_MODE] = state->trigger_mode;
+  memcpy(report + OUTPUT_OFFSET_TRIGGER_PARAMS, state->trigger_params,
+         OUTPUT_TRIGGER_PARAMS);
+}
+
+void output_get_stats(struct output *output, struct output_stats *stats) {
+  stats->updates = atomic_load_explicit(&output->updates, memory_order_relaxed);
+  stats->reports = atomic_load_explicit(&output->reports, memory_order_relaxed);
+  stats->errors = atomic_load_explicit(&output->errors, memory_order_relaxed);
+}
+
+void output_stop(struct output *output) {
+  atomic_store(&output->running, 0);
+  // Returns LIBUSB_ERROR_NOT_FOUND if no report is in flight.
+  libusb_cancel_transfer(output->transfer);
+}
+
+int output_in_flight(struct output *output) {
+  return atomic_load(&output->in_flight);
+}
+
+void output_close(struct output *output) {
+  if (output == NULL) {
+    return;
+  }
+  if (output->transfer != NULL) {
+    transfer_pool_release(output->pool, output->transfer);
+  }
+  free(output);
+}
@@ -0,0 +1,107 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <libusb-1.0/libusb.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "transfer_pool.h"
+
+// Feedback (lights, rumble, adaptive trigger) sent to a controller through
+// its interrupt OUT endpoint. Setters only record the wanted state and return;
+// whatever changed is sent asynchronously in a single output report, at most
+// one per polling interval of the endpoint, so any number of updates between
+// two reports cost one report.
+
+// Output report 2 of the report descriptor, 47 bytes after the ID. The
+// meaning of the bytes is provisional until the real layout is known; the
+// simulated controller uses this one.
+#define OUTPUT_REPORT_ID 0x02
+#define OUTPUT_REPORT_SIZE 48
+#define OUTPUT_OFFSET_FLAGS 1
+#define OUTPUT_OFFSET_LED 2
+#define OUTPUT_OFFSET_RUMBLE 5
+#define OUTPUT_OFFSET_TRIGGER_MODE 6
+#define OUTPUT_OFFSET_TRIGGER_PARAMS 7
+#define OUTPUT_TRIGGER_PARAMS 10
+
+// Which parts of the state a report carries, in its flags byte.
+#define OUTPUT_FLAG_LED 0x01
+#define OUTPUT_FLAG_RUMBLE 0x02
+#define OUTPUT_FLAG_TRIGGER 0x04
+
+struct output_state {
+  uint8_t led[3];
+  uint8_t rumble;
+  uint8_t trigger_mode;
+  uint8_t trigger_params[OUTPUT_TRIGGER_PARAMS];
+};
+
+struct output_stats {
+  // Setter calls.
+  uint64_t updates;
+  // Output reports actually sent.
+  uint64_t reports;
+  uint64_t errors;
+};
+
+struct output {
+  libusb_device_handle *dev_handle;
+  unsigned char endpoint_address;
+  // From `pool`, `buffer` is its buffer.
+  struct transfer_pool *pool;
+  struct libusb_transfer *transfer;
+  unsigned char *buffer;
+
+  // Seqlock over `state`: odd while a setter is writing it. One thread sets
+  // the state of a controller.
+  atomic_uint sequence;
+  struct output_state state;
+  // OUTPUT_FLAG_* changed since the last report.
+  atomic_uint changed;
+
+  // 1 while the transfer is owned by libusb or being submitted. Whoever
+  // flips it from 0 to 1 sends the next report.
+  atomic_int in_flight;
+  atomic_int running;
+  atomic_uint_least64_t updates;
+  atomic_uint_least64_t reports;
+  atomic_uint_least64_t errors;
+};
+
+// Whether `output_open` can write to this endpoint: interrupt OUT only.
+int output_endpoint_supported(
+    const struct libusb_endpoint_descriptor *endpoint);
+
+// The endpoint's interface must be claimed. The transfer comes from the pool
+// of the device. Returns NULL on failure.
+struct output *output_open(libusb_device_handle *dev_handle,
+                           struct transfer_pool *pool,
+                           const struct libusb_endpoint_descriptor *endpoint);
+
+// Allows reports to be sent, and sends the current state if anything was
+// set before.
+void output_start(struct output *output);
+
+// Never block: they update the state and schedule a report if none is in
+// flight.
+void output_set_led(struct output *output, uint8_t red, uint8_t green,
+                    uint8_t blue);
+void output_set_rumble(struct output *output, uint8_t strength);
+void output_set_trigger(struct output *output, uint8_t mode,
+                        const uint8_t params[OUTPUT_TRIGGER_PARAMS]);
+
+// Writes the report for `state` carrying the parts in `flags` into `report`,
+// which holds OUTPUT_REPORT_SIZE bytes.
+void output_encode(const struct output_state *state, unsigned flags,
+                   uint8_t *report);
+
+void output_get_stats(struct output *output, struct output_stats *stats);
+
+// Cancels the report in flight, if any. Events must still be handled until
+// `output_in_flight` returns 0 before closing.
+void output_stop(struct output *output);
+int output_in_flight(struct output *output);
+void output_close(struct output *output);
+
+#endif // OUTPUT_H
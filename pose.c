@@ -0,0 +1,160 @@
+#include "pose.h"
+
+#include <math.h>
+#include <string.h>
+
+void pose_predictor_init(struct pose_predictor *predictor) {
+  memset(predictor, 0, sizeof(*predictor));
+  for (int controller = 0; controller < IMU_NUM_CONTROLLERS; ++controller) {
+    atomic_init(&predictor->slots[controller].sequence, 0);
+  }
+}
+
+void pose_predictor_add_sample(struct pose_predictor *predictor, int controller,
+                               uint64_t timestamp_ns, const float gyro[3]) {
+  const int slot = predictor->next[controller];
+  predictor->timestamps[controller][slot] = timestamp_ns;
+  memcpy(predictor->gyro[controller][slot], gyro, sizeof(float) * 3);
+  predictor->next[controller] = (slot + 1) % POSE_HISTORY;
+  if (predictor->count[controller] < POSE_HISTORY) {
+    ++predictor->count[controller];
+  }
+}
+
+// Least squares line through the recent samples of every axis, evaluated at
+// the latest one: less noisy than the latest sample alone, and the slope is
+// the angular acceleration.
+static void pose_fit(const struct pose_predictor *predictor, int controller,
+                     uint64_t latest_ns, float velocity[3],
+                     float acceleration[3]) {
+  const int count = predictor->count[controller];
+  float t[POSE_HISTORY];
+  // The samples fitted, at most all of them.
+  int used[POSE_HISTORY];
+  int n = 0;
+  float mean_t = 0.0f;
+  for (int i = 0; i < count; ++i) {
+    // Signed: after clock_sync restarts, the samples from before can be
+    // timed after the latest one. They are left out.
+    const int64_t age_ns =
+        (int64_t)(latest_ns - predictor->timestamps[controller][i]);
+    if (age_ns < 0) {
+      continue;
+    }
+    // Relative to the latest sample, in seconds, to keep float precision.
+    t[n] = -(float)age_ns * 1e-9f;
+    mean_t += t[n];
+    used[n++] = i;
+  }
+  // The latest sample is always there.
+  mean_t /= (float)n;
+  float variance = 0.0f;
+  for (int i = 0; i < n; ++i) {
+    variance += (t[i] - mean_t) * (t[i] - mean_t);
+  }
+  for (int axis = 0; axis < 3; ++axis) {
+    float mean = 0.0f;
+    for (int i = 0; i < n; ++i) {
+      mean += predictor->gyro[controller][used[i]][axis];
+    }
+    mean /= (float)n;
+    float slope = 0.0f;
+    if (variance > 0.0f) {
+      float covariance = 0.0f;
+      for (int i = 0; i < n; ++i) {
+        covariance += (t[i] - mean_t) *
+                      (predictor->gyro[controller][used[i]][axis] - mean);
+      }
+      slope = covariance / variance;
+    }
+    slope = fminf(fmaxf(slope, -POSE_MAX_ANGULAR_ACCELERATION),
+                  POSE_MAX_ANGULAR_ACCELERATION);
+    velocity[axis] = mean - slope * mean_t;
+    acceleration[axis] = slope;
+  }
+}
+
+void pose_predictor_publish(struct pose_predictor *predictor, int controller,
+                            const struct imu_fusion *fusion) {
+  if (predictor->count[controller] == 0) {
+    return;
+  }
+  const int latest =
+      (predictor->next[controller] + POSE_HISTORY - 1) % POSE_HISTORY;
+  struct pose_sample sample;
+  sample.timestamp_ns = predictor->timestamps[controller][latest];
+  imu_fusion_get_orientation(fusion, controller, sample.q);
+  pose_fit(predictor, controller, sample.timestamp_ns, sample.angular_velocity,
+           sample.angular_acceleration);
+  for (int axis = 0; axis < 3; ++axis) {
+    sample.angular_velocity[axis] -= fusion->bias[axis][controller];
+  }
+
+  struct pose_slot *slot = &predictor->slots[controller];
+  const unsigned sequence =
+      atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+  atomic_store_explicit(&slot->sequence, sequence + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  memcpy(&slot->sample, &sample, sizeof(sample));
+  atomic_store_explicit(&slot->sequence, sequence + 2, memory_order_release);
+}
+
+void pose_extrapolate(const struct pose_sample *sample, uint64_t target_ns,
+                      struct pose *pose) {
+  uint64_t horizon_ns = 0;
+  if (target_ns > sample->timestamp_ns) {
+    horizon_ns = target_ns - sample->timestamp_ns;
+  }
+  if (horizon_ns > POSE_MAX_HORIZON_NS) {
+    horizon_ns = POSE_MAX_HORIZON_NS;
+  }
+  const float dt = (float)horizon_ns * 1e-9f;
+  pose->timestamp_ns = target_ns;
+  pose->horizon_s = dt;
+
+  // With a constant acceleration the mean velocity over the horizon is the
+  // one halfway through. Rotating about its axis is exact for a fixed axis,
+  // and close enough over a few tens of milliseconds otherwise.
+  float mean[3];
+  for (int axis = 0; axis < 3; ++axis) {
+    mean[axis] = sample->angular_velocity[axis] +
+                 0.5f * dt * sample->angular_acceleration[axis];
+    pose->angular_velocity[axis] = sample->angular_velocity[axis] +
+                                   dt * sample->angular_acceleration[axis];
+  }
+  const float rate =
+      sqrtf(mean[0] * mean[0] + mean[1] * mean[1] + mean[2] * mean[2]);
+  const float half_angle = 0.5f * rate * dt;
+  if (half_angle < 1e-6f) {
+    memcpy(pose->q, sample->q, sizeof(pose->q));
+    return;
+  }
+  const float s = sinf(half_angle) / rate;
+  const float d[4] = {cosf(half_angle), mean[0] * s, mean[1] * s,
+                      mean[2] * s};
+  const float *q = sample->q;
+  // q ⊗ d: the rotation is in the controller frame.
+  pose->q[0] = q[0] * d[0] - q[1] * d[1] - q[2] * d[2] - q[3] * d[3];
+  pose->q[1] = q[0] * d[1] + q[1] * d[0] + q[2] * d[3] - q[3] * d[2];
+  pose->q[2] = q[0] * d[2] - q[1] * d[3] + q[2] * d[0] + q[3] * d[1];
+  pose->q[3] = q[0] * d[3] + q[1] * d[2] - q[2] * d[1] + q[3] * d[0];
+}
+
+int pose_predict(const struct pose_predictor *predictor, int controller,
+                 uint64_t target_ns, struct pose *pose) {
+  const struct pose_slot *slot = &predictor->slots[controller];
+  struct pose_sample sample;
+  unsigned before;
+  do {
+    before = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    memcpy(&sample, &slot->sample, sizeof(sample));
+    atomic_thread_fence(memory_order_acquire);
+  } while ((before & 1) != 0 ||
+           atomic_load_explicit(&slot->sequence, memory_order_relaxed) !=
+               before);
+  if (before == 0) {
+    return -1;
+  }
+  pose_extrapolate(&sample, target_ns, pose);
+  return 0;
+}
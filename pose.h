@@ -0,0 +1,85 @@
+#ifndef POSE_H
+#define POSE_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "imu.h"
+#include "ring.h"
+
+// Orientation of the controllers extrapolated to a future host time, such as
+// the display scan-out of the frame being rendered. The thread running the
+// IMU fusion publishes the latest orientation with an angular velocity and
+// acceleration fitted to the recent gyro samples; any number of threads can
+// then ask for a prediction without locking or waiting on it.
+
+// Gyro samples fitted per controller, a few milliseconds at 1 kHz.
+#define POSE_HISTORY 8
+// Predictions further out than this are made for this horizon, error grows
+// too quickly past it to be useful.
+#define POSE_MAX_HORIZON_NS 50000000ull
+// The fitted angular acceleration (rad/s²) is clamped to this, the slope of a
+// few noisy samples is otherwise easily way off.
+#define POSE_MAX_ANGULAR_ACCELERATION 100.0f
+
+// The state a prediction starts from.
+struct pose_sample {
+  // Host CLOCK_MONOTONIC time of the latest gyro sample.
+  uint64_t timestamp_ns;
+  // w, x, y, z, controller frame into world frame.
+  float q[4];
+  // Controller frame, bias corrected, in rad/s and rad/s².
+  float angular_velocity[3];
+  float angular_acceleration[3];
+};
+
+struct pose {
+  // Time the pose was predicted for.
+  uint64_t timestamp_ns;
+  float q[4];
+  // Controller frame, in rad/s.
+  float angular_velocity[3];
+  // How far ahead of the latest sample the prediction went, after clamping.
+  float horizon_s;
+};
+
+struct pose_slot {
+  // Seqlock over `sample`: odd while the writer updates it.
+  _Alignas(RING_CACHE_LINE) atomic_uint sequence;
+  struct pose_sample sample;
+};
+
+struct pose_predictor {
+  struct pose_slot slots[IMU_NUM_CONTROLLERS];
+
+  // Writer side: the recent raw gyro samples of every controller.
+  _Alignas(RING_CACHE_LINE) uint64_t timestamps[IMU_NUM_CONTROLLERS]
+                                               [POSE_HISTORY];
+  float gyro[IMU_NUM_CONTROLLERS][POSE_HISTORY][3];
+  int count[IMU_NUM_CONTROLLERS];
+  int next[IMU_NUM_CONTROLLERS];
+};
+
+void pose_predictor_init(struct pose_predictor *predictor);
+
+// Writer: remembers a gyro sample (rad/s, before bias correction) taken at
+// `timestamp_ns`.
+void pose_predictor_add_sample(struct pose_predictor *predictor, int controller,
+                               uint64_t timestamp_ns, const float gyro[3]);
+
+// Writer: publishes the orientation of `controller` after the fusion caught
+// up with the samples added so far.
+void pose_predictor_publish(struct pose_predictor *predictor, int controller,
+                            const struct imu_fusion *fusion);
+
+// Extrapolates a sample to `target_ns`, assuming a constant angular
+// acceleration. Targets in the past of the sample give the sample itself.
+void pose_extrapolate(const struct pose_sample *sample, uint64_t target_ns,
+                      struct pose *pose);
+
+// Reader: predicts the pose of `controller` at `target_ns`, from any thread.
+// Returns 0, or -1 if nothing was published for it yet.
+int pose_predict(const struct pose_predictor *predictor, int controller,
+                 uint64_t target_ns, struct pose *pose);
+
+#endif // POSE_H
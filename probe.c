@@ -0,0 +1,281 @@
+#include "probe.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "monotonic.h"
+#include "stream.h"
+
+#define PROBE_MAX_DEVICES DISCOVERY_MAX_DEVICES
+// Cancellations complete within a frame or two, this only guards against a
+// device that stopped responding altogether.
+#define PROBE_CANCEL_TIMEOUT_MS 100
+
+struct probe_read {
+  struct probe_result *result;
+  struct libusb_transfer *transfer;
+  uint64_t submitted_ns;
+  // Submitted and not completed yet.
+  int in_flight;
+  int *pending;
+};
+
+struct probe_interface {
+  libusb_device_handle *dev_handle;
+  int interface_number;
+  // The kernel driver was detached and is reattached after release.
+  int reattach;
+};
+
+static void probe_transfer_callback(struct libusb_transfer *transfer) {
+  struct probe_read *read = transfer->user_data;
+  const uint64_t now = monotonic_ns();
+  struct probe_result *result = read->result;
+  if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+    result->outcome = PROBE_ANSWERED;
+    result->latency_ns = now - read->submitted_ns;
+    result->length = transfer->actual_length;
+  } else if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
+    result->outcome = PROBE_TIMED_OUT;
+  } else {
+    result->outcome = PROBE_FAILED;
+    result->error = transfer->status;
+  }
+  read->in_flight = 0;
+  --*read->pending;
+}
+
+// Claims an interface once per device, whichever endpoint needs it first.
+// Returns 0 or a libusb error code.
+static int probe_claim(struct probe_interface *interfaces, int *num_interfaces,
+                       libusb_device_handle *dev_handle, int interface_number) {
+  for (int i = 0; i < *num_interfaces; ++i) {
+    if (interfaces[i].dev_handle == dev_handle &&
+        interfaces[i].interface_number == interface_number) {
+      return 0;
+    }
+  }
+  int reattach = 0;
+  if (libusb_kernel_driver_active(dev_handle, interface_number) == 1) {
+    int result = libusb_detach_kernel_driver(dev_handle, interface_number);
+    if (result != LIBUSB_SUCCESS) {
+      return result;
+    }
+    reattach = 1;
+  }
+  int result = libusb_claim_interface(dev_handle, interface_number);
+  if (result != LIBUSB_SUCCESS) {
+    if (reattach) {
+      libusb_attach_kernel_driver(dev_handle, interface_number);
+    }
+    return result;
+  }
+  struct probe_interface *claimed = &interfaces[(*num_interfaces)++];
+  claimed->dev_handle = dev_handle;
+  claimed->interface_number = interface_number;
+  claimed->reattach = reattach;
+  return 0;
+}
+
+// Runs the event loop until every read completed or `deadline_ns` passed.
+static void probe_wait(libusb_context *ctx, const int *pending,
+                       uint64_t deadline_ns) {
+  for (;;) {
+    const uint64_t now = monotonic_ns();
+    if (*pending == 0 || now >= deadline_ns) {
+      return;
+    }
+    const uint64_t remaining = deadline_ns - now;
+    struct timeval timeout = {
+        .tv_sec = remaining / 1000000000ull,
+        .tv_usec = (remaining % 1000000000ull) / 1000,
+    };
+    if (libusb_handle_events_timeout_completed(ctx, &timeout, NULL) !=
+        LIBUSB_SUCCESS) {
+      return;
+    }
+  }
+}
+
+// Whether a read on `dev_handle` is still owned by libusb.
+static int probe_in_flight(const struct probe_read *reads, int num_reads,
+                           libusb_device_handle *dev_handle) {
+  for (int i = 0; i < num_reads; ++i) {
+    if (reads[i].in_flight && reads[i].transfer->dev_handle == dev_handle) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int probe_devices(libusb_context *ctx, int deadline_ms,
+                  struct probe_result *results, int max_results) {
+  libusb_device **dev_list;
+  ssize_t count = libusb_get_device_list(ctx, &dev_list);
+  if (count < 0) {
+    return (int)count;
+  }
+  if (max_results > PROBE_MAX_ENDPOINTS) {
+    max_results = PROBE_MAX_ENDPOINTS;
+  }
+
+  libusb_device_handle *handles[PROBE_MAX_DEVICES];
+  int num_handles = 0;
+  struct probe_interface interfaces[PROBE_MAX_ENDPOINTS];
+  int num_interfaces = 0;
+  struct probe_read reads[PROBE_MAX_ENDPOINTS];
+  int num_results = 0;
+  int pending = 0;
+  const uint64_t deadline_ns =
+      monotonic_ns() + (uint64_t)deadline_ms * 1000000ull;
+
+  // Everything is submitted before waiting on anything.
+  for (ssize_t i = 0; i < count && num_handles < PROBE_MAX_DEVICES; ++i) {
+    struct libusb_device_descriptor dev_desc;
+    if (libusb_get_device_descriptor(dev_list[i], &dev_desc) !=
+            LIBUSB_SUCCESS ||
+        !discovery_matches(&dev_desc)) {
+      continue;
+    }
+    char port_path[DISCOVERY_PORT_PATH_SIZE];
+    discovery_port_path(dev_list[i], port_path);
+    struct libusb_config_descriptor *config;
+    if (libusb_get_active_config_descriptor(dev_list[i], &config) !=
+        LIBUSB_SUCCESS) {
+      fprintf(stderr, "%s:%d: no active configuration on %04x at %s\n",
+              __FILE__, __LINE__, dev_desc.idProduct, port_path);
+      continue;
+    }
+    libusb_device_handle *dev_handle;
+    int result = libusb_open(dev_list[i], &dev_handle);
+    if (result != LIBUSB_SUCCESS) {
+      fprintf(stderr, "%s:%d: unable to open %04x at %s: %s\n", __FILE__,
+              __LINE__, dev_desc.idProduct, port_path,
+              libusb_strerror(result));
+      libusb_free_config_descriptor(config);
+      continue;
+    }
+    handles[num_handles++] = dev_handle;
+
+    for (int j = 0; j < config->bNumInterfaces; ++j) {
+      if (config->interface[j].num_altsetting == 0) {
+        continue;
+      }
+      const struct libusb_interface_descriptor *altsetting =
+          &config->interface[j].altsetting[0];
+      for (int k = 0; k < altsetting->bNumEndpoints; ++k) {
+        const struct libusb_endpoint_descriptor *endpoint =
+            &altsetting->endpoint[k];
+        if (!stream_endpoint_supported(endpoint) ||
+            num_results == max_results) {
+          continue;
+        }
+        struct probe_result *probe_result = &results[num_results];
+        struct probe_read *read = &reads[num_results++];
+        memset(probe_result, 0, sizeof(*probe_result));
+        memset(read, 0, sizeof(*read));
+        probe_result->product_id = dev_desc.idProduct;
+        memcpy(probe_result->port_path, port_path, sizeof(port_path));
+        probe_result->interface_number = altsetting->bInterfaceNumber;
+        probe_result->endpoint = endpoint->bEndpointAddress;
+        probe_result->max_packet_size = endpoint->wMaxPacketSize;
+        probe_result->outcome = PROBE_FAILED;
+        read->result = probe_result;
+        read->pending = &pending;
+
+        result = probe_claim(interfaces, &num_interfaces, dev_handle,
+                             altsetting->bInterfaceNumber);
+        unsigned char *buffer = malloc(endpoint->wMaxPacketSize);
+        read->transfer = libusb_alloc_transfer(0);
+        if (result == LIBUSB_SUCCESS &&
+            (buffer == NULL || read->transfer == NULL)) {
+          result = LIBUSB_ERROR_NO_MEM;
+        }
+        if (result == LIBUSB_SUCCESS) {
+          libusb_fill_interrupt_transfer(
+              read->transfer, dev_handle, endpoint->bEndpointAddress, buffer,
+              endpoint->wMaxPacketSize, probe_transfer_callback, read, 0);
+          read->transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+          buffer = NULL;
+          read->submitted_ns = monotonic_ns();
+          result = libusb_submit_transfer(read->transfer);
+        }
+        if (result == LIBUSB_SUCCESS) {
+          probe_result->outcome = PROBE_TIMED_OUT;
+          read->in_flight = 1;
+          ++pending;
+        } else {
+          probe_result->error = result;
+          free(buffer);
+        }
+      }
+    }
+    libusb_free_config_descriptor(config);
+  }
+  libusb_free_device_list(dev_list, 1);
+
+  probe_wait(ctx, &pending, deadline_ns);
+  if (pending > 0) {
+    for (int i = 0; i < num_results; ++i) {
+      if (reads[i].in_flight) {
+        libusb_cancel_transfer(reads[i].transfer);
+      }
+    }
+    probe_wait(ctx, &pending,
+               monotonic_ns() + PROBE_CANCEL_TIMEOUT_MS * 1000000ull);
+  }
+
+  // A transfer libusb still owns cannot be freed, and the handle it was
+  // submitted on cannot be closed under it: both are leaked, the lesser evil.
+  for (int i = 0; i < num_results; ++i) {
+    if (reads[i].transfer != NULL && !reads[i].in_flight) {
+      libusb_free_transfer(reads[i].transfer);
+    }
+  }
+  for (int i = 0; i < num_interfaces; ++i) {
+    if (probe_in_flight(reads, num_results, interfaces[i].dev_handle)) {
+      continue;
+    }
+    libusb_release_interface(interfaces[i].dev_handle,
+                             interfaces[i].interface_number);
+    if (interfaces[i].reattach) {
+      libusb_attach_kernel_driver(interfaces[i].dev_handle,
+                                  interfaces[i].interface_number);
+    }
+  }
+  for (int i = 0; i < num_handles; ++i) {
+    if (probe_in_flight(reads, num_results, handles[i])) {
+      fprintf(stderr, "%s:%d: a read did not complete its cancellation, "
+                      "leaving its device open\n",
+              __FILE__, __LINE__);
+      continue;
+    }
+    libusb_close(handles[i]);
+  }
+  return num_results;
+}
+
+void probe_print_json(const struct probe_result *result) {
+  static const char *outcomes[] = {
+      [PROBE_ANSWERED] = "answered",
+      [PROBE_TIMED_OUT] = "timed_out",
+      [PROBE_FAILED] = "failed",
+  };
+  printf("{\"product_id\": \"%04x\", \"port\": \"%s\", \"interface\": %d, "
+         "\"endpoint\": \"0x%02x\", \"max_packet_size\": %d, "
+         "\"outcome\": \"%s\"",
+         result->product_id, result->port_path, result->interface_number,
+         result->endpoint, result->max_packet_size, outcomes[result->outcome]);
+  if (result->outcome == PROBE_ANSWERED) {
+    printf(", \"latency_us\": %.1f, \"length\": %d",
+           result->latency_ns * 1e-3, result->length);
+  } else if (result->outcome == PROBE_FAILED && result->error < 0) {
+    printf(", \"error\": \"%s\"", libusb_error_name(result->error));
+  } else if (result->outcome == PROBE_FAILED) {
+    // A libusb_transfer_status.
+    printf(", \"transfer_status\": %d", result->error);
+  }
+  printf("}\n");
+}
@@ -0,0 +1,51 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+#include <libusb-1.0/libusb.h>
+#include <stdint.h>
+
+#include "discovery.h"
+
+// Inventory of the PSVR2 devices: one read is submitted at once to every
+// interrupt IN endpoint of every device, and whatever did not answer when a
+// single deadline expires is cancelled. The whole scan takes about as long
+// as the slowest endpoint to send its first report, bounded by the deadline.
+
+#define PROBE_MAX_ENDPOINTS 32
+#define PROBE_DEFAULT_DEADLINE_MS 500
+
+enum probe_outcome {
+  // A report came back before the deadline.
+  PROBE_ANSWERED,
+  // Nothing came back, the read was cancelled at the deadline.
+  PROBE_TIMED_OUT,
+  // The interface could not be claimed or the read failed, see `error`.
+  PROBE_FAILED,
+};
+
+struct probe_result {
+  uint16_t product_id;
+  char port_path[DISCOVERY_PORT_PATH_SIZE];
+  uint8_t interface_number;
+  uint8_t endpoint;
+  uint16_t max_packet_size;
+  enum probe_outcome outcome;
+  // libusb error code or transfer status for PROBE_FAILED, 0 otherwise.
+  int error;
+  // From the submission of the read to its completion.
+  uint64_t latency_ns;
+  // Size of the first report.
+  int length;
+};
+
+// Probes every endpoint within `deadline_ms` and fills up to `max_results`
+// results, in device then endpoint order. Runs the libusb event loop on the
+// calling thread, nothing else may be streaming. Returns the number of
+// results, or a libusb error code if the devices could not be listed.
+int probe_devices(libusb_context *ctx, int deadline_ms,
+                  struct probe_result *results, int max_results);
+
+// Prints a result as one JSON object on a line of its own.
+void probe_print_json(const struct probe_result *result);
+
+#endif // PROBE_H
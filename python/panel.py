@@ -1,6 +1,11 @@
+import numpy as np
 import usb.core
 import panel as pn
 import param
+from bokeh.models import ColumnDataSource
+from bokeh.plotting import figure
+
+import psvr2
 
 class USBEndpoint(param.Parameterized):
     usb_endpoint = param.Parameter(None, precedence= -1)
@@ -112,6 +117,112 @@ class USBDevice(param.Parameterized):
                     ) for index, configuration in enumerate(configurations)],
                 title= f"{self.vendor()}:{self.product()}", collapsed= True)
 
+class LiveStream(param.Parameterized):
+    """Gyro, accelerometer and buttons of one stream, as `main --publish` decodes them."""
+    stream = param.Parameter(None, precedence= -1)
+    shared = param.Parameter(None, precedence= -1)
+    # Points kept on the live plots: the last 1024 buckets of 10 ms, 2 per bucket
+    rollover = param.Integer(2 * psvr2.DOWNSAMPLE_BUCKETS, precedence= -1)
+    # Updates between two redraws of the whole session
+    session_every = param.Integer(20, precedence= -1)
+
+    def __init__(self, **params):
+        super().__init__(**params)
+        self.names = []
+        columns = []
+        for names, indices in ((("gx", "gy", "gz"), self.stream.gyro),
+                               (("ax", "ay", "az"), self.stream.accel)):
+            if indices:
+                self.names.extend(names)
+                columns.extend(indices)
+        # Every report is reduced natively to min/max points, whatever the
+        # session length only those go to the browser
+        self.imu = self.shared.downsample(columns) if columns else None
+        self.buttons = self.shared.downsample([0])
+        empty = {name: [] for name in ("t", "buttons", *self.names)}
+        self.source = ColumnDataSource(data= dict(empty))
+        self.session_source = ColumnDataSource(data= dict(empty))
+        self.start_ns = None
+        self.updates = 0
+
+    def _plot(self, title, names, y_label, source):
+        plot = figure(title= title, height= 200, sizing_mode= "stretch_width",
+                      x_axis_label= "s", y_axis_label= y_label)
+        for name, color in zip(names, ("crimson", "seagreen", "royalblue")):
+            plot.line("t", name, source= source, color= color, legend_label= name)
+        plot.legend.location = "top_left"
+        return plot
+
+    def _columns(self, buttons, imu):
+        timestamps, values = buttons
+        data = {
+            "t": (timestamps.astype(np.int64) - self.start_ns) * 1e-9,
+            "buttons": values[:, 0].copy(),
+        }
+        if imu is not None:
+            # Same samples and buckets, so the same points in time
+            for index, name in enumerate(self.names):
+                data[name] = imu[1][:, index].copy()
+        return data
+
+    def update(self):
+        timestamps, buttons, values = self.stream.read()
+        if len(timestamps) > 0:
+            if self.start_ns is None:
+                self.start_ns = int(timestamps[0])
+            if self.imu is not None:
+                self.imu.add(timestamps, values)
+            self.buttons.add(timestamps, buttons.astype(np.float32)[:, None])
+        if self.start_ns is None:
+            return
+        # Only the buckets completed since the last update
+        data = self._columns(self.buttons.read(),
+                             self.imu.read() if self.imu is not None else None)
+        if len(data["t"]) > 0:
+            self.source.stream(data, rollover= self.rollover)
+
+        self.updates += 1
+        if self.updates % self.session_every == 0:
+            # The coarsest points are minutes wide, redrawing them all is cheap
+            session_s = self.source.data["t"][-1] if len(self.source.data["t"]) else 0
+            self.session_source.data = self._columns(
+                self.buttons.window(session_s),
+                self.imu.window(session_s) if self.imu is not None else None)
+
+    def ui(self):
+        plots = []
+        if self.stream.gyro is not None:
+            plots.append(self._plot("Angular velocity", ("gx", "gy", "gz"), "deg/s", self.source))
+        if self.stream.accel is not None:
+            plots.append(self._plot("Acceleration", ("ax", "ay", "az"), "g", self.source))
+        plots.append(self._plot("Buttons", ("buttons",), "mask", self.source))
+        if self.stream.gyro is not None:
+            plots.append(self._plot("Session angular velocity", ("gx", "gy", "gz"), "deg/s",
+                                    self.session_source))
+        return pn.Card(*[pn.pane.Bokeh(plot) for plot in plots],
+                       title= self.stream.name, collapsed= False)
+
+def live_view():
+    """
+    Plots what a running `main --publish` shares, without touching the devices.
+    """
+    try:
+        shared = psvr2.SharedState()
+    except OSError as error:
+        return pn.pane.Markdown(f"No live data: {error}")
+    streams = [LiveStream(stream= stream, shared= shared)
+               for stream in shared.streams() if stream.decodable]
+    if not streams:
+        return pn.pane.Markdown("No live data: no stream with a report descriptor")
+
+    def update():
+        for stream in streams:
+            stream.update()
+    # About 20 Hz is plenty for the eye, every report in between is in the
+    # min/max points sent
+    pn.state.add_periodic_callback(update, period= 50)
+    return pn.Column(*[stream.ui() for stream in streams])
+
 def main(vendor: list[int] = [], product: list[int] = []):
     """
     Args:
@@ -141,7 +252,8 @@ def main(vendor: list[int] = [], product: list[int] = []):
     # Instantiate the template with widgets displayed in the sidebar
     template = pn.template.FastListTemplate(
         title="USB Prober",
-        main = [device.ui() for device in devices],
+        main = [pn.Card(live_view(), title= "Live", collapsed= False),
+                *[device.ui() for device in devices]],
     )
     template.servable()
 
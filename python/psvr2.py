@@ -0,0 +1,357 @@
+"""Live controller data from a running `main --publish`, through ctypes.
+
+The streaming daemon keeps the devices and writes what it decodes into a
+shared memory segment (see shared_state.h). This module maps that segment
+with libpsvr2.so, built by `make libpsvr2.so` at the root of the repository,
+and hands out the recent reports of every stream decoded into NumPy arrays.
+The arrays are allocated once per stream and filled in place by the native
+code, what `Stream.read` returns are views into them, not copies.
+
+With `main --merge`, `Merged` reads the frames joining both controllers at
+the same instants (see merge.h) into NumPy arrays the same way.
+
+For plotting, `Downsample` reduces what `Stream.read` returns to min/max
+points at a few zoom levels, natively and in fixed memory however long the
+session (see downsample.h).
+"""
+
+import ctypes
+import os
+
+import numpy as np
+
+DEFAULT_NAME = "/psvr2-state"
+# Mirrors hid.h
+HID_MAX_VALUES = 64
+HID_USAGE_PAGE_SENSORS = 0x20
+HID_USAGE_ACCELERATION = (0x0453, 0x0454, 0x0455)
+HID_USAGE_ANGULAR_VELOCITY = (0x0457, 0x0458, 0x0459)
+
+# Mirrors merge.h
+MERGE_SIDES = 2
+MERGE_LEFT = 0
+MERGE_RIGHT = 1
+
+# Mirrors downsample.h
+DOWNSAMPLE_MAX_CHANNELS = 8
+DOWNSAMPLE_BUCKETS = 1024
+DOWNSAMPLE_LEVELS = 4
+
+PRODUCTS = {
+    0x0cde: "PlayStation VR2",
+    0x0e45: "PlayStation VR2 Sense Controller (L)",
+    0x0e46: "PlayStation VR2 Sense Controller (R)",
+}
+
+
+class _SharedState(ctypes.Structure):
+    # struct shared_state
+    _fields_ = [
+        ("segment", ctypes.c_void_p),
+        ("name", ctypes.c_char * 64),
+        ("writer", ctypes.c_int),
+    ]
+
+
+class StreamState(ctypes.Structure):
+    # struct shared_stream_state
+    _fields_ = [
+        ("timestamp_ns", ctypes.c_uint64),
+        ("reports", ctypes.c_uint64),
+        ("product_id", ctypes.c_uint16),
+        ("endpoint", ctypes.c_uint8),
+        ("connected", ctypes.c_uint8),
+        ("report_id", ctypes.c_uint8),
+        ("has_orientation", ctypes.c_uint8),
+        ("num_values", ctypes.c_uint16),
+        ("buttons", ctypes.c_uint32),
+        ("orientation", ctypes.c_float * 4),
+        ("values", ctypes.c_float * HID_MAX_VALUES),
+    ]
+
+
+def _load_library(path=None):
+    if path is None:
+        path = os.environ.get(
+            "PSVR2_LIBRARY",
+            os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "libpsvr2.so"),
+        )
+    lib = ctypes.CDLL(path)
+    state = ctypes.POINTER(_SharedState)
+    lib.shared_state_open.argtypes = [state, ctypes.c_char_p]
+    lib.shared_state_open.restype = ctypes.c_int
+    lib.shared_state_num_streams.argtypes = [state]
+    lib.shared_state_num_streams.restype = ctypes.c_int
+    lib.shared_state_close.argtypes = [state]
+    lib.shared_state_close.restype = None
+    lib.shared_state_read.argtypes = [state, ctypes.c_int, ctypes.POINTER(StreamState)]
+    lib.shared_state_read.restype = ctypes.c_int
+    lib.shared_state_decoder_size.argtypes = []
+    lib.shared_state_decoder_size.restype = ctypes.c_size_t
+    lib.shared_state_compile.argtypes = [state, ctypes.c_int, ctypes.c_void_p]
+    lib.shared_state_compile.restype = ctypes.c_int
+    lib.shared_state_decode_history.argtypes = [
+        state,
+        ctypes.c_int,
+        ctypes.c_void_p,
+        ctypes.POINTER(ctypes.c_uint64),
+        ctypes.c_void_p,
+        ctypes.c_void_p,
+        ctypes.c_void_p,
+        ctypes.c_int,
+    ]
+    lib.shared_state_decode_history.restype = ctypes.c_int
+    lib.shared_state_merge_period_ns.argtypes = [state]
+    lib.shared_state_merge_period_ns.restype = ctypes.c_uint64
+    lib.shared_state_read_merged_columns.argtypes = [
+        state,
+        ctypes.POINTER(ctypes.c_uint64),
+        ctypes.c_void_p,
+        ctypes.c_void_p,
+        ctypes.c_void_p,
+        ctypes.c_void_p,
+        ctypes.c_int,
+    ]
+    lib.shared_state_read_merged_columns.restype = ctypes.c_int
+    lib.hid_find_value.argtypes = [ctypes.c_void_p, ctypes.c_uint16, ctypes.c_uint16]
+    lib.hid_find_value.restype = ctypes.c_int
+    lib.downsample_size.argtypes = []
+    lib.downsample_size.restype = ctypes.c_size_t
+    lib.downsample_init.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_uint64]
+    lib.downsample_init.restype = ctypes.c_int
+    lib.downsample_add.argtypes = [
+        ctypes.c_void_p,
+        ctypes.c_void_p,
+        ctypes.c_void_p,
+        ctypes.c_int,
+        ctypes.c_void_p,
+        ctypes.c_int,
+    ]
+    lib.downsample_add.restype = None
+    lib.downsample_read.argtypes = [
+        ctypes.c_void_p,
+        ctypes.c_int,
+        ctypes.POINTER(ctypes.c_uint64),
+        ctypes.c_void_p,
+        ctypes.c_void_p,
+        ctypes.c_int,
+    ]
+    lib.downsample_read.restype = ctypes.c_int
+    lib.downsample_level_for.argtypes = [ctypes.c_void_p, ctypes.c_uint64]
+    lib.downsample_level_for.restype = ctypes.c_int
+    return lib
+
+
+class Stream:
+    """One streamed endpoint of a device, read from the shared segment."""
+
+    def __init__(self, state, index, product_id, endpoint, batch):
+        self._state = state
+        self.index = index
+        self.product_id = product_id
+        self.endpoint = endpoint
+        lib = state._lib
+        self._decoder = ctypes.create_string_buffer(lib.shared_state_decoder_size())
+        self.decodable = (
+            lib.shared_state_compile(ctypes.byref(state._shared), index, self._decoder) == 0
+        )
+        # Start with what is still in the history.
+        self._next = ctypes.c_uint64(0)
+        self._timestamps = np.zeros(batch, dtype=np.uint64)
+        self._buttons = np.zeros(batch, dtype=np.uint32)
+        self._values = np.zeros((batch, HID_MAX_VALUES), dtype=np.float32)
+        self.gyro = self._find(HID_USAGE_ANGULAR_VELOCITY)
+        self.accel = self._find(HID_USAGE_ACCELERATION)
+
+    @property
+    def name(self):
+        product = PRODUCTS.get(self.product_id, f"{self.product_id:04x}")
+        return f"{product} 0x{self.endpoint:02x}"
+
+    def _find(self, usages):
+        if not self.decodable:
+            return None
+        indices = [
+            self._state._lib.hid_find_value(self._decoder, HID_USAGE_PAGE_SENSORS, usage)
+            for usage in usages
+        ]
+        return indices if min(indices) >= 0 else None
+
+    def state(self):
+        """The latest state, a StreamState, or None if it could not be read."""
+        state = StreamState()
+        if self._state._lib.shared_state_read(
+            ctypes.byref(self._state._shared), self.index, ctypes.byref(state)
+        ) != 0:
+            return None
+        return state
+
+    def read(self):
+        """Decodes the reports received since the last call.
+
+        Returns (timestamps_ns, buttons, values) views of the stream's
+        buffers, valid until the next call. Values are indexed by the value
+        indices of the report descriptor, see `gyro` and `accel`.
+        """
+        if not self.decodable:
+            return self._timestamps[:0], self._buttons[:0], self._values[:0]
+        rows = self._state._lib.shared_state_decode_history(
+            ctypes.byref(self._state._shared),
+            self.index,
+            self._decoder,
+            ctypes.byref(self._next),
+            self._timestamps.ctypes.data,
+            self._buttons.ctypes.data,
+            self._values.ctypes.data,
+            len(self._timestamps),
+        )
+        return self._timestamps[:rows], self._buttons[:rows], self._values[:rows]
+
+
+class Merged:
+    """The frames of both controllers published by `main --merge`."""
+
+    def __init__(self, state, period_ns, batch):
+        self._state = state
+        self.period_ns = period_ns
+        # Start with what is still kept.
+        self._next = ctypes.c_uint64(0)
+        self._timestamps = np.zeros(batch, dtype=np.uint64)
+        self._stale = np.zeros(batch, dtype=np.uint32)
+        self._buttons = np.zeros((batch, MERGE_SIDES), dtype=np.uint32)
+        self._values = np.zeros((batch, MERGE_SIDES, HID_MAX_VALUES), dtype=np.float32)
+
+    def read(self):
+        """The frames merged since the last call.
+
+        Returns (timestamps_ns, stale, buttons, values) views, valid until
+        the next call. `buttons` and `values` have one row per frame and one
+        entry per hand, indexed by MERGE_LEFT and MERGE_RIGHT; bit
+        1 << MERGE_LEFT or 1 << MERGE_RIGHT of `stale` is set when that hand
+        was late and its latest state was held.
+        """
+        rows = self._state._lib.shared_state_read_merged_columns(
+            ctypes.byref(self._state._shared),
+            ctypes.byref(self._next),
+            self._timestamps.ctypes.data,
+            self._stale.ctypes.data,
+            self._buttons.ctypes.data,
+            self._values.ctypes.data,
+            len(self._timestamps),
+        )
+        return (
+            self._timestamps[:rows],
+            self._stale[:rows],
+            self._buttons[:rows],
+            self._values[:rows],
+        )
+
+
+class Downsample:
+    """Min/max points of a few columns of the rows `Stream.read` returns.
+
+    Time is cut into buckets of `bucket_s`, and 16 times coarser at each of
+    the next levels; every bucket becomes two points, the smallest and the
+    largest value of each column in the order they came, so peaks survive.
+    The last 1024 buckets of every level are kept, which at 10 ms is 10
+    seconds at level 0 and over 11 hours at level 3.
+    """
+
+    def __init__(self, lib, columns, bucket_s=0.01):
+        self._lib = lib
+        self.columns = np.ascontiguousarray(columns, dtype=np.intc)
+        self._downsample = ctypes.create_string_buffer(lib.downsample_size())
+        if lib.downsample_init(self._downsample, len(self.columns), int(bucket_s * 1e9)) != 0:
+            raise ValueError(f"at most {DOWNSAMPLE_MAX_CHANNELS} columns")
+        self._next = [ctypes.c_uint64(0) for _ in range(DOWNSAMPLE_LEVELS)]
+        self._timestamps = np.zeros(2 * DOWNSAMPLE_BUCKETS, dtype=np.uint64)
+        self._values = np.zeros((2 * DOWNSAMPLE_BUCKETS, len(self.columns)), dtype=np.float32)
+
+    def add(self, timestamps, values):
+        """Adds rows in time order: `values` is 2D float32, one row per timestamp."""
+        if len(timestamps) == 0:
+            return
+        timestamps = np.ascontiguousarray(timestamps, dtype=np.uint64)
+        values = np.ascontiguousarray(values, dtype=np.float32)
+        self._lib.downsample_add(
+            self._downsample,
+            timestamps.ctypes.data,
+            values.ctypes.data,
+            values.shape[1],
+            self.columns.ctypes.data,
+            len(timestamps),
+        )
+
+    def _read(self, level, next):
+        points = self._lib.downsample_read(
+            self._downsample,
+            level,
+            ctypes.byref(next),
+            self._timestamps.ctypes.data,
+            self._values.ctypes.data,
+            len(self._timestamps),
+        )
+        return self._timestamps[:points], self._values[:points]
+
+    def read(self, level=0):
+        """The points of the buckets of `level` completed since the last call.
+
+        Returns (timestamps_ns, values) views, valid until the next call,
+        with one column of values per column given to the constructor.
+        """
+        return self._read(level, self._next[level])
+
+    def window(self, window_s):
+        """Every kept point of the finest level spanning `window_s`, as `read`."""
+        level = self._lib.downsample_level_for(self._downsample, int(window_s * 1e9))
+        return self._read(level, ctypes.c_uint64(0))
+
+
+class SharedState:
+    """The segment published by `main --publish`.
+
+    Raises OSError if there is none, or one from an incompatible build.
+    """
+
+    def __init__(self, name=DEFAULT_NAME, batch=4096, library=None):
+        self._lib = _load_library(library)
+        self._shared = _SharedState()
+        self._batch = batch
+        if self._lib.shared_state_open(ctypes.byref(self._shared), name.encode()) != 0:
+            raise OSError(f"no compatible shared state named {name}, is main --publish running?")
+        self._streams = []
+
+    def streams(self):
+        """Every stream published so far, new ones are picked up on each call."""
+        count = self._lib.shared_state_num_streams(ctypes.byref(self._shared))
+        for index in range(len(self._streams), count):
+            state = StreamState()
+            if self._lib.shared_state_read(
+                ctypes.byref(self._shared), index, ctypes.byref(state)
+            ) != 0:
+                break
+            self._streams.append(
+                Stream(self, index, state.product_id, state.endpoint, self._batch)
+            )
+        return list(self._streams)
+
+    def merged(self):
+        """A Merged of the frames of both hands, None without `main --merge`."""
+        period_ns = self._lib.shared_state_merge_period_ns(ctypes.byref(self._shared))
+        if period_ns == 0:
+            return None
+        return Merged(self, period_ns, self._batch)
+
+    def downsample(self, columns, bucket_s=0.01):
+        """A Downsample of `columns` of the rows of the streams."""
+        return Downsample(self._lib, columns, bucket_s)
+
+    def close(self):
+        if self._shared.segment:
+            self._lib.shared_state_close(ctypes.byref(self._shared))
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
@@ -0,0 +1,148 @@
+#include "replay.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "monotonic.h"
+
+static struct replay_source *replay_find_source(struct replay *replay,
+                                                uint16_t product_id,
+                                                uint8_t endpoint) {
+  for (int i = 0; i < replay->num_sources; ++i) {
+    struct replay_source *source = &replay->sources[i];
+    if (source->product_id == product_id && source->endpoint == endpoint) {
+      return source;
+    }
+  }
+  return NULL;
+}
+
+int replay_open(struct replay *replay, const char *path, int realtime) {
+  memset(replay, 0, sizeof(*replay));
+  replay->realtime = realtime;
+  atomic_init(&replay->running, 0);
+  if (capture_reader_open(&replay->reader, path) != 0) {
+    return -1;
+  }
+
+  // A first pass over the mapping finds which rings are needed, so the
+  // replay thread never has to allocate.
+  const struct capture_record_header *header;
+  const uint8_t *payload;
+  while ((header = capture_reader_next(&replay->reader, &payload)) != NULL) {
+    if (header->endpoint == CAPTURE_ENDPOINT_DESCRIPTOR ||
+        replay_find_source(replay, header->product_id, header->endpoint) !=
+            NULL) {
+      continue;
+    }
+    if (replay->num_sources == REPLAY_MAX_SOURCES) {
+      fprintf(stderr, "%s:%d: too many sources in %s\n", __FILE__, __LINE__,
+              path);
+      replay_close(replay);
+      return -1;
+    }
+    struct replay_source *source = &replay->sources[replay->num_sources++];
+    source->product_id = header->product_id;
+    source->endpoint = header->endpoint;
+    source->ring = report_ring_create();
+    if (source->ring == NULL) {
+      replay_close(replay);
+      return -1;
+    }
+  }
+
+  // Descriptors are attached to every source of their device.
+  capture_reader_rewind(&replay->reader);
+  while ((header = capture_reader_next(&replay->reader, &payload)) != NULL) {
+    if (header->endpoint != CAPTURE_ENDPOINT_DESCRIPTOR) {
+      continue;
+    }
+    for (int i = 0; i < replay->num_sources; ++i) {
+      struct replay_source *source = &replay->sources[i];
+      if (source->product_id == header->product_id) {
+        source->report_descriptor = payload;
+        source->report_descriptor_length = header->length;
+      }
+    }
+  }
+  capture_reader_rewind(&replay->reader);
+  return 0;
+}
+
+static void sleep_until(uint64_t deadline_ns) {
+  struct timespec deadline = {
+      .tv_sec = deadline_ns / 1000000000ull,
+      .tv_nsec = deadline_ns % 1000000000ull,
+  };
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) ==
+         EINTR) {
+  }
+}
+
+static void *replay_main(void *arg) {
+  struct replay *replay = arg;
+  const struct capture_record_header *header;
+  const uint8_t *payload;
+  uint64_t first_timestamp_ns = 0;
+  const uint64_t start_ns = monotonic_ns();
+
+  while (atomic_load_explicit(&replay->running, memory_order_acquire) &&
+         (header = capture_reader_next(&replay->reader, &payload)) != NULL) {
+    if (header->endpoint == CAPTURE_ENDPOINT_DESCRIPTOR) {
+      continue;
+    }
+    if (replay->records == 0) {
+      first_timestamp_ns = header->timestamp_ns;
+    }
+    // Reports keep their original spacing, shifted to the replay start.
+    uint64_t timestamp_ns =
+        start_ns + (header->timestamp_ns - first_timestamp_ns);
+    struct report_ring *ring =
+        replay_find_source(replay, header->product_id, header->endpoint)->ring;
+
+    if (replay->realtime) {
+      sleep_until(timestamp_ns);
+      // Like a live stream: if the consumer is late the report is dropped.
+      report_ring_push(ring, timestamp_ns, header->product_id,
+                       header->endpoint, payload, header->length);
+    } else {
+      // As fast as possible, but never lose a report: wait for room rather
+      // than have the ring count a drop.
+      while (report_ring_count(ring) == REPORT_RING_SIZE &&
+             atomic_load_explicit(&replay->running, memory_order_relaxed)) {
+        sched_yield();
+      }
+      report_ring_push(ring, timestamp_ns, header->product_id,
+                       header->endpoint, payload, header->length);
+    }
+    ++replay->records;
+  }
+
+  atomic_store_explicit(&replay->running, 0, memory_order_release);
+  return NULL;
+}
+
+int replay_start(struct replay *replay) {
+  atomic_store(&replay->running, 1);
+  int result = pthread_create(&replay->thread, NULL, replay_main, replay);
+  if (result != 0) {
+    atomic_store(&replay->running, 0);
+  }
+  return result;
+}
+
+void replay_stop(struct replay *replay) {
+  atomic_store(&replay->running, 0);
+  pthread_join(replay->thread, NULL);
+}
+
+void replay_close(struct replay *replay) {
+  for (int i = 0; i < replay->num_sources; ++i) {
+    report_ring_destroy(replay->sources[i].ring);
+  }
+  replay->num_sources = 0;
+  capture_reader_close(&replay->reader);
+}
@@ -0,0 +1,47 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "capture.h"
+#include "ring.h"
+
+#define REPLAY_MAX_SOURCES 8
+
+// One ring per (device, endpoint) found in the capture, like the live
+// streams have.
+struct replay_source {
+  uint16_t product_id;
+  uint8_t endpoint;
+  struct report_ring *ring;
+  // Points into the mapping, NULL if the capture has no descriptor for the
+  // device.
+  const uint8_t *report_descriptor;
+  int report_descriptor_length;
+};
+
+// Feeds a capture back into report rings from its own thread, either at the
+// pace it was recorded at or as fast as the consumer drains it.
+struct replay {
+  struct capture_reader reader;
+  struct replay_source sources[REPLAY_MAX_SOURCES];
+  int num_sources;
+  int realtime;
+
+  pthread_t thread;
+  // Cleared by the replay thread once the whole capture has been pushed.
+  atomic_int running;
+  uint64_t records;
+};
+
+// Maps the capture and creates a ring for each source found in it.
+// Returns 0 or -1.
+int replay_open(struct replay *replay, const char *path, int realtime);
+int replay_start(struct replay *replay);
+// Stops early if the replay is still running and joins the thread.
+void replay_stop(struct replay *replay);
+void replay_close(struct replay *replay);
+
+#endif // REPLAY_H
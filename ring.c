@@ -0,0 +1,120 @@
+#include "ring.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define REPORT_RING_MASK (REPORT_RING_SIZE - 1)
+
+_Static_assert((REPORT_RING_SIZE & REPORT_RING_MASK) == 0,
+               "REPORT_RING_SIZE must be a power of two");
+_Static_assert(sizeof(struct report) == 2 * RING_CACHE_LINE,
+               "a report slot should span exactly two cache lines");
+
+struct report_ring *report_ring_create(void) {
+  struct report_ring *ring =
+      aligned_alloc(RING_CACHE_LINE, sizeof(struct report_ring));
+  if (ring == NULL) {
+    return NULL;
+  }
+  memset(ring, 0, sizeof(*ring));
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  atomic_init(&ring->pushed, 0);
+  atomic_init(&ring->dropped, 0);
+  atomic_init(&ring->overruns, 0);
+  return ring;
+}
+
+void report_ring_destroy(struct report_ring *ring) { free(ring); }
+
+static void counter_increment(atomic_uint_least64_t *counter) {
+  // Only the producer writes the counters, a plain load/store pair is enough
+  // and avoids a locked instruction on the hot path.
+  atomic_store_explicit(
+      counter, atomic_load_explicit(counter, memory_order_relaxed) + 1,
+      memory_order_relaxed);
+}
+
+struct report *report_ring_reserve(struct report_ring *ring) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  if (head - ring->cached_tail >= REPORT_RING_SIZE) {
+    ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - ring->cached_tail >= REPORT_RING_SIZE) {
+      counter_increment(&ring->dropped);
+      return NULL;
+    }
+  }
+  return &ring->slots[head & REPORT_RING_MASK];
+}
+
+void report_ring_commit(struct report_ring *ring) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  counter_increment(&ring->pushed);
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+int report_ring_push(struct report_ring *ring, uint64_t timestamp_ns,
+                     uint16_t product_id, uint8_t endpoint,
+                     const uint8_t *data, size_t length) {
+  struct report *slot = report_ring_reserve(ring);
+  if (slot == NULL) {
+    return -1;
+  }
+  if (length > REPORT_MAX_SIZE) {
+    counter_increment(&ring->overruns);
+    length = REPORT_MAX_SIZE;
+  }
+  slot->timestamp_ns = timestamp_ns;
+  slot->product_id = product_id;
+  slot->endpoint = endpoint;
+  slot->length = (uint16_t)length;
+  memcpy(slot->data, data, length);
+  report_ring_commit(ring);
+  return 0;
+}
+
+const struct report *report_ring_peek(struct report_ring *ring) {
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  if (tail == ring->cached_head) {
+    ring->cached_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail == ring->cached_head) {
+      return NULL;
+    }
+  }
+  return &ring->slots[tail & REPORT_RING_MASK];
+}
+
+void report_ring_release(struct report_ring *ring) {
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+size_t report_ring_pop(struct report_ring *ring, struct report *out,
+                       size_t max) {
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  size_t count = head - tail;
+  if (count > max) {
+    count = max;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    out[i] = ring->slots[(tail + i) & REPORT_RING_MASK];
+  }
+  ring->cached_head = head;
+  atomic_store_explicit(&ring->tail, tail + count, memory_order_release);
+  return count;
+}
+
+size_t report_ring_count(struct report_ring *ring) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  return head - tail;
+}
+
+void report_ring_get_stats(struct report_ring *ring,
+                           struct report_ring_stats *stats) {
+  stats->pushed = atomic_load_explicit(&ring->pushed, memory_order_relaxed);
+  stats->dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+  stats->overruns =
+      atomic_load_explicit(&ring->overruns, memory_order_relaxed);
+}
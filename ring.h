@@ -0,0 +1,85 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Payload bytes stored inline in every slot. Chosen so that a slot is exactly
+// two cache lines. Longer reports are truncated and counted as overruns.
+#define REPORT_MAX_SIZE 112
+// Number of slots, must be a power of two. At 1 kHz this is about a second
+// of reports per endpoint.
+#define REPORT_RING_SIZE 1024
+
+#define RING_CACHE_LINE 64
+
+struct report {
+  // Host CLOCK_MONOTONIC time at which the transfer completed.
+  uint64_t timestamp_ns;
+  uint16_t product_id;
+  uint8_t endpoint;
+  uint8_t reserved;
+  uint16_t length;
+  uint8_t data[REPORT_MAX_SIZE];
+};
+
+struct report_ring_stats {
+  uint64_t pushed;
+  // Reports thrown away because the consumer did not keep up.
+  uint64_t dropped;
+  // Reports longer than REPORT_MAX_SIZE, truncated on the way in.
+  uint64_t overruns;
+};
+
+// Single-producer/single-consumer ring of fixed size slots. The producer is
+// the USB event thread, the consumer is whichever thread drains the reports.
+// Neither side ever blocks or allocates.
+struct report_ring {
+  // Producer side.
+  _Alignas(RING_CACHE_LINE) atomic_size_t head;
+  size_t cached_tail;
+  atomic_uint_least64_t pushed;
+  atomic_uint_least64_t dropped;
+  atomic_uint_least64_t overruns;
+
+  // Consumer side.
+  _Alignas(RING_CACHE_LINE) atomic_size_t tail;
+  size_t cached_head;
+
+  _Alignas(RING_CACHE_LINE) struct report slots[REPORT_RING_SIZE];
+};
+
+// The ring is a few hundred kilobytes so it is allocated once rather than
+// living on the stack. Returns NULL on failure.
+struct report_ring *report_ring_create(void);
+void report_ring_destroy(struct report_ring *ring);
+
+// Producer: returns the next free slot, or NULL if the ring is full (the
+// report is then counted as dropped). Fill the slot then commit it.
+struct report *report_ring_reserve(struct report_ring *ring);
+void report_ring_commit(struct report_ring *ring);
+
+// Producer: copies a report into the ring. Returns 0, or -1 if it was
+// dropped.
+int report_ring_push(struct report_ring *ring, uint64_t timestamp_ns,
+                     uint16_t product_id, uint8_t endpoint,
+                     const uint8_t *data, size_t length);
+
+// Consumer: returns the oldest report without removing it, or NULL if the
+// ring is empty. The slot stays valid until report_ring_release.
+const struct report *report_ring_peek(struct report_ring *ring);
+void report_ring_release(struct report_ring *ring);
+
+// Consumer: copies up to `max` reports into `out`, returns how many.
+size_t report_ring_pop(struct report_ring *ring, struct report *out,
+                       size_t max);
+
+// Either side: number of reports waiting to be consumed.
+size_t report_ring_count(struct report_ring *ring);
+
+// Any thread: counters are updated with relaxed atomics.
+void report_ring_get_stats(struct report_ring *ring,
+                           struct report_ring_stats *stats);
+
+#endif // RING_H
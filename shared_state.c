@@ -0,0 +1,352 @@
+#include "shared_state.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Readers give up after this many torn reads, which only happens if they are
+// descheduled in the middle of a copy over and over.
+#define SHARED_STATE_READ_TRIES 64
+
+int shared_state_create(struct shared_state *shared, const char *name) {
+  memset(shared, 0, sizeof(*shared));
+  if (strlen(name) >= sizeof(shared->name)) {
+    fprintf(stderr, "%s:%d: shared memory name too long: %s\n", __FILE__,
+            __LINE__, name);
+    return -1;
+  }
+  // A segment left behind by a previous run is reused, its readers see the
+  // magic disappear and come back.
+  int fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "%s:%d: unable to open shared memory %s: ", __FILE__,
+            __LINE__, name);
+    perror(NULL);
+    return -1;
+  }
+  if (ftruncate(fd, sizeof(struct shared_segment)) != 0) {
+    fprintf(stderr, "%s:%d: unable to size shared memory %s: ", __FILE__,
+            __LINE__, name);
+    perror(NULL);
+    close(fd);
+    return -1;
+  }
+  struct shared_segment *segment =
+      mmap(NULL, sizeof(*segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (segment == MAP_FAILED) {
+    fprintf(stderr, "%s:%d: unable to map shared memory %s: ", __FILE__,
+            __LINE__, name);
+    perror(NULL);
+    return -1;
+  }
+
+  segment->magic = 0;
+  atomic_thread_fence(memory_order_release);
+  memset((char *)segment + sizeof(segment->magic), 0,
+         sizeof(*segment) - sizeof(segment->magic));
+  segment->version = SHARED_STATE_VERSION;
+  segment->size = sizeof(*segment);
+  atomic_store_explicit(&segment->num_streams, 0, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  segment->magic = SHARED_STATE_MAGIC;
+
+  shared->segment = segment;
+  strcpy(shared->name, name);
+  shared->writer = 1;
+  return 0;
+}
+
+void shared_state_add_stream(struct shared_state *shared, int index,
+                             uint16_t product_id, uint8_t endpoint,
+                             const uint8_t *descriptor, int descriptor_length) {
+  if (shared->segment == NULL || index >= SHARED_STATE_MAX_STREAMS) {
+    return;
+  }
+  struct shared_stream *stream = &shared->segment->streams[index];
+  stream->descriptor_length = 0;
+  if (descriptor != NULL && descriptor_length <= HID_MAX_DESCRIPTOR_SIZE) {
+    memcpy(stream->descriptor, descriptor, descriptor_length);
+    stream->descriptor_length = (uint16_t)descriptor_length;
+  }
+  struct shared_stream_state state = {0};
+  state.product_id = product_id;
+  state.endpoint = endpoint;
+  shared_state_publish(shared, index, &state);
+  if (index >= (int)atomic_load_explicit(&shared->segment->num_streams,
+                                         memory_order_relaxed)) {
+    atomic_store_explicit(&shared->segment->num_streams, index + 1,
+                          memory_order_release);
+  }
+}
+
+void shared_state_publish(struct shared_state *shared, int index,
+                          const struct shared_stream_state *state) {
+  if (shared->segment == NULL || index >= SHARED_STATE_MAX_STREAMS) {
+    return;
+  }
+  struct shared_stream *stream = &shared->segment->streams[index];
+  const uint64_t sequence =
+      atomic_load_explicit(&stream->sequence, memory_order_relaxed);
+  atomic_store_explicit(&stream->sequence, sequence + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  memcpy(&stream->state, state, sizeof(*state));
+  atomic_store_explicit(&stream->sequence, sequence + 2, memory_order_release);
+}
+
+void shared_state_append(struct shared_state *shared, int index,
+                         const struct report *report) {
+  if (shared->segment == NULL || index >= SHARED_STATE_MAX_STREAMS) {
+    return;
+  }
+  struct shared_stream *stream = &shared->segment->streams[index];
+  const uint64_t head =
+      atomic_load_explicit(&stream->history_head, memory_order_relaxed);
+  struct shared_history_entry *entry =
+      &stream->history[head & (SHARED_STATE_HISTORY_SIZE - 1)];
+  atomic_store_explicit(&entry->sequence, 2 * head + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  memcpy(&entry->report, report, sizeof(*report));
+  atomic_store_explicit(&entry->sequence, 2 * head + 2, memory_order_release);
+  atomic_store_explicit(&stream->history_head, head + 1, memory_order_release);
+}
+
+void shared_state_set_merge(struct shared_state *shared, uint64_t period_ns) {
+  if (shared->segment == NULL) {
+    return;
+  }
+  atomic_store_explicit(&shared->segment->merge_period_ns, period_ns,
+                        memory_order_release);
+}
+
+void shared_state_append_merged(struct shared_state *shared,
+                                const struct merge_frame *frame) {
+  if (shared->segment == NULL) {
+    return;
+  }
+  struct shared_segment *segment = shared->segment;
+  const uint64_t head =
+      atomic_load_explicit(&segment->merged_head, memory_order_relaxed);
+  struct shared_merged_entry *entry =
+      &segment->merged[head & (SHARED_STATE_MERGED_SIZE - 1)];
+  atomic_store_explicit(&entry->sequence, 2 * head + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  memcpy(&entry->frame, frame, sizeof(*frame));
+  atomic_store_explicit(&entry->sequence, 2 * head + 2, memory_order_release);
+  atomic_store_explicit(&segment->merged_head, head + 1, memory_order_release);
+}
+
+int shared_state_open(struct shared_state *shared, const char *name) {
+  memset(shared, 0, sizeof(*shared));
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 ||
+      info.st_size < (off_t)sizeof(struct shared_segment)) {
+    close(fd);
+    return -1;
+  }
+  struct shared_segment *segment =
+      mmap(NULL, sizeof(*segment), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (segment == MAP_FAILED) {
+    return -1;
+  }
+  if (segment->magic != SHARED_STATE_MAGIC ||
+      segment->version != SHARED_STATE_VERSION ||
+      segment->size != sizeof(*segment)) {
+    munmap(segment, sizeof(*segment));
+    return -1;
+  }
+  shared->segment = segment;
+  return 0;
+}
+
+int shared_state_num_streams(const struct shared_state *shared) {
+  return (int)atomic_load_explicit(&shared->segment->num_streams,
+                                   memory_order_acquire);
+}
+
+int shared_state_read(const struct shared_state *shared, int index,
+                      struct shared_stream_state *state) {
+  if (index < 0 || index >= shared_state_num_streams(shared)) {
+    return -1;
+  }
+  struct shared_stream *stream = &shared->segment->streams[index];
+  for (int tries = 0; tries < SHARED_STATE_READ_TRIES; ++tries) {
+    const uint64_t before =
+        atomic_load_explicit(&stream->sequence, memory_order_acquire);
+    if ((before & 1) != 0) {
+      continue;
+    }
+    memcpy(state, &stream->state, sizeof(*state));
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&stream->sequence, memory_order_relaxed) ==
+        before) {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+int shared_state_read_history(const struct shared_state *shared, int index,
+                              uint64_t *next, struct report *out, int max) {
+  if (index < 0 || index >= shared_state_num_streams(shared)) {
+    return 0;
+  }
+  struct shared_stream *stream = &shared->segment->streams[index];
+  const uint64_t head =
+      atomic_load_explicit(&stream->history_head, memory_order_acquire);
+  if (*next > head) {
+    // The writer started over.
+    *next = 0;
+  }
+  if (head - *next > SHARED_STATE_HISTORY_SIZE) {
+    *next = head - SHARED_STATE_HISTORY_SIZE;
+  }
+  int count = 0;
+  while (count < max && *next < head) {
+    const struct shared_history_entry *entry =
+        &stream->history[*next & (SHARED_STATE_HISTORY_SIZE - 1)];
+    const uint64_t expected = 2 * *next + 2;
+    if (atomic_load_explicit(&entry->sequence, memory_order_acquire) ==
+        expected) {
+      memcpy(&out[count], &entry->report, sizeof(out[count]));
+      atomic_thread_fence(memory_order_acquire);
+      if (atomic_load_explicit(&entry->sequence, memory_order_relaxed) ==
+          expected) {
+        ++count;
+      }
+    }
+    // Otherwise it was overwritten while reading, skip it.
+    ++*next;
+  }
+  return count;
+}
+
+int shared_state_compile(const struct shared_state *shared, int index,
+                         struct hid_decoder *decoder) {
+  if (index < 0 || index >= shared_state_num_streams(shared)) {
+    return -1;
+  }
+  const struct shared_stream *stream = &shared->segment->streams[index];
+  if (stream->descriptor_length == 0) {
+    return -1;
+  }
+  return hid_compile(stream->descriptor, stream->descriptor_length, decoder);
+}
+
+size_t shared_state_decoder_size(void) { return sizeof(struct hid_decoder); }
+
+int shared_state_decode_history(const struct shared_state *shared, int index,
+                                const struct hid_decoder *decoder,
+                                uint64_t *next, uint64_t *timestamps,
+                                uint32_t *buttons, float *values, int max) {
+  // The reports are copied out in small chunks, a torn read could otherwise
+  // make it into the decoded columns.
+  struct report reports[32];
+  struct hid_state state;
+  memset(&state, 0, sizeof(state));
+  int rows = 0;
+  while (rows < max) {
+    int chunk = max - rows < 32 ? max - rows : 32;
+    int count = shared_state_read_history(shared, index, next, reports, chunk);
+    if (count == 0) {
+      break;
+    }
+    for (int i = 0; i < count; ++i) {
+      if (hid_decode(decoder, reports[i].data, reports[i].length, &state) < 0) {
+        continue;
+      }
+      timestamps[rows] = reports[i].timestamp_ns;
+      buttons[rows] = state.buttons;
+      memcpy(values + (size_t)rows * HID_MAX_VALUES, state.values,
+             sizeof(state.values));
+      ++rows;
+    }
+  }
+  return rows;
+}
+
+uint64_t shared_state_merge_period_ns(const struct shared_state *shared) {
+  return atomic_load_explicit(&shared->segment->merge_period_ns,
+                              memory_order_acquire);
+}
+
+int shared_state_read_merged(const struct shared_state *shared, uint64_t *next,
+                             struct merge_frame *out, int max) {
+  struct shared_segment *segment = shared->segment;
+  const uint64_t head =
+      atomic_load_explicit(&segment->merged_head, memory_order_acquire);
+  if (*next > head) {
+    // The writer started over.
+    *next = 0;
+  }
+  if (head - *next > SHARED_STATE_MERGED_SIZE) {
+    *next = head - SHARED_STATE_MERGED_SIZE;
+  }
+  int count = 0;
+  while (count < max && *next < head) {
+    const struct shared_merged_entry *entry =
+        &segment->merged[*next & (SHARED_STATE_MERGED_SIZE - 1)];
+    const uint64_t expected = 2 * *next + 2;
+    if (atomic_load_explicit(&entry->sequence, memory_order_acquire) ==
+        expected) {
+      memcpy(&out[count], &entry->frame, sizeof(out[count]));
+      atomic_thread_fence(memory_order_acquire);
+      if (atomic_load_explicit(&entry->sequence, memory_order_relaxed) ==
+          expected) {
+        ++count;
+      }
+    }
+    // Otherwise it was overwritten while reading, skip it.
+    ++*next;
+  }
+  return count;
+}
+
+int shared_state_read_merged_columns(const struct shared_state *shared,
+                                     uint64_t *next, uint64_t *timestamps,
+                                     uint32_t *stale, uint32_t *buttons,
+                                     float *values, int max) {
+  struct merge_frame frames[16];
+  int rows = 0;
+  while (rows < max) {
+    int chunk = max - rows < 16 ? max - rows : 16;
+    int count = shared_state_read_merged(shared, next, frames, chunk);
+    if (count == 0) {
+      break;
+    }
+    for (int i = 0; i < count; ++i, ++rows) {
+      timestamps[rows] = frames[i].timestamp_ns;
+      stale[rows] = frames[i].stale;
+      for (int side = 0; side < MERGE_SIDES; ++side) {
+        buttons[(size_t)rows * MERGE_SIDES + side] =
+            frames[i].sides[side].buttons;
+        memcpy(values + ((size_t)rows * MERGE_SIDES + side) * HID_MAX_VALUES,
+               frames[i].sides[side].values,
+               sizeof(frames[i].sides[side].values));
+      }
+    }
+  }
+  return rows;
+}
+
+void shared_state_close(struct shared_state *shared) {
+  if (shared->segment == NULL) {
+    return;
+  }
+  if (shared->writer) {
+    shared->segment->magic = 0;
+  }
+  munmap(shared->segment, sizeof(*shared->segment));
+  shared->segment = NULL;
+  if (shared->writer) {
+    shm_unlink(shared->name);
+  }
+}
@@ -0,0 +1,179 @@
+#ifndef SHARED_STATE_H
+#define SHARED_STATE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hid.h"
+#include "merge.h"
+#include "ring.h"
+
+// The latest decoded state of every streamed endpoint and a short history of
+// its raw reports, and with --merge the last frames of both controllers,
+// published in a POSIX shared memory segment so that other
+// processes can follow the controllers without opening the devices.
+//
+// There is one writer, the thread draining the report rings. Readers never
+// write to the segment: the state is behind a seqlock and every history entry
+// carries its own sequence number, so any number of readers can poll it
+// wait-free without the writer, let alone the USB thread, knowing about them.
+
+#define SHARED_STATE_DEFAULT_NAME "/psvr2-state"
+#define SHARED_STATE_MAGIC 0x32525650 // "PVR2"
+// Bumped whenever the layout below changes.
+#define SHARED_STATE_VERSION 3
+#define SHARED_STATE_MAX_STREAMS 8
+// Number of reports kept per stream, must be a power of two. About a quarter
+// of a second at 1 kHz.
+#define SHARED_STATE_HISTORY_SIZE 256
+// Number of merged frames kept, must be a power of two. A second at 250 Hz.
+#define SHARED_STATE_MERGED_SIZE 256
+
+struct shared_stream_state {
+  // Host CLOCK_MONOTONIC time of the latest report.
+  uint64_t timestamp_ns;
+  uint64_t reports;
+  uint16_t product_id;
+  uint8_t endpoint;
+  uint8_t connected;
+  uint8_t report_id;
+  // Whether `orientation` is filled in, for controllers with an IMU.
+  uint8_t has_orientation;
+  uint16_t num_values;
+  uint32_t buttons;
+  // w, x, y, z.
+  float orientation[4];
+  float values[HID_MAX_VALUES];
+};
+
+struct shared_history_entry {
+  // 2n + 1 while the nth report of the stream is written here, 2n + 2 once it
+  // is complete.
+  atomic_uint_least64_t sequence;
+  struct report report;
+};
+
+struct shared_stream {
+  // Seqlock over `state`: odd while the writer is updating it.
+  _Alignas(RING_CACHE_LINE) atomic_uint_least64_t sequence;
+  struct shared_stream_state state;
+  // Report descriptor of the stream, 0 long if unknown. Written before the
+  // stream is published and never changed after, readers decode the history
+  // with it.
+  uint16_t descriptor_length;
+  uint8_t descriptor[HID_MAX_DESCRIPTOR_SIZE];
+  // Reports appended to the history so far.
+  _Alignas(RING_CACHE_LINE) atomic_uint_least64_t history_head;
+  struct shared_history_entry history[SHARED_STATE_HISTORY_SIZE];
+};
+
+struct shared_merged_entry {
+  // 2n + 1 while the nth frame is written here, 2n + 2 once it is complete.
+  atomic_uint_least64_t sequence;
+  struct merge_frame frame;
+};
+
+struct shared_segment {
+  uint32_t magic;
+  uint32_t version;
+  // sizeof(struct shared_segment), as a check for readers built separately.
+  uint32_t size;
+  // Streams in use, only ever grows while the writer runs.
+  atomic_uint num_streams;
+  struct shared_stream streams[SHARED_STATE_MAX_STREAMS];
+  // Period of the merged frames, 0 when the writer does not merge.
+  atomic_uint_least64_t merge_period_ns;
+  // Frames appended to `merged` so far.
+  _Alignas(RING_CACHE_LINE) atomic_uint_least64_t merged_head;
+  struct shared_merged_entry merged[SHARED_STATE_MERGED_SIZE];
+};
+
+struct shared_state {
+  struct shared_segment *segment;
+  // Set for the writer, which removes the segment when closing.
+  char name[64];
+  int writer;
+};
+
+// Writer: creates (or takes over) the segment `name`. Returns 0 or -1.
+int shared_state_create(struct shared_state *shared, const char *name);
+
+// Writer: makes `index` visible to readers. Streams are published in order.
+// `descriptor` may be NULL when the report descriptor is not known.
+void shared_state_add_stream(struct shared_state *shared, int index,
+                             uint16_t product_id, uint8_t endpoint,
+                             const uint8_t *descriptor, int descriptor_length);
+
+// Writer: replaces the latest state of a stream.
+void shared_state_publish(struct shared_state *shared, int index,
+                          const struct shared_stream_state *state);
+
+// Writer: appends a report to the history of a stream.
+void shared_state_append(struct shared_state *shared, int index,
+                         const struct report *report);
+
+// Writer: announces that frames are merged every `period_ns`.
+void shared_state_set_merge(struct shared_state *shared, uint64_t period_ns);
+
+// Writer: appends a merged frame.
+void shared_state_append_merged(struct shared_state *shared,
+                                const struct merge_frame *frame);
+
+// Reader: maps the segment `name` read only. Returns 0, or -1 if there is no
+// compatible segment.
+int shared_state_open(struct shared_state *shared, const char *name);
+
+// Reader: number of streams published.
+int shared_state_num_streams(const struct shared_state *shared);
+
+// Reader: copies the latest state of a stream. Returns 0, or -1 if the writer
+// kept updating it during every attempt.
+int shared_state_read(const struct shared_state *shared, int index,
+                      struct shared_stream_state *state);
+
+// Reader: copies up to `max` reports of a stream, starting with report number
+// `*next` or the oldest one still kept if it was overwritten, and advances
+// `*next` past the last report copied. Returns how many were copied.
+int shared_state_read_history(const struct shared_state *shared, int index,
+                              uint64_t *next, struct report *out, int max);
+
+// Reader: compiles the report descriptor of a stream into `decoder`. Returns
+// 0, or -1 if the stream has none or it does not compile.
+int shared_state_compile(const struct shared_state *shared, int index,
+                         struct hid_decoder *decoder);
+
+// sizeof(struct hid_decoder), for bindings that allocate it without seeing
+// this header.
+size_t shared_state_decoder_size(void);
+
+// Reader: like shared_state_read_history, but decodes the reports straight
+// into columns owned by the caller: `timestamps` and `buttons` hold `max`
+// entries, `values` `max` rows of HID_MAX_VALUES. Reports the decoder does
+// not know are skipped. Returns how many rows were written.
+int shared_state_decode_history(const struct shared_state *shared, int index,
+                                const struct hid_decoder *decoder,
+                                uint64_t *next, uint64_t *timestamps,
+                                uint32_t *buttons, float *values, int max);
+
+// Reader: period of the merged frames, 0 if the writer does not merge.
+uint64_t shared_state_merge_period_ns(const struct shared_state *shared);
+
+// Reader: copies up to `max` merged frames, like shared_state_read_history.
+// Returns how many were copied.
+int shared_state_read_merged(const struct shared_state *shared, uint64_t *next,
+                             struct merge_frame *out, int max);
+
+// Reader: like shared_state_read_merged, but into columns owned by the
+// caller: `timestamps` and `stale` hold `max` entries, `buttons` `max` rows of
+// MERGE_SIDES and `values` `max` rows of MERGE_SIDES * HID_MAX_VALUES, left
+// hand first. Returns how many rows were written.
+int shared_state_read_merged_columns(const struct shared_state *shared,
+                                     uint64_t *next, uint64_t *timestamps,
+                                     uint32_t *stale, uint32_t *buttons,
+                                     float *values, int max);
+
+// Unmaps the segment, and removes it for the writer.
+void shared_state_close(struct shared_state *shared);
+
+#endif // SHARED_STATE_H
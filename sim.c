@@ -0,0 +1,474 @@
+#include "sim.h"
+
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+#include "monotonic.h"
+#include "sony.h"
+#include "stream.h"
+
+// Class specific bytes, as printed by the enumeration of the real devices.
+static const unsigned char audio_control_extra[] = {
+    9,  36, 1, 0, 1, 39, 0, 1, 1, 12, 36, 2, 1, 1, 1, 6, 1, 0, 0, 0,
+    0, 9,  36, 6, 2, 1, 1, 3, 0, 0,  9, 36, 3, 3, 1, 3, 4, 2, 0};
+static const unsigned char audio_streaming_extra[] = {
+    7, 36, 1, 1, 1, 1, 0, 11, 36, 2, 1, 1, 2, 16, 1, 128, 187, 0};
+static const unsigned char audio_endpoint_extra[] = {7, 37, 1, 0, 0, 0, 0};
+static const unsigned char hid_extra[] = {9, 33, 17, 1, 0, 1, 34, 252, 0};
+
+// Report descriptor describing the synthetic input report (see sim.h). The
+// output and feature reports only stand in for the ones of the real devices
+// and bring it to the 252 bytes announced above.
+const uint8_t sim_report_descriptor[SIM_REPORT_DESCRIPTOR_SIZE] = {
+    0x05, 0x01,       // Usage Page (Generic Desktop)
+    0x09, 0x05,       // Usage (Game Pad)
+    0xa1, 0x01,       // Collection (Application)
+    0x85, 0x01,       //   Report ID (1)
+    0x09, 0x30,       //   Usage (X)
+    0x09, 0x31,       //   Usage (Y)
+    0x09, 0x32,       //   Usage (Z)
+    0x09, 0x35,       //   Usage (Rz)
+    0x15, 0x00,       //   Logical Minimum (0)
+    0x26, 0xff, 0x00, //   Logical Maximum (255)
+    0x75, 0x08,       //   Report Size (8)
+    0x95, 0x04,       //   Report Count (4)
+    0x81, 0x02,       //   Input (Data, Variable, Absolute)
+    0x05, 0x09,       //   Usage Page (Button)
+    0x19, 0x01,       //   Usage Minimum (1)
+    0x29, 0x10,       //   Usage Maximum (16)
+    0x15, 0x00,       //   Logical Minimum (0)
+    0x25, 0x01,       //   Logical Maximum (1)
+    0x75, 0x01,       //   Report Size (1)
+    0x95, 0x10,       //   Report Count (16)
+    0x81, 0x02,       //   Input (Data, Variable, Absolute)
+    0x75, 0x08,       //   Report Size (8)
+    0x95, 0x02,       //   Report Count (2)
+    0x81, 0x01,       //   Input (Constant)
+    0x06, 0x00, 0xff, //   Usage Page (Vendor Defined 0xFF00)
+    0x09, 0x21,       //   Usage (Device Timestamp)
+    0x15, 0x00,       //   Logical Minimum (0)
+    0x27, 0xff, 0xff, 0xff, 0xff, // Logical Maximum (4294967295)
+    0x75, 0x20,                   //   Report Size (32)
+    0x95, 0x01,                   //   Report Count (1)
+    0x81, 0x02,                   //   Input (Data, Variable, Absolute)
+    0x05, 0x20,                   //   Usage Page (Sensors)
+    0x0a, 0x57, 0x04,             //   Usage (Angular Velocity X)
+    0x0a, 0x58, 0x04,             //   Usage (Angular Velocity Y)
+    0x0a, 0x59, 0x04,             //   Usage (Angular Velocity Z)
+    0x16, 0x00, 0x80,             //   Logical Minimum (-32768)
+    0x26, 0xff, 0x7f,             //   Logical Maximum (32767)
+    0x36, 0xf4, 0xb1,             //   Physical Minimum (-19980)
+    0x46, 0x0c, 0x4e,             //   Physical Maximum (19980)
+    0x55, 0x0f,                   //   Unit Exponent (-1), deg/s
+    0x75, 0x10,                   //   Report Size (16)
+    0x95, 0x03,                   //   Report Count (3)
+    0x81, 0x02,                   //   Input (Data, Variable, Absolute)
+    0x0a, 0x53, 0x04,             //   Usage (Acceleration X)
+    0x0a, 0x54, 0x04,             //   Usage (Acceleration Y)
+    0x0a, 0x55, 0x04,             //   Usage (Acceleration Z)
+    0x37, 0xc0, 0x63, 0xff, 0xff, //   Physical Minimum (-40000)
+    0x47, 0x40, 0x9c, 0x00, 0x00, //   Physical Maximum (40000)
+    0x55, 0x0c,                   //   Unit Exponent (-4), g
+    0x81, 0x02,                   //   Input (Data, Variable, Absolute)
+    0x06, 0x00, 0xff,             //   Usage Page (Vendor Defined 0xFF00)
+    0x09, 0x22,                   //   Usage (Touch)
+    0x15, 0x00,                   //   Logical Minimum (0)
+    0x26, 0xff, 0x00,             //   Logical Maximum (255)
+    0x35, 0x00,                   //   Physical Minimum (0)
+    0x45, 0x00,                   //   Physical Maximum (0)
+    0x55, 0x00,                   //   Unit Exponent (0)
+    0x75, 0x08,                   //   Report Size (8)
+    0x95, 0x01,                   //   Report Count (1)
+    0x81, 0x02,                   //   Input (Data, Variable, Absolute)
+    0x95, 0x26,                   //   Report Count (38)
+    0x81, 0x01,                   //   Input (Constant)
+    0x85, 0x02,                   //   Report ID (2)
+    0x09, 0x23,                   //   Usage (Output State)
+    0x15, 0x00,                   //   Logical Minimum (0)
+    0x26, 0xff, 0x00,             //   Logical Maximum (255)
+    0x75, 0x08,                   //   Report Size (8)
+    0x95, 0x2f,                   //   Report Count (47)
+    0x91, 0x02,                   //   Output (Data, Variable, Absolute)
+    0x85, 0x05,                   //   Report ID (5)
+    0x09, 0x24,                   //   Usage (Calibration)
+    0x96, 0x28, 0x00,             //   Report Count (40)
+    0xb1, 0x02,                   //   Feature (Data, Variable, Absolute)
+    0x85, 0x09,                   //   Report ID (9)
+    0x09, 0x25,                   //   Usage (Pairing)
+    0x95, 0x13,                   //   Report Count (19)
+    0xb1, 0x02,                   //   Feature (Data, Variable, Absolute)
+    0x85, 0x20,                   //   Report ID (32)
+    0x09, 0x26,                   //   Usage (Firmware)
+    0x95, 0x3f,                   //   Report Count (63)
+    0xb1, 0x02,                   //   Feature (Data, Variable, Absolute)
+    0x85, 0x22,                   //   Report ID (34)
+    0x09, 0x27,                   //   Usage (Vendor 0x27)
+    0x95, 0x3f,                   //   Report Count (63)
+    0xb1, 0x02,                   //   Feature (Data, Variable, Absolute)
+    0x85, 0x80,                   //   Report ID (128)
+    0x09, 0x28,                   //   Usage (Vendor 0x28)
+    0x95, 0x3f,                   //   Report Count (63)
+    0xb1, 0x02,                   //   Feature (Data, Variable, Absolute)
+    0x85, 0x81,                   //   Report ID (129)
+    0x09, 0x29,                   //   Usage (Vendor 0x29)
+    0x95, 0x3f,                   //   Report Count (63)
+    0xb1, 0x02,                   //   Feature (Data, Variable, Absolute)
+    0x85, 0x82,                   //   Report ID (130)
+    0x09, 0x2a,                   //   Usage (Vendor 0x2A)
+    0x95, 0x09,                   //   Report Count (9)
+    0xb1, 0x02,                   //   Feature (Data, Variable, Absolute)
+    0x85, 0x83,                   //   Report ID (131)
+    0x09, 0x2b,                   //   Usage (Vendor 0x2B)
+    0x95, 0x3f,                   //   Report Count (63)
+    0xb1, 0x02,                   //   Feature (Data, Variable, Absolute)
+    0x85, 0x84,                   //   Report ID (132)
+    0x09, 0x2c,                   //   Usage (Vendor 0x2C)
+    0x95, 0x3f,                   //   Report Count (63)
+    0xb1, 0x02,                   //   Feature (Data, Variable, Absolute)
+    0x85, 0x85,                   //   Report ID (133)
+    0x09, 0x2d,                   //   Usage (Vendor 0x2D)
+    0x95, 0x02,                   //   Report Count (2)
+    0xb1, 0x02,                   //   Feature (Data, Variable, Absolute)
+    0x85, 0x86,                   //   Report ID (134)
+    0x09, 0x2e,                   //   Usage (Vendor 0x2E)
+    0x95, 0x3f,                   //   Report Count (63)
+    0xb1, 0x02,                   //   Feature (Data, Variable, Absolute)
+    0xc0,                         // End Collection
+};
+
+static const struct libusb_endpoint_descriptor audio_endpoints[] = {
+    {
+        .bLength = 9,
+        .bDescriptorType = LIBUSB_DT_ENDPOINT,
+        .bEndpointAddress = 0x01,
+        // Isochronous, adaptive, data.
+        .bmAttributes = 0x09,
+        .wMaxPacketSize = 98,
+        .bInterval = 1,
+        .extra = audio_endpoint_extra,
+        .extra_length = sizeof(audio_endpoint_extra),
+    },
+};
+
+static const struct libusb_endpoint_descriptor hid_endpoints[] = {
+    {
+        .bLength = 7,
+        .bDescriptorType = LIBUSB_DT_ENDPOINT,
+        .bEndpointAddress = 0x84,
+        .bmAttributes = LIBUSB_TRANSFER_TYPE_INTERRUPT,
+        .wMaxPacketSize = 64,
+        .bInterval = 1,
+    },
+    {
+        .bLength = 7,
+        .bDescriptorType = LIBUSB_DT_ENDPOINT,
+        .bEndpointAddress = 0x03,
+        .bmAttributes = LIBUSB_TRANSFER_TYPE_INTERRUPT,
+        .wMaxPacketSize = 64,
+        .bInterval = 1,
+    },
+};
+
+static const struct libusb_interface_descriptor audio_control_altsettings[] = {
+    {
+        .bLength = 9,
+        .bDescriptorType = LIBUSB_DT_INTERFACE,
+        .bInterfaceNumber = 0,
+        .bInterfaceClass = LIBUSB_CLASS_AUDIO,
+        .bInterfaceSubClass = 1,
+        .extra = audio_control_extra,
+        .extra_length = sizeof(audio_control_extra),
+    },
+};
+
+static const struct libusb_interface_descriptor audio_streaming_altsettings[] = {
+    {
+        .bLength = 9,
+        .bDescriptorType = LIBUSB_DT_INTERFACE,
+        .bInterfaceNumber = 1,
+        .bAlternateSetting = 0,
+        .bInterfaceClass = LIBUSB_CLASS_AUDIO,
+        .bInterfaceSubClass = 2,
+    },
+    {
+        .bLength = 9,
+        .bDescriptorType = LIBUSB_DT_INTERFACE,
+        .bInterfaceNumber = 1,
+        .bAlternateSetting = 1,
+        .bNumEndpoints = 1,
+        .bInterfaceClass = LIBUSB_CLASS_AUDIO,
+        .bInterfaceSubClass = 2,
+        .endpoint = audio_endpoints,
+        .extra = audio_streaming_extra,
+        .extra_length = sizeof(audio_streaming_extra),
+    },
+};
+
+static const struct libusb_interface_descriptor hid_altsettings[] = {
+    {
+        .bLength = 9,
+        .bDescriptorType = LIBUSB_DT_INTERFACE,
+        .bInterfaceNumber = 2,
+        .bNumEndpoints = 2,
+        .bInterfaceClass = LIBUSB_CLASS_HID,
+        .endpoint = hid_endpoints,
+        .extra = hid_extra,
+        .extra_length = sizeof(hid_extra),
+    },
+};
+
+static const struct libusb_interface interfaces[] = {
+    {.altsetting = audio_control_altsettings, .num_altsetting = 1},
+    {.altsetting = audio_streaming_altsettings, .num_altsetting = 2},
+    {.altsetting = hid_altsettings, .num_altsetting = 1},
+};
+
+static const struct libusb_config_descriptor config = {
+    .bLength = 9,
+    .bDescriptorType = LIBUSB_DT_CONFIG,
+    .bNumInterfaces = 3,
+    .bConfigurationValue = 1,
+    .bmAttributes = 192,
+    .MaxPower = 250,
+    .interface = interfaces,
+};
+
+#define SENSE_CONTROLLER_DESCRIPTOR(product_id)                                \
+  {                                                                            \
+    .bLength = 18, .bDescriptorType = LIBUSB_DT_DEVICE, .bcdUSB = 0x0200,      \
+    .bMaxPacketSize0 = 0x40, .idVendor = SONY_VENDOR_ID,                       \
+    .idProduct = (product_id), .bcdDevice = 0x0100, .iManufacturer = 1,        \
+    .iProduct = 2, .iSerialNumber = 0, .bNumConfigurations = 1,                \
+  }
+
+const struct sim_device sim_devices[SIM_NUM_DEVICES] = {
+    {
+        .device = SENSE_CONTROLLER_DESCRIPTOR(LEFT_SENSE_CONTROLLER_DEVICE_ID),
+        .config = &config,
+        .manufacturer = "Sony Interactive Entertainment",
+        .product = "PlayStation VR2 Sense Controller (L)",
+    },
+    {
+        .device = SENSE_CONTROLLER_DESCRIPTOR(RIGHT_SENSE_CONTROLLER_DEVICE_ID),
+        .config = &config,
+        .manufacturer = "Sony Interactive Entertainment",
+        .product = "PlayStation VR2 Sense Controller (R)",
+    },
+};
+
+// xorshift64*, good enough for noise and jitter.
+static uint64_t sim_random(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545f4914f6cdd1dull;
+}
+
+static float sim_uniform(uint64_t *state) {
+  return (float)((sim_random(state) >> 40) + 1) / (float)(1 << 24);
+}
+
+float sim_gaussian(uint64_t *state) {
+  // Box-Muller, one of the pair is thrown away.
+  float u1 = sim_uniform(state);
+  float u2 = sim_uniform(state);
+  return sqrtf(-2.0f * logf(u1)) * cosf(2.0f * (float)M_PI * u2);
+}
+
+static uint64_t noise_state = 0x9e3779b97f4a7c15ull;
+
+static int16_t saturate_int16(float value) {
+  if (value > 32767.0f) {
+    return 32767;
+  }
+  if (value < -32768.0f) {
+    return -32768;
+  }
+  return (int16_t)lrintf(value);
+}
+
+static void write_int16(uint8_t *data, int16_t value) {
+  data[0] = (uint16_t)value & 0xff;
+  data[1] = (uint16_t)value >> 8;
+}
+
+void sim_generate_report(struct sim_source *source, float dt,
+                         uint32_t device_time_us) {
+  const float t = source->reports * dt + source->phase;
+  float *q = source->orientation;
+
+  // Smooth wrist-like motion, a couple of rad/s at most.
+  const float gyro[3] = {
+      1.5f * sinf(2.0f * (float)M_PI * 0.30f * t),
+      1.2f * cosf(2.0f * (float)M_PI * 0.20f * t),
+      0.8f * sinf(2.0f * (float)M_PI * 0.50f * t + 1.0f),
+  };
+
+  // Integrate the orientation so the accelerometer agrees with the gyro.
+  const float dq[4] = {
+      0.5f * (-q[1] * gyro[0] - q[2] * gyro[1] - q[3] * gyro[2]),
+      0.5f * (q[0] * gyro[0] + q[2] * gyro[2] - q[3] * gyro[1]),
+      0.5f * (q[0] * gyro[1] - q[1] * gyro[2] + q[3] * gyro[0]),
+      0.5f * (q[0] * gyro[2] + q[1] * gyro[1] - q[2] * gyro[0]),
+  };
+  float norm = 0.0f;
+  for (int i = 0; i < 4; ++i) {
+    q[i] += dq[i] * dt;
+    norm += q[i] * q[i];
+  }
+  norm = 1.0f / sqrtf(norm);
+  for (int i = 0; i < 4; ++i) {
+    q[i] *= norm;
+  }
+
+  // Gravity (+1 g along world Z) expressed in the controller frame.
+  const float accel[3] = {
+      2.0f * (q[1] * q[3] - q[0] * q[2]),
+      2.0f * (q[0] * q[1] + q[2] * q[3]),
+      q[0] * q[0] - q[1] * q[1] - q[2] * q[2] + q[3] * q[3],
+  };
+
+  uint8_t *report = source->report;
+  memset(report, 0, SIM_REPORT_SIZE);
+  report[0] = SIM_REPORT_ID;
+  report[SIM_REPORT_STICK_X] = (uint8_t)(128.0f + 100.0f * sinf(0.7f * t));
+  report[SIM_REPORT_STICK_Y] = (uint8_t)(128.0f + 100.0f * cosf(0.9f * t));
+  report[SIM_REPORT_TRIGGER] = (uint8_t)((source->reports / 4) & 0xff);
+  report[SIM_REPORT_GRIP] = (source->reports / 700) % 2 ? 255 : 0;
+  // A different button every half second.
+  const uint16_t buttons = 1u << ((source->reports / 500) % 16);
+  report[SIM_REPORT_BUTTONS] = buttons & 0xff;
+  report[SIM_REPORT_BUTTONS + 1] = buttons >> 8;
+  report[SIM_REPORT_TIMESTAMP] = device_time_us & 0xff;
+  report[SIM_REPORT_TIMESTAMP + 1] = (device_time_us >> 8) & 0xff;
+  report[SIM_REPORT_TIMESTAMP + 2] = (device_time_us >> 16) & 0xff;
+  report[SIM_REPORT_TIMESTAMP + 3] = device_time_us >> 24;
+
+  const float rad_to_deg = 180.0f / (float)M_PI;
+  // Small constant gyro bias on top of the sensor noise, like a real IMU.
+  const float gyro_bias_dps = 0.5f;
+  for (int i = 0; i < 3; ++i) {
+    float dps = gyro[i] * rad_to_deg + gyro_bias_dps +
+                0.1f * sim_gaussian(&noise_state);
+    write_int16(report + SIM_REPORT_GYRO + 2 * i,
+                saturate_int16(dps * SIM_GYRO_LSB_PER_DPS));
+    float g = accel[i] + 0.01f * sim_gaussian(&noise_state);
+    write_int16(report + SIM_REPORT_ACCEL + 2 * i,
+                saturate_int16(g * SIM_ACCEL_LSB_PER_G));
+  }
+  report[SIM_REPORT_TOUCH] = report[SIM_REPORT_GRIP] ? 0x01 : 0x00;
+
+  ++source->reports;
+}
+
+int sim_open(struct sim *sim, double rate_hz, double jitter_us) {
+  memset(sim, 0, sizeof(*sim));
+  sim->rate_hz = rate_hz > 0.0 ? rate_hz : SIM_DEFAULT_RATE_HZ;
+  sim->jitter_ns = jitter_us >= 0.0 ? jitter_us * 1000.0 : 0.0;
+  sim->seed = 0x853c49e6748fea9bull;
+  atomic_init(&sim->running, 0);
+
+  // Stream whatever the live code would stream on these descriptors.
+  for (int d = 0; d < SIM_NUM_DEVICES; ++d) {
+    const struct libusb_config_descriptor *config = sim_devices[d].config;
+    for (int i = 0; i < config->bNumInterfaces; ++i) {
+      const struct libusb_interface *interface = &config->interface[i];
+      for (int j = 0; j < interface->num_altsetting; ++j) {
+        const struct libusb_interface_descriptor *altsetting =
+            &interface->altsetting[j];
+        for (int k = 0; k < altsetting->bNumEndpoints; ++k) {
+          if (!stream_endpoint_supported(&altsetting->endpoint[k])) {
+            continue;
+          }
+          struct sim_source *source = &sim->sources[sim->num_sources++];
+          source->device = &sim_devices[d];
+          source->endpoint = altsetting->endpoint[k].bEndpointAddress;
+          source->orientation[0] = 1.0f;
+          source->phase = 3.0f * d;
+          source->clock_offset_us = 1234567u * (d + 1);
+          source->clock_drift_ppm = d == 0 ? 20.0 : -35.0;
+          source->ring = report_ring_create();
+          if (source->ring == NULL) {
+            sim_close(sim);
+            return -1;
+          }
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+static void sleep_until(uint64_t deadline_ns) {
+  struct timespec deadline = {
+      .tv_sec = deadline_ns / 1000000000ull,
+      .tv_nsec = deadline_ns % 1000000000ull,
+  };
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) ==
+         EINTR) {
+  }
+}
+
+static void *sim_main(void *arg) {
+  struct sim *sim = arg;
+  const double period_ns = 1e9 / sim->rate_hz;
+  const float dt = (float)(1.0 / sim->rate_hz);
+  const uint64_t start_ns = monotonic_ns();
+  uint64_t due_ns[SIM_NUM_DEVICES];
+
+  for (uint64_t tick = 0;
+       atomic_load_explicit(&sim->running, memory_order_acquire); ++tick) {
+    const uint64_t nominal_ns = start_ns + (uint64_t)(tick * period_ns);
+    // Completions arrive late by a random amount, never early, and the two
+    // controllers do not arrive together.
+    for (int i = 0; i < sim->num_sources; ++i) {
+      due_ns[i] = nominal_ns + (uint64_t)fabs(sim->jitter_ns *
+                                              sim_gaussian(&sim->seed));
+    }
+    int pushed = 0;
+    while (pushed != (1 << sim->num_sources) - 1) {
+      int next = -1;
+      for (int i = 0; i < sim->num_sources; ++i) {
+        if (!(pushed & (1 << i)) && (next < 0 || due_ns[i] < due_ns[next])) {
+          next = i;
+        }
+      }
+      sleep_until(due_ns[next]);
+      struct sim_source *source = &sim->sources[next];
+      const double elapsed_us = (nominal_ns - start_ns) / 1000.0;
+      sim_generate_report(
+          source, dt,
+          source->clock_offset_us +
+              (uint32_t)(uint64_t)(elapsed_us *
+                                   (1.0 + source->clock_drift_ppm * 1e-6)));
+      report_ring_push(source->ring, monotonic_ns(),
+                       source->device->device.idProduct, source->endpoint,
+                       source->report, SIM_REPORT_SIZE);
+      pushed |= 1 << next;
+    }
+  }
+  return NULL;
+}
+
+int sim_start(struct sim *sim) {
+  atomic_store(&sim->running, 1);
+  int result = pthread_create(&sim->thread, NULL, sim_main, sim);
+  if (result != 0) {
+    atomic_store(&sim->running, 0);
+  }
+  return result;
+}
+
+void sim_stop(struct sim *sim) {
+  atomic_store(&sim->running, 0);
+  pthread_join(sim->thread, NULL);
+}
+
+void sim_close(struct sim *sim) {
+  for (int i = 0; i < sim->num_sources; ++i) {
+    report_ring_destroy(sim->sources[i].ring);
+  }
+  sim->num_sources = 0;
+}
@@ -0,0 +1,92 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <libusb-1.0/libusb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "ring.h"
+
+// Software stand-in for the two Sense controllers. The descriptors mirror
+// what the real controllers report (see README.md) and the synthetic reports
+// go through the same rings as the live streams. struct sim pushes them there
+// directly, without libusb, so discovery and the transfers of stream.c are not
+// simulated; sim/libusb.c serves the same devices and reports through the
+// libusb API instead.
+
+#define SIM_NUM_DEVICES 2
+#define SIM_DEFAULT_RATE_HZ 1000.0
+#define SIM_DEFAULT_JITTER_US 50.0
+
+// Layout of the synthetic input report. The real layout is still unknown,
+// this one only has to be plausible and stable.
+#define SIM_REPORT_ID 0x01
+#define SIM_REPORT_SIZE 64
+#define SIM_REPORT_STICK_X 1
+#define SIM_REPORT_STICK_Y 2
+#define SIM_REPORT_TRIGGER 3
+#define SIM_REPORT_GRIP 4
+#define SIM_REPORT_BUTTONS 5 // 16 bits
+#define SIM_REPORT_TIMESTAMP 9 // 32 bit device time in microseconds
+#define SIM_REPORT_GYRO 13 // 3 x int16
+#define SIM_REPORT_ACCEL 19 // 3 x int16
+#define SIM_REPORT_TOUCH 25
+// Raw units: +/-2000 deg/s and +/-4 g full scale.
+#define SIM_GYRO_LSB_PER_DPS 16.4f
+#define SIM_ACCEL_LSB_PER_G 8192.0f
+
+// The report descriptor of interface #2, matching the synthetic report.
+#define SIM_REPORT_DESCRIPTOR_SIZE 252
+extern const uint8_t sim_report_descriptor[SIM_REPORT_DESCRIPTOR_SIZE];
+
+struct sim_device {
+  struct libusb_device_descriptor device;
+  const struct libusb_config_descriptor *config;
+  const char *manufacturer;
+  const char *product;
+};
+
+extern const struct sim_device sim_devices[SIM_NUM_DEVICES];
+
+struct sim_source {
+  const struct sim_device *device;
+  uint8_t endpoint;
+  struct report_ring *ring;
+  // Generator state, only touched by the sim thread.
+  uint64_t reports;
+  float orientation[4];
+  float phase;
+  // Each controller runs its own clock, offset and drifting from the host.
+  uint32_t clock_offset_us;
+  double clock_drift_ppm;
+  uint8_t report[SIM_REPORT_SIZE];
+};
+
+struct sim {
+  double rate_hz;
+  double jitter_ns;
+  struct sim_source sources[SIM_NUM_DEVICES];
+  int num_sources;
+
+  pthread_t thread;
+  atomic_int running;
+  uint64_t seed;
+};
+
+// Creates a ring for every streamable endpoint of the simulated devices.
+// Returns 0 or -1.
+int sim_open(struct sim *sim, double rate_hz, double jitter_us);
+int sim_start(struct sim *sim);
+void sim_stop(struct sim *sim);
+void sim_close(struct sim *sim);
+
+// Advances the motion of `source` by `dt` seconds and writes the matching
+// report into `source->report`.
+void sim_generate_report(struct sim_source *source, float dt,
+                         uint32_t device_time_us);
+
+// Standard normal sample, advancing the xorshift state `state`.
+float sim_gaussian(uint64_t *state);
+
+#endif // SIM_H
@@ -0,0 +1,1114 @@
+// The part of libusb-1.0 this program uses, implemented on top of the
+// simulated controllers of sim.c. Linked instead of libusb into `main-sim`
+// (see the Makefile), so discovery, the claims, stream.c with its resubmission
+// and transfer pool, the outputs and both event loops run unchanged against
+// devices that do not exist.
+//
+// A device thread plays the controllers: each report tick it completes the
+// oldest interrupt IN transfer waiting on a controller with a freshly
+// generated report, and it completes the OUT and isochronous transfers once
+// their packets would have gone out, one per frame. Completions are queued
+// and handed to their callbacks by libusb_handle_events*, on whichever thread
+// calls it, behind an eventfd that is also the only pollfd.
+//
+// Configured from the environment:
+//   PSVR2_SIM_RATE       reports per second and controller, 1000 by default.
+//   PSVR2_SIM_JITTER_US  how late a report may be, 50 us by default.
+//   PSVR2_SIM_REPLUG_MS  unplugs the right controller every that many ms
+//                        and plugs it back as long after, 0 (never) by
+//                        default.
+
+#include <libusb-1.0/libusb.h>
+
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "monotonic.h"
+#include "sim.h"
+
+#define USB_SIM_MAX_INTERFACES 8
+#define USB_SIM_MAX_CALLBACKS 8
+#define USB_SIM_MAX_HOTPLUG_EVENTS 16
+// Endpoint addresses folded into 0..31, the direction in bit 4.
+#define USB_SIM_ENDPOINT_INDEX(endpoint)                                       \
+  (((endpoint) & 0x0f) | (((endpoint) & LIBUSB_ENDPOINT_IN) >> 3))
+
+// Put in front of every transfer, which libusb_alloc_transfer returns right
+// after it.
+struct usb_sim_transfer {
+  _Alignas(max_align_t) struct usb_sim_transfer *next;
+  // When the device thread completes it, 0 to wait for a report.
+  uint64_t due_ns;
+  // From libusb_submit_transfer until its callback returns.
+  int in_flight;
+  // Completed, waiting for libusb_handle_events*.
+  int done;
+};
+
+struct libusb_device {
+  libusb_context *ctx;
+  const struct sim_device *sim;
+  // The reports of the interrupt IN endpoint, 0 if there is none.
+  struct sim_source source;
+  uint64_t report_due_ns;
+  int present;
+  // Bumped on every departure, so the handles of an earlier connection fail
+  // with LIBUSB_ERROR_NO_DEVICE.
+  int generation;
+  // One bit per interface: still bound to its kernel driver, and claimed.
+  unsigned int bound;
+  unsigned int claimed;
+  uint8_t altsettings[USB_SIM_MAX_INTERFACES];
+  // When the packets already queued on an OUT endpoint will have gone out.
+  uint64_t busy_until_ns[32];
+};
+
+struct libusb_device_handle {
+  libusb_device *device;
+  int generation;
+  unsigned int claimed;
+};
+
+struct usb_sim_callback {
+  int used;
+  int events;
+  int vendor_id;
+  int product_id;
+  libusb_hotplug_callback_fn fn;
+  void *user_data;
+};
+
+struct usb_sim_hotplug_event {
+  libusb_device *device;
+  libusb_hotplug_event event;
+};
+
+struct libusb_context {
+  double rate_hz;
+  double jitter_ns;
+  uint64_t replug_ns;
+  uint64_t seed;
+
+  // Everything below is under `lock`, but the callbacks run without it.
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_t thread;
+  int running;
+  libusb_device devices[SIM_NUM_DEVICES];
+  struct usb_sim_transfer *pending;
+  struct usb_sim_transfer *completed;
+  struct usb_sim_transfer **completed_tail;
+  struct usb_sim_callback callbacks[USB_SIM_MAX_CALLBACKS];
+  struct usb_sim_hotplug_event hotplug_events[USB_SIM_MAX_HOTPLUG_EVENTS];
+  int num_hotplug_events;
+
+  // Only one thread hands out completions at a time, as in libusb.
+  pthread_mutex_t event_lock;
+  struct libusb_pollfd pollfd;
+};
+
+static struct usb_sim_transfer *
+usb_sim_transfer_of(struct libusb_transfer *transfer) {
+  return (struct usb_sim_transfer *)transfer - 1;
+}
+
+static struct libusb_transfer *
+usb_sim_libusb_transfer(struct usb_sim_transfer *transfer) {
+  return (struct libusb_transfer *)(transfer + 1);
+}
+
+static int usb_sim_attached(const libusb_device_handle *dev_handle) {
+  return dev_handle->device->present &&
+         dev_handle->generation == dev_handle->device->generation;
+}
+
+static void usb_sim_wake_events(libusb_context *ctx) {
+  const uint64_t one = 1;
+  if (write(ctx->pollfd.fd, &one, sizeof(one)) < 0) {
+    // Only fails when the counter is saturated, still readable then.
+  }
+}
+
+// The endpoint descriptor of `endpoint` in the current alternate settings, and
+// its interface number, or NULL.
+static const struct libusb_endpoint_descriptor *
+usb_sim_find_endpoint(const libusb_device *device, unsigned char endpoint,
+                      int *interface_number) {
+  const struct libusb_config_descriptor *config = device->sim->config;
+  for (int i = 0; i < config->bNumInterfaces; ++i) {
+    const struct libusb_interface *interface = &config->interface[i];
+    for (int j = 0; j < interface->num_altsetting; ++j) {
+      const struct libusb_interface_descriptor *altsetting =
+          &interface->altsetting[j];
+      if (altsetting->bInterfaceNumber >= USB_SIM_MAX_INTERFACES ||
+          altsetting->bAlternateSetting !=
+              device->altsettings[altsetting->bInterfaceNumber]) {
+        continue;
+      }
+      for (int k = 0; k < altsetting->bNumEndpoints; ++k) {
+        if (altsetting->endpoint[k].bEndpointAddress == endpoint) {
+          *interface_number = altsetting->bInterfaceNumber;
+          return &altsetting->endpoint[k];
+        }
+      }
+    }
+  }
+  return NULL;
+}
+
+// Moves a pending transfer to the completed ones. Called with the lock held.
+static void usb_sim_complete(libusb_context *ctx,
+                             struct usb_sim_transfer *transfer,
+                             enum libusb_transfer_status status) {
+  struct usb_sim_transfer **link = &ctx->pending;
+  while (*link != transfer) {
+    link = &(*link)->next;
+  }
+  *link = transfer->next;
+  transfer->next = NULL;
+  transfer->done = 1;
+  usb_sim_libusb_transfer(transfer)->status = status;
+  *ctx->completed_tail = transfer;
+  ctx->completed_tail = &transfer->next;
+  usb_sim_wake_events(ctx);
+}
+
+// Gives the next report of `device` to the oldest transfer waiting for one.
+// The report is lost if there is none, as it would be on the bus.
+static void usb_sim_deliver_report(libusb_context *ctx, libusb_device *device,
+                                   uint64_t tick) {
+  struct sim_source *source = &device->source;
+  if (source->endpoint == 0) {
+    return;
+  }
+  const float dt = (float)(1.0 / ctx->rate_hz);
+  const double elapsed_us = tick * 1e6 / ctx->rate_hz;
+  sim_generate_report(
+      source, dt,
+      source->clock_offset_us +
+          (uint32_t)(uint64_t)(elapsed_us *
+                               (1.0 + source->clock_drift_ppm * 1e-6)));
+  for (struct usb_sim_transfer *transfer = ctx->pending; transfer != NULL;
+       transfer = transfer->next) {
+    struct libusb_transfer *usb_transfer = usb_sim_libusb_transfer(transfer);
+    if (usb_transfer->dev_handle->device != device ||
+        usb_transfer->endpoint != source->endpoint) {
+      continue;
+    }
+    const int length = usb_transfer->length < SIM_REPORT_SIZE
+                           ? usb_transfer->length
+                           : SIM_REPORT_SIZE;
+    memcpy(usb_transfer->buffer, source->report, length);
+    usb_transfer->actual_length = length;
+    usb_sim_complete(ctx, transfer, LIBUSB_TRANSFER_COMPLETED);
+    return;
+  }
+}
+
+// Completes the OUT transfers that went out and the ones that timed out.
+static void usb_sim_complete_due(libusb_context *ctx, uint64_t now_ns) {
+  struct usb_sim_transfer *transfer = ctx->pending;
+  while (transfer != NULL) {
+    struct usb_sim_transfer *next = transfer->next;
+    struct libusb_transfer *usb_transfer = usb_sim_libusb_transfer(transfer);
+    if (transfer->due_ns != 0 && transfer->due_ns <= now_ns) {
+      if (usb_transfer->endpoint & LIBUSB_ENDPOINT_IN) {
+        usb_sim_complete(ctx, transfer, LIBUSB_TRANSFER_TIMED_OUT);
+      } else {
+        usb_transfer->actual_length = usb_transfer->length;
+        for (int i = 0; i < usb_transfer->num_iso_packets; ++i) {
+          struct libusb_iso_packet_descriptor *packet =
+              &usb_transfer->iso_packet_desc[i];
+          packet->actual_length = packet->length;
+          packet->status = LIBUSB_TRANSFER_COMPLETED;
+        }
+        usb_sim_complete(ctx, transfer, LIBUSB_TRANSFER_COMPLETED);
+      }
+    }
+    transfer = next;
+  }
+}
+
+static void usb_sim_queue_hotplug(libusb_context *ctx, libusb_device *device,
+                                  libusb_hotplug_event event) {
+  if (ctx->num_hotplug_events < USB_SIM_MAX_HOTPLUG_EVENTS) {
+    ctx->hotplug_events[ctx->num_hotplug_events++] =
+        (struct usb_sim_hotplug_event){.device = device, .event = event};
+    usb_sim_wake_events(ctx);
+  }
+}
+
+// Plugs a device in with every interface bound to its kernel driver.
+static void usb_sim_arrive(libusb_device *device) {
+  device->present = 1;
+  device->bound = (1u << device->sim->config->bNumInterfaces) - 1;
+  device->claimed = 0;
+  memset(device->altsettings, 0, sizeof(device->altsettings));
+  memset(device->busy_until_ns, 0, sizeof(device->busy_until_ns));
+}
+
+// Unplugs a device, failing its transfers as libusb does.
+static void usb_sim_leave(libusb_context *ctx, libusb_device *device) {
+  device->present = 0;
+  ++device->generation;
+  struct usb_sim_transfer *transfer = ctx->pending;
+  while (transfer != NULL) {
+    struct usb_sim_transfer *next = transfer->next;
+    if (usb_sim_libusb_transfer(transfer)->dev_handle->device == device) {
+      usb_sim_complete(ctx, transfer, LIBUSB_TRANSFER_NO_DEVICE);
+    }
+    transfer = next;
+  }
+  usb_sim_queue_hotplug(ctx, device, LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT);
+}
+
+static void usb_sim_wait_until(libusb_context *ctx, uint64_t deadline_ns) {
+  struct timespec deadline = {
+      .tv_sec = deadline_ns / 1000000000ull,
+      .tv_nsec = deadline_ns % 1000000000ull,
+  };
+  pthread_cond_timedwait(&ctx->wake, &ctx->lock, &deadline);
+}
+
+static void *usb_sim_main(void *arg) {
+  libusb_context *ctx = arg;
+  const double period_ns = 1e9 / ctx->rate_hz;
+  const uint64_t start_ns = monotonic_ns();
+  uint64_t tick = 0;
+  // Devices still to report in the current tick, one bit each.
+  int reporting = 0;
+  uint64_t replug_due_ns = start_ns + ctx->replug_ns;
+
+  pthread_mutex_lock(&ctx->lock);
+  while (ctx->running) {
+    const uint64_t now_ns = monotonic_ns();
+    if (reporting == 0) {
+      // Reports arrive late by a random amount, never early, and the two
+      // controllers do not arrive together.
+      const uint64_t nominal_ns = start_ns + (uint64_t)(tick * period_ns);
+      for (int d = 0; d < SIM_NUM_DEVICES; ++d) {
+        ctx->devices[d].report_due_ns =
+            nominal_ns +
+            (uint64_t)fabs(ctx->jitter_ns * sim_gaussian(&ctx->seed));
+      }
+      reporting = (1 << SIM_NUM_DEVICES) - 1;
+    }
+    for (int d = 0; d < SIM_NUM_DEVICES; ++d) {
+      libusb_device *device = &ctx->devices[d];
+      if ((reporting & (1 << d)) && device->report_due_ns <= now_ns) {
+        if (device->present) {
+          usb_sim_deliver_report(ctx, device, tick);
+        }
+        reporting &= ~(1 << d);
+      }
+    }
+    if (reporting == 0) {
+      ++tick;
+    }
+    usb_sim_complete_due(ctx, now_ns);
+    if (ctx->replug_ns != 0 && replug_due_ns <= now_ns) {
+      libusb_device *device = &ctx->devices[SIM_NUM_DEVICES - 1];
+      if (device->present) {
+        usb_sim_leave(ctx, device);
+      } else {
+        usb_sim_arrive(device);
+        usb_sim_queue_hotplug(ctx, device,
+                              LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED);
+      }
+      replug_due_ns += ctx->replug_ns;
+    }
+
+    // Sleeps until the next report or completion, a submission waking it up
+    // earlier.
+    uint64_t wake_ns = start_ns + (uint64_t)(tick * period_ns);
+    for (int d = 0; d < SIM_NUM_DEVICES; ++d) {
+      if ((reporting & (1 << d)) && ctx->devices[d].report_due_ns < wake_ns) {
+        wake_ns = ctx->devices[d].report_due_ns;
+      }
+    }
+    for (struct usb_sim_transfer *transfer = ctx->pending; transfer != NULL;
+         transfer = transfer->next) {
+      if (transfer->due_ns != 0 && transfer->due_ns < wake_ns) {
+        wake_ns = transfer->due_ns;
+      }
+    }
+    if (ctx->replug_ns != 0 && replug_due_ns < wake_ns) {
+      wake_ns = replug_due_ns;
+    }
+    if (wake_ns > now_ns) {
+      usb_sim_wait_until(ctx, wake_ns);
+    }
+  }
+  pthread_mutex_unlock(&ctx->lock);
+  return NULL;
+}
+
+static double usb_sim_getenv(const char *name, double fallback) {
+  const char *value = getenv(name);
+  if (value == NULL || *value == '\0') {
+    return fallback;
+  }
+  char *end;
+  const double parsed = strtod(value, &end);
+  if (*end != '\0' || !(parsed >= 0.0)) {
+    fprintf(stderr, "%s:%d: ignoring %s=%s\n", __FILE__, __LINE__, name,
+            value);
+    return fallback;
+  }
+  return parsed;
+}
+
+int libusb_init(libusb_context **ctx_out) {
+  libusb_context *ctx = calloc(1, sizeof(*ctx));
+  if (ctx == NULL) {
+    return LIBUSB_ERROR_NO_MEM;
+  }
+  ctx->rate_hz = usb_sim_getenv("PSVR2_SIM_RATE", SIM_DEFAULT_RATE_HZ);
+  if (ctx->rate_hz == 0.0) {
+    ctx->rate_hz = SIM_DEFAULT_RATE_HZ;
+  }
+  ctx->jitter_ns =
+      usb_sim_getenv("PSVR2_SIM_JITTER_US", SIM_DEFAULT_JITTER_US) * 1000.0;
+  ctx->replug_ns =
+      (uint64_t)(usb_sim_getenv("PSVR2_SIM_REPLUG_MS", 0.0) * 1000000.0);
+  ctx->seed = 0x853c49e6748fea9bull;
+  ctx->completed_tail = &ctx->completed;
+  ctx->pollfd.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  ctx->pollfd.events = POLLIN;
+  if (ctx->pollfd.fd < 0) {
+    free(ctx);
+    return LIBUSB_ERROR_OTHER;
+  }
+
+  // The generators start as sim_open starts them.
+  for (int d = 0; d < SIM_NUM_DEVICES; ++d) {
+    libusb_device *device = &ctx->devices[d];
+    device->ctx = ctx;
+    device->sim = &sim_devices[d];
+    device->source.device = &sim_devices[d];
+    device->source.orientation[0] = 1.0f;
+    device->source.phase = 3.0f * d;
+    device->source.clock_offset_us = 1234567u * (d + 1);
+    device->source.clock_drift_ppm = d == 0 ? 20.0 : -35.0;
+    const struct libusb_config_descriptor *config = device->sim->config;
+    for (int i = 0; i < config->bNumInterfaces; ++i) {
+      const struct libusb_interface_descriptor *altsetting =
+          &config->interface[i].altsetting[0];
+      for (int k = 0; k < altsetting->bNumEndpoints; ++k) {
+        const struct libusb_endpoint_descriptor *endpoint =
+            &altsetting->endpoint[k];
+        if ((endpoint->bEndpointAddress & LIBUSB_ENDPOINT_IN) &&
+            (endpoint->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) ==
+                LIBUSB_ENDPOINT_TRANSFER_TYPE_INTERRUPT) {
+          device->source.endpoint = endpoint->bEndpointAddress;
+        }
+      }
+    }
+    device->generation = 1;
+    usb_sim_arrive(device);
+  }
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&ctx->wake, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_mutex_init(&ctx->lock, NULL);
+  pthread_mutex_init(&ctx->event_lock, NULL);
+  ctx->running = 1;
+  if (pthread_create(&ctx->thread, NULL, usb_sim_main, ctx) != 0) {
+    pthread_cond_destroy(&ctx->wake);
+    pthread_mutex_destroy(&ctx->lock);
+    pthread_mutex_destroy(&ctx->event_lock);
+    close(ctx->pollfd.fd);
+    free(ctx);
+    return LIBUSB_ERROR_OTHER;
+  }
+  fprintf(stderr,
+          "Simulated libusb: %d controllers at %.0f Hz, %.0f us of jitter",
+          SIM_NUM_DEVICES, ctx->rate_hz, ctx->jitter_ns / 1000.0);
+  if (ctx->replug_ns != 0) {
+    fprintf(stderr, ", the right one replugged every %.0f ms",
+            ctx->replug_ns / 1e6);
+  }
+  fprintf(stderr, "\n");
+  *ctx_out = ctx;
+  return LIBUSB_SUCCESS;
+}
+
+void libusb_exit(libusb_context *ctx) {
+  pthread_mutex_lock(&ctx->lock);
+  ctx->running = 0;
+  pthread_cond_signal(&ctx->wake);
+  pthread_mutex_unlock(&ctx->lock);
+  pthread_join(ctx->thread, NULL);
+  pthread_cond_destroy(&ctx->wake);
+  pthread_mutex_destroy(&ctx->lock);
+  pthread_mutex_destroy(&ctx->event_lock);
+  close(ctx->pollfd.fd);
+  free(ctx);
+}
+
+int libusb_has_capability(uint32_t capability) {
+  return capability == LIBUSB_CAP_HAS_HOTPLUG;
+}
+
+const char *libusb_error_name(int error_code) {
+  switch (error_code) {
+  case LIBUSB_SUCCESS:
+    return "LIBUSB_SUCCESS / LIBUSB_TRANSFER_COMPLETED";
+  case LIBUSB_ERROR_IO:
+    return "LIBUSB_ERROR_IO";
+  case LIBUSB_ERROR_INVALID_PARAM:
+    return "LIBUSB_ERROR_INVALID_PARAM";
+  case LIBUSB_ERROR_ACCESS:
+    return "LIBUSB_ERROR_ACCESS";
+  case LIBUSB_ERROR_NO_DEVICE:
+    return "LIBUSB_ERROR_NO_DEVICE";
+  case LIBUSB_ERROR_NOT_FOUND:
+    return "LIBUSB_ERROR_NOT_FOUND";
+  case LIBUSB_ERROR_BUSY:
+    return "LIBUSB_ERROR_BUSY";
+  case LIBUSB_ERROR_TIMEOUT:
+    return "LIBUSB_ERROR_TIMEOUT";
+  case LIBUSB_ERROR_OVERFLOW:
+    return "LIBUSB_ERROR_OVERFLOW";
+  case LIBUSB_ERROR_PIPE:
+    return "LIBUSB_ERROR_PIPE";
+  case LIBUSB_ERROR_INTERRUPTED:
+    return "LIBUSB_ERROR_INTERRUPTED";
+  case LIBUSB_ERROR_NO_MEM:
+    return "LIBUSB_ERROR_NO_MEM";
+  case LIBUSB_ERROR_NOT_SUPPORTED:
+    return "LIBUSB_ERROR_NOT_SUPPORTED";
+  case LIBUSB_ERROR_OTHER:
+    return "LIBUSB_ERROR_OTHER";
+  case LIBUSB_TRANSFER_ERROR:
+    return "LIBUSB_TRANSFER_ERROR";
+  case LIBUSB_TRANSFER_TIMED_OUT:
+    return "LIBUSB_TRANSFER_TIMED_OUT";
+  case LIBUSB_TRANSFER_CANCELLED:
+    return "LIBUSB_TRANSFER_CANCELLED";
+  case LIBUSB_TRANSFER_STALL:
+    return "LIBUSB_TRANSFER_STALL";
+  case LIBUSB_TRANSFER_NO_DEVICE:
+    return "LIBUSB_TRANSFER_NO_DEVICE";
+  case LIBUSB_TRANSFER_OVERFLOW:
+    return "LIBUSB_TRANSFER_OVERFLOW";
+  default:
+    return "**UNKNOWN**";
+  }
+}
+
+const char *libusb_strerror(int error_code) {
+  return libusb_error_name(error_code);
+}
+
+ssize_t libusb_get_device_list(libusb_context *ctx, libusb_device ***list) {
+  libusb_device **devices = calloc(SIM_NUM_DEVICES + 1, sizeof(*devices));
+  if (devices == NULL) {
+    return LIBUSB_ERROR_NO_MEM;
+  }
+  ssize_t count = 0;
+  pthread_mutex_lock(&ctx->lock);
+  for (int d = 0; d < SIM_NUM_DEVICES; ++d) {
+    if (ctx->devices[d].present) {
+      devices[count++] = &ctx->devices[d];
+    }
+  }
+  pthread_mutex_unlock(&ctx->lock);
+  *list = devices;
+  return count;
+}
+
+void libusb_free_device_list(libusb_device **list, int unref_devices) {
+  free(list);
+}
+
+// The devices live as long as their context, references change nothing.
+libusb_device *libusb_ref_device(libusb_device *device) { return device; }
+
+void libusb_unref_device(libusb_device *device) {}
+
+int libusb_get_device_descriptor(libusb_device *device,
+                                 struct libusb_device_descriptor *desc) {
+  *desc = device->sim->device;
+  return LIBUSB_SUCCESS;
+}
+
+// The descriptors are the static ones of sim.c, freeing them does nothing.
+int libusb_get_config_descriptor(libusb_device *device, uint8_t config_index,
+                                 struct libusb_config_descriptor **config) {
+  if (config_index != 0) {
+    return LIBUSB_ERROR_NOT_FOUND;
+  }
+  *config = (struct libusb_config_descriptor *)device->sim->config;
+  return LIBUSB_SUCCESS;
+}
+
+int libusb_get_active_config_descriptor(
+    libusb_device *device, struct libusb_config_descriptor **config) {
+  return libusb_get_config_descriptor(device, 0, config);
+}
+
+void libusb_free_config_descriptor(struct libusb_config_descriptor *config) {}
+
+uint8_t libusb_get_bus_number(libusb_device *device) { return 1; }
+
+int libusb_get_port_numbers(libusb_device *device, uint8_t *port_numbers,
+                            int port_numbers_len) {
+  if (port_numbers_len < 1) {
+    return LIBUSB_ERROR_OVERFLOW;
+  }
+  port_numbers[0] = (uint8_t)(device - device->ctx->devices + 1);
+  return 1;
+}
+
+int libusb_get_device_speed(libusb_device *device) {
+  return LIBUSB_SPEED_FULL;
+}
+
+int libusb_get_max_packet_size(libusb_device *device, unsigned char endpoint) {
+  const struct libusb_config_descriptor *config = device->sim->config;
+  for (int i = 0; i < config->bNumInterfaces; ++i) {
+    const struct libusb_interface *interface = &config->interface[i];
+    for (int j = 0; j < interface->num_altsetting; ++j) {
+      const struct libusb_interface_descriptor *altsetting =
+          &interface->altsetting[j];
+      for (int k = 0; k < altsetting->bNumEndpoints; ++k) {
+        if (altsetting->endpoint[k].bEndpointAddress == endpoint) {
+          return altsetting->endpoint[k].wMaxPacketSize;
+        }
+      }
+    }
+  }
+  return LIBUSB_ERROR_NOT_FOUND;
+}
+
+int libusb_open(libusb_device *device, libusb_device_handle **dev_handle) {
+  libusb_context *ctx = device->ctx;
+  pthread_mutex_lock(&ctx->lock);
+  const int present = device->present;
+  const int generation = device->generation;
+  pthread_mutex_unlock(&ctx->lock);
+  if (!present) {
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+  libusb_device_handle *handle = calloc(1, sizeof(*handle));
+  if (handle == NULL) {
+    return LIBUSB_ERROR_NO_MEM;
+  }
+  handle->device = device;
+  handle->generation = generation;
+  *dev_handle = handle;
+  return LIBUSB_SUCCESS;
+}
+
+// Closing a handle with transfers still in flight is a bug of the caller:
+// libusb would complete them into freed memory. They are reported and
+// dropped here instead.
+void libusb_close(libusb_device_handle *dev_handle) {
+  libusb_context *ctx = dev_handle->device->ctx;
+  pthread_mutex_lock(&ctx->lock);
+  int dropped = 0;
+  struct usb_sim_transfer **link = &ctx->pending;
+  while (*link != NULL) {
+    if (usb_sim_libusb_transfer(*link)->dev_handle == dev_handle) {
+      *link = (*link)->next;
+      ++dropped;
+    } else {
+      link = &(*link)->next;
+    }
+  }
+  ctx->completed_tail = &ctx->completed;
+  while (*ctx->completed_tail != NULL) {
+    if (usb_sim_libusb_transfer(*ctx->completed_tail)->dev_handle ==
+        dev_handle) {
+      *ctx->completed_tail = (*ctx->completed_tail)->next;
+      ++dropped;
+    } else {
+      ctx->completed_tail = &(*ctx->completed_tail)->next;
+    }
+  }
+  if (usb_sim_attached(dev_handle)) {
+    dev_handle->device->claimed &= ~dev_handle->claimed;
+  }
+  pthread_mutex_unlock(&ctx->lock);
+  if (dropped > 0) {
+    fprintf(stderr, "%s:%d: closing a handle with %d transfers in flight\n",
+            __FILE__, __LINE__, dropped);
+  }
+  free(dev_handle);
+}
+
+libusb_device *libusb_get_device(libusb_device_handle *dev_handle) {
+  return dev_handle->device;
+}
+
+int libusb_get_string_descriptor_ascii(libusb_device_handle *dev_handle,
+                                       uint8_t desc_index, unsigned char *data,
+                                       int length) {
+  const struct sim_device *sim = dev_handle->device->sim;
+  const char *string = NULL;
+  if (desc_index == 0 || length <= 0) {
+    return LIBUSB_ERROR_INVALID_PARAM;
+  } else if (desc_index == sim->device.iManufacturer) {
+    string = sim->manufacturer;
+  } else if (desc_index == sim->device.iProduct) {
+    string = sim->product;
+  } else {
+    return LIBUSB_ERROR_PIPE;
+  }
+  int copied = (int)strlen(string);
+  if (copied > length - 1) {
+    copied = length - 1;
+  }
+  memcpy(data, string, copied);
+  data[copied] = '\0';
+  return copied;
+}
+
+int libusb_get_bos_descriptor(libusb_device_handle *dev_handle,
+                              struct libusb_bos_descriptor **bos) {
+  // A USB 2.0 device without one.
+  return LIBUSB_ERROR_PIPE;
+}
+
+void libusb_free_bos_descriptor(struct libusb_bos_descriptor *bos) {}
+
+static int usb_sim_check_interface(libusb_device_handle *dev_handle,
+                                   int interface_number) {
+  if (!usb_sim_attached(dev_handle)) {
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+  if (interface_number < 0 ||
+      interface_number >= dev_handle->device->sim->config->bNumInterfaces) {
+    return LIBUSB_ERROR_NOT_FOUND;
+  }
+  return LIBUSB_SUCCESS;
+}
+
+int libusb_kernel_driver_active(libusb_device_handle *dev_handle,
+                                int interface_number) {
+  libusb_context *ctx = dev_handle->device->ctx;
+  pthread_mutex_lock(&ctx->lock);
+  int result = usb_sim_check_interface(dev_handle, interface_number);
+  if (result == LIBUSB_SUCCESS) {
+    result = (dev_handle->device->bound >> interface_number) & 1;
+  }
+  pthread_mutex_unlock(&ctx->lock);
+  return result;
+}
+
+int libusb_detach_kernel_driver(libusb_device_handle *dev_handle,
+                                int interface_number) {
+  libusb_context *ctx = dev_handle->device->ctx;
+  pthread_mutex_lock(&ctx->lock);
+  int result = usb_sim_check_interface(dev_handle, interface_number);
+  if (result == LIBUSB_SUCCESS) {
+    if (dev_handle->device->bound & (1u << interface_number)) {
+      dev_handle->device->bound &= ~(1u << interface_number);
+    } else {
+      result = LIBUSB_ERROR_NOT_FOUND;
+    }
+  }
+  pthread_mutex_unlock(&ctx->lock);
+  return result;
+}
+
+int libusb_attach_kernel_driver(libusb_device_handle *dev_handle,
+                                int interface_number) {
+  libusb_context *ctx = dev_handle->device->ctx;
+  pthread_mutex_lock(&ctx->lock);
+  int result = usb_sim_check_interface(dev_handle, interface_number);
+  if (result == LIBUSB_SUCCESS) {
+    if (dev_handle->device->claimed & (1u << interface_number)) {
+      result = LIBUSB_ERROR_BUSY;
+    } else {
+      dev_handle->device->bound |= 1u << interface_number;
+    }
+  }
+  pthread_mutex_unlock(&ctx->lock);
+  return result;
+}
+
+int libusb_claim_interface(libusb_device_handle *dev_handle,
+                           int interface_number) {
+  libusb_context *ctx = dev_handle->device->ctx;
+  pthread_mutex_lock(&ctx->lock);
+  int result = usb_sim_check_interface(dev_handle, interface_number);
+  const unsigned int bit = 1u << interface_number;
+  if (result == LIBUSB_SUCCESS && !(dev_handle->claimed & bit)) {
+    if ((dev_handle->device->bound | dev_handle->device->claimed) & bit) {
+      result = LIBUSB_ERROR_BUSY;
+    } else {
+      dev_handle->device->claimed |= bit;
+      dev_handle->claimed |= bit;
+    }
+  }
+  pthread_mutex_unlock(&ctx->lock);
+  return result;
+}
+
+int libusb_release_interface(libusb_device_handle *dev_handle,
+                             int interface_number) {
+  libusb_context *ctx = dev_handle->device->ctx;
+  pthread_mutex_lock(&ctx->lock);
+  int result = usb_sim_check_interface(dev_handle, interface_number);
+  const unsigned int bit = 1u << interface_number;
+  if (result == LIBUSB_SUCCESS) {
+    if (dev_handle->claimed & bit) {
+      dev_handle->device->claimed &= ~bit;
+      dev_handle->claimed &= ~bit;
+      dev_handle->device->altsettings[interface_number] = 0;
+    } else {
+      result = LIBUSB_ERROR_NOT_FOUND;
+    }
+  }
+  pthread_mutex_unlock(&ctx->lock);
+  return result;
+}
+
+int libusb_set_interface_alt_setting(libusb_device_handle *dev_handle,
+                                     int interface_number,
+                                     int alternate_setting) {
+  libusb_context *ctx = dev_handle->device->ctx;
+  pthread_mutex_lock(&ctx->lock);
+  int result = usb_sim_check_interface(dev_handle, interface_number);
+  if (result == LIBUSB_SUCCESS) {
+    const struct libusb_interface *interface =
+        &dev_handle->device->sim->config->interface[interface_number];
+    if (!(dev_handle->claimed & (1u << interface_number)) ||
+        alternate_setting < 0 ||
+        alternate_setting >= interface->num_altsetting) {
+      result = LIBUSB_ERROR_NOT_FOUND;
+    } else {
+      dev_handle->device->altsettings[interface_number] =
+          (uint8_t)alternate_setting;
+    }
+  }
+  pthread_mutex_unlock(&ctx->lock);
+  return result;
+}
+
+// Only the HID report descriptors are known, every other request stalls.
+int libusb_control_transfer(libusb_device_handle *dev_handle,
+                            uint8_t request_type, uint8_t request,
+                            uint16_t value, uint16_t index, unsigned char *data,
+                            uint16_t length, unsigned int timeout) {
+  libusb_context *ctx = dev_handle->device->ctx;
+  pthread_mutex_lock(&ctx->lock);
+  const int attached = usb_sim_attached(dev_handle);
+  pthread_mutex_unlock(&ctx->lock);
+  if (!attached) {
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+  const struct libusb_config_descriptor *config =
+      dev_handle->device->sim->config;
+  if (request_type != (LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_STANDARD |
+                       LIBUSB_RECIPIENT_INTERFACE) ||
+      request != LIBUSB_REQUEST_GET_DESCRIPTOR ||
+      value >> 8 != LIBUSB_DT_REPORT || index >= config->bNumInterfaces ||
+      config->interface[index].altsetting[0].bInterfaceClass !=
+          LIBUSB_CLASS_HID) {
+    return LIBUSB_ERROR_PIPE;
+  }
+  const int copied =
+      length < SIM_REPORT_DESCRIPTOR_SIZE ? length : SIM_REPORT_DESCRIPTOR_SIZE;
+  memcpy(data, sim_report_descriptor, copied);
+  return copied;
+}
+
+struct libusb_transfer *libusb_alloc_transfer(int iso_packets) {
+  const size_t size =
+      sizeof(struct usb_sim_transfer) + sizeof(struct libusb_transfer) +
+      iso_packets * sizeof(struct libusb_iso_packet_descriptor);
+  struct usb_sim_transfer *transfer = calloc(1, size);
+  if (transfer == NULL) {
+    return NULL;
+  }
+  struct libusb_transfer *usb_transfer = usb_sim_libusb_transfer(transfer);
+  usb_transfer->num_iso_packets = iso_packets;
+  return usb_transfer;
+}
+
+void libusb_free_transfer(struct libusb_transfer *transfer) {
+  if (transfer == NULL) {
+    return;
+  }
+  if (usb_sim_transfer_of(transfer)->in_flight) {
+    fprintf(stderr, "%s:%d: freeing a transfer still in flight\n", __FILE__,
+            __LINE__);
+  }
+  if (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER) {
+    free(transfer->buffer);
+  }
+  free(usb_sim_transfer_of(transfer));
+}
+
+int libusb_submit_transfer(struct libusb_transfer *transfer) {
+  struct usb_sim_transfer *sim_transfer = usb_sim_transfer_of(transfer);
+  libusb_device_handle *dev_handle = transfer->dev_handle;
+  libusb_device *device = dev_handle->device;
+  libusb_context *ctx = device->ctx;
+  int result = LIBUSB_SUCCESS;
+  pthread_mutex_lock(&ctx->lock);
+  int interface_number;
+  const struct libusb_endpoint_descriptor *endpoint =
+      usb_sim_attached(dev_handle)
+          ? usb_sim_find_endpoint(device, transfer->endpoint, &interface_number)
+          : NULL;
+  if (!usb_sim_attached(dev_handle)) {
+    result = LIBUSB_ERROR_NO_DEVICE;
+  } else if (sim_transfer->in_flight) {
+    result = LIBUSB_ERROR_BUSY;
+  } else if (endpoint == NULL ||
+             !(dev_handle->claimed & (1u << interface_number))) {
+    result = LIBUSB_ERROR_NOT_FOUND;
+  } else if ((endpoint->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) !=
+             transfer->type) {
+    result = LIBUSB_ERROR_INVALID_PARAM;
+  }
+  if (result != LIBUSB_SUCCESS) {
+    pthread_mutex_unlock(&ctx->lock);
+    return result;
+  }
+
+  const uint64_t now_ns = monotonic_ns();
+  sim_transfer->in_flight = 1;
+  sim_transfer->done = 0;
+  sim_transfer->due_ns = 0;
+  transfer->actual_length = 0;
+  if (transfer->endpoint & LIBUSB_ENDPOINT_IN) {
+    if (transfer->timeout != 0) {
+      sim_transfer->due_ns = now_ns + transfer->timeout * 1000000ull;
+    }
+  } else {
+    // One packet per frame, after the ones already queued on the endpoint.
+    uint64_t *busy_until_ns =
+        &device->busy_until_ns[USB_SIM_ENDPOINT_INDEX(transfer->endpoint)];
+    const int packets =
+        transfer->num_iso_packets > 0 ? transfer->num_iso_packets : 1;
+    const uint64_t start_ns = *busy_until_ns > now_ns ? *busy_until_ns : now_ns;
+    *busy_until_ns = start_ns + packets * 1000000ull;
+    sim_transfer->due_ns = *busy_until_ns;
+  }
+  struct usb_sim_transfer **link = &ctx->pending;
+  while (*link != NULL) {
+    link = &(*link)->next;
+  }
+  sim_transfer->next = NULL;
+  *link = sim_transfer;
+  pthread_cond_signal(&ctx->wake);
+  pthread_mutex_unlock(&ctx->lock);
+  return LIBUSB_SUCCESS;
+}
+
+int libusb_cancel_transfer(struct libusb_transfer *transfer) {
+  struct usb_sim_transfer *sim_transfer = usb_sim_transfer_of(transfer);
+  libusb_context *ctx = transfer->dev_handle->device->ctx;
+  int result = LIBUSB_ERROR_NOT_FOUND;
+  pthread_mutex_lock(&ctx->lock);
+  if (sim_transfer->in_flight && !sim_transfer->done) {
+    usb_sim_complete(ctx, sim_transfer, LIBUSB_TRANSFER_CANCELLED);
+    result = LIBUSB_SUCCESS;
+  }
+  pthread_mutex_unlock(&ctx->lock);
+  return result;
+}
+
+// Plain host memory: what matters is that the pool takes this path.
+unsigned char *libusb_dev_mem_alloc(libusb_device_handle *dev_handle,
+                                    size_t length) {
+  return calloc(1, length);
+}
+
+int libusb_dev_mem_free(libusb_device_handle *dev_handle, unsigned char *buffer,
+                        size_t length) {
+  free(buffer);
+  return LIBUSB_SUCCESS;
+}
+
+static int usb_sim_matches(const struct usb_sim_callback *callback,
+                           const libusb_device *device,
+                           libusb_hotplug_event event) {
+  return callback->used && (callback->events & event) &&
+         (callback->vendor_id == LIBUSB_HOTPLUG_MATCH_ANY ||
+          callback->vendor_id == device->sim->device.idVendor) &&
+         (callback->product_id == LIBUSB_HOTPLUG_MATCH_ANY ||
+          callback->product_id == device->sim->device.idProduct);
+}
+
+// Runs the callbacks matching a hotplug event, deregistering the ones that
+// return 1.
+static void usb_sim_run_hotplug(libusb_context *ctx, libusb_device *device,
+                                libusb_hotplug_event event) {
+  for (int i = 0; i < USB_SIM_MAX_CALLBACKS; ++i) {
+    pthread_mutex_lock(&ctx->lock);
+    const struct usb_sim_callback callback = ctx->callbacks[i];
+    pthread_mutex_unlock(&ctx->lock);
+    if (usb_sim_matches(&callback, device, event) &&
+        callback.fn(ctx, device, event, callback.user_data) == 1) {
+      libusb_hotplug_deregister_callback(ctx, i + 1);
+    }
+  }
+}
+
+int libusb_hotplug_register_callback(
+    libusb_context *ctx, int events, int flags, int vendor_id, int product_id,
+    int dev_class, libusb_hotplug_callback_fn cb_fn, void *user_data,
+    libusb_hotplug_callback_handle *callback_handle) {
+  pthread_mutex_lock(&ctx->lock);
+  int slot = 0;
+  while (slot < USB_SIM_MAX_CALLBACKS && ctx->callbacks[slot].used) {
+    ++slot;
+  }
+  if (slot == USB_SIM_MAX_CALLBACKS) {
+    pthread_mutex_unlock(&ctx->lock);
+    return LIBUSB_ERROR_NO_MEM;
+  }
+  struct usb_sim_callback *callback = &ctx->callbacks[slot];
+  *callback = (struct usb_sim_callback){
+      .used = 1,
+      .events = events,
+      .vendor_id = vendor_id,
+      .product_id = product_id,
+      .fn = cb_fn,
+      .user_data = user_data,
+  };
+  int present[SIM_NUM_DEVICES];
+  for (int d = 0; d < SIM_NUM_DEVICES; ++d) {
+    present[d] = ctx->devices[d].present;
+  }
+  pthread_mutex_unlock(&ctx->lock);
+  if (callback_handle != NULL) {
+    *callback_handle = slot + 1;
+  }
+
+  // The devices already there are reported from here, as libusb does.
+  if (flags & LIBUSB_HOTPLUG_ENUMERATE) {
+    for (int d = 0; d < SIM_NUM_DEVICES; ++d) {
+      libusb_device *device = &ctx->devices[d];
+      if (present[d] && usb_sim_matches(callback, device,
+                                        LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)) {
+        cb_fn(ctx, device, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, user_data);
+      }
+    }
+  }
+  return LIBUSB_SUCCESS;
+}
+
+void libusb_hotplug_deregister_callback(
+    libusb_context *ctx, libusb_hotplug_callback_handle callback_handle) {
+  if (callback_handle < 1 || callback_handle > USB_SIM_MAX_CALLBACKS) {
+    return;
+  }
+  pthread_mutex_lock(&ctx->lock);
+  ctx->callbacks[callback_handle - 1].used = 0;
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+int libusb_handle_events_timeout_completed(libusb_context *ctx,
+                                           struct timeval *tv, int *completed) {
+  const int timeout_ms =
+      tv == NULL ? -1 : (int)(tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000);
+  struct pollfd pollfd = {.fd = ctx->pollfd.fd, .events = POLLIN};
+  if (completed != NULL && *completed) {
+    return LIBUSB_SUCCESS;
+  }
+  const int ready = poll(&pollfd, 1, timeout_ms);
+  if (ready < 0) {
+    return errno == EINTR ? LIBUSB_ERROR_INTERRUPTED : LIBUSB_ERROR_IO;
+  }
+  if (ready == 0) {
+    return LIBUSB_SUCCESS;
+  }
+  uint64_t count;
+  if (read(ctx->pollfd.fd, &count, sizeof(count)) < 0) {
+    // Another thread took the wake-up, and the completions with it.
+  }
+
+  pthread_mutex_lock(&ctx->event_lock);
+  pthread_mutex_lock(&ctx->lock);
+  struct usb_sim_hotplug_event events[USB_SIM_MAX_HOTPLUG_EVENTS];
+  const int num_events = ctx->num_hotplug_events;
+  memcpy(events, ctx->hotplug_events, num_events * sizeof(*events));
+  ctx->num_hotplug_events = 0;
+  struct usb_sim_transfer *transfer = ctx->completed;
+  ctx->completed = NULL;
+  ctx->completed_tail = &ctx->completed;
+  pthread_mutex_unlock(&ctx->lock);
+
+  for (int i = 0; i < num_events; ++i) {
+    usb_sim_run_hotplug(ctx, events[i].device, events[i].event);
+  }
+  while (transfer != NULL) {
+    struct usb_sim_transfer *next = transfer->next;
+    struct libusb_transfer *usb_transfer = usb_sim_libusb_transfer(transfer);
+    // The callback may submit it again, or free it.
+    pthread_mutex_lock(&ctx->lock);
+    transfer->in_flight = 0;
+    transfer->done = 0;
+    pthread_mutex_unlock(&ctx->lock);
+    const int free_transfer =
+        usb_transfer->flags & LIBUSB_TRANSFER_FREE_TRANSFER;
+    usb_transfer->callback(usb_transfer);
+    if (free_transfer) {
+      libusb_free_transfer(usb_transfer);
+    }
+    transfer = next;
+  }
+  pthread_mutex_unlock(&ctx->event_lock);
+  return LIBUSB_SUCCESS;
+}
+
+int libusb_handle_events_timeout(libusb_context *ctx, struct timeval *tv) {
+  return libusb_handle_events_timeout_completed(ctx, tv, NULL);
+}
+
+int libusb_handle_events_completed(libusb_context *ctx, int *completed) {
+  struct timeval tv = {.tv_sec = 60, .tv_usec = 0};
+  return libusb_handle_events_timeout_completed(ctx, &tv, completed);
+}
+
+int libusb_handle_events(libusb_context *ctx) {
+  return libusb_handle_events_completed(ctx, NULL);
+}
+
+void libusb_interrupt_event_handler(libusb_context *ctx) {
+  usb_sim_wake_events(ctx);
+}
+
+// The device thread times everything out, libusb has no timeout of its own.
+int libusb_get_next_timeout(libusb_context *ctx, struct timeval *tv) {
+  return 0;
+}
+
+int libusb_pollfds_handle_timeouts(libusb_context *ctx) { return 1; }
+
+const struct libusb_pollfd **libusb_get_pollfds(libusb_context *ctx) {
+  const struct libusb_pollfd **pollfds = calloc(2, sizeof(*pollfds));
+  if (pollfds != NULL) {
+    pollfds[0] = &ctx->pollfd;
+  }
+  return pollfds;
+}
+
+void libusb_free_pollfds(const struct libusb_pollfd **pollfds) {
+  free(pollfds);
+}
+
+// The eventfd stays the only descriptor, there is never anything to notify.
+void libusb_set_pollfd_notifiers(libusb_context *ctx,
+                                 libusb_pollfd_added_cb added_cb,
+                                 libusb_pollfd_removed_cb removed_cb,
+                                 void *user_data) {}
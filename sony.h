@@ -0,0 +1,10 @@
+#ifndef SONY_H
+#define SONY_H
+
+// SONY DEVICE STUFF
+#define SONY_VENDOR_ID 0x054c
+#define RIGHT_SENSE_CONTROLLER_DEVICE_ID 0x0e46
+#define LEFT_SENSE_CONTROLLER_DEVICE_ID 0x0e45
+#define PSVR2_DEVICE_ID 0x0cde
+
+#endif // SONY_H
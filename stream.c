@@ -0,0 +1,193 @@
+#include "stream.h"
+
+#include "logger.h"
+#include "monotonic.h"
+#include "ring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Where the submit time of a transfer is kept. A handful of pointers to
+// compare, only when measuring the latency.
+static int stream_transfer_index(const struct stream *stream,
+                                 const struct libusb_transfer *transfer) {
+  int index = 0;
+  while (index < stream->num_transfers - 1 &&
+         stream->transfers[index] != transfer) {
+    ++index;
+  }
+  return index;
+}
+
+static void stream_mark_submitted(struct stream *stream,
+                                  const struct libusb_transfer *transfer) {
+  if (stream->submit_latency != NULL) {
+    stream->submitted_ns[stream_transfer_index(stream, transfer)] =
+        monotonic_ns();
+  }
+}
+
+static void stream_transfer_callback(struct libusb_transfer *transfer) {
+  struct stream *stream = transfer->user_data;
+
+  switch (transfer->status) {
+  case LIBUSB_TRANSFER_COMPLETED:
+    if (stream->submit_latency != NULL) {
+      const int index = stream_transfer_index(stream, transfer);
+      histogram_record(stream->submit_latency,
+                       monotonic_ns() - stream->submitted_ns[index]);
+    }
+    ++stream->reports;
+    if (stream->on_report != NULL) {
+      stream->on_report(stream, transfer->buffer, transfer->actual_length,
+                        stream->user_data);
+    }
+    break;
+  case LIBUSB_TRANSFER_CANCELLED:
+  case LIBUSB_TRANSFER_NO_DEVICE:
+    // The stream is being stopped or the controller went away: do not
+    // resubmit.
+    atomic_fetch_sub(&stream->in_flight, 1);
+    return;
+  default:
+    // Timeouts, stalls and overflows only lose this report, keep going.
+    ++stream->errors;
+    LOGGER(LOGGER_TRANSFER_ERROR, LOGGER_UINT(stream->product_id),
+           LOGGER_UINT(stream->endpoint_address), LOGGER_INT(transfer->status));
+    break;
+  }
+
+  if (!atomic_load_explicit(&stream->running, memory_order_acquire)) {
+    atomic_fetch_sub(&stream->in_flight, 1);
+    return;
+  }
+
+  // Resubmit straight away so the transfer is queued again before the next
+  // polling interval.
+  stream_mark_submitted(stream, transfer);
+  int result = libusb_submit_transfer(transfer);
+  if (result != LIBUSB_SUCCESS) {
+    ++stream->errors;
+    LOGGER(LOGGER_RESUBMIT_ERROR, LOGGER_UINT(stream->product_id),
+           LOGGER_UINT(stream->endpoint_address), LOGGER_INT(result));
+    atomic_fetch_sub(&stream->in_flight, 1);
+  }
+}
+
+int stream_endpoint_supported(
+    const struct libusb_endpoint_descriptor *endpoint) {
+  return (endpoint->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) ==
+             LIBUSB_TRANSFER_TYPE_INTERRUPT &&
+         (endpoint->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) ==
+             LIBUSB_ENDPOINT_IN;
+}
+
+struct stream *stream_open(libusb_device_handle *dev_handle,
+                           struct transfer_pool *pool,
+                           unsigned char endpoint_address, int num_transfers,
+                           stream_report_callback on_report, void *user_data) {
+  if ((endpoint_address & LIBUSB_ENDPOINT_DIR_MASK) != LIBUSB_ENDPOINT_IN) {
+    fprintf(stderr, "%s:%d: endpoint 0x%02x is not an IN endpoint\n", __FILE__,
+            __LINE__, endpoint_address);
+    return NULL;
+  }
+  if (num_transfers <= 0) {
+    num_transfers = STREAM_DEFAULT_TRANSFERS;
+  }
+  if (num_transfers > STREAM_MAX_TRANSFERS) {
+    num_transfers = STREAM_MAX_TRANSFERS;
+  }
+
+  // wMaxPacketSize is already in host byte order in libusb's descriptors.
+  int buffer_size = libusb_get_max_packet_size(libusb_get_device(dev_handle),
+                                               endpoint_address);
+  if (buffer_size <= 0) {
+    fprintf(stderr, "%s:%d: unable to get the maximum packet size: %s\n",
+            __FILE__, __LINE__, libusb_error_name(buffer_size));
+    return NULL;
+  }
+
+  struct stream *stream = calloc(1, sizeof(*stream));
+  if (stream == NULL) {
+    return NULL;
+  }
+  stream->dev_handle = dev_handle;
+  stream->pool = pool;
+  struct libusb_device_descriptor dev_desc;
+  if (libusb_get_device_descriptor(libusb_get_device(dev_handle), &dev_desc) ==
+      LIBUSB_SUCCESS) {
+    stream->product_id = dev_desc.idProduct;
+  }
+  stream->endpoint_address = endpoint_address;
+  stream->buffer_size = buffer_size;
+  stream->num_transfers = num_transfers;
+  stream->on_report = on_report;
+  stream->user_data = user_data;
+  atomic_init(&stream->running, 0);
+  atomic_init(&stream->in_flight, 0);
+
+  // Buffers are set up once, up front, and reused for every report.
+  for (int i = 0; i < num_transfers; ++i) {
+    struct libusb_transfer *transfer =
+        transfer_pool_acquire(pool, 0, buffer_size);
+    if (transfer == NULL) {
+      stream_close(stream);
+      return NULL;
+    }
+    libusb_fill_interrupt_transfer(transfer, dev_handle, endpoint_address,
+                                   transfer->buffer, buffer_size,
+                                   stream_transfer_callback, stream, 0);
+    stream->transfers[i] = transfer;
+  }
+
+  return stream;
+}
+
+int stream_start(struct stream *stream) {
+  atomic_store(&stream->running, 1);
+  for (int i = 0; i < stream->num_transfers; ++i) {
+    // Counted before submitting: the event thread may already be running and
+    // complete the transfer before libusb_submit_transfer returns.
+    atomic_fetch_add(&stream->in_flight, 1);
+    stream_mark_submitted(stream, stream->transfers[i]);
+    int result = libusb_submit_transfer(stream->transfers[i]);
+    if (result != LIBUSB_SUCCESS) {
+      fprintf(stderr, "%s:%d: unable to submit transfer %d: %s\n", __FILE__,
+              __LINE__, i, libusb_error_name(result));
+      atomic_fetch_sub(&stream->in_flight, 1);
+      stream_stop(stream);
+      return result;
+    }
+  }
+  return LIBUSB_SUCCESS;
+}
+
+void stream_stop(struct stream *stream) {
+  atomic_store(&stream->running, 0);
+  for (int i = 0; i < stream->num_transfers; ++i) {
+    // Transfers that are not in flight return LIBUSB_ERROR_NOT_FOUND.
+    libusb_cancel_transfer(stream->transfers[i]);
+  }
+}
+
+int stream_in_flight(struct stream *stream) {
+  return atomic_load(&stream->in_flight);
+}
+
+void stream_close(struct stream *stream) {
+  if (stream == NULL) {
+    return;
+  }
+  for (int i = 0; i < stream->num_transfers; ++i) {
+    if (stream->transfers[i] != NULL) {
+      transfer_pool_release(stream->pool, stream->transfers[i]);
+    }
+  }
+  free(stream);
+}
+
+void stream_push_to_ring(struct stream *stream, const unsigned char *data,
+                         int length, void *user_data) {
+  report_ring_push(user_data, monotonic_ns(), stream->product_id,
+                   stream->endpoint_address, data, (size_t)length);
+}
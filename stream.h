@@ -0,0 +1,81 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <libusb-1.0/libusb.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "histogram.h"
+#include "transfer_pool.h"
+
+// Number of transfers kept in flight on an endpoint when the caller does not
+// ask for a specific amount. One transfer is always being serviced by the
+// host controller while the others wait, so no polling interval is missed.
+#define STREAM_DEFAULT_TRANSFERS 8
+#define STREAM_MAX_TRANSFERS 64
+
+struct stream;
+
+// Called from the libusb event handling thread for every completed report.
+// `data` is only valid for the duration of the call.
+typedef void (*stream_report_callback)(struct stream *stream,
+                                       const unsigned char *data, int length,
+                                       void *user_data);
+
+struct stream {
+  libusb_device_handle *dev_handle;
+  uint16_t product_id;
+  unsigned char endpoint_address;
+  int buffer_size;
+  int num_transfers;
+  // From `pool`, each with its own buffer of `buffer_size`.
+  struct transfer_pool *pool;
+  struct libusb_transfer *transfers[STREAM_MAX_TRANSFERS];
+
+  stream_report_callback on_report;
+  void *user_data;
+
+  // Time from submitting each transfer to its completion, with several
+  // transfers queued this includes the polling intervals spent waiting for
+  // the ones ahead of it. NULL to not measure.
+  struct histogram *submit_latency;
+  uint64_t submitted_ns[STREAM_MAX_TRANSFERS];
+
+  atomic_int running;
+  atomic_int in_flight;
+  // Only touched from the event handling thread.
+  uint64_t reports;
+  uint64_t errors;
+};
+
+// Whether `stream_open` can stream from this endpoint: interrupt IN only.
+int stream_endpoint_supported(
+    const struct libusb_endpoint_descriptor *endpoint);
+
+// Takes the transfers and their buffers for an IN endpoint from the pool of
+// the device. The buffer size is the endpoint's maximum packet size as
+// reported by libusb. Returns NULL on failure.
+struct stream *stream_open(libusb_device_handle *dev_handle,
+                           struct transfer_pool *pool,
+                           unsigned char endpoint_address, int num_transfers,
+                           stream_report_callback on_report, void *user_data);
+
+// Submits every transfer. Returns LIBUSB_SUCCESS or a libusb error code.
+int stream_start(struct stream *stream);
+
+// Cancels the in flight transfers. Events must still be handled until
+// `stream_in_flight` returns 0 before the stream can be closed.
+void stream_stop(struct stream *stream);
+
+int stream_in_flight(struct stream *stream);
+
+// Gives the transfers back to the pool. The stream must not have any
+// transfer in flight.
+void stream_close(struct stream *stream);
+
+// A stream_report_callback that timestamps each report and copies it into the
+// report_ring passed as `user_data`.
+void stream_push_to_ring(struct stream *stream, const unsigned char *data,
+                         int length, void *user_data);
+
+#endif // STREAM_H
@@ -1,4 +1,4 @@
-// Compile with gcc mouse.c -o mouse -lusb-1.0
+// Compile with gcc mouse.c ../hid.c -o mouse -lusb-1.0 -lm
 // You will probably need root privilege to for libusb to see all connected
 // devices. libusb hides devices when claimed by the system (so if you can use
 // your mouse, the mouse device is claimed by the system and regular users will
@@ -7,6 +7,8 @@
 #include <libusb-1.0/libusb.h>
 #include <stdio.h>
 
+#include "../hid.h"
+
 #define VENDOR_ID 0x1ea7
 #define PRODUCT_ID 0x0064
 
@@ -49,6 +51,7 @@ int main() {
   // Find the correct interface
   int interface_number = -1;
   int endpoint_number = -1;
+  int report_descriptor_length = 0;
   struct libusb_device_descriptor dev_desc;
   r = libusb_get_device_descriptor(libusb_get_device(dev_handle), &dev_desc);
   if (r == LIBUSB_SUCCESS) {
@@ -65,6 +68,8 @@ int main() {
             if (iface_desc->bInterfaceClass == LIBUSB_CLASS_HID) {
               interface_number = iface_desc->bInterfaceNumber;
               endpoint_number = iface_desc->endpoint[0].bEndpointAddress;
+              report_descriptor_length =
+                  hid_report_descriptor_length(iface_desc);
               break;
             }
           }
@@ -115,6 +120,22 @@ int main() {
     return 1;
   }
 
+  // Let the report descriptor tell where the buttons are.
+  static struct hid_decoder decoder;
+  struct hid_state state = {0};
+  int has_decoder = 0;
+  uint8_t report_descriptor[HID_MAX_DESCRIPTOR_SIZE];
+  if (report_descriptor_length > HID_MAX_DESCRIPTOR_SIZE) {
+    report_descriptor_length = HID_MAX_DESCRIPTOR_SIZE;
+  }
+  r = hid_fetch_report_descriptor(dev_handle, interface_number,
+                                  report_descriptor, report_descriptor_length);
+  if (r > 0 && hid_compile(report_descriptor, r, &decoder) == 0) {
+    has_decoder = 1;
+  } else {
+    printf("No report descriptor, assuming the buttons are in byte 1\n");
+  }
+
   // Set up an infinite loop to continuously monitor mouse events
   int tries = 0;
   while (tries < 10) {
@@ -133,6 +154,10 @@ int main() {
       }
       printf("\n");
       unsigned char button = data[1];
+      if (has_decoder &&
+          hid_decode(&decoder, data, transferred, &state) >= 0) {
+        button = state.buttons & 0xff;
+      }
       handle_mouse_event(button);
     } else {
       printf("Transfer failed\n");
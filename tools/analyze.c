@@ -0,0 +1,642 @@
+// Finds the fields of unknown input reports in a capture: counters, IMU
+// style 16 bit signals, analog bytes and buttons. The capture is mapped, its
+// records indexed once, then every group of reports (same device, endpoint
+// and report ID) is split across threads which gather per byte statistics
+// in a single pass. A second, smaller pass correlates the 16 bit candidates.
+//
+//   tools/analyze [-j THREADS] [--top N] session.cap
+//
+// Prints one JSON object per line: a header per group, then its candidate
+// fields, best first within each kind.
+
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "hid.h"
+
+#define ANALYZE_MAX_BYTES REPORT_MAX_SIZE
+#define ANALYZE_MAX_GROUPS 16
+#define ANALYZE_MAX_THREADS 64
+// Groups with fewer reports are not worth any statistics.
+#define ANALYZE_MIN_RECORDS 100
+// 16 bit candidates correlated with each other in the second pass.
+#define ANALYZE_MAX_SIGNALS 32
+#define ANALYZE_DEFAULT_TOP 16
+
+// Counter widths in bytes, little endian.
+static const int counter_widths[] = {4, 2, 1};
+#define ANALYZE_NUM_WIDTHS 3
+
+struct group {
+  uint16_t product_id;
+  uint8_t endpoint;
+  // -1 unless the report descriptor of the device, found in the capture,
+  // declares report IDs. The first byte is data otherwise.
+  int report_id;
+  // Offsets of the payloads in the mapping, in capture order.
+  size_t *offsets;
+  size_t count;
+  size_t capacity;
+  // Shortest report of the group, only bytes every report has are analysed.
+  int length;
+};
+
+// What one thread gathers over its share of a group. Merged by adding.
+struct byte_stats {
+  uint64_t values[ANALYZE_MAX_BYTES][256];
+  // Histogram of the XOR with the previous report: change and bit toggle
+  // counts both come out of it.
+  uint64_t flips[ANALYZE_MAX_BYTES][256];
+  // Consecutive reports where the little endian field at this offset grew,
+  // modulo its width, and by how much in total.
+  uint64_t increasing[ANALYZE_NUM_WIDTHS][ANALYZE_MAX_BYTES];
+  double steps[ANALYZE_NUM_WIDTHS][ANALYZE_MAX_BYTES];
+  uint64_t pairs;
+};
+
+struct signal_stats {
+  double sum[ANALYZE_MAX_SIGNALS];
+  double sum_squares[ANALYZE_MAX_SIGNALS];
+  double sum_products[ANALYZE_MAX_SIGNALS][ANALYZE_MAX_SIGNALS];
+};
+
+struct worker {
+  pthread_t thread;
+  const uint8_t *data;
+  const struct group *group;
+  size_t first;
+  size_t end;
+  // Offsets of the 16 bit signals for the second pass, 0 of them in the
+  // first.
+  const int *signals;
+  int num_signals;
+  struct byte_stats *bytes;
+  struct signal_stats *correlation;
+};
+
+enum candidate_kind {
+  CANDIDATE_COUNTER,
+  CANDIDATE_SIGNAL,
+  CANDIDATE_ANALOG,
+  CANDIDATE_BUTTON,
+};
+
+struct candidate {
+  enum candidate_kind kind;
+  int offset;
+  // Bytes, or the bit number for buttons.
+  int width;
+  double score;
+};
+
+static uint64_t read_le(const uint8_t *data, int width) {
+  uint64_t value = 0;
+  for (int i = width - 1; i >= 0; --i) {
+    value = value << 8 | data[i];
+  }
+  return value;
+}
+
+static void *gather_bytes(void *argument) {
+  struct worker *worker = argument;
+  const struct group *group = worker->group;
+  struct byte_stats *stats = worker->bytes;
+  const int length = group->length;
+  // The first report of the share is compared with the one before it, the
+  // last of the previous share.
+  const uint8_t *previous = worker->first > 0
+                                ? worker->data +
+                                      group->offsets[worker->first - 1]
+                                : NULL;
+  for (size_t i = worker->first; i < worker->end; ++i) {
+    const uint8_t *report = worker->data + group->offsets[i];
+    for (int byte = 0; byte < length; ++byte) {
+      ++stats->values[byte][report[byte]];
+    }
+    if (previous != NULL) {
+      for (int byte = 0; byte < length; ++byte) {
+        ++stats->flips[byte][report[byte] ^ previous[byte]];
+      }
+      for (int w = 0; w < ANALYZE_NUM_WIDTHS; ++w) {
+        const int width = counter_widths[w];
+        const int bits = width * 8;
+        const uint64_t mask = bits == 64 ? ~0ull : (1ull << bits) - 1;
+        for (int byte = 0; byte + width <= length; ++byte) {
+          const uint64_t step = (read_le(report + byte, width) -
+                                 read_le(previous + byte, width)) &
+                                mask;
+          if (step != 0 && step < (1ull << (bits - 1))) {
+            ++stats->increasing[w][byte];
+            stats->steps[w][byte] += (double)step;
+          }
+        }
+      }
+      ++stats->pairs;
+    }
+    previous = report;
+  }
+  return NULL;
+}
+
+static void *gather_signals(void *argument) {
+  struct worker *worker = argument;
+  struct signal_stats *stats = worker->correlation;
+  const int n = worker->num_signals;
+  for (size_t i = worker->first; i < worker->end; ++i) {
+    const uint8_t *report = worker->data + worker->group->offsets[i];
+    double x[ANALYZE_MAX_SIGNALS];
+    for (int s = 0; s < n; ++s) {
+      x[s] = (double)(int16_t)read_le(report + worker->signals[s], 2);
+      stats->sum[s] += x[s];
+      stats->sum_squares[s] += x[s] * x[s];
+    }
+    for (int a = 0; a < n; ++a) {
+      for (int b = a + 1; b < n; ++b) {
+        stats->sum_products[a][b] += x[a] * x[b];
+      }
+    }
+  }
+  return NULL;
+}
+
+// Splits the group evenly and runs `gather` on every share, each thread with
+// its own statistics. Returns 0 or -1.
+static int run_workers(struct worker *workers, int num_threads,
+                       void *(*gather)(void *)) {
+  int started = 0;
+  for (; started < num_threads; ++started) {
+    if (pthread_create(&workers[started].thread, NULL, gather,
+                       &workers[started]) != 0) {
+      fprintf(stderr, "%s:%d: unable to start a thread\n", __FILE__,
+              __LINE__);
+      break;
+    }
+  }
+  for (int i = 0; i < started; ++i) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  return started == num_threads ? 0 : -1;
+}
+
+static double entropy(const uint64_t *histogram, uint64_t total) {
+  double bits = 0.0;
+  for (int value = 0; value < 256; ++value) {
+    if (histogram[value] != 0) {
+      const double p = (double)histogram[value] / (double)total;
+      bits -= p * log2(p);
+    }
+  }
+  return bits;
+}
+
+static uint64_t bit_count(const uint64_t *histogram, int bit) {
+  uint64_t count = 0;
+  for (int value = 0; value < 256; ++value) {
+    if (value & (1 << bit)) {
+      count += histogram[value];
+    }
+  }
+  return count;
+}
+
+static int compare_candidates(const void *a, const void *b) {
+  const struct candidate *x = a;
+  const struct candidate *y = b;
+  if (x->kind != y->kind) {
+    return (int)x->kind - (int)y->kind;
+  }
+  return x->score < y->score ? 1 : x->score > y->score ? -1 : 0;
+}
+
+static const char *kind_names[] = {
+    [CANDIDATE_COUNTER] = "counter",
+    [CANDIDATE_SIGNAL] = "signal16",
+    [CANDIDATE_ANALOG] = "analog8",
+    [CANDIDATE_BUTTON] = "button",
+};
+
+static int analyze_group(const uint8_t *data, const struct group *group,
+                         int num_threads, int top) {
+  const int length = group->length;
+  if ((size_t)num_threads > group->count / ANALYZE_MIN_RECORDS) {
+    num_threads = (int)(group->count / ANALYZE_MIN_RECORDS);
+  }
+  if (num_threads < 1) {
+    num_threads = 1;
+  }
+  struct worker workers[ANALYZE_MAX_THREADS];
+  struct byte_stats *bytes = calloc(num_threads, sizeof(struct byte_stats));
+  struct signal_stats *correlation =
+      calloc(num_threads, sizeof(struct signal_stats));
+  if (bytes == NULL || correlation == NULL) {
+    fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+    free(bytes);
+    free(correlation);
+    return -1;
+  }
+  for (int i = 0; i < num_threads; ++i) {
+    workers[i] = (struct worker){
+        .data = data,
+        .group = group,
+        .first = group->count * i / num_threads,
+        .end = group->count * (i + 1) / num_threads,
+        .bytes = &bytes[i],
+        .correlation = &correlation[i],
+    };
+  }
+  if (run_workers(workers, num_threads, gather_bytes) != 0) {
+    free(bytes);
+    free(correlation);
+    return -1;
+  }
+  struct byte_stats *total = &bytes[0];
+  for (int i = 1; i < num_threads; ++i) {
+    uint64_t *into = &total->values[0][0];
+    const uint64_t *from = &bytes[i].values[0][0];
+    for (size_t j = 0; j < 2 * ANALYZE_MAX_BYTES * 256; ++j) {
+      // values then flips, laid out back to back.
+      into[j] += from[j];
+    }
+    for (int w = 0; w < ANALYZE_NUM_WIDTHS; ++w) {
+      for (int byte = 0; byte < length; ++byte) {
+        total->increasing[w][byte] += bytes[i].increasing[w][byte];
+        total->steps[w][byte] += bytes[i].steps[w][byte];
+      }
+    }
+    total->pairs += bytes[i].pairs;
+  }
+
+  const double records = (double)group->count;
+  const double pairs = total->pairs > 0 ? (double)total->pairs : 1.0;
+  double byte_entropy[ANALYZE_MAX_BYTES];
+  double change_rate[ANALYZE_MAX_BYTES];
+  for (int byte = 0; byte < length; ++byte) {
+    byte_entropy[byte] = entropy(total->values[byte], group->count);
+    change_rate[byte] = 1.0 - (double)total->flips[byte][0] / pairs;
+  }
+
+  struct candidate candidates[ANALYZE_MAX_BYTES * 10];
+  int num_candidates = 0;
+  // Bytes already explained by a wider field.
+  uint8_t claimed[ANALYZE_MAX_BYTES] = {0};
+
+  // Counters: grow from almost every report to the next, widest first.
+  for (int w = 0; w < ANALYZE_NUM_WIDTHS; ++w) {
+    const int width = counter_widths[w];
+    for (int byte = 0; byte + width <= length; ++byte) {
+      const double rate = (double)total->increasing[w][byte] / pairs;
+      // The lowest byte of a counter is the one that moves: this keeps
+      // constant bytes below a counter from shifting it into a wider one.
+      if (rate < 0.99 || claimed[byte] || change_rate[byte] < 0.5) {
+        continue;
+      }
+      candidates[num_candidates++] = (struct candidate){
+          .kind = CANDIDATE_COUNTER,
+          .offset = byte,
+          .width = width,
+          .score = rate,
+      };
+      memset(claimed + byte, 1, width);
+    }
+  }
+
+  // 16 bit signals: a busy low byte over a much quieter high byte, which is
+  // what a noisy sensor reading looks like. A misaligned pair sees the
+  // opposite.
+  int signals[ANALYZE_MAX_SIGNALS];
+  int num_signals = 0;
+  struct candidate signal_candidates[ANALYZE_MAX_BYTES];
+  int num_signal_candidates = 0;
+  for (int byte = 0; byte + 1 < length; ++byte) {
+    if (claimed[byte] || claimed[byte + 1] || byte_entropy[byte] < 4.0 ||
+        change_rate[byte] < 0.5) {
+      continue;
+    }
+    const double drop = byte_entropy[byte] - byte_entropy[byte + 1];
+    if (drop <= 1.0) {
+      continue;
+    }
+    signal_candidates[num_signal_candidates++] = (struct candidate){
+        .kind = CANDIDATE_SIGNAL,
+        .offset = byte,
+        .width = 2,
+        .score = change_rate[byte] * drop,
+    };
+  }
+  qsort(signal_candidates, num_signal_candidates, sizeof(struct candidate),
+        compare_candidates);
+  for (int i = 0; i < num_signal_candidates; ++i) {
+    const int byte = signal_candidates[i].offset;
+    // A better candidate may already overlap this one.
+    if (claimed[byte] || claimed[byte + 1]) {
+      continue;
+    }
+    claimed[byte] = claimed[byte + 1] = 1;
+    candidates[num_candidates++] = signal_candidates[i];
+    if (num_signals < ANALYZE_MAX_SIGNALS) {
+      signals[num_signals++] = byte;
+    }
+  }
+
+  // Analog bytes: move now and then over more values than a handful of
+  // buttons would make.
+  for (int byte = 0; byte < length; ++byte) {
+    int distinct = 0;
+    for (int value = 0; value < 256; ++value) {
+      distinct += total->values[byte][value] != 0;
+    }
+    if (claimed[byte] || distinct <= 16 || byte_entropy[byte] < 1.0 ||
+        change_rate[byte] <= 0.0) {
+      continue;
+    }
+    claimed[byte] = 1;
+    candidates[num_candidates++] = (struct candidate){
+        .kind = CANDIDATE_ANALOG,
+        .offset = byte,
+        .width = 1,
+        .score = byte_entropy[byte] * (1.0 - change_rate[byte]),
+    };
+  }
+
+  // Buttons: bits that flip, but rarely.
+  for (int byte = 0; byte < length; ++byte) {
+    if (claimed[byte]) {
+      continue;
+    }
+    for (int bit = 0; bit < 8; ++bit) {
+      const uint64_t toggles = bit_count(total->flips[byte], bit);
+      if (toggles == 0 || (double)toggles / pairs > 0.05) {
+        continue;
+      }
+      candidates[num_candidates++] = (struct candidate){
+          .kind = CANDIDATE_BUTTON,
+          .offset = byte,
+          .width = bit,
+          .score = (double)toggles,
+      };
+    }
+  }
+
+  // Which signals move together: the axes of one sensor usually do.
+  double correlation_matrix[ANALYZE_MAX_SIGNALS][ANALYZE_MAX_SIGNALS] = {{0}};
+  if (num_signals > 1) {
+    for (int i = 0; i < num_threads; ++i) {
+      workers[i].signals = signals;
+      workers[i].num_signals = num_signals;
+    }
+    if (run_workers(workers, num_threads, gather_signals) != 0) {
+      free(bytes);
+      free(correlation);
+      return -1;
+    }
+    struct signal_stats *sums = &correlation[0];
+    for (int i = 1; i < num_threads; ++i) {
+      for (int a = 0; a < num_signals; ++a) {
+        sums->sum[a] += correlation[i].sum[a];
+        sums->sum_squares[a] += correlation[i].sum_squares[a];
+        for (int b = a + 1; b < num_signals; ++b) {
+          sums->sum_products[a][b] += correlation[i].sum_products[a][b];
+        }
+      }
+    }
+    for (int a = 0; a < num_signals; ++a) {
+      for (int b = a + 1; b < num_signals; ++b) {
+        const double covariance =
+            sums->sum_products[a][b] - sums->sum[a] * sums->sum[b] / records;
+        const double variance_a =
+            sums->sum_squares[a] - sums->sum[a] * sums->sum[a] / records;
+        const double variance_b =
+            sums->sum_squares[b] - sums->sum[b] * sums->sum[b] / records;
+        const double r = variance_a > 0.0 && variance_b > 0.0
+                             ? covariance / sqrt(variance_a * variance_b)
+                             : 0.0;
+        correlation_matrix[a][b] = correlation_matrix[b][a] = r;
+      }
+    }
+  }
+
+  printf("{\"product_id\": \"%04x\", \"endpoint\": \"0x%02x\", ",
+         group->product_id, group->endpoint);
+  if (group->report_id >= 0) {
+    printf("\"report_id\": %d, ", group->report_id);
+  } else {
+    printf("\"report_id\": null, ");
+  }
+  printf("\"reports\": %zu, \"length\": %d, \"threads\": %d}\n",
+         group->count, length, num_threads);
+  qsort(candidates, num_candidates, sizeof(struct candidate),
+        compare_candidates);
+  int printed = 0;
+  for (int i = 0; i < num_candidates; ++i) {
+    const struct candidate *candidate = &candidates[i];
+    printed = i > 0 && candidates[i - 1].kind == candidate->kind ? printed + 1
+                                                                  : 0;
+    if (printed >= top) {
+      continue;
+    }
+    const int byte = candidate->offset;
+    printf("  {\"kind\": \"%s\", \"offset\": %d", kind_names[candidate->kind],
+           byte);
+    switch (candidate->kind) {
+    case CANDIDATE_COUNTER: {
+      int w = 0;
+      while (counter_widths[w] != candidate->width) {
+        ++w;
+      }
+      const uint64_t increasing = total->increasing[w][byte];
+      printf(", \"width\": %d, \"increasing\": %.4f, \"mean_step\": %.2f",
+             candidate->width, candidate->score,
+             total->steps[w][byte] / (double)(increasing ? increasing : 1));
+      break;
+    }
+    case CANDIDATE_SIGNAL: {
+      int self = 0;
+      while (signals[self] != byte) {
+        ++self;
+      }
+      int partner = -1;
+      for (int other = 0; other < num_signals; ++other) {
+        if (other != self &&
+            (partner < 0 || fabs(correlation_matrix[self][other]) >
+                                fabs(correlation_matrix[self][partner]))) {
+          partner = other;
+        }
+      }
+      printf(", \"score\": %.3f, \"entropy\": %.2f, \"change_rate\": %.4f",
+             candidate->score, byte_entropy[byte], change_rate[byte]);
+      if (partner >= 0) {
+        printf(", \"correlated_with\": %d, \"correlation\": %.3f",
+               signals[partner], correlation_matrix[self][partner]);
+      }
+      break;
+    }
+    case CANDIDATE_ANALOG:
+      printf(", \"entropy\": %.2f, \"change_rate\": %.4f", byte_entropy[byte],
+             change_rate[byte]);
+      break;
+    case CANDIDATE_BUTTON:
+      printf(", \"bit\": %d, \"toggles\": %.0f, \"set\": %.4f",
+             candidate->width, candidate->score,
+             (double)bit_count(total->values[byte], candidate->width) /
+                 records);
+      break;
+    }
+    printf("}\n");
+  }
+  free(bytes);
+  free(correlation);
+  return 0;
+}
+
+// Sorts the records of the capture into groups. The descriptors, which come
+// before the reports of their device, tell whether the first byte of its
+// reports is a report ID.
+static int index_capture(struct capture_reader *reader, struct group *groups,
+                         int *num_groups) {
+  // Devices whose report descriptor declares report IDs.
+  uint16_t with_report_ids[ANALYZE_MAX_GROUPS];
+  int num_with_report_ids = 0;
+  static struct hid_decoder decoder;
+  size_t left_out = 0;
+  const uint8_t *payload;
+  const struct capture_record_header *header;
+  while ((header = capture_reader_next(reader, &payload)) != NULL) {
+    if (header->endpoint == CAPTURE_ENDPOINT_DESCRIPTOR) {
+      if (num_with_report_ids < ANALYZE_MAX_GROUPS &&
+          hid_compile(payload, header->length, &decoder) == 0 &&
+          decoder.uses_report_ids) {
+        with_report_ids[num_with_report_ids++] = header->product_id;
+      }
+      continue;
+    }
+    if (header->length == 0) {
+      continue;
+    }
+    int report_id = -1;
+    for (int i = 0; i < num_with_report_ids; ++i) {
+      if (with_report_ids[i] == header->product_id) {
+        report_id = payload[0];
+        break;
+      }
+    }
+    struct group *group = NULL;
+    for (int i = 0; i < *num_groups; ++i) {
+      if (groups[i].product_id == header->product_id &&
+          groups[i].endpoint == header->endpoint &&
+          groups[i].report_id == report_id) {
+        group = &groups[i];
+        break;
+      }
+    }
+    if (group == NULL) {
+      if (*num_groups == ANALYZE_MAX_GROUPS) {
+        ++left_out;
+        continue;
+      }
+      group = &groups[(*num_groups)++];
+      memset(group, 0, sizeof(*group));
+      group->product_id = header->product_id;
+      group->endpoint = header->endpoint;
+      group->report_id = report_id;
+      group->length = ANALYZE_MAX_BYTES;
+    }
+    if (group->count == group->capacity) {
+      size_t capacity = group->capacity ? group->capacity * 2 : 4096;
+      size_t *offsets = realloc(group->offsets, capacity * sizeof(size_t));
+      if (offsets == NULL) {
+        fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+        return -1;
+      }
+      group->offsets = offsets;
+      group->capacity = capacity;
+    }
+    group->offsets[group->count++] = (size_t)(payload - reader->data);
+    if (header->length < group->length) {
+      group->length = header->length;
+    }
+  }
+  if (left_out > 0) {
+    fprintf(stderr, "%s:%d: %zu reports left out, they belong to more than %d "
+                    "groups\n",
+            __FILE__, __LINE__, left_out, ANALYZE_MAX_GROUPS);
+  }
+  return 0;
+}
+
+static void print_usage(const char *program) {
+  printf("Usage: %s [options] CAPTURE\n", program);
+  printf("  -j, --threads N  threads per pass (default: one per core)\n");
+  printf("      --top N      candidates printed per kind (default %d)\n",
+         ANALYZE_DEFAULT_TOP);
+  printf("  -h, --help       show this help\n");
+}
+
+int main(int argc, char *argv[]) {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int num_threads = cores > 0 ? (int)cores : 1;
+  int top = ANALYZE_DEFAULT_TOP;
+
+  enum { OPTION_TOP = 256 };
+  static const struct option options[] = {
+      {"threads", required_argument, NULL, 'j'},
+      {"top", required_argument, NULL, OPTION_TOP},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0},
+  };
+  int option;
+  while ((option = getopt_long(argc, argv, "j:h", options, NULL)) != -1) {
+    switch (option) {
+    case 'j':
+      num_threads = atoi(optarg);
+      if (num_threads <= 0 || num_threads > ANALYZE_MAX_THREADS) {
+        fprintf(stderr, "--threads must be between 1 and %d\n",
+                ANALYZE_MAX_THREADS);
+        return 1;
+      }
+      break;
+    case OPTION_TOP:
+      top = atoi(optarg);
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      return 0;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc - 1) {
+    print_usage(argv[0]);
+    return 1;
+  }
+  if (num_threads > ANALYZE_MAX_THREADS) {
+    num_threads = ANALYZE_MAX_THREADS;
+  }
+
+  struct capture_reader reader;
+  if (capture_reader_open(&reader, argv[optind]) != 0) {
+    return 1;
+  }
+  static struct group groups[ANALYZE_MAX_GROUPS];
+  int num_groups = 0;
+  int result = index_capture(&reader, groups, &num_groups);
+  // The groups are read in parallel from here, no longer front to back.
+  madvise((void *)reader.data, reader.size, MADV_RANDOM);
+  for (int i = 0; result == 0 && i < num_groups; ++i) {
+    if (groups[i].count >= ANALYZE_MIN_RECORDS) {
+      result = analyze_group(reader.data, &groups[i], num_threads, top);
+    }
+  }
+  for (int i = 0; i < num_groups; ++i) {
+    free(groups[i].offsets);
+  }
+  capture_reader_close(&reader);
+  return result == 0 ? 0 : 1;
+}
@@ -0,0 +1,61 @@
+// Prints the records of a binary log written by `main --log FILE`, one line
+// each: host time in seconds, the thread that logged it, then the message.
+//
+//   tools/logdump session.log
+//
+// Records of one thread are in order. Records of different threads were
+// written out in batches, so their timestamps can go back a little from one
+// batch to the next.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "logger.h"
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    printf("Usage: %s LOG\n", argv[0]);
+    return 1;
+  }
+  FILE *file = fopen(argv[1], "rb");
+  if (file == NULL) {
+    fprintf(stderr, "%s:%d: unable to open %s\n", __FILE__, __LINE__, argv[1]);
+    return 1;
+  }
+  struct logger_file_header header;
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      memcmp(header.magic, LOGGER_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != LOGGER_VERSION ||
+      header.record_size != sizeof(struct logger_record)) {
+    fprintf(stderr, "%s:%d: %s is not a log file\n", __FILE__, __LINE__,
+            argv[1]);
+    fclose(file);
+    return 1;
+  }
+
+  struct logger_record records[256];
+  size_t count;
+  unsigned long unknown = 0;
+  while ((count = fread(records, sizeof(struct logger_record), 256, file)) >
+         0) {
+    for (size_t i = 0; i < count; ++i) {
+      char text[256];
+      if (logger_format_record(&records[i], text, sizeof(text)) < 0) {
+        ++unknown;
+        continue;
+      }
+      printf("%llu.%06llu [%d]%s %s\n",
+             (unsigned long long)(records[i].timestamp_ns / 1000000000ull),
+             (unsigned long long)(records[i].timestamp_ns % 1000000000ull /
+                                  1000ull),
+             records[i].thread,
+             logger_is_error(&records[i]) ? " error:" : "", text);
+    }
+  }
+  fclose(file);
+  if (unknown > 0) {
+    fprintf(stderr, "%lu records with an unknown format, from a newer build?\n",
+            unknown);
+  }
+  return 0;
+}
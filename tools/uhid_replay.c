@@ -0,0 +1,219 @@
+// Replays a capture through virtual HID devices created with /dev/uhid, so
+// the hidraw backend (`main --hidraw`) can be tried without any controller.
+// Every device of the capture that has a report descriptor becomes a HID
+// device with the same vendor and product IDs, whose input reports are sent
+// at the pace they were recorded at. Output reports written to the devices
+// are counted.
+//
+//   sudo tools/uhid_replay [--loop] session.cap
+//   ./main --hidraw
+//
+// Creating uhid devices needs write access to /dev/uhid, usually root.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/input.h>
+#include <linux/uhid.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "monotonic.h"
+#include "sony.h"
+
+#define UHID_REPLAY_MAX_DEVICES 8
+
+struct virtual_device {
+  uint16_t product_id;
+  int fd;
+  uint64_t inputs;
+  uint64_t outputs;
+};
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void handle_interrupt(int signum) { interrupted = 1; }
+
+static int uhid_write(int fd, const struct uhid_event *event) {
+  ssize_t written = write(fd, event, sizeof(*event));
+  if (written != sizeof(*event)) {
+    fprintf(stderr, "%s:%d: unable to write to /dev/uhid: %s\n", __FILE__,
+            __LINE__, written < 0 ? strerror(errno) : "short write");
+    return -1;
+  }
+  return 0;
+}
+
+static int create_device(struct virtual_device *device,
+                         const uint8_t *descriptor, uint16_t length) {
+  device->fd = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+  if (device->fd < 0) {
+    fprintf(stderr, "%s:%d: unable to open /dev/uhid: %s\n", __FILE__,
+            __LINE__, strerror(errno));
+    return -1;
+  }
+  struct uhid_event event;
+  memset(&event, 0, sizeof(event));
+  event.type = UHID_CREATE2;
+  snprintf((char *)event.u.create2.name, sizeof(event.u.create2.name),
+           "PSVR2 replay %04x", device->product_id);
+  snprintf((char *)event.u.create2.phys, sizeof(event.u.create2.phys),
+           "psvr2-replay");
+  event.u.create2.rd_size = length;
+  event.u.create2.bus = BUS_USB;
+  event.u.create2.vendor = SONY_VENDOR_ID;
+  event.u.create2.product = device->product_id;
+  memcpy(event.u.create2.rd_data, descriptor, length);
+  if (uhid_write(device->fd, &event) != 0) {
+    close(device->fd);
+    device->fd = -1;
+    return -1;
+  }
+  // The kernel starts the device once a HID driver is bound to it, input
+  // sent before that is lost.
+  do {
+    if (read(device->fd, &event, sizeof(event)) <= 0) {
+      fprintf(stderr, "%s:%d: device %04x did not start\n", __FILE__,
+              __LINE__, device->product_id);
+      close(device->fd);
+      device->fd = -1;
+      return -1;
+    }
+  } while (event.type != UHID_START);
+  fcntl(device->fd, F_SETFL, fcntl(device->fd, F_GETFL) | O_NONBLOCK);
+  return 0;
+}
+
+// Counts the output reports written to the device since the last call.
+static void drain_events(struct virtual_device *device) {
+  struct uhid_event event;
+  while (read(device->fd, &event, sizeof(event)) > 0) {
+    if (event.type == UHID_OUTPUT) {
+      ++device->outputs;
+    }
+  }
+}
+
+static void sleep_until(uint64_t deadline_ns) {
+  struct timespec deadline = {
+      .tv_sec = deadline_ns / 1000000000ull,
+      .tv_nsec = deadline_ns % 1000000000ull,
+  };
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) ==
+             EINTR &&
+         !interrupted) {
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int loop = 0;
+  static const struct option options[] = {
+      {"loop", no_argument, NULL, 'l'},
+      {"help", no_argument, NULL, 'h'},
+      {NULL, 0, NULL, 0},
+  };
+  int option;
+  while ((option = getopt_long(argc, argv, "lh", options, NULL)) != -1) {
+    switch (option) {
+    case 'l':
+      loop = 1;
+      break;
+    default:
+      printf("Usage: %s [--loop] CAPTURE\n", argv[0]);
+      return option == 'h' ? 0 : 1;
+    }
+  }
+  if (optind != argc - 1) {
+    printf("Usage: %s [--loop] CAPTURE\n", argv[0]);
+    return 1;
+  }
+
+  struct capture_reader reader;
+  if (capture_reader_open(&reader, argv[optind]) != 0) {
+    return 1;
+  }
+  struct virtual_device devices[UHID_REPLAY_MAX_DEVICES];
+  int num_devices = 0;
+  const struct capture_record_header *header;
+  const uint8_t *payload;
+  while ((header = capture_reader_next(&reader, &payload)) != NULL &&
+         num_devices < UHID_REPLAY_MAX_DEVICES) {
+    if (header->endpoint != CAPTURE_ENDPOINT_DESCRIPTOR) {
+      continue;
+    }
+    int known = 0;
+    for (int i = 0; i < num_devices; ++i) {
+      known |= devices[i].product_id == header->product_id;
+    }
+    if (known) {
+      continue;
+    }
+    struct virtual_device *device = &devices[num_devices];
+    memset(device, 0, sizeof(*device));
+    device->product_id = header->product_id;
+    if (create_device(device, payload, header->length) == 0) {
+      printf("0x%04x: virtual device created\n", device->product_id);
+      ++num_devices;
+    }
+  }
+  if (num_devices == 0) {
+    fprintf(stderr, "No device with a report descriptor could be created\n");
+    capture_reader_close(&reader);
+    return 1;
+  }
+
+  signal(SIGINT, handle_interrupt);
+  printf("Replaying %s, press Ctrl-C to stop.\n", argv[optind]);
+  do {
+    capture_reader_rewind(&reader);
+    uint64_t first_record_ns = 0;
+    const uint64_t start_ns = monotonic_ns();
+    while (!interrupted &&
+           (header = capture_reader_next(&reader, &payload)) != NULL) {
+      struct virtual_device *device = NULL;
+      for (int i = 0; i < num_devices; ++i) {
+        if (devices[i].product_id == header->product_id) {
+          device = &devices[i];
+        }
+      }
+      if (device == NULL || header->endpoint == CAPTURE_ENDPOINT_DESCRIPTOR ||
+          header->length > UHID_DATA_MAX) {
+        continue;
+      }
+      if (first_record_ns == 0) {
+        first_record_ns = header->timestamp_ns;
+      }
+      sleep_until(start_ns + (header->timestamp_ns - first_record_ns));
+
+      struct uhid_event event;
+      memset(&event, 0, sizeof(event));
+      event.type = UHID_INPUT2;
+      event.u.input2.size = header->length;
+      memcpy(event.u.input2.data, payload, header->length);
+      if (uhid_write(device->fd, &event) != 0) {
+        interrupted = 1;
+        break;
+      }
+      ++device->inputs;
+      drain_events(device);
+    }
+  } while (loop && !interrupted);
+
+  for (int i = 0; i < num_devices; ++i) {
+    drain_events(&devices[i]);
+    printf("0x%04x: %lu input reports sent, %lu output reports received\n",
+           devices[i].product_id, (unsigned long)devices[i].inputs,
+           (unsigned long)devices[i].outputs);
+    struct uhid_event event;
+    memset(&event, 0, sizeof(event));
+    event.type = UHID_DESTROY;
+    uhid_write(devices[i].fd, &event);
+    close(devices[i].fd);
+  }
+  capture_reader_close(&reader);
+  return 0;
+}
@@ -0,0 +1,186 @@
+#include "transfer_pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+
+struct transfer_pool *transfer_pool_create(libusb_device_handle *dev_handle) {
+  struct transfer_pool *pool = calloc(1, sizeof(*pool));
+  if (pool == NULL) {
+    return NULL;
+  }
+  transfer_pool_attach(pool, dev_handle);
+  return pool;
+}
+
+void transfer_pool_attach(struct transfer_pool *pool,
+                          libusb_device_handle *dev_handle) {
+  pool->dev_handle = dev_handle;
+  // Not having it is fine, buffers then come from the heap.
+  pool->device_memory =
+      libusb_dev_mem_alloc(dev_handle, TRANSFER_POOL_DEVICE_MEMORY);
+  pool->device_memory_used = 0;
+}
+
+// Whole cache lines, so that no two buffers share one.
+static size_t transfer_pool_buffer_size(int length) {
+  return ((size_t)length + RING_CACHE_LINE - 1) &
+         ~(size_t)(RING_CACHE_LINE - 1);
+}
+
+// Device memory for `size` bytes, NULL once the mapping is used up.
+static unsigned char *transfer_pool_device_buffer(struct transfer_pool *pool,
+                                                  size_t size) {
+  if (pool->device_memory == NULL ||
+      TRANSFER_POOL_DEVICE_MEMORY - pool->device_memory_used < size) {
+    return NULL;
+  }
+  unsigned char *buffer = pool->device_memory + pool->device_memory_used;
+  pool->device_memory_used += size;
+  return buffer;
+}
+
+// Gives `entry` a buffer of at least `length` bytes, from the device memory
+// while it lasts. A heap buffer it already has is moved there when there is
+// room again, after the device came back. Returns 0 or -1.
+static int transfer_pool_buffer(struct transfer_pool *pool,
+                                struct pooled_transfer *entry, int length) {
+  if (entry->buffer != NULL && entry->device_memory) {
+    return 0;
+  }
+  const size_t size = entry->buffer != NULL
+                          ? (size_t)entry->capacity
+                          : transfer_pool_buffer_size(length);
+  unsigned char *buffer = transfer_pool_device_buffer(pool, size);
+  if (buffer != NULL) {
+    free(entry->buffer);
+    entry->device_memory = 1;
+  } else if (entry->buffer != NULL) {
+    return 0;
+  } else {
+    buffer = aligned_alloc(RING_CACHE_LINE, size);
+    if (buffer == NULL) {
+      return -1;
+    }
+    entry->device_memory = 0;
+  }
+  entry->buffer = buffer;
+  entry->capacity = (int)size;
+  return 0;
+}
+
+// A new entry with a transfer for `iso_packets` packets and no buffer yet,
+// NULL on failure.
+static struct pooled_transfer *transfer_pool_grow(struct transfer_pool *pool,
+                                                  int iso_packets) {
+  if (pool->num_transfers == pool->capacity) {
+    const int capacity = pool->capacity > 0 ? pool->capacity * 2 : 16;
+    struct pooled_transfer *transfers =
+        realloc(pool->transfers, (size_t)capacity * sizeof(*transfers));
+    if (transfers == NULL) {
+      fprintf(stderr, "%s:%d: out of memory\n", __FILE__, __LINE__);
+      return NULL;
+    }
+    pool->transfers = transfers;
+    pool->capacity = capacity;
+  }
+  struct libusb_transfer *transfer = libusb_alloc_transfer(iso_packets);
+  if (transfer == NULL) {
+    return NULL;
+  }
+  struct pooled_transfer *entry = &pool->transfers[pool->num_transfers++];
+  memset(entry, 0, sizeof(*entry));
+  entry->transfer = transfer;
+  entry->iso_packets = iso_packets;
+  return entry;
+}
+
+struct libusb_transfer *transfer_pool_acquire(struct transfer_pool *pool,
+                                              int iso_packets, int length) {
+  struct pooled_transfer *entry = NULL;
+  for (int i = 0; i < pool->num_transfers; ++i) {
+    struct pooled_transfer *candidate = &pool->transfers[i];
+    if (!candidate->in_use && candidate->iso_packets >= iso_packets &&
+        (candidate->buffer == NULL || candidate->capacity >= length)) {
+      entry = candidate;
+      break;
+    }
+  }
+  if (entry != NULL) {
+    ++pool->recycled;
+  } else {
+    entry = transfer_pool_grow(pool, iso_packets);
+    if (entry == NULL) {
+      return NULL;
+    }
+  }
+  if (transfer_pool_buffer(pool, entry, length) != 0) {
+    // Kept without a buffer, for the next acquire.
+    return NULL;
+  }
+
+  entry->in_use = 1;
+  // Whatever the previous user left, as if freshly allocated.
+  struct libusb_transfer *transfer = entry->transfer;
+  memset(entry->buffer, 0, (size_t)entry->capacity);
+  transfer->flags = 0;
+  transfer->buffer = entry->buffer;
+  transfer->length = length;
+  transfer->num_iso_packets = iso_packets;
+  transfer->user_data = NULL;
+  return transfer;
+}
+
+void transfer_pool_release(struct transfer_pool *pool,
+                           struct libusb_transfer *transfer) {
+  for (int i = 0; i < pool->num_transfers; ++i) {
+    if (pool->transfers[i].transfer == transfer) {
+      pool->transfers[i].in_use = 0;
+      return;
+    }
+  }
+}
+
+int transfer_pool_is_device_memory(const struct transfer_pool *pool,
+                                   const struct libusb_transfer *transfer) {
+  for (int i = 0; i < pool->num_transfers; ++i) {
+    if (pool->transfers[i].transfer == transfer) {
+      return pool->transfers[i].device_memory;
+    }
+  }
+  return 0;
+}
+
+void transfer_pool_detach(struct transfer_pool *pool) {
+  for (int i = 0; i < pool->num_transfers; ++i) {
+    struct pooled_transfer *entry = &pool->transfers[i];
+    if (entry->device_memory) {
+      entry->buffer = NULL;
+      entry->capacity = 0;
+      entry->device_memory = 0;
+    }
+  }
+  if (pool->device_memory != NULL) {
+    libusb_dev_mem_free(pool->dev_handle, pool->device_memory,
+                        TRANSFER_POOL_DEVICE_MEMORY);
+    pool->device_memory = NULL;
+  }
+  pool->dev_handle = NULL;
+}
+
+void transfer_pool_destroy(struct transfer_pool *pool) {
+  if (pool == NULL) {
+    return;
+  }
+  if (pool->dev_handle != NULL) {
+    transfer_pool_detach(pool);
+  }
+  for (int i = 0; i < pool->num_transfers; ++i) {
+    libusb_free_transfer(pool->transfers[i].transfer);
+    free(pool->transfers[i].buffer);
+  }
+  free(pool->transfers);
+  free(pool);
+}
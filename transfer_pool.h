@@ -0,0 +1,82 @@
+#ifndef TRANSFER_POOL_H
+#define TRANSFER_POOL_H
+
+#include <libusb-1.0/libusb.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The transfers of a device and their buffers, allocated as its streams and
+// outputs first open and recycled by them instead of being freed, also when
+// the device comes back after being unplugged. Buffers come from
+// libusb_dev_mem_alloc where the platform has it: memory mapped from usbfs
+// that the host controller reads and writes directly, without the kernel
+// copying every report through a bounce buffer. Without it, or once the
+// mapping is used up, they come from the heap.
+//
+// Only used from the thread that opens and closes the device, never from the
+// transfer callbacks.
+
+// Mapped from usbfs for every handle of the device. The kernel limits the
+// memory of all usbfs users, 16 MiB by default.
+#define TRANSFER_POOL_DEVICE_MEMORY (64 * 1024)
+
+struct pooled_transfer {
+  struct libusb_transfer *transfer;
+  // What the transfer and its buffer were allocated for, a later acquire
+  // asking for no more reuses them.
+  int iso_packets;
+  int capacity;
+  // NULL once its device memory went with the handle, a new one is taken
+  // when the transfer is handed out again.
+  unsigned char *buffer;
+  // Part of the device memory mapping rather than its own heap allocation.
+  int device_memory;
+  int in_use;
+};
+
+struct transfer_pool {
+  // NULL while the device is away.
+  libusb_device_handle *dev_handle;
+  // NULL when libusb_dev_mem_alloc is not available.
+  unsigned char *device_memory;
+  size_t device_memory_used;
+  // Grows with what the streams and outputs of the device open.
+  struct pooled_transfer *transfers;
+  int num_transfers;
+  int capacity;
+  // Transfers handed out again instead of being allocated, since the start.
+  uint64_t recycled;
+};
+
+// Attached to `dev_handle`. Returns NULL on failure.
+struct transfer_pool *transfer_pool_create(libusb_device_handle *dev_handle);
+
+// Maps the device memory of a new handle of the device, if possible.
+void transfer_pool_attach(struct transfer_pool *pool,
+                          libusb_device_handle *dev_handle);
+
+// Gives the device memory back and keeps the transfers for the next handle.
+// Must be called before the device handle is closed, with every transfer
+// released.
+void transfer_pool_detach(struct transfer_pool *pool);
+
+// A transfer with room for `iso_packets` packets and a zeroed buffer of
+// `length` bytes, which stays valid until it is released. Returns NULL on
+// failure.
+struct libusb_transfer *transfer_pool_acquire(struct transfer_pool *pool,
+                                              int iso_packets, int length);
+
+// Gives a transfer back for a later acquire. It must not be in flight.
+void transfer_pool_release(struct transfer_pool *pool,
+                           struct libusb_transfer *transfer);
+
+// Whether the buffer of `transfer` is device memory.
+int transfer_pool_is_device_memory(const struct transfer_pool *pool,
+                                   const struct libusb_transfer *transfer);
+
+// Frees the transfers, their buffers and the device memory. Must be called
+// before the device handle is closed, if it is still attached, with every
+// transfer released.
+void transfer_pool_destroy(struct transfer_pool *pool);
+
+#endif // TRANSFER_POOL_H
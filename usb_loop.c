@@ -0,0 +1,145 @@
+#include "usb_loop.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+static void usb_loop_fd_added(int fd, short events, void *user_data) {
+  struct usb_loop *loop = user_data;
+  struct epoll_event event = {.events = 0, .data.fd = fd};
+  if (events & POLLIN) {
+    event.events |= EPOLLIN;
+  }
+  if (events & POLLOUT) {
+    event.events |= EPOLLOUT;
+  }
+  // libusb announces a descriptor again when the events it waits for
+  // change.
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0 &&
+      (errno != EEXIST ||
+       epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &event) != 0)) {
+    fprintf(stderr, "%s:%d: unable to watch descriptor %d: %s\n", __FILE__,
+            __LINE__, fd, strerror(errno));
+  }
+  ++loop->fd_changes;
+}
+
+static void usb_loop_fd_removed(int fd, void *user_data) {
+  struct usb_loop *loop = user_data;
+  // Already gone from the set if libusb closed it first.
+  epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+  ++loop->fd_changes;
+}
+
+int usb_loop_open(struct usb_loop *loop, libusb_context *ctx) {
+  memset(loop, 0, sizeof(*loop));
+  loop->ctx = ctx;
+  loop->timer_fd = -1;
+  loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epoll_fd < 0) {
+    fprintf(stderr, "%s:%d: unable to create an epoll set: %s\n", __FILE__,
+            __LINE__, strerror(errno));
+    return -1;
+  }
+  loop->timer_needed = !libusb_pollfds_handle_timeouts(ctx);
+  if (loop->timer_needed) {
+    loop->timer_fd =
+        timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = loop->timer_fd};
+    if (loop->timer_fd < 0 ||
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->timer_fd, &event) !=
+            0) {
+      fprintf(stderr, "%s:%d: unable to set up the timer: %s\n", __FILE__,
+              __LINE__, strerror(errno));
+      usb_loop_close(loop);
+      return -1;
+    }
+  }
+
+  // Notified from now on, the descriptors already there are listed once.
+  libusb_set_pollfd_notifiers(ctx, usb_loop_fd_added, usb_loop_fd_removed,
+                              loop);
+  const struct libusb_pollfd **pollfds = libusb_get_pollfds(ctx);
+  if (pollfds == NULL) {
+    fprintf(stderr, "%s:%d: libusb cannot list its descriptors\n", __FILE__,
+            __LINE__);
+    usb_loop_close(loop);
+    return -1;
+  }
+  for (int i = 0; pollfds[i] != NULL; ++i) {
+    usb_loop_fd_added(pollfds[i]->fd, pollfds[i]->events, loop);
+  }
+  libusb_free_pollfds(pollfds);
+  int r = usb_loop_update_timeout(loop);
+  if (r != LIBUSB_SUCCESS) {
+    fprintf(stderr, "%s:%d: unable to arm the timer: %s\n", __FILE__,
+            __LINE__, libusb_error_name(r));
+    usb_loop_close(loop);
+    return -1;
+  }
+  return 0;
+}
+
+int usb_loop_fd(const struct usb_loop *loop) { return loop->epoll_fd; }
+
+int usb_loop_update_timeout(struct usb_loop *loop) {
+  if (!loop->timer_needed) {
+    return LIBUSB_SUCCESS;
+  }
+  struct timeval timeout;
+  int result = libusb_get_next_timeout(loop->ctx, &timeout);
+  if (result < 0) {
+    return result;
+  }
+  // All zero disarms the timer, when nothing is waiting for a timeout.
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  if (result == 1) {
+    spec.it_value.tv_sec = timeout.tv_sec;
+    spec.it_value.tv_nsec = timeout.tv_usec * 1000;
+    // Already expired: the soonest a relative timer can fire.
+    if (timeout.tv_sec == 0 && timeout.tv_usec == 0) {
+      spec.it_value.tv_nsec = 1;
+    }
+  }
+  if (timerfd_settime(loop->timer_fd, 0, &spec, NULL) != 0) {
+    return LIBUSB_ERROR_OTHER;
+  }
+  return LIBUSB_SUCCESS;
+}
+
+int usb_loop_process_ready(struct usb_loop *loop) {
+  ++loop->wakeups;
+  if (loop->timer_needed) {
+    uint64_t expirations;
+    // Only clears the readiness, libusb checks the timeouts on its own.
+    if (read(loop->timer_fd, &expirations, sizeof(expirations)) < 0 &&
+        errno != EAGAIN) {
+      return LIBUSB_ERROR_IO;
+    }
+  }
+  // A zero timeout polls libusb's descriptors once and returns.
+  struct timeval zero = {.tv_sec = 0, .tv_usec = 0};
+  int result = libusb_handle_events_timeout_completed(loop->ctx, &zero, NULL);
+  if (result != LIBUSB_SUCCESS && result != LIBUSB_ERROR_INTERRUPTED) {
+    return result;
+  }
+  return usb_loop_update_timeout(loop);
+}
+
+void usb_loop_close(struct usb_loop *loop) {
+  libusb_set_pollfd_notifiers(loop->ctx, NULL, NULL, NULL);
+  if (loop->timer_fd >= 0) {
+    close(loop->timer_fd);
+    loop->timer_fd = -1;
+  }
+  if (loop->epoll_fd >= 0) {
+    close(loop->epoll_fd);
+    loop->epoll_fd = -1;
+  }
+}
@@ -0,0 +1,49 @@
+#ifndef USB_LOOP_H
+#define USB_LOOP_H
+
+#include <libusb-1.0/libusb.h>
+#include <stdint.h>
+
+// Runs libusb's event handling inside an application's own event loop rather
+// than on a usb_thread, for applications that already have one epoll reactor
+// and no thread to spare. The file descriptors libusb polls, kept up to date
+// through its pollfd notifiers, and a timerfd armed for libusb's next timeout
+// are gathered in an epoll set of their own. Its descriptor goes into the
+// application's epoll set. When it is readable, usb_loop_process_ready
+// handles whatever is ready without blocking, and the transfer callbacks run
+// right there on the application's thread: no handoff, no context switch.
+//
+// The thread calling usb_loop_process_ready must be the only one handling
+// the events of the context.
+
+struct usb_loop {
+  libusb_context *ctx;
+  int epoll_fd;
+  // Armed for libusb's next timeout. Not needed, and never armed, where
+  // libusb has a timer among its own descriptors.
+  int timer_fd;
+  int timer_needed;
+  // Calls to usb_loop_process_ready.
+  uint64_t wakeups;
+  // Descriptors added and removed by libusb since the start.
+  uint64_t fd_changes;
+};
+
+// Returns 0, or -1 with a message on stderr.
+int usb_loop_open(struct usb_loop *loop, libusb_context *ctx);
+
+// The descriptor to watch for EPOLLIN, or POLLIN, in the application's loop.
+int usb_loop_fd(const struct usb_loop *loop);
+
+// Handles the events and timeouts that are due without blocking, then
+// re-arms the timer. Returns LIBUSB_SUCCESS or a libusb error code.
+int usb_loop_process_ready(struct usb_loop *loop);
+
+// Re-arms the timer for libusb's next timeout. Needed after submitting a
+// transfer with a timeout anywhere but from a transfer callback.
+int usb_loop_update_timeout(struct usb_loop *loop);
+
+// Gives the descriptors back to libusb's own handling.
+void usb_loop_close(struct usb_loop *loop);
+
+#endif // USB_LOOP_H
@@ -0,0 +1,37 @@
+#include "usb_thread.h"
+
+#include <stdio.h>
+
+static void *usb_thread_main(void *arg) {
+  struct usb_thread *usb_thread = arg;
+  while (atomic_load_explicit(&usb_thread->running, memory_order_acquire)) {
+    // Blocks until something happens, libusb_interrupt_event_handler wakes it
+    // up when the thread is asked to stop.
+    int result = libusb_handle_events(usb_thread->ctx);
+    if (result < 0 && result != LIBUSB_ERROR_INTERRUPTED) {
+      fprintf(stderr, "%s:%d: event handling error: %s\n", __FILE__, __LINE__,
+              libusb_error_name(result));
+      atomic_store(&usb_thread->error, result);
+      atomic_store(&usb_thread->running, 0);
+    }
+  }
+  return NULL;
+}
+
+int usb_thread_start(struct usb_thread *usb_thread, libusb_context *ctx) {
+  usb_thread->ctx = ctx;
+  atomic_init(&usb_thread->running, 1);
+  atomic_init(&usb_thread->error, 0);
+  int result =
+      pthread_create(&usb_thread->thread, NULL, usb_thread_main, usb_thread);
+  if (result != 0) {
+    atomic_store(&usb_thread->running, 0);
+  }
+  return result;
+}
+
+void usb_thread_stop(struct usb_thread *usb_thread) {
+  atomic_store_explicit(&usb_thread->running, 0, memory_order_release);
+  libusb_interrupt_event_handler(usb_thread->ctx);
+  pthread_join(usb_thread->thread, NULL);
+}
@@ -0,0 +1,26 @@
+#ifndef USB_THREAD_H
+#define USB_THREAD_H
+
+#include <libusb-1.0/libusb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Dedicated thread running libusb's event handling. Once started it is the
+// only thread calling into the event loop of `ctx`, so every transfer
+// callback runs on it.
+struct usb_thread {
+  libusb_context *ctx;
+  pthread_t thread;
+  atomic_int running;
+  // Last error returned by libusb_handle_events, 0 if none.
+  atomic_int error;
+};
+
+// Returns 0 or an errno value from pthread_create.
+int usb_thread_start(struct usb_thread *usb_thread, libusb_context *ctx);
+
+// Wakes the thread up and waits for it to exit. Safe to call if the thread
+// already stopped on its own after an error.
+void usb_thread_stop(struct usb_thread *usb_thread);
+
+#endif // USB_THREAD_H